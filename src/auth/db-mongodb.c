@@ -88,6 +88,23 @@ static struct mongodb_connection *db_mongodb_conn_find(const char *config_path)
 	return NULL;
 }
 
+static mongodb_template_t
+db_mongodb_template_init(struct mongodb_connection *conn, const char *name,
+			 const char *query, const char *fields,
+			 const char *defaults)
+{
+	mongodb_template_t tmpl;
+	const char *error;
+
+	tmpl = mongodb_template_init(conn->conn, query, fields,
+				     defaults, &error);
+	if (tmpl == NULL) {
+		i_fatal("mongodb %s: Invalid %s: %s",
+			conn->config_path, name, error);
+	}
+	return tmpl;
+}
+
 int db_mongodb_connect(struct mongodb_connection *conn)
 {
 	//mongo_client(conn->conn, conn->set.connect, 27017);
@@ -126,11 +143,53 @@ struct mongodb_connection *db_mongodb_init(const char *config_path, bool userdb)
 	conn->next = mongodb_connections;
 	mongodb_connections = conn;
 
-	conn->conn = mongodb_conn_init("mongodb://localhost");
-
+	conn->conn = mongodb_conn_init(conn->set.connect != NULL ?
+				       conn->set.connect : "mongodb://localhost");
+	if (conn->conn == NULL)
+		i_fatal("mongodb %s: Invalid connect setting", config_path);
+
+	conn->password_template =
+		db_mongodb_template_init(conn, "password_query",
+					 conn->set.password_query,
+					 conn->set.password_fields,
+					 conn->set.password_defaults);
+	conn->user_template =
+		db_mongodb_template_init(conn, "user_query",
+					 conn->set.user_query,
+					 conn->set.user_fields,
+					 conn->set.user_defaults);
+	conn->iterate_template =
+		db_mongodb_template_init(conn, "iterate_query",
+					 conn->set.iterate_query,
+					 conn->set.iterate_fields,
+					 conn->set.iterate_defaults);
 	return conn;
 }
 
+void db_mongodb_unref(struct mongodb_connection **_conn)
+{
+	struct mongodb_connection *conn = *_conn;
+	struct mongodb_connection **p;
+
+	*_conn = NULL;
+	i_assert(conn->refcount >= 0);
+	if (--conn->refcount > 0)
+		return;
+
+	for (p = &mongodb_connections; *p != NULL; p = &(*p)->next) {
+		if (*p == conn) {
+			*p = conn->next;
+			break;
+		}
+	}
+
+	mongodb_template_deinit(&conn->password_template);
+	mongodb_template_deinit(&conn->user_template);
+	mongodb_template_deinit(&conn->iterate_template);
+	mongodb_conn_deinit(&conn->conn);
+	pool_unref(&conn->pool);
+}
+
 #endif
 
 // vim: noexpandtab shiftwidth=8 tabstop=8
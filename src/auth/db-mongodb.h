@@ -39,6 +39,11 @@ struct mongodb_connection {
     struct mongodb_settings set;
 	mongodb_conn_t conn;
 
+	/* queries compiled from the settings */
+	mongodb_template_t password_template;
+	mongodb_template_t user_template;
+	mongodb_template_t iterate_template;
+
 	unsigned int default_password_query:1;
 	unsigned int default_user_query:1;
 	unsigned int default_update_query:1;
@@ -21,6 +21,7 @@ struct mongodb_passdb_module {
 
 struct passdb_mongodb_request {
 	struct auth_request *auth_request;
+	mongodb_query_t query;
 	union {
 		verify_plain_callback_t *verify_plain;
 		lookup_credentials_callback_t *lookup_credentials;
@@ -49,64 +50,27 @@ static void mongodb_query_save_results(mongodb_result_t result,
 	mongodb_result_iterate_deinit(&iter);
 }
 
-static void mongodb_lookup_pass(struct passdb_mongodb_request *mongodb_request)
+static void mongodb_lookup_pass_callback(int ret, mongodb_result_t result,
+					 void *context)
 {
+	struct passdb_mongodb_request *mongodb_request = context;
 	struct auth_request *auth_request = mongodb_request->auth_request;
 	struct passdb_module *_module = auth_request->passdb->passdb;
 	struct mongodb_passdb_module *module = (struct mongodb_passdb_module *)_module;
-	mongodb_conn_t mongodb_conn = module->conn->conn;
-	mongodb_query_t mongodb_query;
-	mongodb_result_t result;
-
 	enum passdb_result passdb_result;
 	const char *password, *scheme;
-	string_t *query;
-	int ret;
 
 	passdb_result = PASSDB_RESULT_INTERNAL_FAILURE;
 	password = NULL;
 
-	auth_request_ref(mongodb_request->auth_request);
-
- 	query = t_str_new(512);
-	var_expand(query, module->conn->set.password_query,
-		   auth_request_get_var_expand_table(auth_request,
-						     NULL));
-
-	auth_request_log_debug(auth_request, "mongodb",
-			       "query: %s", str_c(query));
-
-	mongodb_query = mongodb_query_init(mongodb_conn);
-	if (mongodb_query_parse_query(mongodb_query, str_c(query)) < 0) {
-		auth_request_log_error(auth_request, "mongodb",
-				       "Query failed: %s", mongodb_get_error(mongodb_conn));
-		goto cleanup;
-	}
-
-	if (module->conn->set.password_defaults != NULL)
-		if (mongodb_query_parse_defaults(mongodb_query,
-						 module->conn->set.password_defaults) < 0) {
-			auth_request_log_error(auth_request, "mongodb",
-					       "Query failed: %s", mongodb_get_error(mongodb_conn));
-			goto cleanup;
-		}
-
-	if (mongodb_query_parse_fields(mongodb_query, module->conn->set.password_fields) < 0) {
-		auth_request_log_error(auth_request, "mongodb",
-				       "Query failed: %s", mongodb_get_error(mongodb_conn));
-		goto cleanup;
-	}
-
-	ret = mongodb_query_find_one(mongodb_query, module->conn->set.collection, &result);
-
-	//mongodb_query_debug("db_mongodb_find return=%d", ret);
 	if (ret != MONGODB_QUERY_OK) {
 		if (ret == MONGODB_QUERY_NO_RESULT) {
 			auth_request_log_info(auth_request, "mongodb", "unknown user");
 			passdb_result = PASSDB_RESULT_USER_UNKNOWN;
 		} else {
 			auth_request_log_error(auth_request, "mongodb",
-					       "Query failed: %s", mongodb_get_error(mongodb_conn));
+					       "Query failed: %s",
+					       mongodb_get_error(module->conn->conn));
 		}
 	} else {
 		mongodb_query_save_results(result, mongodb_request);
@@ -130,26 +94,48 @@ static void mongodb_lookup_pass(struct passdb_mongodb_request *mongodb_request)
 		passdb_handle_credentials(passdb_result, password, scheme,
 			mongodb_request->callback.lookup_credentials,
 			auth_request);
-		goto cleanup;
-	}
-
-	/* verify plain */
-	if (password == NULL) {
+	} else if (password == NULL) {
+		/* verify plain */
 		mongodb_request->callback.verify_plain(passdb_result, auth_request);
-		goto cleanup;
+	} else {
+		ret = auth_request_password_verify(auth_request,
+						   auth_request->mech_password,
+						   password, scheme, "mongodb");
+
+		mongodb_request->callback.verify_plain(ret > 0 ? PASSDB_RESULT_OK :
+						       PASSDB_RESULT_PASSWORD_MISMATCH,
+						       auth_request);
 	}
 
-	ret = auth_request_password_verify(auth_request,
-					   auth_request->mech_password,
-					   password, scheme, "mongodb");
+	mongodb_query_deinit(&mongodb_request->query);
+	auth_request_unref(&auth_request);
+}
+
+static void mongodb_lookup_pass(struct passdb_mongodb_request *mongodb_request)
+{
+	struct auth_request *auth_request = mongodb_request->auth_request;
+	struct passdb_module *_module = auth_request->passdb->passdb;
+	struct mongodb_passdb_module *module = (struct mongodb_passdb_module *)_module;
+	const struct var_expand_table *table;
+
+	auth_request_ref(auth_request);
 
-	mongodb_request->callback.verify_plain(ret > 0 ? PASSDB_RESULT_OK :
-					       PASSDB_RESULT_PASSWORD_MISMATCH,
-					       auth_request);
+	table = auth_request_get_var_expand_table(auth_request, NULL);
+	if (auth_request->set->debug) {
+		string_t *query = t_str_new(512);
 
-cleanup:
-	mongodb_query_deinit(&mongodb_query);
-	auth_request_unref(&auth_request);
+		var_expand(query, module->conn->set.password_query, table);
+		auth_request_log_debug(auth_request, "mongodb",
+				       "query: %s", str_c(query));
+	}
+	mongodb_request->query =
+		mongodb_query_init_template(module->conn->password_template,
+					    table);
+
+	mongodb_query_find_one_async(mongodb_request->query,
+				     module->conn->set.collection,
+				     mongodb_lookup_pass_callback,
+				     mongodb_request);
 }
 
 static void mongodb_verify_plain(struct auth_request *request,
@@ -219,7 +205,7 @@ static void passdb_mongodb_deinit(struct passdb_module *_module)
 	struct mongodb_passdb_module *module =
 		(struct mongodb_passdb_module *)_module;
 
-	mongodb_conn_deinit(&module->conn->conn);
+	db_mongodb_unref(&module->conn);
 }
 
 struct passdb_module_interface passdb_mongodb = {
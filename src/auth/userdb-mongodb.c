@@ -7,6 +7,7 @@
 
 #include "str.h"
 #include "hash.h"
+#include "var-expand.h"
 #include "auth-cache.h"
 #include "db-mongodb.h"
 
@@ -16,6 +17,12 @@ struct mongodb_userdb_module {
 	struct mongodb_connection *conn;
 };
 
+struct userdb_mongodb_request {
+	struct auth_request *auth_request;
+	userdb_callback_t *callback;
+	mongodb_query_t query;
+};
+
 struct mongodb_userdb_iterate_context {
 	struct userdb_iterate_context ctx;
 	mongodb_query_t query;
@@ -42,37 +49,16 @@ static void mongodb_query_get_result(struct mongodb_result *result,
 	mongodb_result_iterate_deinit(&iter);
 }
 
-static void userdb_mongodb_lookup(struct auth_request *auth_request,
-				  userdb_callback_t *callback)
+static void userdb_mongodb_lookup_callback(int ret, mongodb_result_t result,
+					   void *context)
 {
+	struct userdb_mongodb_request *mongodb_request = context;
+	struct auth_request *auth_request = mongodb_request->auth_request;
 	struct userdb_module *_module = auth_request->userdb->userdb;
 	struct mongodb_userdb_module *module =
 		(struct mongodb_userdb_module *)_module;
 	enum userdb_result userdb_result = USERDB_RESULT_INTERNAL_FAILURE;
-	mongodb_query_t mongodb_query;
-	mongodb_result_t mongodb_result;
-
-	string_t *query;
-	int ret;
 
- 	query = t_str_new(512);
-	var_expand(query, module->conn->set.user_query,
-		   auth_request_get_var_expand_table(auth_request,
-						     NULL));
-
-	auth_request_log_debug(auth_request, "mongodb",
-			       "query: %s", str_c(query));
-
-	mongodb_query = mongodb_query_init(module->conn->conn);
-	mongodb_query_parse_query(mongodb_query, str_c(query));
-
-	if (module->conn->set.user_defaults != NULL)
-		mongodb_query_parse_defaults(mongodb_query,
-					     module->conn->set.user_defaults);
-
-	mongodb_query_parse_fields(mongodb_query, module->conn->set.user_fields);
-
-	ret = mongodb_query_find_one(mongodb_query, module->conn->set.collection, &mongodb_result);
 	if (ret != MONGODB_QUERY_OK) {
 		if (ret == MONGODB_QUERY_NO_RESULT) {
 			auth_request_log_info(auth_request, "mongodb", "unknown user");
@@ -82,11 +68,46 @@ static void userdb_mongodb_lookup(struct auth_request *auth_request,
 				       "Query failed: %s", mongodb_get_error(module->conn->conn));
 		}
 	} else {
-		mongodb_query_get_result(mongodb_result, auth_request);
+		mongodb_query_get_result(result, auth_request);
 		userdb_result = USERDB_RESULT_OK;
 	}
 
-	callback(userdb_result, auth_request);
+	mongodb_request->callback(userdb_result, auth_request);
+	mongodb_query_deinit(&mongodb_request->query);
+	auth_request_unref(&auth_request);
+	i_free(mongodb_request);
+}
+
+static void userdb_mongodb_lookup(struct auth_request *auth_request,
+				  userdb_callback_t *callback)
+{
+	struct userdb_module *_module = auth_request->userdb->userdb;
+	struct mongodb_userdb_module *module =
+		(struct mongodb_userdb_module *)_module;
+	struct userdb_mongodb_request *mongodb_request;
+	const struct var_expand_table *table;
+
+	auth_request_ref(auth_request);
+	mongodb_request = i_new(struct userdb_mongodb_request, 1);
+	mongodb_request->auth_request = auth_request;
+	mongodb_request->callback = callback;
+
+	table = auth_request_get_var_expand_table(auth_request, NULL);
+	if (auth_request->set->debug) {
+		string_t *query = t_str_new(512);
+
+		var_expand(query, module->conn->set.user_query, table);
+		auth_request_log_debug(auth_request, "mongodb",
+				       "query: %s", str_c(query));
+	}
+	mongodb_request->query =
+		mongodb_query_init_template(module->conn->user_template,
+					    table);
+
+	mongodb_query_find_one_async(mongodb_request->query,
+				     module->conn->set.collection,
+				     userdb_mongodb_lookup_callback,
+				     mongodb_request);
 }
 
 static struct userdb_iterate_context *
@@ -98,21 +119,9 @@ userdb_mongodb_iterate_init(struct auth_request *auth_request,
 		(struct mongodb_userdb_module *)_module;
 	struct mongodb_userdb_iterate_context *ctx;
 	mongodb_query_t mongodb_query;
-	string_t *query;
-
-	query = t_str_new(512);
-	var_expand(query, module->conn->set.iterate_query,
-		   auth_request_get_var_expand_table(auth_request,
-						     NULL));
 
-	mongodb_query = mongodb_query_init(module->conn->conn);
-	mongodb_query_parse_query(mongodb_query, str_c(query));
-
-	if (module->conn->set.iterate_defaults != NULL)
-		mongodb_query_parse_defaults(mongodb_query,
-					     module->conn->set.iterate_defaults);
-
-    mongodb_query_parse_fields(mongodb_query, module->conn->set.iterate_fields);
+	mongodb_query = mongodb_query_init_template(module->conn->iterate_template,
+		auth_request_get_var_expand_table(auth_request, NULL));
 
 	ctx = i_new(struct mongodb_userdb_iterate_context, 1);
 	ctx->ctx.auth_request = auth_request;
@@ -219,6 +228,8 @@ static void userdb_mongodb_deinit(struct userdb_module *_module)
 {
 	struct mongodb_userdb_module *module =
 		(struct mongodb_userdb_module *)_module;
+
+	db_mongodb_unref(&module->conn);
 }
 
 struct userdb_module_interface userdb_mongodb = {
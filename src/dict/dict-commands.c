@@ -44,6 +44,43 @@ static int cmd_lookup(struct dict_connection *conn, const char *line)
 	return 0;
 }
 
+static int cmd_lookup_multi(struct dict_connection *conn, const char *line)
+{
+	const char *const *keys, **values;
+	unsigned int i, count;
+	string_t *reply;
+
+	if (conn->iter_ctx != NULL) {
+		i_error("dict client: LOOKUP_MULTI: Can't lookup while iterating");
+		return -1;
+	}
+
+	/* <key> [<key> ...] */
+	keys = t_strsplit_tab(line);
+	count = str_array_length(keys);
+	values = t_new(const char *, count);
+
+	reply = t_str_new(256);
+	if (dict_lookup_multi(conn->dict, pool_datastack_create(),
+			      keys, values) < 0)
+		str_append_c(reply, DICT_PROTOCOL_REPLY_FAIL);
+	else {
+		for (i = 0; i < count; i++) {
+			if (i > 0)
+				str_append_c(reply, '\t');
+			if (values[i] == NULL)
+				str_append_c(reply, DICT_PROTOCOL_REPLY_NOTFOUND);
+			else {
+				str_append_c(reply, DICT_PROTOCOL_REPLY_OK);
+				str_append(reply, dict_client_escape(values[i]));
+			}
+		}
+	}
+	str_append_c(reply, '\n');
+	o_stream_nsend(conn->output, str_data(reply), str_len(reply));
+	return 0;
+}
+
 static int cmd_iterate_flush(struct dict_connection *conn)
 {
 	string_t *str;
@@ -349,6 +386,7 @@ static int cmd_atomic_inc(struct dict_connection *conn, const char *line)
 
 static struct dict_client_cmd cmds[] = {
 	{ DICT_PROTOCOL_CMD_LOOKUP, cmd_lookup },
+	{ DICT_PROTOCOL_CMD_LOOKUP_MULTI, cmd_lookup_multi },
 	{ DICT_PROTOCOL_CMD_ITERATE, cmd_iterate },
 	{ DICT_PROTOCOL_CMD_BEGIN, cmd_begin },
 	{ DICT_PROTOCOL_CMD_COMMIT, cmd_commit },
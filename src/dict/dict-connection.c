@@ -6,6 +6,7 @@
 #include "istream.h"
 #include "ostream.h"
 #include "llist.h"
+#include "strnum.h"
 #include "master-service.h"
 #include "dict-client.h"
 #include "dict-settings.h"
@@ -20,7 +21,7 @@ static struct dict_connection *dict_connections;
 static int dict_connection_parse_handshake(struct dict_connection *conn,
 					   const char *line)
 {
-	const char *username, *name, *value_type;
+	const char *username, *name, *value_type, *minor_version;
 
 	if (*line++ != DICT_PROTOCOL_CMD_HELLO)
 		return -1;
@@ -30,11 +31,15 @@ static int dict_connection_parse_handshake(struct dict_connection *conn,
 	    *line++ != '\t')
 		return -1;
 
-	/* skip minor version */
+	/* get minor version */
+	minor_version = line;
 	while (*line != '\t' && *line != '\0') line++;
 
 	if (*line++ != '\t')
 		return -1;
+	if (str_to_uint(t_strdup_until(minor_version, line - 1),
+			&conn->minor_version) < 0)
+		conn->minor_version = 0;
 
 	/* get value type */
 	value_type = line;
@@ -127,6 +132,14 @@ static void dict_connection_input(struct dict_connection *conn)
 			dict_connection_destroy(conn);
 			return;
 		}
+		if (conn->minor_version >=
+		    DICT_CLIENT_PROTOCOL_MINOR_VERSION_LOOKUP_MULTI) {
+			/* older clients don't expect a reply */
+			o_stream_nsend_str(conn->output, t_strdup_printf(
+				"%c%u\t%u\n", DICT_PROTOCOL_REPLY_HELLO,
+				DICT_CLIENT_PROTOCOL_MAJOR_VERSION,
+				DICT_CLIENT_PROTOCOL_MINOR_VERSION));
+		}
 	}
 
 	while ((line = i_stream_next_line(conn->input)) != NULL) {
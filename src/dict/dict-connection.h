@@ -17,6 +17,7 @@ struct dict_connection {
 	char *name;
 	struct dict *dict;
 	enum dict_data_type value_type;
+	unsigned int minor_version;
 
 	int fd;
 	struct io *io;
@@ -7,6 +7,7 @@
 #include "file-lock.h"
 #include "message-parser.h"
 #include "message-part-serialize.h"
+#include "imap-bodystructure.h"
 #include "mail-index-private.h"
 #include "mail-cache-private.h"
 #include "mail-index-modseq.h"
@@ -224,6 +225,26 @@ static void dump_extension_header(struct mail_index *index,
 
 			name += rec->name_len;
 		}
+	} else if (strcmp(ext->name, "cache-stats") == 0) {
+		struct mail_cache_stats_record rec;
+		const unsigned char *p = data;
+		size_t pos, name_len;
+
+		printf("header\n");
+		for (pos = 0; pos + sizeof(rec) < ext->hdr_size; ) {
+			memcpy(&rec, p + pos, sizeof(rec));
+			pos += sizeof(rec);
+			name_len = strlen((const char *)p + pos);
+			printf(" - %s: hits=%u misses=%u miss_usecs=%llu",
+			       (const char *)p + pos, rec.hits, rec.misses,
+			       (unsigned long long)rec.miss_usecs);
+			if (rec.dropped_time != 0) {
+				printf(" dropped=%s",
+				       unixdate2str(rec.dropped_time));
+			}
+			printf("\n");
+			pos += (name_len + 1 + 3) & ~3;
+		}
 	} else {
 		printf("header ........ = %s\n",
 		       binary_to_hex(data, ext->hdr_size));
@@ -407,6 +428,27 @@ dump_cache_mime_parts(string_t *str, const void *data, unsigned int size)
 	dump_message_part(str, part);
 }
 
+static void
+dump_cache_bodystructure_parts(string_t *str, const void *data,
+			       unsigned int size)
+{
+	struct message_part *part;
+	const char *error;
+
+	str_append_c(str, ' ');
+
+	part = imap_bodystructure_deserialize(pool_datastack_create(),
+					      data, size, &error);
+	if (part == NULL) {
+		str_printfa(str, "error: %s", error);
+		return;
+	}
+
+	dump_message_part(str, part);
+	str_append_c(str, ' ');
+	imap_bodystructure_write(part, str, TRUE);
+}
+
 static void dump_cache(struct mail_cache_view *cache_view, unsigned int seq)
 {
 	struct mail_cache_lookup_iterate_ctx iter;
@@ -450,6 +492,9 @@ static void dump_cache(struct mail_cache_view *cache_view, unsigned int seq)
 			str_printfa(str, "(%s)", binary_to_hex(data, size));
 			if (strcmp(field->name, "mime.parts") == 0)
 				dump_cache_mime_parts(str, data, size);
+			else if (strcmp(field->name,
+					"imap.bodystructure.parts") == 0)
+				dump_cache_bodystructure_parts(str, data, size);
 			break;
 		case MAIL_CACHE_FIELD_STRING:
 			if (size > 0)
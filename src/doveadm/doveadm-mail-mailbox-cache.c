@@ -0,0 +1,132 @@
+/* Copyright (c) 2013 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "mail-namespace.h"
+#include "mail-storage.h"
+#include "mail-cache.h"
+#include "mail-search.h"
+#include "doveadm-print.h"
+#include "doveadm-mail.h"
+#include "doveadm-mailbox-list-iter.h"
+
+struct cache_cmd_context {
+	struct doveadm_mail_cmd_context ctx;
+	struct mail_search_args *search_args;
+};
+
+static const char *cache_decision_to_str(int decision)
+{
+	const char *str;
+
+	switch (decision & ~MAIL_CACHE_DECISION_FORCED) {
+	case MAIL_CACHE_DECISION_NO:
+		str = "no";
+		break;
+	case MAIL_CACHE_DECISION_TEMP:
+		str = "temp";
+		break;
+	case MAIL_CACHE_DECISION_YES:
+		str = "yes";
+		break;
+	default:
+		str = "?";
+		break;
+	}
+	if ((decision & MAIL_CACHE_DECISION_FORCED) != 0)
+		str = t_strconcat(str, "-forced", NULL);
+	return str;
+}
+
+static int
+cache_mailbox(struct cache_cmd_context *ctx, const struct mailbox_info *info)
+{
+	struct mailbox *box;
+	struct mailbox_metadata metadata;
+	const struct mailbox_cache_field *field;
+
+	box = doveadm_mailbox_find(ctx->ctx.cur_mail_user, info->vname);
+	if (mailbox_get_metadata(box, MAILBOX_METADATA_CACHE_FIELDS,
+				 &metadata) < 0) {
+		doveadm_mail_failed_mailbox(&ctx->ctx, box);
+		mailbox_free(&box);
+		return -1;
+	}
+	array_foreach(metadata.cache_fields, field) {
+		doveadm_print(mailbox_get_vname(box));
+		doveadm_print(field->name);
+		doveadm_print(cache_decision_to_str(field->decision));
+		doveadm_print_num(field->hits);
+		doveadm_print_num(field->misses);
+		doveadm_print_num(field->misses == 0 ? 0 :
+				  field->miss_usecs / field->misses);
+	}
+	mailbox_free(&box);
+	return 0;
+}
+
+static int
+cmd_mailbox_cache_run(struct doveadm_mail_cmd_context *_ctx,
+		      struct mail_user *user)
+{
+	struct cache_cmd_context *ctx = (struct cache_cmd_context *)_ctx;
+	enum mailbox_list_iter_flags iter_flags =
+		MAILBOX_LIST_ITER_NO_AUTO_BOXES |
+		MAILBOX_LIST_ITER_RETURN_NO_FLAGS;
+	struct doveadm_mailbox_list_iter *iter;
+	const struct mailbox_info *info;
+	int ret = 0;
+
+	iter = doveadm_mailbox_list_iter_init(_ctx, user, ctx->search_args,
+					      iter_flags);
+	while ((info = doveadm_mailbox_list_iter_next(iter)) != NULL) {
+		T_BEGIN {
+			if (cache_mailbox(ctx, info) < 0)
+				ret = -1;
+		} T_END;
+	}
+	if (doveadm_mailbox_list_iter_deinit(&iter) < 0)
+		ret = -1;
+	return ret;
+}
+
+static void cmd_mailbox_cache_init(struct doveadm_mail_cmd_context *_ctx,
+				   const char *const args[])
+{
+	struct cache_cmd_context *ctx = (struct cache_cmd_context *)_ctx;
+
+	if (args[0] == NULL)
+		doveadm_mail_help_name("mailbox cache");
+
+	ctx->search_args = doveadm_mail_mailbox_search_args_build(args);
+
+	doveadm_print_header_simple("mailbox");
+	doveadm_print_header_simple("field");
+	doveadm_print_header_simple("decision");
+	doveadm_print_header_simple("hits");
+	doveadm_print_header_simple("misses");
+	doveadm_print_header_simple("avg_miss_usecs");
+}
+
+static void cmd_mailbox_cache_deinit(struct doveadm_mail_cmd_context *_ctx)
+{
+	struct cache_cmd_context *ctx = (struct cache_cmd_context *)_ctx;
+
+	mail_search_args_unref(&ctx->search_args);
+}
+
+static struct doveadm_mail_cmd_context *cmd_mailbox_cache_alloc(void)
+{
+	struct cache_cmd_context *ctx;
+
+	ctx = doveadm_mail_cmd_alloc(struct cache_cmd_context);
+	ctx->ctx.v.init = cmd_mailbox_cache_init;
+	ctx->ctx.v.deinit = cmd_mailbox_cache_deinit;
+	ctx->ctx.v.run = cmd_mailbox_cache_run;
+	doveadm_print_init(DOVEADM_PRINT_TYPE_TABLE);
+	return &ctx->ctx;
+}
+
+struct doveadm_mail_cmd cmd_mailbox_cache = {
+	cmd_mailbox_cache_alloc, "mailbox cache", "<mailbox mask> [...]"
+};
@@ -714,6 +714,7 @@ static struct doveadm_mail_cmd *mail_commands[] = {
 	&cmd_mailbox_subscribe,
 	&cmd_mailbox_unsubscribe,
 	&cmd_mailbox_status,
+	&cmd_mailbox_cache,
 	&cmd_batch,
 	&cmd_dsync_backup,
 	&cmd_dsync_mirror,
@@ -155,6 +155,7 @@ extern struct doveadm_mail_cmd cmd_mailbox_rename;
 extern struct doveadm_mail_cmd cmd_mailbox_subscribe;
 extern struct doveadm_mail_cmd cmd_mailbox_unsubscribe;
 extern struct doveadm_mail_cmd cmd_mailbox_status;
+extern struct doveadm_mail_cmd cmd_mailbox_cache;
 extern struct doveadm_mail_cmd cmd_batch;
 
 #endif
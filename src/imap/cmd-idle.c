@@ -17,7 +17,7 @@ struct cmd_idle_context {
 	struct client_command_context *cmd;
 
 	struct imap_sync_context *sync_ctx;
-	struct timeout *keepalive_to;
+	struct timeout *keepalive_to, *park_to;
 
 	unsigned int manual_cork:1;
 	unsigned int sync_pending:1;
@@ -26,6 +26,14 @@ struct cmd_idle_context {
 static void idle_add_keepalive_timeout(struct cmd_idle_context *ctx);
 static bool cmd_idle_continue(struct client_command_context *cmd);
 
+static void idle_unpark(struct cmd_idle_context *ctx)
+{
+	if (ctx->client->parked) {
+		ctx->client->parked = FALSE;
+		imap_refresh_proctitle();
+	}
+}
+
 static void
 idle_finish(struct cmd_idle_context *ctx, bool done_ok, bool free_cmd)
 {
@@ -33,6 +41,9 @@ idle_finish(struct cmd_idle_context *ctx, bool done_ok, bool free_cmd)
 
 	if (ctx->keepalive_to != NULL)
 		timeout_remove(&ctx->keepalive_to);
+	if (ctx->park_to != NULL)
+		timeout_remove(&ctx->park_to);
+	idle_unpark(ctx);
 
 	if (ctx->sync_ctx != NULL) {
 		/* we're here only in connection failure cases */
@@ -138,6 +149,39 @@ static void keepalive_timeout(struct cmd_idle_context *ctx)
 	idle_add_keepalive_timeout(ctx);
 }
 
+static void idle_park(struct cmd_idle_context *ctx)
+{
+	struct client *client = ctx->client;
+
+	timeout_remove(&ctx->park_to);
+	if (ctx->sync_ctx != NULL) {
+		/* the timeout is added back after syncing is finished */
+		return;
+	}
+
+	/* nothing is done with the mailbox until it changes or IDLE is
+	   finished, so release whatever can be allocated again later */
+	if (client->mailbox != NULL)
+		mailbox_park(client->mailbox);
+	/* don't keep this client's peak data stack usage allocated for the
+	   other clients in this process */
+	data_stack_free_unused();
+	client->parked = TRUE;
+	imap_refresh_proctitle();
+}
+
+static void idle_add_park_timeout(struct cmd_idle_context *ctx)
+{
+	unsigned int secs = ctx->client->set->imap_idle_park_timeout;
+
+	if (secs == 0)
+		return;
+
+	if (ctx->park_to != NULL)
+		timeout_remove(&ctx->park_to);
+	ctx->park_to = timeout_add(secs * 1000, idle_park, ctx);
+}
+
 static void idle_sync_now(struct mailbox *box, struct cmd_idle_context *ctx)
 {
 	i_assert(ctx->sync_ctx == NULL);
@@ -151,6 +195,7 @@ static void idle_callback(struct mailbox *box, struct cmd_idle_context *ctx)
 {
 	struct client *client = ctx->client;
 
+	idle_unpark(ctx);
 	if (ctx->sync_ctx != NULL)
 		ctx->sync_pending = TRUE;
 	else {
@@ -272,6 +317,7 @@ static bool cmd_idle_continue(struct client_command_context *cmd)
 		return FALSE;
 	}
 	cmd->state = CLIENT_COMMAND_STATE_WAIT_INPUT;
+	idle_add_park_timeout(ctx);
 
 	if (ctx->manual_cork) {
 		ctx->manual_cork = FALSE;
@@ -300,6 +346,7 @@ bool cmd_idle(struct client_command_context *cmd)
 	ctx->cmd = cmd;
 	ctx->client = client;
 	idle_add_keepalive_timeout(ctx);
+	idle_add_park_timeout(ctx);
 
 	if (client->mailbox != NULL)
 		mailbox_notify_changes(client->mailbox, idle_callback, ctx);
@@ -190,6 +190,18 @@ void client_command_cancel(struct client_command_context **_cmd)
 	}
 }
 
+size_t client_get_memory_usage(struct client *client)
+{
+	size_t size;
+
+	size = pool_alloconly_get_total_alloc_size(client->pool) +
+		pool_alloconly_get_total_alloc_size(client->command_pool) +
+		pool_alloconly_get_total_alloc_size(client->user->pool);
+	size += i_stream_get_data_size(client->input) +
+		o_stream_get_buffer_used_size(client->output);
+	return size;
+}
+
 static const char *client_stats(struct client *client)
 {
 	static struct var_expand_table static_tab[] = {
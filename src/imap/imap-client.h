@@ -164,6 +164,9 @@ struct client {
 	unsigned int notify_immediate_expunges:1;
 	unsigned int notify_count_changes:1;
 	unsigned int notify_flag_changes:1;
+	/* client has been in IDLE long enough that its mailbox's memory
+	   was released */
+	unsigned int parked:1;
 };
 
 struct imap_module_register {
@@ -242,6 +245,11 @@ void client_input(struct client *client);
 bool client_handle_input(struct client *client);
 int client_output(struct client *client);
 
+/* Returns the approximate amount of memory allocated for the client. This
+   includes the client's and its user's memory pools and unprocessed
+   input/output, but not the storage's index files. */
+size_t client_get_memory_usage(struct client *client);
+
 void clients_destroy_all(void);
 
 #endif
@@ -637,6 +637,33 @@ void imap_fetch_free(struct imap_fetch_context **_ctx)
 	pool_unref(&ctx->ctx_pool);
 }
 
+static int
+fetch_send_parenthesized(struct imap_fetch_context *ctx,
+			 const char *prefix, const char *value)
+{
+	struct const_iovec iov[4];
+	unsigned int iov_count = 0;
+
+	/* send the separator, prefix, value and the closing parenthesis
+	   with a single call, so they get written out together */
+	if (ctx->state.cur_first)
+		ctx->state.cur_first = FALSE;
+	else {
+		iov[iov_count].iov_base = " ";
+		iov[iov_count++].iov_len = 1;
+	}
+	iov[iov_count].iov_base = prefix;
+	iov[iov_count++].iov_len = strlen(prefix);
+	iov[iov_count].iov_base = value;
+	iov[iov_count++].iov_len = strlen(value);
+	iov[iov_count].iov_base = ")";
+	iov[iov_count++].iov_len = 1;
+
+	if (o_stream_sendv(ctx->client->output, iov, iov_count) < 0)
+		return -1;
+	return 0;
+}
+
 static int fetch_body(struct imap_fetch_context *ctx, struct mail *mail,
 		      void *context ATTR_UNUSED)
 {
@@ -645,16 +672,7 @@ static int fetch_body(struct imap_fetch_context *ctx, struct mail *mail,
 	if (mail_get_special(mail, MAIL_FETCH_IMAP_BODY, &body) < 0)
 		return -1;
 
-	if (ctx->state.cur_first)
-		ctx->state.cur_first = FALSE;
-	else {
-		if (o_stream_send(ctx->client->output, " ", 1) < 0)
-			return -1;
-	}
-
-	if (o_stream_send(ctx->client->output, "BODY (", 6) < 0 ||
-	    o_stream_send_str(ctx->client->output, body) < 0 ||
-	    o_stream_send(ctx->client->output, ")", 1) < 0)
+	if (fetch_send_parenthesized(ctx, "BODY (", body) < 0)
 		return -1;
 	return 1;
 }
@@ -679,16 +697,7 @@ static int fetch_bodystructure(struct imap_fetch_context *ctx,
 			     &bodystructure) < 0)
 		return -1;
 
-	if (ctx->state.cur_first)
-		ctx->state.cur_first = FALSE;
-	else {
-		if (o_stream_send(ctx->client->output, " ", 1) < 0)
-			return -1;
-	}
-
-	if (o_stream_send(ctx->client->output, "BODYSTRUCTURE (", 15) < 0 ||
-	    o_stream_send_str(ctx->client->output, bodystructure) < 0 ||
-	    o_stream_send(ctx->client->output, ")", 1) < 0)
+	if (fetch_send_parenthesized(ctx, "BODYSTRUCTURE (", bodystructure) < 0)
 		return -1;
 
 	return 1;
@@ -710,16 +719,7 @@ static int fetch_envelope(struct imap_fetch_context *ctx, struct mail *mail,
 	if (mail_get_special(mail, MAIL_FETCH_IMAP_ENVELOPE, &envelope) < 0)
 		return -1;
 
-	if (ctx->state.cur_first)
-		ctx->state.cur_first = FALSE;
-	else {
-		if (o_stream_send(ctx->client->output, " ", 1) < 0)
-			return -1;
-	}
-
-	if (o_stream_send(ctx->client->output, "ENVELOPE (", 10) < 0 ||
-	    o_stream_send_str(ctx->client->output, envelope) < 0 ||
-	    o_stream_send(ctx->client->output, ")", 1) < 0)
+	if (fetch_send_parenthesized(ctx, "ENVELOPE (", envelope) < 0)
 		return -1;
 	return 1;
 }
@@ -64,6 +64,7 @@ static const struct setting_define imap_setting_defines[] = {
 
 	DEF(SET_SIZE, imap_max_line_length),
 	DEF(SET_TIME, imap_idle_notify_interval),
+	DEF(SET_TIME, imap_idle_park_timeout),
 	DEF(SET_STR, imap_capability),
 	DEF(SET_STR, imap_client_workarounds),
 	DEF(SET_STR, imap_logout_format),
@@ -84,6 +85,7 @@ static const struct imap_settings imap_default_settings = {
 	   liberal by default. */
 	.imap_max_line_length = 64*1024,
 	.imap_idle_notify_interval = 2*60,
+	.imap_idle_park_timeout = 0,
 	.imap_capability = "",
 	.imap_client_workarounds = "",
 	.imap_logout_format = "in=%i out=%o",
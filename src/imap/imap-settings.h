@@ -17,6 +17,7 @@ struct imap_settings {
 	/* imap: */
 	uoff_t imap_max_line_length;
 	unsigned int imap_idle_notify_interval;
+	unsigned int imap_idle_park_timeout;
 	const char *imap_capability;
 	const char *imap_client_workarounds;
 	const char *imap_logout_format;
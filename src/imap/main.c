@@ -51,6 +51,8 @@ void imap_refresh_proctitle(void)
 	struct client *client;
 	struct client_command_context *cmd;
 	string_t *title = t_str_new(128);
+	unsigned int parked_count = 0;
+	size_t memory_usage = 0;
 
 	if (!verbose_proctitle)
 		return;
@@ -78,7 +80,16 @@ void imap_refresh_proctitle(void)
 		}
 		break;
 	default:
+		for (client = imap_clients; client != NULL; client = client->next) {
+			if (client->parked)
+				parked_count++;
+			memory_usage += client_get_memory_usage(client);
+		}
 		str_printfa(title, "%u connections", imap_client_count);
+		if (parked_count > 0)
+			str_printfa(title, ", %u parked", parked_count);
+		str_printfa(title, ", %"PRIuSIZE_T" kB",
+			    memory_usage / 1024);
 		break;
 	}
 	str_append_c(title, ']');
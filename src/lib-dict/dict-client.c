@@ -1,6 +1,7 @@
 /* Copyright (c) 2005-2013 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "array.h"
 #include "llist.h"
 #include "str.h"
 #include "net.h"
@@ -26,6 +27,11 @@
 /* Log a warning if dict lookup takes longer than this many seconds. */
 #define DICT_CLIENT_READ_WARN_TIMEOUT_SECS 5
 
+struct client_dict_lookup {
+	dict_lookup_callback_t *callback;
+	void *context;
+};
+
 struct client_dict {
 	struct dict dict;
 
@@ -41,22 +47,35 @@ struct client_dict {
 	struct ostream *output;
 	struct io *io;
 	struct timeout *to_idle;
+	struct timeout *to_requests;
 
 	struct client_dict_transaction_context *transactions;
+	/* asynchronous lookups waiting for a reply, in the order they were
+	   sent */
+	ARRAY(struct client_dict_lookup) async_lookups;
+	struct client_dict_iterate_context *async_iter;
 
 	unsigned int connect_counter;
 	unsigned int transaction_id_counter;
 	unsigned int async_commits;
+	/* 0 until the server's handshake has been received, which older
+	   servers never send */
+	unsigned int server_minor_version;
 
 	unsigned int in_iteration:1;
 	unsigned int handshaked:1;
+	/* the first reply line has been read. a handshake would have been
+	   sent before any other reply. */
+	unsigned int server_handshake_checked:1;
 };
 
 struct client_dict_iterate_context {
 	struct dict_iterate_context ctx;
 
 	pool_t pool;
+	enum dict_iterate_flags flags;
 	bool failed;
+	bool finished;
 };
 
 struct client_dict_transaction_context {
@@ -78,6 +97,7 @@ struct client_dict_transaction_context {
 
 static int client_dict_connect(struct client_dict *dict);
 static void client_dict_disconnect(struct client_dict *dict);
+static void client_dict_update_io(struct client_dict *dict);
 
 const char *dict_client_escape(const char *src)
 {
@@ -270,8 +290,8 @@ client_dict_finish_transaction(struct client_dict *dict,
 	/* the callback may call the dict code again, so remove this
 	   transaction before calling it */
 	i_assert(dict->async_commits > 0);
-	if (--dict->async_commits == 0)
-		io_remove(&dict->io);
+	dict->async_commits--;
+	client_dict_update_io(dict);
 	DLLIST_REMOVE(&dict->transactions, ctx);
 
 	if (ctx->callback != NULL)
@@ -310,13 +330,108 @@ static ssize_t client_dict_read_timeout(struct client_dict *dict)
 	return ret;
 }
 
-static int client_dict_read_one_line(struct client_dict *dict, char **line_r)
+static void
+client_dict_lookup_callback(const struct client_dict_lookup *lookup,
+			    const char *line)
+{
+	struct dict_lookup_result result;
+
+	memset(&result, 0, sizeof(result));
+	T_BEGIN {
+		switch (*line) {
+		case DICT_PROTOCOL_REPLY_OK:
+			result.value = dict_client_unescape(line + 1);
+			result.ret = 1;
+			break;
+		case DICT_PROTOCOL_REPLY_NOTFOUND:
+			result.ret = 0;
+			break;
+		default:
+			result.ret = -1;
+			break;
+		}
+		lookup->callback(&result, lookup->context);
+	} T_END;
+}
+
+static void client_dict_finish_lookup(struct client_dict *dict, char *line)
+{
+	struct client_dict_lookup lookup;
+
+	/* the callback may send more lookups, so remove this one first */
+	lookup = *array_idx(&dict->async_lookups, 0);
+	array_delete(&dict->async_lookups, 0, 1);
+	if (dict->to_requests != NULL)
+		timeout_reset(dict->to_requests);
+
+	client_dict_lookup_callback(&lookup, line);
+	client_dict_update_io(dict);
+}
+
+/* Handle replies to asynchronous commands. Returns 1 if the line is a reply
+   to the caller's command, 0 if it was already handled. */
+static int client_dict_handle_line(struct client_dict *dict, char *line)
 {
+	const char *const *args;
 	unsigned int id;
+	int ret;
+
+	if (!dict->server_handshake_checked) {
+		dict->server_handshake_checked = TRUE;
+		if (*line == DICT_PROTOCOL_REPLY_HELLO) {
+			args = t_strsplit_tab(line + 1);
+			if (str_array_length(args) < 2 ||
+			    str_to_uint(args[1],
+					&dict->server_minor_version) < 0) {
+				i_error("dict-client: Invalid handshake: %s",
+					line);
+				dict->server_minor_version = 0;
+			}
+			return 0;
+		}
+	}
+	if (*line == DICT_PROTOCOL_REPLY_ASYNC_COMMIT) {
+		switch (line[1]) {
+		case DICT_PROTOCOL_REPLY_OK:
+			ret = 1;
+			break;
+		case DICT_PROTOCOL_REPLY_NOTFOUND:
+			ret = 0;
+			break;
+		case DICT_PROTOCOL_REPLY_FAIL:
+			ret = -1;
+			break;
+		default:
+			i_error("dict-client: Invalid async commit line: %s",
+				line);
+			return 0;
+		}
+		if (str_to_uint(line+2, &id) < 0) {
+			i_error("dict-client: Invalid ID");
+			return 0;
+		}
+		client_dict_finish_transaction(dict, id, ret);
+		return 0;
+	}
+	if (array_count(&dict->async_lookups) > 0) {
+		/* replies come in the same order as the commands were sent,
+		   so this belongs to the oldest asynchronous lookup */
+		client_dict_finish_lookup(dict, line);
+		return 0;
+	}
+	return 1;
+}
+
+static int client_dict_read_one_line(struct client_dict *dict, char **line_r)
+{
 	char *line;
 	ssize_t ret;
 
 	*line_r = NULL;
+	if (dict->input == NULL) {
+		/* a callback disconnected us */
+		return -1;
+	}
 	while ((line = i_stream_next_line(dict->input)) == NULL) {
 		ret = client_dict_read_timeout(dict);
 		switch (ret) {
@@ -340,29 +455,8 @@ static int client_dict_read_one_line(struct client_dict *dict, char **line_r)
 			break;
 		}
 	}
-	if (*line == DICT_PROTOCOL_REPLY_ASYNC_COMMIT) {
-		switch (line[1]) {
-		case DICT_PROTOCOL_REPLY_OK:
-			ret = 1;
-			break;
-		case DICT_PROTOCOL_REPLY_NOTFOUND:
-			ret = 0;
-			break;
-		case DICT_PROTOCOL_REPLY_FAIL:
-			ret = -1;
-			break;
-		default:
-			i_error("dict-client: Invalid async commit line: %s",
-				line);
-			return 0;
-		}
-		if (str_to_uint(line+2, &id) < 0) {
-			i_error("dict-client: Invalid ID");
-			return 0;
-		}
-		client_dict_finish_transaction(dict, id, ret);
+	if (client_dict_handle_line(dict, line) == 0)
 		return 0;
-	}
 	*line_r = line;
 	return 1;
 }
@@ -370,7 +464,8 @@ static int client_dict_read_one_line(struct client_dict *dict, char **line_r)
 static bool client_dict_is_finished(struct client_dict *dict)
 {
 	return dict->transactions == NULL && !dict->in_iteration &&
-		dict->async_commits == 0;
+		dict->async_commits == 0 &&
+		array_count(&dict->async_lookups) == 0;
 }
 
 static void client_dict_timeout(struct client_dict *dict)
@@ -448,9 +543,14 @@ static int client_dict_connect(struct client_dict *dict)
 static void client_dict_disconnect(struct client_dict *dict)
 {
 	struct client_dict_transaction_context *ctx, *next;
+	struct client_dict_iterate_context *iter = NULL;
+	ARRAY(struct client_dict_lookup) lookups;
+	const struct client_dict_lookup *lookup;
 
 	dict->connect_counter++;
 	dict->handshaked = FALSE;
+	dict->server_handshake_checked = FALSE;
+	dict->server_minor_version = 0;
 
 	/* abort all pending async commits */
 	for (ctx = dict->transactions; ctx != NULL; ctx = next) {
@@ -458,9 +558,24 @@ static void client_dict_disconnect(struct client_dict *dict)
 		if (ctx->async)
 			client_dict_finish_transaction(dict, ctx->id, -1);
 	}
+	/* the lookup and iteration callbacks may send new commands, so call
+	   them only after the connection is closed */
+	t_array_init(&lookups, array_count(&dict->async_lookups) + 1);
+	array_append_array(&lookups, &dict->async_lookups);
+	array_clear(&dict->async_lookups);
+	if (dict->async_iter != NULL) {
+		dict->async_iter->failed = TRUE;
+		if (dict->async_iter->ctx.has_more) {
+			/* the iterator is waiting for more replies */
+			iter = dict->async_iter;
+			iter->ctx.has_more = FALSE;
+		}
+	}
 
 	if (dict->to_idle != NULL)
 		timeout_remove(&dict->to_idle);
+	if (dict->to_requests != NULL)
+		timeout_remove(&dict->to_requests);
 	if (dict->io != NULL)
 		io_remove(&dict->io);
 	if (dict->input != NULL)
@@ -473,6 +588,12 @@ static void client_dict_disconnect(struct client_dict *dict)
 			i_error("close(%s) failed: %m", dict->path);
 		dict->fd = -1;
 	}
+
+	/* abort all pending async lookups and the iteration */
+	array_foreach(&lookups, lookup)
+		client_dict_lookup_callback(lookup, "");
+	if (iter != NULL && dict->async_iter == iter)
+		iter->ctx.async_callback(iter->ctx.async_context);
 }
 
 static int
@@ -500,6 +621,7 @@ client_dict_init(struct dict *driver, const char *uri,
 	dict->username = p_strdup(pool, username);
 
 	dict->fd = -1;
+	i_array_init(&dict->async_lookups, 4);
 
 	if (*uri != ':') {
 		/* path given */
@@ -519,6 +641,7 @@ static void client_dict_deinit(struct dict *_dict)
 
         client_dict_disconnect(dict);
 	i_assert(dict->transactions == NULL);
+	array_free(&dict->async_lookups);
 	pool_unref(&dict->pool);
 }
 
@@ -531,8 +654,16 @@ static int client_dict_wait(struct dict *_dict)
 	if (!dict->handshaked)
 		return -1;
 
-	while (dict->async_commits > 0) {
+	while (dict->async_commits > 0 ||
+	       array_count(&dict->async_lookups) > 0) {
 		if (client_dict_read_one_line(dict, &line) < 0) {
+			client_dict_disconnect(dict);
+			ret = -1;
+			break;
+		}
+		if (line != NULL) {
+			i_error("dict-client: Unexpected reply: %s", line);
+			client_dict_disconnect(dict);
 			ret = -1;
 			break;
 		}
@@ -571,6 +702,114 @@ static int client_dict_lookup(struct dict *_dict, pool_t pool,
 	}
 }
 
+static int
+client_dict_lookup_multi_send(struct client_dict *dict, pool_t pool,
+			      const char *const *keys, const char **values_r)
+{
+	const char *const *args;
+	unsigned int i, count = str_array_length(keys);
+	char *line;
+	int ret;
+
+	T_BEGIN {
+		string_t *query = t_str_new(256);
+
+		str_append_c(query, DICT_PROTOCOL_CMD_LOOKUP_MULTI);
+		for (i = 0; i < count; i++) {
+			if (i > 0)
+				str_append_c(query, '\t');
+			str_append(query, dict_client_escape(keys[i]));
+		}
+		str_append_c(query, '\n');
+		ret = client_dict_send_query(dict, str_c(query));
+	} T_END;
+	if (ret < 0)
+		return -1;
+
+	/* read reply */
+	line = client_dict_read_line(dict);
+	if (line == NULL || *line == DICT_PROTOCOL_REPLY_FAIL)
+		return -1;
+
+	args = t_strsplit_tab(line);
+	if (str_array_length(args) != count) {
+		i_error("dict-client: LOOKUP_MULTI returned %u values, "
+			"expected %u", str_array_length(args), count);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		switch (args[i][0]) {
+		case DICT_PROTOCOL_REPLY_OK:
+			values_r[i] = p_strdup(pool,
+				dict_client_unescape(args[i] + 1));
+			break;
+		case DICT_PROTOCOL_REPLY_NOTFOUND:
+			values_r[i] = NULL;
+			break;
+		default:
+			i_error("dict-client: LOOKUP_MULTI returned "
+				"invalid value: %s", args[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int
+client_dict_lookup_multi(struct dict *_dict, pool_t pool,
+			 const char *const *keys, const char **values_r)
+{
+	struct client_dict *dict = (struct client_dict *)_dict;
+	unsigned int i;
+
+	/* older servers disconnect on LOOKUP_MULTI. their version is known
+	   only after the first reply, so until then look up the keys one
+	   at a time. */
+	for (i = 0; keys[i] != NULL; i++) {
+		if (dict->server_minor_version >=
+		    DICT_CLIENT_PROTOCOL_MINOR_VERSION_LOOKUP_MULTI)
+			break;
+		if (client_dict_lookup(_dict, pool, keys[i], &values_r[i]) < 0)
+			return -1;
+	}
+	if (keys[i] == NULL)
+		return 0;
+	return client_dict_lookup_multi_send(dict, pool, keys + i,
+					     values_r + i);
+}
+
+static void
+client_dict_lookup_async(struct dict *_dict, const char *key,
+			 dict_lookup_callback_t *callback, void *context)
+{
+	struct client_dict *dict = (struct client_dict *)_dict;
+	struct client_dict_lookup *lookup;
+	struct dict_lookup_result result;
+	int ret;
+
+	/* iteration replies would get mixed up with the lookup reply */
+	i_assert(!dict->in_iteration);
+
+	T_BEGIN {
+		const char *query;
+
+		query = t_strdup_printf("%c%s\n", DICT_PROTOCOL_CMD_LOOKUP,
+					dict_client_escape(key));
+		ret = client_dict_send_query(dict, query);
+	} T_END;
+	if (ret < 0) {
+		memset(&result, 0, sizeof(result));
+		result.ret = -1;
+		callback(&result, context);
+		return;
+	}
+
+	lookup = array_append_space(&dict->async_lookups);
+	lookup->callback = callback;
+	lookup->context = context;
+	client_dict_update_io(dict);
+}
+
 static struct dict_iterate_context *
 client_dict_iterate_init(struct dict *_dict, const char *const *paths,
 			 enum dict_iterate_flags flags)
@@ -585,12 +824,17 @@ client_dict_iterate_init(struct dict *_dict, const char *const *paths,
 	ctx = i_new(struct client_dict_iterate_context, 1);
 	ctx->ctx.dict = _dict;
 	ctx->pool = pool_alloconly_create("client dict iteration", 512);
+	ctx->flags = flags;
+	if ((flags & DICT_ITERATE_FLAG_ASYNC) != 0)
+		dict->async_iter = ctx;
 
 	T_BEGIN {
 		string_t *query = t_str_new(256);
 		unsigned int i;
 
-		str_printfa(query, "%c%d", DICT_PROTOCOL_CMD_ITERATE, flags);
+		/* the server always iterates synchronously */
+		str_printfa(query, "%c%d", DICT_PROTOCOL_CMD_ITERATE,
+			    flags & ~DICT_ITERATE_FLAG_ASYNC);
 		for (i = 0; paths[i] != NULL; i++) {
 			str_append_c(query, '\t');
 			str_append(query, dict_client_escape(paths[i]));
@@ -602,26 +846,16 @@ client_dict_iterate_init(struct dict *_dict, const char *const *paths,
 	return &ctx->ctx;
 }
 
-static bool client_dict_iterate(struct dict_iterate_context *_ctx,
-				const char **key_r, const char **value_r)
+static bool
+client_dict_iterate_parse(struct client_dict_iterate_context *ctx, char *line,
+			  const char **key_r, const char **value_r)
 {
-	struct client_dict_iterate_context *ctx =
-		(struct client_dict_iterate_context *)_ctx;
-	struct client_dict *dict = (struct client_dict *)_ctx->dict;
-	char *line, *value;
-
-	if (ctx->failed)
-		return FALSE;
-
-	/* read next reply */
-	line = client_dict_read_line(dict);
-	if (line == NULL) {
-		ctx->failed = TRUE;
-		return FALSE;
-	}
+	struct client_dict *dict = (struct client_dict *)ctx->ctx.dict;
+	char *value;
 
 	if (*line == '\0') {
 		/* end of iteration */
+		ctx->finished = TRUE;
 		return FALSE;
 	}
 
@@ -652,6 +886,52 @@ static bool client_dict_iterate(struct dict_iterate_context *_ctx,
 	return TRUE;
 }
 
+static char *
+client_dict_iterate_read_line_nonblock(struct client_dict_iterate_context *ctx)
+{
+	struct client_dict *dict = (struct client_dict *)ctx->ctx.dict;
+	char *line;
+
+	while (dict->input != NULL &&
+	       (line = i_stream_next_line(dict->input)) != NULL) {
+		if (client_dict_handle_line(dict, line) > 0)
+			return line;
+	}
+	if (dict->input == NULL) {
+		ctx->failed = TRUE;
+		return NULL;
+	}
+	/* wait for more input */
+	ctx->ctx.has_more = TRUE;
+	client_dict_update_io(dict);
+	return NULL;
+}
+
+static bool client_dict_iterate(struct dict_iterate_context *_ctx,
+				const char **key_r, const char **value_r)
+{
+	struct client_dict_iterate_context *ctx =
+		(struct client_dict_iterate_context *)_ctx;
+	struct client_dict *dict = (struct client_dict *)_ctx->dict;
+	char *line;
+
+	_ctx->has_more = FALSE;
+	if (ctx->failed || ctx->finished)
+		return FALSE;
+
+	/* read next reply */
+	if ((ctx->flags & DICT_ITERATE_FLAG_ASYNC) != 0)
+		line = client_dict_iterate_read_line_nonblock(ctx);
+	else {
+		line = client_dict_read_line(dict);
+		if (line == NULL)
+			ctx->failed = TRUE;
+	}
+	if (line == NULL)
+		return FALSE;
+	return client_dict_iterate_parse(ctx, line, key_r, value_r);
+}
+
 static int client_dict_iterate_deinit(struct dict_iterate_context *_ctx)
 {
 	struct client_dict *dict = (struct client_dict *)_ctx->dict;
@@ -659,10 +939,19 @@ static int client_dict_iterate_deinit(struct dict_iterate_context *_ctx)
 		(struct client_dict_iterate_context *)_ctx;
 	int ret = ctx->failed ? -1 : 0;
 
+	if (dict->async_iter == ctx) {
+		dict->async_iter = NULL;
+		if (!ctx->finished && !ctx->failed) {
+			/* the rest of the iteration replies would get mixed
+			   up with the following commands */
+			client_dict_disconnect(dict);
+		}
+	}
 	pool_unref(&ctx->pool);
 	i_free(ctx);
 	dict->in_iteration = FALSE;
 
+	client_dict_update_io(dict);
 	client_dict_add_timeout(dict);
 	return ret;
 }
@@ -683,17 +972,76 @@ client_dict_transaction_init(struct dict *_dict)
 
 static void dict_async_input(struct client_dict *dict)
 {
+	struct client_dict_iterate_context *iter = dict->async_iter;
 	char *line;
 	int ret;
 
-	i_assert(!dict->in_iteration);
+	if (iter != NULL && iter->ctx.has_more) {
+		/* let the iterator parse the lines */
+		switch (i_stream_read(dict->input)) {
+		case -1:
+			if (dict->input->stream_errno != 0)
+				i_error("read(%s) failed: %m", dict->path);
+			else {
+				i_error("read(%s) failed: Remote disconnected",
+					dict->path);
+			}
+			/* calls the iteration callback */
+			client_dict_disconnect(dict);
+			return;
+		case -2:
+			i_error("read(%s) returned too much data", dict->path);
+			client_dict_disconnect(dict);
+			return;
+		}
+		iter->ctx.has_more = FALSE;
+		client_dict_update_io(dict);
+		iter->ctx.async_callback(iter->ctx.async_context);
+		return;
+	}
 
 	do {
 		ret = client_dict_read_one_line(dict, &line);
-	} while (ret == 0 && i_stream_get_data_size(dict->input) > 0);
+		if (ret > 0) {
+			i_error("dict-client: Unexpected reply: %s", line);
+			ret = -1;
+		}
+	} while (ret == 0 && dict->input != NULL &&
+		 i_stream_get_data_size(dict->input) > 0);
 
 	if (ret < 0)
+		client_dict_disconnect(dict);
+}
+
+static void client_dict_requests_timeout(struct client_dict *dict)
+{
+	i_error("read(%s) failed: Timeout after %u seconds",
+		dict->path, DICT_CLIENT_READ_TIMEOUT_SECS);
+	client_dict_disconnect(dict);
+}
+
+static void client_dict_update_io(struct client_dict *dict)
+{
+	/* the timeout is restarted whenever an iteration starts waiting for
+	   more replies */
+	bool have_requests = array_count(&dict->async_lookups) > 0 ||
+		(dict->async_iter != NULL && dict->async_iter->ctx.has_more);
+	bool need_io;
+
+	need_io = dict->fd != -1 &&
+		(dict->async_commits > 0 || have_requests);
+	if (need_io && dict->io == NULL)
+		dict->io = io_add(dict->fd, IO_READ, dict_async_input, dict);
+	else if (!need_io && dict->io != NULL)
 		io_remove(&dict->io);
+
+	if (have_requests && dict->to_requests == NULL) {
+		dict->to_requests =
+			timeout_add(DICT_CLIENT_READ_TIMEOUT_SECS*1000,
+				    client_dict_requests_timeout, dict);
+	} else if (!have_requests && dict->to_requests != NULL) {
+		timeout_remove(&dict->to_requests);
+	}
 }
 
 static int
@@ -721,10 +1069,8 @@ client_dict_transaction_commit(struct dict_transaction_context *_ctx,
 			ctx->callback = callback;
 			ctx->context = context;
 			ctx->async = TRUE;
-			if (dict->async_commits++ == 0) {
-				dict->io = io_add(dict->fd, IO_READ,
-						  dict_async_input, dict);
-			}
+			dict->async_commits++;
+			client_dict_update_io(dict);
 		} else {
 			/* sync commit, read reply */
 			line = client_dict_read_line(dict);
@@ -851,6 +1197,8 @@ struct dict dict_driver_client = {
 		client_dict_set,
 		client_dict_unset,
 		client_dict_append,
-		client_dict_atomic_inc
+		client_dict_atomic_inc,
+		client_dict_lookup_async,
+		client_dict_lookup_multi
 	}
 };
@@ -6,7 +6,9 @@
 #define DEFAULT_DICT_SERVER_SOCKET_FNAME "dict"
 
 #define DICT_CLIENT_PROTOCOL_MAJOR_VERSION 2
-#define DICT_CLIENT_PROTOCOL_MINOR_VERSION 0
+#define DICT_CLIENT_PROTOCOL_MINOR_VERSION 1
+/* the server sends a handshake and supports LOOKUP_MULTI since this */
+#define DICT_CLIENT_PROTOCOL_MINOR_VERSION_LOOKUP_MULTI 1
 
 #define DICT_CLIENT_MAX_LINE_LENGTH (64*1024)
 
@@ -15,6 +17,8 @@ enum {
 	DICT_PROTOCOL_CMD_HELLO = 'H',
 
 	DICT_PROTOCOL_CMD_LOOKUP = 'L', /* <key> */
+	/* reply: O<value> or N for each key, separated by tabs */
+	DICT_PROTOCOL_CMD_LOOKUP_MULTI = 'M', /* <key> [<key> ...] */
 	DICT_PROTOCOL_CMD_ITERATE = 'I', /* <flags> <path> */
 
 	DICT_PROTOCOL_CMD_BEGIN = 'B', /* <id> */
@@ -32,7 +36,10 @@ enum {
 	DICT_PROTOCOL_REPLY_OK = 'O', /* <value> */
 	DICT_PROTOCOL_REPLY_NOTFOUND = 'N',
 	DICT_PROTOCOL_REPLY_FAIL = 'F',
-	DICT_PROTOCOL_REPLY_ASYNC_COMMIT = 'A'
+	DICT_PROTOCOL_REPLY_ASYNC_COMMIT = 'A',
+	/* <major-version> <minor-version>. Sent as the first reply, if the
+	   client's minor version is at least 1. */
+	DICT_PROTOCOL_REPLY_HELLO = 'H'
 };
 
 const char *dict_client_escape(const char *src);
@@ -37,6 +37,8 @@ struct memcached_ascii_connection {
 struct memcached_ascii_dict_reply {
 	unsigned int reply_count;
 	dict_transaction_commit_callback_t *callback;
+	/* for asynchronous lookups instead of callback */
+	dict_lookup_callback_t *lookup_callback;
 	void *context;
 };
 
@@ -70,19 +72,29 @@ static void memcached_ascii_conn_destroy(struct connection *_conn)
 {
 	struct memcached_ascii_connection *conn =
 		(struct memcached_ascii_connection *)_conn;
+	ARRAY(struct memcached_ascii_dict_reply) replies;
 	const struct memcached_ascii_dict_reply *reply;
+	struct dict_lookup_result result;
 
 	connection_disconnect(_conn);
 	if (conn->dict->ioloop != NULL)
 		io_loop_stop(conn->dict->ioloop);
 
-	array_foreach(&conn->dict->replies, reply) {
-		if (reply->callback != NULL)
-			reply->callback(-1, reply->context);
-	}
+	/* the callbacks may send new requests */
+	t_array_init(&replies, array_count(&conn->dict->replies) + 1);
+	array_append_array(&replies, &conn->dict->replies);
 	array_clear(&conn->dict->replies);
 	array_clear(&conn->dict->input_states);
 	conn->reply_bytes_left = 0;
+
+	memset(&result, 0, sizeof(result));
+	result.ret = -1;
+	array_foreach(&replies, reply) {
+		if (reply->lookup_callback != NULL)
+			reply->lookup_callback(&result, reply->context);
+		else if (reply->callback != NULL)
+			reply->callback(-1, reply->context);
+	}
 }
 
 static bool memcached_ascii_input_value(struct memcached_ascii_connection *conn)
@@ -171,9 +183,25 @@ static int memcached_ascii_input_reply_read(struct memcached_ascii_dict *dict)
 	return -1;
 }
 
+static void
+memcached_ascii_lookup_callback(struct memcached_ascii_dict *dict,
+				const struct memcached_ascii_dict_reply *reply)
+{
+	struct dict_lookup_result result;
+
+	memset(&result, 0, sizeof(result));
+	if (dict->conn.value_received) {
+		result.ret = 1;
+		result.value = str_c(dict->conn.reply_str);
+	}
+	T_BEGIN {
+		reply->lookup_callback(&result, reply->context);
+	} T_END;
+}
+
 static int memcached_ascii_input_reply(struct memcached_ascii_dict *dict)
 {
-	struct memcached_ascii_dict_reply *replies;
+	struct memcached_ascii_dict_reply *replies, reply;
 	unsigned int count;
 	int ret;
 
@@ -186,9 +214,13 @@ static int memcached_ascii_input_reply(struct memcached_ascii_dict *dict)
 	i_assert(count > 0);
 	i_assert(replies[0].reply_count > 0);
 	if (--replies[0].reply_count == 0) {
-		if (replies[0].callback != NULL)
-			replies[0].callback(1, replies[0].context);
+		/* the callback may add new replies */
+		reply = replies[0];
 		array_delete(&dict->replies, 0, 1);
+		if (reply.lookup_callback != NULL)
+			memcached_ascii_lookup_callback(dict, &reply);
+		else if (reply.callback != NULL)
+			reply.callback(1, reply.context);
 	}
 	return 1;
 }
@@ -469,16 +501,24 @@ memcached_ascii_dict_get_full_key(struct memcached_ascii_dict *dict,
 	return key;
 }
 
-static int
-memcached_ascii_dict_lookup_real(struct memcached_ascii_dict *dict, pool_t pool,
-				 const char *key, const char **value_r)
+static int memcached_ascii_dict_wait(struct dict *_dict)
+{
+	struct memcached_ascii_dict *dict =
+		(struct memcached_ascii_dict *)_dict;
+
+	if (array_count(&dict->input_states) == 0)
+		return 0;
+	return memcached_ascii_wait(dict);
+}
+
+static void
+memcached_ascii_dict_send_get(struct memcached_ascii_dict *dict,
+			      const char *key,
+			      dict_lookup_callback_t *callback, void *context)
 {
 	enum memcached_ascii_input_state state = MEMCACHED_INPUT_STATE_GET;
 	struct memcached_ascii_dict_reply *reply;
 
-	if (memcached_ascii_connect(dict) < 0)
-		return -1;
-
 	key = memcached_ascii_dict_get_full_key(dict, key);
 	o_stream_nsend_str(dict->conn.conn.output,
 			   t_strdup_printf("get %s\r\n", key));
@@ -486,7 +526,20 @@ memcached_ascii_dict_lookup_real(struct memcached_ascii_dict *dict, pool_t pool,
 
 	reply = array_append_space(&dict->replies);
 	reply->reply_count = 1;
+	reply->lookup_callback = callback;
+	reply->context = context;
+}
 
+static int
+memcached_ascii_dict_lookup_real(struct memcached_ascii_dict *dict, pool_t pool,
+				 const char *key, const char **value_r)
+{
+	if (memcached_ascii_connect(dict) < 0)
+		return -1;
+
+	/* this also waits for the earlier asynchronous requests. our reply
+	   is the last one, so it's left to reply_str. */
+	memcached_ascii_dict_send_get(dict, key, NULL, NULL);
 	if (memcached_ascii_wait(dict) < 0)
 		return -1;
 
@@ -509,6 +562,25 @@ memcached_ascii_dict_lookup(struct dict *_dict, pool_t pool,
 	return ret;
 }
 
+static void
+memcached_ascii_dict_lookup_async(struct dict *_dict, const char *key,
+				  dict_lookup_callback_t *callback,
+				  void *context)
+{
+	struct memcached_ascii_dict *dict = (struct memcached_ascii_dict *)_dict;
+	struct dict_lookup_result result;
+
+	if (memcached_ascii_connect(dict) < 0) {
+		memset(&result, 0, sizeof(result));
+		result.ret = -1;
+		callback(&result, context);
+		return;
+	}
+	T_BEGIN {
+		memcached_ascii_dict_send_get(dict, key, callback, context);
+	} T_END;
+}
+
 static struct dict_transaction_context *
 memcached_ascii_transaction_init(struct dict *_dict)
 {
@@ -639,7 +711,7 @@ struct dict dict_driver_memcached_ascii = {
 	{
 		memcached_ascii_dict_init,
 		memcached_ascii_dict_deinit,
-		NULL,
+		memcached_ascii_dict_wait,
 		memcached_ascii_dict_lookup,
 		NULL,
 		NULL,
@@ -650,6 +722,7 @@ struct dict dict_driver_memcached_ascii = {
 		dict_transaction_memory_set,
 		dict_transaction_memory_unset,
 		dict_transaction_memory_append,
-		dict_transaction_memory_atomic_inc
+		dict_transaction_memory_atomic_inc,
+		memcached_ascii_dict_lookup_async
 	}
 };
@@ -40,10 +40,15 @@ struct memcached_connection {
 		const unsigned char *value;
 		unsigned int value_len;
 		enum memcached_response status;
-		bool reply_received;
 	} reply;
 };
 
+struct memcached_dict_lookup {
+	dict_lookup_callback_t *callback;
+	void *context;
+	char *key;
+};
+
 struct memcached_dict {
 	struct dict dict;
 	struct ip_addr ip;
@@ -53,6 +58,8 @@ struct memcached_dict {
 
 	struct ioloop *ioloop;
 	struct memcached_connection conn;
+	/* lookups waiting for a reply, in the order they were sent */
+	ARRAY(struct memcached_dict_lookup) lookups;
 
 	bool connected;
 };
@@ -68,6 +75,73 @@ static void memcached_conn_destroy(struct connection *_conn)
 
 	if (conn->dict->ioloop != NULL)
 		io_loop_stop(conn->dict->ioloop);
+
+	if (array_count(&conn->dict->lookups) > 0) T_BEGIN {
+		ARRAY(struct memcached_dict_lookup) lookups;
+		struct memcached_dict_lookup *lookup;
+		struct dict_lookup_result result;
+
+		/* callbacks may send new lookups */
+		t_array_init(&lookups, array_count(&conn->dict->lookups));
+		array_append_array(&lookups, &conn->dict->lookups);
+		array_clear(&conn->dict->lookups);
+
+		memset(&result, 0, sizeof(result));
+		result.ret = -1;
+		array_foreach_modifiable(&lookups, lookup) {
+			lookup->callback(&result, lookup->context);
+			i_free(lookup->key);
+		}
+	} T_END;
+}
+
+static int
+memcached_reply_get_result(const struct memcached_connection *conn,
+			   const char *key)
+{
+	switch (conn->reply.status) {
+	case MEMCACHED_RESPONSE_OK:
+		return 1;
+	case MEMCACHED_RESPONSE_NOTFOUND:
+		return 0;
+	case MEMCACHED_RESPONSE_INTERNALERROR:
+		i_error("memcached: Lookup(%s) failed: Internal error", key);
+		return -1;
+	case MEMCACHED_RESPONSE_BUSY:
+		i_error("memcached: Lookup(%s) failed: Busy", key);
+		return -1;
+	case MEMCACHED_RESPONSE_TEMPFAILURE:
+		i_error("memcached: Lookup(%s) failed: Temporary failure", key);
+		return -1;
+	}
+
+	i_error("memcached: Lookup(%s) failed: Error code=%u",
+		key, conn->reply.status);
+	return -1;
+}
+
+static void memcached_lookup_finish(struct memcached_connection *conn)
+{
+	struct memcached_dict_lookup lookup;
+	struct dict_lookup_result result;
+
+	lookup = *array_idx(&conn->dict->lookups, 0);
+	array_delete(&conn->dict->lookups, 0, 1);
+
+	T_BEGIN {
+		memset(&result, 0, sizeof(result));
+		result.ret = memcached_reply_get_result(conn, lookup.key);
+		if (result.ret > 0) {
+			result.value = t_strndup(conn->reply.value,
+						 conn->reply.value_len);
+		}
+		lookup.callback(&result, lookup.context);
+	} T_END;
+	i_free(lookup.key);
+
+	if (array_count(&conn->dict->lookups) == 0 &&
+	    conn->dict->ioloop != NULL)
+		io_loop_stop(conn->dict->ioloop);
 }
 
 static int memcached_input_get(struct memcached_connection *conn)
@@ -115,16 +189,19 @@ static int memcached_input_get(struct memcached_connection *conn)
 	conn->reply.status = status;
 
 	i_stream_skip(conn->conn.input, body_len);
-	conn->reply.reply_received = TRUE;
 
-	if (conn->dict->ioloop != NULL)
-		io_loop_stop(conn->dict->ioloop);
+	if (array_count(&conn->dict->lookups) == 0) {
+		i_error("memcached: Unexpected reply");
+		return -1;
+	}
+	memcached_lookup_finish(conn);
 	return 1;
 }
 
 static void memcached_conn_input(struct connection *_conn)
 {
 	struct memcached_connection *conn = (struct memcached_connection *)_conn;
+	int ret;
 
 	switch (i_stream_read(_conn->input)) {
 	case 0:
@@ -136,7 +213,8 @@ static void memcached_conn_input(struct connection *_conn)
 		break;
 	}
 
-	if (memcached_input_get(conn) < 0)
+	while ((ret = memcached_input_get(conn)) > 0) ;
+	if (ret < 0)
 		memcached_conn_destroy(_conn);
 }
 
@@ -231,6 +309,7 @@ memcached_dict_init(struct dict *driver, const char *uri,
 	dict->dict = *driver;
 	dict->conn.cmd = buffer_create_dynamic(default_pool, 256);
 	dict->conn.dict = dict;
+	i_array_init(&dict->lookups, 4);
 	*dict_r = &dict->dict;
 	return 0;
 }
@@ -240,6 +319,8 @@ static void memcached_dict_deinit(struct dict *_dict)
 	struct memcached_dict *dict = (struct memcached_dict *)_dict;
 
 	connection_deinit(&dict->conn.conn);
+	i_assert(array_count(&dict->lookups) == 0);
+	array_free(&dict->lookups);
 	buffer_free(&dict->conn.cmd);
 	i_free(dict->key_prefix);
 	i_free(dict);
@@ -273,93 +354,137 @@ static void memcached_add_header(buffer_t *buf, unsigned int key_len)
 	i_assert(buf->used == MEMCACHED_REQUEST_HDR_LENGTH);
 }
 
-static int
-memcached_dict_lookup_real(struct memcached_dict *dict, pool_t pool,
-			   const char *key, const char **value_r)
+static const char *
+memcached_dict_get_full_key(struct memcached_dict *dict, const char *key)
 {
-	struct ioloop *prev_ioloop = current_ioloop;
-	struct timeout *to;
-	unsigned int key_len;
-
 	if (strncmp(key, DICT_PATH_SHARED, strlen(DICT_PATH_SHARED)) == 0)
 		key += strlen(DICT_PATH_SHARED);
 	else {
 		i_error("memcached: Only shared keys supported currently");
-		return -1;
+		return NULL;
 	}
 	if (*dict->key_prefix != '\0')
 		key = t_strconcat(dict->key_prefix, key, NULL);
-	key_len = strlen(key);
-	if (key_len > 0xffff) {
+	if (strlen(key) > 0xffff) {
 		i_error("memcached: Key is too long (%u bytes): %s",
-			key_len, key);
-		return -1;
+			(unsigned int)strlen(key), key);
+		return NULL;
 	}
+	return key;
+}
+
+static void memcached_dict_run_ioloop(struct memcached_dict *dict)
+{
+	struct ioloop *prev_ioloop = current_ioloop;
+	struct timeout *to;
 
 	i_assert(dict->ioloop == NULL);
 
 	dict->ioloop = io_loop_create();
 	connection_switch_ioloop(&dict->conn.conn);
 
+	to = timeout_add(dict->timeout_msecs,
+			 memcached_dict_lookup_timeout, dict);
+	io_loop_run(dict->ioloop);
+	timeout_remove(&to);
+
+	current_ioloop = prev_ioloop;
+	connection_switch_ioloop(&dict->conn.conn);
+	current_ioloop = dict->ioloop;
+	io_loop_destroy(&dict->ioloop);
+}
+
+static int memcached_dict_connect(struct memcached_dict *dict)
+{
 	if (dict->conn.conn.fd_in == -1 &&
 	    connection_client_connect(&dict->conn.conn) < 0) {
 		i_error("memcached: Couldn't connect to %s:%u",
 			net_ip2addr(&dict->ip), dict->port);
-	} else {
-		to = timeout_add(dict->timeout_msecs,
-				 memcached_dict_lookup_timeout, dict);
-		if (!dict->connected) {
-			/* wait for connection */
-			io_loop_run(dict->ioloop);
-		}
-
-		if (dict->connected) {
-			buffer_set_used_size(dict->conn.cmd, 0);
-			memcached_add_header(dict->conn.cmd, key_len);
-			buffer_append(dict->conn.cmd, key, key_len);
+		return -1;
+	}
+	if (!dict->connected) {
+		/* wait for connection */
+		memcached_dict_run_ioloop(dict);
+	}
+	return dict->connected ? 0 : -1;
+}
 
-			o_stream_nsend(dict->conn.conn.output,
-				       dict->conn.cmd->data,
-				       dict->conn.cmd->used);
+static void
+memcached_dict_send_get(struct memcached_dict *dict, const char *key,
+			dict_lookup_callback_t *callback, void *context)
+{
+	struct memcached_dict_lookup *lookup;
+	struct dict_lookup_result result;
+	unsigned int key_len;
 
-			memset(&dict->conn.reply, 0, sizeof(dict->conn.reply));
-			io_loop_run(dict->ioloop);
-		}
-		timeout_remove(&to);
+	key = memcached_dict_get_full_key(dict, key);
+	if (key == NULL || memcached_dict_connect(dict) < 0) {
+		memset(&result, 0, sizeof(result));
+		result.ret = -1;
+		callback(&result, context);
+		return;
 	}
+	key_len = strlen(key);
 
-	current_ioloop = prev_ioloop;
-	connection_switch_ioloop(&dict->conn.conn);
-	current_ioloop = dict->ioloop;
-	io_loop_destroy(&dict->ioloop);
+	buffer_set_used_size(dict->conn.cmd, 0);
+	memcached_add_header(dict->conn.cmd, key_len);
+	buffer_append(dict->conn.cmd, key, key_len);
+
+	o_stream_nsend(dict->conn.conn.output,
+		       dict->conn.cmd->data, dict->conn.cmd->used);
+
+	lookup = array_append_space(&dict->lookups);
+	lookup->callback = callback;
+	lookup->context = context;
+	lookup->key = i_strdup(key);
+}
+
+struct memcached_dict_sync_lookup {
+	struct memcached_dict *dict;
+	pool_t pool;
+
+	int ret;
+	const char *value;
+	bool finished;
+};
+
+static void
+memcached_dict_sync_lookup_callback(const struct dict_lookup_result *result,
+				    struct memcached_dict_sync_lookup *ctx)
+{
+	ctx->ret = result->ret;
+	ctx->value = p_strdup(ctx->pool, result->value);
+	ctx->finished = TRUE;
+	if (ctx->dict->ioloop != NULL)
+		io_loop_stop(ctx->dict->ioloop);
+}
+
+static int
+memcached_dict_lookup_real(struct memcached_dict *dict, pool_t pool,
+			   const char *key, const char **value_r)
+{
+	struct memcached_dict_sync_lookup ctx;
 
-	if (!dict->conn.reply.reply_received) {
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.dict = dict;
+	ctx.pool = pool;
+
+	/* replies to earlier asynchronous lookups are handled while
+	   waiting */
+	memcached_dict_send_get(dict, key,
+		(dict_lookup_callback_t *)memcached_dict_sync_lookup_callback,
+		&ctx);
+	if (!ctx.finished)
+		memcached_dict_run_ioloop(dict);
+
+	if (!ctx.finished) {
 		/* we failed in some way. make sure we disconnect since the
 		   connection state isn't known anymore */
 		memcached_conn_destroy(&dict->conn.conn);
-		return -1;
-	}
-	switch (dict->conn.reply.status) {
-	case MEMCACHED_RESPONSE_OK:
-		*value_r = p_strndup(pool, dict->conn.reply.value,
-				     dict->conn.reply.value_len);
-		return 1;
-	case MEMCACHED_RESPONSE_NOTFOUND:
-		return 0;
-	case MEMCACHED_RESPONSE_INTERNALERROR:
-		i_error("memcached: Lookup(%s) failed: Internal error", key);
-		return -1;
-	case MEMCACHED_RESPONSE_BUSY:
-		i_error("memcached: Lookup(%s) failed: Busy", key);
-		return -1;
-	case MEMCACHED_RESPONSE_TEMPFAILURE:
-		i_error("memcached: Lookup(%s) failed: Temporary failure", key);
-		return -1;
+		i_assert(ctx.finished);
 	}
-
-	i_error("memcached: Lookup(%s) failed: Error code=%u",
-		key, dict->conn.reply.status);
-	return -1;
+	*value_r = ctx.value;
+	return ctx.ret;
 }
 
 static int memcached_dict_lookup(struct dict *_dict, pool_t pool,
@@ -376,12 +501,88 @@ static int memcached_dict_lookup(struct dict *_dict, pool_t pool,
 	return ret;
 }
 
+static void
+memcached_dict_lookup_async(struct dict *_dict, const char *key,
+			    dict_lookup_callback_t *callback, void *context)
+{
+	struct memcached_dict *dict = (struct memcached_dict *)_dict;
+
+	T_BEGIN {
+		memcached_dict_send_get(dict, key, callback, context);
+	} T_END;
+}
+
+static int memcached_dict_wait(struct dict *_dict)
+{
+	struct memcached_dict *dict = (struct memcached_dict *)_dict;
+
+	if (array_count(&dict->lookups) == 0)
+		return 0;
+
+	memcached_dict_run_ioloop(dict);
+	if (array_count(&dict->lookups) > 0) {
+		/* timed out. this also fails the lookups. */
+		memcached_conn_destroy(&dict->conn.conn);
+		return -1;
+	}
+	return 0;
+}
+
+struct memcached_dict_multi_value {
+	pool_t pool;
+	const char **value_r;
+	bool *failed;
+};
+
+static void
+memcached_dict_lookup_multi_callback(const struct dict_lookup_result *result,
+				     struct memcached_dict_multi_value *ctx)
+{
+	if (result->ret > 0)
+		*ctx->value_r = p_strdup(ctx->pool, result->value);
+	else if (result->ret < 0)
+		*ctx->failed = TRUE;
+}
+
+static int
+memcached_dict_lookup_multi(struct dict *_dict, pool_t pool,
+			    const char *const *keys, const char **values_r)
+{
+	struct memcached_dict *dict = (struct memcached_dict *)_dict;
+	struct memcached_dict_multi_value *ctx;
+	unsigned int i, count = str_array_length(keys);
+	bool failed = FALSE;
+
+	if (memcached_dict_connect(dict) < 0)
+		return -1;
+
+	/* send all the GETs in one packet. the replies come in the same
+	   order. */
+	ctx = i_new(struct memcached_dict_multi_value, count);
+	o_stream_cork(dict->conn.conn.output);
+	for (i = 0; i < count; i++) T_BEGIN {
+		ctx[i].pool = pool;
+		ctx[i].value_r = &values_r[i];
+		ctx[i].failed = &failed;
+		memcached_dict_send_get(dict, keys[i],
+			(dict_lookup_callback_t *)memcached_dict_lookup_multi_callback,
+			&ctx[i]);
+	} T_END;
+	if (dict->conn.conn.output != NULL)
+		o_stream_uncork(dict->conn.conn.output);
+
+	if (memcached_dict_wait(_dict) < 0)
+		failed = TRUE;
+	i_free(ctx);
+	return failed ? -1 : 0;
+}
+
 struct dict dict_driver_memcached = {
 	.name = "memcached",
 	{
 		memcached_dict_init,
 		memcached_dict_deinit,
-		NULL,
+		memcached_dict_wait,
 		memcached_dict_lookup,
 		NULL,
 		NULL,
@@ -392,6 +593,8 @@ struct dict dict_driver_memcached = {
 		NULL,
 		NULL,
 		NULL,
-		NULL
+		NULL,
+		memcached_dict_lookup_async,
+		memcached_dict_lookup_multi
 	}
 };
@@ -5,12 +5,21 @@
 #ifdef HAVE_MONGODB
 
 #include "array.h"
+#include "str.h"
+#include "json-parser.h"
 #include "dict-private.h"
 #include "dict-transaction-memory.h"
 #include "hash.h"
 #include "mongodb-api.h"
 #include "dict-mongodb-settings.h"
 
+#ifdef MONGODB_DICT_DEBUG
+#  define mongodb_debug_dict(format, ...) \
+	i_debug("dict/mongodb: " format, ## __VA_ARGS__)
+#else
+#  define mongodb_debug_dict(format, ...)
+#endif
+
 struct mongodb_dict {
 	struct dict dict;
 
@@ -35,19 +44,22 @@ struct mongodb_dict_iterate_context {
 	unsigned int key_prefix_len, pattern_prefix_len, next_map_idx;
 };
 
-struct dict_mongodb_commit_ctx {
-	struct mongodb_dict *dict;
-	struct dict_transaction_memory_context *memctx;
-	string_t *str;
+struct dict_mongodb_lookup_ctx {
+	mongodb_query_t query;
+	const char *value_field;
 
-	dict_transaction_commit_callback_t *callback;
+	dict_lookup_callback_t *callback;
 	void *context;
 };
 
-struct dict_mongodb_commit_query {
+struct dict_mongodb_commit_ctx {
 	struct mongodb_dict *dict;
-	char *query;
-	ARRAY(struct dict_transaction_memory_change) changes;
+	ARRAY(mongodb_query_t) queries;
+	unsigned int pending;
+	int ret;
+
+	dict_transaction_commit_callback_t *callback;
+	void *context;
 };
 
 static bool
@@ -182,6 +194,12 @@ static int mongodb_dict_init(struct dict *driver, const char *uri,
 	}
 
 	dict->conn = mongodb_conn_init(dict->set->uri);
+	if (dict->conn == NULL) {
+		*error_r = t_strdup_printf("Couldn't initialize connection: %s",
+					   dict->set->uri);
+		mongodb_dict_free(&dict);
+		return -1;
+	}
 	*dict_r = &dict->dict;
 
 	return 0;
@@ -194,6 +212,14 @@ static void mongodb_dict_deinit(struct dict *_dict)
 	mongodb_dict_free(&dict);
 }
 
+static int mongodb_dict_wait(struct dict *_dict)
+{
+	struct mongodb_dict *dict = (struct mongodb_dict *)_dict;
+
+	mongodb_conn_wait(dict->conn);
+	return 0;
+}
+
 static int mongodb_dict_lookup(struct  dict *_dict, pool_t pool,
 			       const char *key, const char **value_r)
 {
@@ -213,7 +239,7 @@ static int mongodb_dict_lookup(struct  dict *_dict, pool_t pool,
 	}
 
 	json = t_strdup_printf("{\"%s\": \"%s\"}", map->username_field, dict->username);
-	i_debug("dict/mongodb: query = %s", json);
+	mongodb_debug_dict("query = %s", json);
 
 	query = mongodb_query_init(dict->conn);
 	mongodb_query_parse_query(query, json);
@@ -227,7 +253,7 @@ static int mongodb_dict_lookup(struct  dict *_dict, pool_t pool,
 		mongodb_result_field(result,  map->value_field, &value);
 		if (value != NULL) {
 			*value_r = p_strdup(pool, value);
-			i_debug("dict/mongodb: value=%s", *value_r);
+			mongodb_debug_dict("value=%s", *value_r);
 			ret = 1;
 		} else {
 			ret = 0;
@@ -238,12 +264,158 @@ static int mongodb_dict_lookup(struct  dict *_dict, pool_t pool,
 	return ret;
 }
 
+static int
+mongodb_dict_lookup_multi_group(struct mongodb_dict *dict, pool_t pool,
+				const struct dict_mongodb_map *const *maps,
+				const ARRAY_TYPE(uint) *group,
+				const char **values_r)
+{
+	const struct dict_mongodb_map *map = maps[*array_idx(group, 0)];
+	const unsigned int *idxp;
+	mongodb_result_t result;
+	mongodb_query_t query;
+	string_t *fields;
+	const char *json, *value;
+	int ret;
+
+	fields = t_str_new(128);
+	array_foreach(group, idxp) {
+		if (str_len(fields) > 0)
+			str_append_c(fields, ',');
+		str_append(fields, maps[*idxp]->value_field);
+	}
+
+	json = t_strdup_printf("{\"%s\": \"%s\"}", map->username_field, dict->username);
+	mongodb_debug_dict("query = %s, fields = %s", json, str_c(fields));
+
+	query = mongodb_query_init(dict->conn);
+	mongodb_query_parse_query(query, json);
+	mongodb_query_parse_fields(query, str_c(fields));
+
+	ret = mongodb_query_find_one(query, map->collection, &result);
+	if (ret != MONGODB_QUERY_OK)
+		ret = -1;
+	else {
+		array_foreach(group, idxp) {
+			mongodb_result_field(result, maps[*idxp]->value_field,
+					     &value);
+			if (value != NULL)
+				values_r[*idxp] = p_strdup(pool, value);
+		}
+		ret = 0;
+	}
+	mongodb_query_deinit(&query);
+	return ret;
+}
+
+static int
+mongodb_dict_lookup_multi(struct dict *_dict, pool_t pool,
+			  const char *const *keys, const char **values_r)
+{
+	struct mongodb_dict *dict = (struct mongodb_dict *)_dict;
+	const struct dict_mongodb_map **maps;
+	ARRAY_TYPE(const_string) values;
+	ARRAY_TYPE(uint) group;
+	unsigned int i, j, count = str_array_length(keys);
+	bool *done;
+	int ret = 0;
+
+	/* the maps don't have fields for the key variables, so all the keys
+	   whose values are in the same user's document can be fetched with a
+	   single query that returns all of their value fields */
+	maps = t_new(const struct dict_mongodb_map *, count);
+	done = t_new(bool, count);
+	for (i = 0; i < count; i++) {
+		maps[i] = mongodb_dict_find_map(dict, keys[i], &values);
+		if (maps[i] == NULL) {
+			i_error("mongodb dict lookup: Invalid/unmapped key: %s",
+				keys[i]);
+			done[i] = TRUE;
+		}
+	}
+
+	t_array_init(&group, count);
+	for (i = 0; i < count; i++) {
+		if (done[i])
+			continue;
+
+		array_clear(&group);
+		array_append(&group, &i, 1);
+		for (j = i + 1; j < count; j++) {
+			if (!done[j] &&
+			    strcmp(maps[j]->collection, maps[i]->collection) == 0 &&
+			    strcmp(maps[j]->username_field,
+				   maps[i]->username_field) == 0) {
+				array_append(&group, &j, 1);
+				done[j] = TRUE;
+			}
+		}
+		if (mongodb_dict_lookup_multi_group(dict, pool, maps, &group,
+						    values_r) < 0)
+			ret = -1;
+	}
+	return ret;
+}
+
+static void mongodb_dict_lookup_callback(int ret, mongodb_result_t result,
+					 void *context)
+{
+	struct dict_mongodb_lookup_ctx *ctx = context;
+	struct dict_lookup_result lookup_result;
+
+	memset(&lookup_result, 0, sizeof(lookup_result));
+	if (ret != MONGODB_QUERY_OK)
+		lookup_result.ret = -1;
+	else {
+		mongodb_result_field(result, ctx->value_field,
+				     &lookup_result.value);
+		lookup_result.ret = lookup_result.value != NULL ? 1 : 0;
+	}
+	ctx->callback(&lookup_result, ctx->context);
+
+	mongodb_query_deinit(&ctx->query);
+	i_free(ctx);
+}
+
+static void
+mongodb_dict_lookup_async(struct dict *_dict, const char *key,
+			  dict_lookup_callback_t *callback, void *context)
+{
+	struct mongodb_dict *dict = (struct mongodb_dict *)_dict;
+	const struct dict_mongodb_map *map;
+	struct dict_mongodb_lookup_ctx *ctx;
+	ARRAY_TYPE(const_string) values;
+	const char *json;
+
+	map = mongodb_dict_find_map(dict, key, &values);
+	if (map == NULL) {
+		struct dict_lookup_result result;
+
+		i_error("mongodb dict lookup: Invalid/unmapped key: %s", key);
+		memset(&result, 0, sizeof(result));
+		callback(&result, context);
+		return;
+	}
+
+	json = t_strdup_printf("{\"%s\": \"%s\"}", map->username_field, dict->username);
+	mongodb_debug_dict("query = %s", json);
+
+	ctx = i_new(struct dict_mongodb_lookup_ctx, 1);
+	ctx->value_field = map->value_field;
+	ctx->callback = callback;
+	ctx->context = context;
+	ctx->query = mongodb_query_init(dict->conn);
+	mongodb_query_parse_query(ctx->query, json);
+	mongodb_query_parse_fields(ctx->query, map->value_field);
+	mongodb_query_find_one_async(ctx->query, map->collection,
+				     mongodb_dict_lookup_callback, ctx);
+}
+
 static struct dict_transaction_context *
 mongodb_dict_transaction_init(struct dict *_dict)
 {
 	struct dict_transaction_memory_context *ctx;
 	pool_t pool;
-	i_debug("dict/mongodb: transaction_init");
 
 	pool = pool_alloconly_create("mongodb dict transaction", 2048);
 	ctx = p_new(pool, struct dict_transaction_memory_context, 1);
@@ -251,87 +423,100 @@ mongodb_dict_transaction_init(struct dict *_dict)
 	return &ctx->ctx;
 }
 
-static void mongodb_dict_run_change_query(struct dict_mongodb_commit_ctx *ctx,
-					  const struct dict_transaction_memory_change *change)
+static void mongodb_dict_commit_finish(struct dict_mongodb_commit_ctx *ctx)
+{
+	mongodb_query_t *queryp;
+
+	if (ctx->callback != NULL)
+		ctx->callback(ctx->ret, ctx->context);
+
+	array_foreach_modifiable(&ctx->queries, queryp)
+		mongodb_query_deinit(queryp);
+	array_free(&ctx->queries);
+	i_free(ctx);
+}
+
+static void mongodb_dict_commit_callback(int ret,
+					 mongodb_result_t result ATTR_UNUSED,
+					 void *context)
+{
+	struct dict_mongodb_commit_ctx *ctx = context;
+
+	if (ret != MONGODB_QUERY_OK) {
+		i_error("mongodb dict commit: %s",
+			mongodb_get_error(ctx->dict->conn));
+		ctx->ret = -1;
+	}
+
+	i_assert(ctx->pending > 0);
+	if (--ctx->pending == 0)
+		mongodb_dict_commit_finish(ctx);
+}
+
+static int mongodb_dict_run_change_query(struct dict_mongodb_commit_ctx *ctx,
+					 const struct dict_transaction_memory_change *change)
 {
 	struct mongodb_dict *dict = ctx->dict;
 	const struct dict_mongodb_map *map;
 	ARRAY_TYPE(const_string) values;
 	mongodb_query_t query;
-	string_t *json;
+	string_t *selector, *update;
 
 	map = mongodb_dict_find_map(dict, change->key, &values);
 	if (map == NULL) {
-		i_error("mongodb dict lookup: Invalid/unmapped key: %s", change->key);
-		return;
+		i_error("mongodb dict commit: Invalid/unmapped key: %s", change->key);
+		return -1;
 	}
 
+	selector = t_str_new(128);
+	str_append_c(selector, '{');
+	str_append_c(selector, '"');
+	json_append_escaped(selector, map->username_field);
+	str_append(selector, "\": \"");
+	json_append_escaped(selector, dict->username);
+	str_append(selector, "\"}");
+
+	update = t_str_new(128);
 	switch (change->type) {
 	case DICT_CHANGE_TYPE_SET:
-		json = t_strdup_printf("{\"$set\":{\"%s\": %s}}", map->value_field, change->value.str);
+		str_append(update, "{\"$set\": {\"");
+		json_append_escaped(update, map->value_field);
+		str_append(update, "\": \"");
+		json_append_escaped(update, change->value.str);
+		str_append(update, "\"}}");
 		break;
 	case DICT_CHANGE_TYPE_UNSET:
-		json = t_strdup_printf("{\"$unset\":{\"%s\": 1}}", map->value_field);
+		str_append(update, "{\"$unset\": {\"");
+		json_append_escaped(update, map->value_field);
+		str_append(update, "\": 1}}");
+		break;
+	case DICT_CHANGE_TYPE_INC:
+		str_append(update, "{\"$inc\": {\"");
+		json_append_escaped(update, map->value_field);
+		str_printfa(update, "\": %lld}}", change->value.diff);
 		break;
+	case DICT_CHANGE_TYPE_APPEND:
+		i_error("mongodb dict commit: append not supported: %s",
+			change->key);
+		return -1;
 	}
-	i_debug("DICT OP: %s", json);
-}
-
-static int mongodb_dict_commit_changes(struct dict_mongodb_commit_ctx *ctx)
-{
-	struct mongodb_dict *dict = ctx->dict;
-	HASH_TABLE(const char *, const struct dict_transaction_memory_change *) queries;
-	const struct dict_transaction_memory_change *changes, *change;
-	const struct dict_mongodb_map *map;
-	ARRAY_TYPE(const_string) values;
-	unsigned int i, count;
-	const char *json;
-	
-	/*
-	 * We need to perform two sweeps of the stored changes in an effort to make
-	 * the changes atomic. We can $set, $unset, $inc and $push in an update
-	 * query however we can only do one at a time. An $unset prior to a $set is
-	 * pointless so we want to drop the $unset.
-	 */
-	hash_table_create(&queries, ctx->dict->pool, 0, str_hash, strcmp);
-	changes = array_get(&ctx->memctx->changes, &count);
-	i_assert(count > 0);
-
-	for (i = 0; i < count; i++) {
-		const struct dict_transaction_memory_change *change = &changes[i], *tmp;
-
-		map = mongodb_dict_find_map(dict, change->key, &values);
-		if (map == NULL) {
-			i_error("mongodb dict lookup: Invalid/unmapped key: %s", change->key);
-			return -1;
-		}
-
-		json = t_strdup_printf("{\"%s\": \"%s\"}", map->username_field, dict->username);
-		tmp = hash_table_lookup(queries, json);
-		if (tmp == NULL) {
-			hash_table_update(queries, (const char *)change->key, change);
-		} else {
-			switch (change->type) {
-			case DICT_CHANGE_TYPE_SET:
-				if (tmp->type == DICT_CHANGE_TYPE_UNSET)
-					hash_table_update(queries, (const char *)change->key, change);
-				break;
-			}
-		}
-	};
+	mongodb_debug_dict("update %s with %s", str_c(selector), str_c(update));
 
-	T_BEGIN {
-		struct hash_iterate_context *iter = hash_table_iterate_init(queries);
-		const struct dict_transaction_memory_change *change;
-		const char *key;
-
-		while (hash_table_iterate(iter, queries, &key, &change)) {
-			mongodb_dict_run_change_query(ctx, change);
-		}
-
-	} T_END;
+	query = mongodb_query_init(dict->conn);
+	if (mongodb_query_parse_query(query, str_c(selector)) < 0 ||
+	    mongodb_query_parse_update(query, str_c(update)) < 0) {
+		i_error("mongodb dict commit: Invalid update for key %s",
+			change->key);
+		mongodb_query_deinit(&query);
+		return -1;
+	}
+	array_append(&ctx->queries, &query, 1);
 
-	hash_table_destroy(&queries);
+	/* all the updates are pipelined to the server at once */
+	ctx->pending++;
+	mongodb_query_update_async(query, map->collection, FALSE,
+				   mongodb_dict_commit_callback, ctx);
+	return 0;
 }
 
 static int
@@ -343,29 +528,42 @@ mongodb_dict_transaction_commit(struct dict_transaction_context *_ctx,
 	struct dict_transaction_memory_context *ctx =
 		(struct dict_transaction_memory_context *)_ctx;
 	struct mongodb_dict *dict = (struct mongodb_dict *)_ctx->dict;
-	struct dict_mongodb_commit_ctx commit_ctx;
-	
+	const struct dict_transaction_memory_change *change;
+	struct dict_mongodb_commit_ctx *commit_ctx;
 	int ret = 1;
 
-	i_debug("dict/mongodb: transaction_commit");
-
-	if (_ctx->changed) {
-		memset(&commit_ctx, 0, sizeof(commit_ctx));
-		commit_ctx.dict = dict;
-		commit_ctx.memctx = ctx;
-		commit_ctx.callback = callback;
-		commit_ctx.context = context;
-		commit_ctx.str = str_new(default_pool, 256);
-
-		ret = mongodb_dict_commit_changes(&commit_ctx);
-		if (ret >= 0) {
-
-		}
+	if (!_ctx->changed) {
+		if (callback != NULL)
+			callback(ret, context);
+		pool_unref(&ctx->pool);
+		return ret;
 	}
 
-	if (callback != NULL)
-		callback(ret, context);
+	commit_ctx = i_new(struct dict_mongodb_commit_ctx, 1);
+	commit_ctx->dict = dict;
+	commit_ctx->callback = callback;
+	commit_ctx->context = context;
+	commit_ctx->ret = 1;
+	/* keep the context referenced until all the updates are sent */
+	commit_ctx->pending = 1;
+	i_array_init(&commit_ctx->queries, array_count(&ctx->changes));
+
+	array_foreach(&ctx->changes, change) {
+		T_BEGIN {
+			if (mongodb_dict_run_change_query(commit_ctx, change) < 0)
+				commit_ctx->ret = -1;
+		} T_END;
+	}
 	pool_unref(&ctx->pool);
+
+	if (async)
+		ret = 1;
+	else {
+		mongodb_conn_wait(dict->conn);
+		ret = commit_ctx->ret;
+	}
+	if (--commit_ctx->pending == 0)
+		mongodb_dict_commit_finish(commit_ctx);
 	return ret;
 }
 
@@ -374,7 +572,7 @@ struct dict dict_driver_mongodb = {
 	{
 		mongodb_dict_init,
 		mongodb_dict_deinit,
-		NULL,
+		mongodb_dict_wait,
 		mongodb_dict_lookup,
 		NULL,
 		NULL,
@@ -385,7 +583,9 @@ struct dict dict_driver_mongodb = {
 		dict_transaction_memory_set,
 		dict_transaction_memory_unset,
 		dict_transaction_memory_append,
-		dict_transaction_memory_atomic_inc
+		dict_transaction_memory_atomic_inc,
+		mongodb_dict_lookup_async,
+		mongodb_dict_lookup_multi
 	}
 };
 #endif
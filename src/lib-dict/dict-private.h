@@ -36,6 +36,11 @@ struct dict_vfuncs {
 		       const char *key, const char *value);
 	void (*atomic_inc)(struct dict_transaction_context *ctx,
 			   const char *key, long long diff);
+
+	void (*lookup_async)(struct dict *dict, const char *key,
+			     dict_lookup_callback_t *callback, void *context);
+	int (*lookup_multi)(struct dict *dict, pool_t pool,
+			    const char *const *keys, const char **values_r);
 };
 
 struct dict {
@@ -46,6 +51,12 @@ struct dict {
 
 struct dict_iterate_context {
 	struct dict *dict;
+
+	dict_iterate_callback_t *async_callback;
+	void *async_context;
+
+	/* asynchronous iteration is waiting for more results */
+	unsigned int has_more:1;
 };
 
 struct dict_transaction_context {
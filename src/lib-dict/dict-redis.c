@@ -15,6 +15,8 @@
 enum redis_input_state {
 	/* expecting $-1 / $<size> followed by GET reply */
 	REDIS_INPUT_STATE_GET,
+	/* expecting *<nreplies> followed by a GET reply for each key */
+	REDIS_INPUT_STATE_MGET,
 	/* expecting +QUEUED */
 	REDIS_INPUT_STATE_MULTI,
 	/* expecting +OK reply for DISCARD */
@@ -41,6 +43,14 @@ struct redis_dict_reply {
 	void *context;
 };
 
+struct redis_dict_lookup {
+	/* NULL for synchronous lookups */
+	dict_lookup_callback_t *callback;
+	void *context;
+	/* full key of a lookup waiting for the connection */
+	char *key;
+};
+
 struct redis_dict {
 	struct dict dict;
 	struct ip_addr ip;
@@ -53,6 +63,12 @@ struct redis_dict {
 
 	ARRAY(enum redis_input_state) input_states;
 	ARRAY(struct redis_dict_reply) replies;
+	/* one for each REDIS_INPUT_STATE_GET */
+	ARRAY(struct redis_dict_lookup) lookups;
+	/* asynchronous lookups waiting for the connection to be created */
+	ARRAY(struct redis_dict_lookup) connect_lookups;
+	/* timeout for asynchronous lookups */
+	struct timeout *to_lookup;
 
 	bool connected;
 	bool transaction_open;
@@ -66,6 +82,8 @@ struct redis_dict_transaction_context {
 
 static struct connection_list *redis_connections;
 
+static void redis_dict_update_timeout(struct redis_dict *dict);
+
 static void
 redis_input_state_add(struct redis_dict *dict, enum redis_input_state state)
 {
@@ -91,6 +109,31 @@ static void redis_conn_destroy(struct connection *_conn)
 	}
 	array_clear(&conn->dict->replies);
 	array_clear(&conn->dict->input_states);
+	if (conn->dict->to_lookup != NULL)
+		timeout_remove(&conn->dict->to_lookup);
+
+	if (array_count(&conn->dict->lookups) > 0 ||
+	    array_count(&conn->dict->connect_lookups) > 0) T_BEGIN {
+		ARRAY(struct redis_dict_lookup) lookups;
+		struct redis_dict_lookup *lookup;
+		struct dict_lookup_result result;
+
+		/* callbacks may send new lookups */
+		t_array_init(&lookups, array_count(&conn->dict->lookups) +
+			     array_count(&conn->dict->connect_lookups));
+		array_append_array(&lookups, &conn->dict->lookups);
+		array_append_array(&lookups, &conn->dict->connect_lookups);
+		array_clear(&conn->dict->lookups);
+		array_clear(&conn->dict->connect_lookups);
+
+		memset(&result, 0, sizeof(result));
+		result.ret = -1;
+		array_foreach_modifiable(&lookups, lookup) {
+			i_free(lookup->key);
+			if (lookup->callback != NULL)
+				lookup->callback(&result, lookup->context);
+		}
+	} T_END;
 
 	if (conn->dict->ioloop != NULL)
 		io_loop_stop(conn->dict->ioloop);
@@ -107,14 +150,51 @@ static void redis_wait(struct redis_dict *dict)
 
 	do {
 		io_loop_run(dict->ioloop);
-	} while (array_count(&dict->input_states) > 0);
+	} while (array_count(&dict->input_states) > 0 ||
+		 array_count(&dict->connect_lookups) > 0);
 
 	current_ioloop = prev_ioloop;
 	connection_switch_ioloop(&dict->conn.conn);
+	if (dict->to_lookup != NULL)
+		dict->to_lookup = io_loop_move_timeout(&dict->to_lookup);
 	current_ioloop = dict->ioloop;
 	io_loop_destroy(&dict->ioloop);
 }
 
+static void redis_input_get_finish(struct redis_connection *conn)
+{
+	struct redis_dict *dict = conn->dict;
+	struct redis_dict_lookup lookup;
+	struct dict_lookup_result result;
+
+	if (dict->ioloop != NULL)
+		io_loop_stop(dict->ioloop);
+	redis_input_state_remove(dict);
+
+	lookup = *array_idx(&dict->lookups, 0);
+	array_delete(&dict->lookups, 0, 1);
+	if (dict->to_lookup != NULL)
+		timeout_reset(dict->to_lookup);
+	redis_dict_update_timeout(dict);
+	if (lookup.callback == NULL) {
+		/* synchronous lookup, redis_dict_lookup_real() reads the
+		   reply from last_reply */
+		conn->value_received = TRUE;
+		return;
+	}
+
+	memset(&result, 0, sizeof(result));
+	if (conn->value_not_found)
+		result.ret = 0;
+	else {
+		result.ret = 1;
+		result.value = str_c(conn->last_reply);
+	}
+	T_BEGIN {
+		lookup.callback(&result, lookup.context);
+	} T_END;
+}
+
 static int redis_input_get(struct redis_connection *conn)
 {
 	const unsigned char *data;
@@ -126,14 +206,13 @@ static int redis_input_get(struct redis_connection *conn)
 		line = i_stream_next_line(conn->conn.input);
 		if (line == NULL)
 			return 0;
+		str_truncate(conn->last_reply, 0);
 		if (strcmp(line, "$-1") == 0) {
-			conn->value_received = TRUE;
 			conn->value_not_found = TRUE;
-			if (conn->dict->ioloop != NULL)
-				io_loop_stop(conn->dict->ioloop);
-			redis_input_state_remove(conn->dict);
+			redis_input_get_finish(conn);
 			return 1;
 		}
+		conn->value_not_found = FALSE;
 		if (line[0] != '$' || str_to_uint(line+1, &conn->bytes_left) < 0) {
 			i_error("redis: Unexpected input (wanted $size): %s",
 				line);
@@ -155,12 +234,8 @@ static int redis_input_get(struct redis_connection *conn)
 		return 0;
 
 	/* reply fully read - drop trailing CRLF */
-	conn->value_received = TRUE;
 	str_truncate(conn->last_reply, str_len(conn->last_reply)-2);
-
-	if (conn->dict->ioloop != NULL)
-		io_loop_stop(conn->dict->ioloop);
-	redis_input_state_remove(conn->dict);
+	redis_input_get_finish(conn);
 	return 1;
 }
 
@@ -193,6 +268,11 @@ static int redis_conn_input_more(struct redis_connection *conn)
 	switch (state) {
 	case REDIS_INPUT_STATE_GET:
 		i_unreached();
+	case REDIS_INPUT_STATE_MGET:
+		if (line[0] != '*' || str_to_uint(line+1, &num_replies) < 0)
+			break;
+		/* the following GET states were added for each key */
+		return 1;
 	case REDIS_INPUT_STATE_MULTI:
 	case REDIS_INPUT_STATE_DISCARD:
 		if (line[0] != '+')
@@ -254,6 +334,57 @@ static void redis_conn_input(struct connection *_conn)
 		redis_conn_destroy(_conn);
 }
 
+static void redis_dict_lookup_async_timeout(struct redis_dict *dict)
+{
+	i_error("redis: Lookup timed out in %u.%03u secs",
+		dict->timeout_msecs/1000, dict->timeout_msecs%1000);
+	redis_conn_destroy(&dict->conn.conn);
+}
+
+static void redis_dict_update_timeout(struct redis_dict *dict)
+{
+	bool waiting = array_count(&dict->lookups) > 0 ||
+		array_count(&dict->connect_lookups) > 0;
+
+	if (waiting && dict->to_lookup == NULL) {
+		dict->to_lookup = timeout_add(dict->timeout_msecs,
+					      redis_dict_lookup_async_timeout,
+					      dict);
+	} else if (!waiting && dict->to_lookup != NULL) {
+		timeout_remove(&dict->to_lookup);
+	}
+}
+
+static void redis_dict_send_get(struct redis_dict *dict, const char *key,
+				dict_lookup_callback_t *callback,
+				void *context)
+{
+	struct redis_dict_lookup *lookup;
+	const char *cmd;
+
+	cmd = t_strdup_printf("*2\r\n$3\r\nGET\r\n$%d\r\n%s\r\n",
+			      (int)strlen(key), key);
+	o_stream_nsend_str(dict->conn.conn.output, cmd);
+
+	lookup = array_append_space(&dict->lookups);
+	lookup->callback = callback;
+	lookup->context = context;
+	redis_input_state_add(dict, REDIS_INPUT_STATE_GET);
+	redis_dict_update_timeout(dict);
+}
+
+static void redis_dict_send_connect_lookups(struct redis_dict *dict)
+{
+	struct redis_dict_lookup *lookup;
+
+	array_foreach_modifiable(&dict->connect_lookups, lookup) {
+		redis_dict_send_get(dict, lookup->key,
+				    lookup->callback, lookup->context);
+		i_free(lookup->key);
+	}
+	array_clear(&dict->connect_lookups);
+}
+
 static void redis_conn_connected(struct connection *_conn, bool success)
 {
 	struct redis_connection *conn = (struct redis_connection *)_conn;
@@ -263,6 +394,7 @@ static void redis_conn_connected(struct connection *_conn, bool success)
 			net_ip2addr(&conn->dict->ip), conn->dict->port);
 	} else {
 		conn->dict->connected = TRUE;
+		redis_dict_send_connect_lookups(conn->dict);
 	}
 	if (conn->dict->ioloop != NULL)
 		io_loop_stop(conn->dict->ioloop);
@@ -366,6 +498,8 @@ redis_dict_init(struct dict *driver, const char *uri,
 
 	i_array_init(&dict->input_states, 4);
 	i_array_init(&dict->replies, 4);
+	i_array_init(&dict->lookups, 4);
+	i_array_init(&dict->connect_lookups, 4);
 	if (strchr(username, DICT_USERNAME_SEPARATOR) == NULL)
 		dict->username = i_strdup(username);
 	else {
@@ -381,13 +515,16 @@ static void redis_dict_deinit(struct dict *_dict)
 {
 	struct redis_dict *dict = (struct redis_dict *)_dict;
 
-	if (array_count(&dict->input_states) > 0) {
-		i_assert(dict->connected);
+	if (array_count(&dict->input_states) > 0 ||
+	    array_count(&dict->connect_lookups) > 0)
 		redis_wait(dict);
-	}
+	if (dict->to_lookup != NULL)
+		timeout_remove(&dict->to_lookup);
 	connection_deinit(&dict->conn.conn);
 	str_free(&dict->conn.last_reply);
 	array_free(&dict->replies);
+	array_free(&dict->lookups);
+	array_free(&dict->connect_lookups);
 	array_free(&dict->input_states);
 	i_free(dict->key_prefix);
 	i_free(dict->username);
@@ -426,7 +563,6 @@ redis_dict_lookup_real(struct redis_dict *dict, pool_t pool,
 		       const char *key, const char **value_r)
 {
 	struct timeout *to;
-	const char *cmd;
 	struct ioloop *prev_ioloop = current_ioloop;
 
 	key = redis_dict_get_full_key(dict, key);
@@ -452,12 +588,7 @@ redis_dict_lookup_real(struct redis_dict *dict, pool_t pool,
 		}
 
 		if (dict->connected) {
-			cmd = t_strdup_printf("*2\r\n$3\r\nGET\r\n$%d\r\n%s\r\n",
-					      (int)strlen(key), key);
-			o_stream_nsend_str(dict->conn.conn.output, cmd);
-
-			str_truncate(dict->conn.last_reply, 0);
-			redis_input_state_add(dict, REDIS_INPUT_STATE_GET);
+			redis_dict_send_get(dict, key, NULL, NULL);
 			do {
 				io_loop_run(dict->ioloop);
 			} while (array_count(&dict->input_states) > 0);
@@ -467,6 +598,8 @@ redis_dict_lookup_real(struct redis_dict *dict, pool_t pool,
 
 	current_ioloop = prev_ioloop;
 	connection_switch_ioloop(&dict->conn.conn);
+	if (dict->to_lookup != NULL)
+		dict->to_lookup = io_loop_move_timeout(&dict->to_lookup);
 	current_ioloop = dict->ioloop;
 	io_loop_destroy(&dict->ioloop);
 
@@ -499,6 +632,114 @@ static int redis_dict_lookup(struct dict *_dict, pool_t pool,
 	return ret;
 }
 
+static void
+redis_dict_lookup_async(struct dict *_dict, const char *key,
+			dict_lookup_callback_t *callback, void *context)
+{
+	struct redis_dict *dict = (struct redis_dict *)_dict;
+	struct redis_dict_lookup *lookup;
+	struct dict_lookup_result result;
+
+	i_assert(!dict->transaction_open);
+
+	if (dict->conn.conn.fd_in == -1 &&
+	    connection_client_connect(&dict->conn.conn) < 0) {
+		i_error("redis: Couldn't connect to %s:%u",
+			net_ip2addr(&dict->ip), dict->port);
+		memset(&result, 0, sizeof(result));
+		result.ret = -1;
+		callback(&result, context);
+		return;
+	}
+
+	T_BEGIN {
+		key = redis_dict_get_full_key(dict, key);
+		if (dict->connected)
+			redis_dict_send_get(dict, key, callback, context);
+		else {
+			/* send it once the connection is created */
+			lookup = array_append_space(&dict->connect_lookups);
+			lookup->callback = callback;
+			lookup->context = context;
+			lookup->key = i_strdup(key);
+			redis_dict_update_timeout(dict);
+		}
+	} T_END;
+}
+
+struct redis_dict_multi_value {
+	pool_t pool;
+	const char **value_r;
+	bool *failed;
+};
+
+static void
+redis_dict_lookup_multi_callback(const struct dict_lookup_result *result,
+				 struct redis_dict_multi_value *ctx)
+{
+	if (result->ret > 0)
+		*ctx->value_r = p_strdup(ctx->pool, result->value);
+	else if (result->ret < 0)
+		*ctx->failed = TRUE;
+}
+
+static int
+redis_dict_lookup_multi(struct dict *_dict, pool_t pool,
+			const char *const *keys, const char **values_r)
+{
+	struct redis_dict *dict = (struct redis_dict *)_dict;
+	struct redis_dict_multi_value *ctx;
+	unsigned int i, count = str_array_length(keys);
+	bool failed = FALSE;
+
+	i_assert(!dict->transaction_open);
+
+	if (dict->conn.conn.fd_in == -1 &&
+	    connection_client_connect(&dict->conn.conn) < 0) {
+		i_error("redis: Couldn't connect to %s:%u",
+			net_ip2addr(&dict->ip), dict->port);
+	} else if (!dict->connected) {
+		/* wait for connection */
+		redis_wait(dict);
+	}
+	if (!dict->connected)
+		return -1;
+
+	ctx = i_new(struct redis_dict_multi_value, count);
+	T_BEGIN {
+		string_t *cmd = t_str_new(256);
+		struct redis_dict_lookup *lookup;
+		const char *key;
+
+		str_printfa(cmd, "*%u\r\n$4\r\nMGET\r\n", count + 1);
+		for (i = 0; i < count; i++) {
+			key = redis_dict_get_full_key(dict, keys[i]);
+			str_printfa(cmd, "$%u\r\n%s\r\n",
+				    (unsigned int)strlen(key), key);
+		}
+		o_stream_nsend(dict->conn.conn.output,
+			       str_data(cmd), str_len(cmd));
+
+		redis_input_state_add(dict, REDIS_INPUT_STATE_MGET);
+		for (i = 0; i < count; i++) {
+			ctx[i].pool = pool;
+			ctx[i].value_r = &values_r[i];
+			ctx[i].failed = &failed;
+
+			lookup = array_append_space(&dict->lookups);
+			lookup->callback = (dict_lookup_callback_t *)
+				redis_dict_lookup_multi_callback;
+			lookup->context = &ctx[i];
+			redis_input_state_add(dict, REDIS_INPUT_STATE_GET);
+		}
+	} T_END;
+
+	/* a disconnection fails all the lookups */
+	redis_wait(dict);
+	i_free(ctx);
+	return failed ? -1 : 0;
+}
+
 static struct dict_transaction_context *
 redis_transaction_init(struct dict *_dict)
 {
@@ -704,6 +945,8 @@ struct dict dict_driver_redis = {
 		redis_set,
 		redis_unset,
 		redis_append,
-		redis_atomic_inc
+		redis_atomic_inc,
+		redis_dict_lookup_async,
+		redis_dict_lookup_multi
 	}
 };
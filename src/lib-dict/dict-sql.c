@@ -46,6 +46,15 @@ struct sql_dict_iterate_context {
 	unsigned int key_prefix_len, pattern_prefix_len, next_map_idx;
 	unsigned int path_idx;
 	bool failed;
+	/* DICT_ITERATE_FLAG_ASYNC: waiting for the query result */
+	bool query_pending;
+	/* deinit was called while query was still pending */
+	bool destroyed;
+};
+
+struct sql_dict_lookup_context {
+	dict_lookup_callback_t *callback;
+	void *context;
 };
 
 struct sql_dict_inc_row {
@@ -308,6 +317,215 @@ static int sql_dict_lookup(struct dict *_dict, pool_t pool,
 	return ret;
 }
 
+struct sql_dict_multi_key {
+	const struct dict_sql_map *map;
+	ARRAY_TYPE(const_string) values;
+	bool done;
+};
+
+static bool
+sql_dict_multi_keys_mergeable(const struct sql_dict_multi_key *k1,
+			      const struct sql_dict_multi_key *k2,
+			      const char *key1, const char *key2)
+{
+	const char *const *v1, *const *v2;
+	unsigned int i, count;
+
+	if (k1->map != k2->map || key1[0] != key2[0])
+		return FALSE;
+
+	/* all but the last field must be the same */
+	v1 = array_get(&k1->values, &count);
+	v2 = array_idx(&k2->values, 0);
+	if (count == 0)
+		return FALSE;
+	for (i = 0; i + 1 < count; i++) {
+		if (strcmp(v1[i], v2[i]) != 0)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static int
+sql_dict_lookup_multi_in(struct sql_dict *dict, pool_t pool,
+			 struct sql_dict_multi_key *mkeys,
+			 const char *const *keys,
+			 const ARRAY_TYPE(uint) *group, const char **values_r)
+{
+	const struct sql_dict_multi_key *mkey =
+		&mkeys[*array_idx(group, 0)];
+	const struct dict_sql_map *map = mkey->map;
+	const char *const *sql_fields, *last_field, *field_value;
+	const unsigned int *idxp;
+	ARRAY_TYPE(const_string) prefix_values;
+	struct sql_result *result;
+	string_t *query;
+	unsigned int count, where_pos;
+	int ret;
+
+	sql_fields = array_get(&map->sql_fields, &count);
+	last_field = sql_fields[count-1];
+
+	/* SELECT value, last_field FROM table WHERE <other fields> AND
+	   last_field IN (..) */
+	t_array_init(&prefix_values, count);
+	array_append(&prefix_values, array_idx(&mkey->values, 0), count-1);
+
+	query = t_str_new(256);
+	str_printfa(query, "SELECT %s,%s FROM %s",
+		    map->value_field, last_field, map->table);
+	where_pos = str_len(query);
+	sql_dict_where_build(dict, map, &prefix_values,
+			     keys[*array_idx(group, 0)][0],
+			     SQL_DICT_RECURSE_NONE, query);
+	str_printfa(query, " %s %s IN (",
+		    str_len(query) == where_pos ? "WHERE" : "AND", last_field);
+	array_foreach(group, idxp) {
+		str_printfa(query, "'%s',", sql_escape_string(dict->db,
+			*array_idx(&mkeys[*idxp].values, count-1)));
+	}
+	str_truncate(query, str_len(query)-1);
+	str_append_c(query, ')');
+
+	result = sql_query_s(dict->db, str_c(query));
+	while ((ret = sql_result_next_row(result)) > 0) {
+		field_value = sql_result_get_field_value(result, 1);
+		if (field_value == NULL)
+			continue;
+		array_foreach(group, idxp) {
+			if (values_r[*idxp] == NULL &&
+			    strcmp(*array_idx(&mkeys[*idxp].values, count-1),
+				   field_value) == 0) {
+				values_r[*idxp] = p_strdup(pool,
+					sql_result_get_field_value(result, 0));
+			}
+		}
+	}
+	if (ret < 0) {
+		i_error("dict sql lookup failed: %s",
+			sql_result_get_error(result));
+	}
+	sql_result_unref(result);
+	return ret;
+}
+
+static int
+sql_dict_lookup_multi_real(struct sql_dict *dict, pool_t pool,
+			   const char *const *keys, const char **values_r)
+{
+	struct sql_dict_multi_key *mkeys;
+	ARRAY_TYPE(uint) group;
+	unsigned int i, j, count = str_array_length(keys);
+	int ret = 0;
+
+	mkeys = t_new(struct sql_dict_multi_key, count);
+	for (i = 0; i < count; i++) {
+		mkeys[i].map = sql_dict_find_map(dict, keys[i],
+						 &mkeys[i].values);
+		if (mkeys[i].map == NULL) {
+			i_error("sql dict lookup: Invalid/unmapped key: %s",
+				keys[i]);
+			mkeys[i].done = TRUE;
+		}
+	}
+
+	/* keys that differ only by their last field are looked up
+	   with a single query */
+	t_array_init(&group, count);
+	for (i = 0; i < count; i++) {
+		if (mkeys[i].done)
+			continue;
+
+		array_clear(&group);
+		array_append(&group, &i, 1);
+		for (j = i + 1; j < count; j++) {
+			if (!mkeys[j].done &&
+			    sql_dict_multi_keys_mergeable(&mkeys[i], &mkeys[j],
+							  keys[i], keys[j])) {
+				array_append(&group, &j, 1);
+				mkeys[j].done = TRUE;
+			}
+		}
+		if (array_count(&group) == 1) {
+			if (sql_dict_lookup(&dict->dict, pool, keys[i],
+					    &values_r[i]) < 0)
+				ret = -1;
+		} else {
+			if (sql_dict_lookup_multi_in(dict, pool, mkeys, keys,
+						     &group, values_r) < 0)
+				ret = -1;
+		}
+	}
+	return ret;
+}
+
+static int sql_dict_lookup_multi(struct dict *_dict, pool_t pool,
+				 const char *const *keys,
+				 const char **values_r)
+{
+	struct sql_dict *dict = (struct sql_dict *)_dict;
+	int ret;
+
+	if (pool->datastack_pool)
+		ret = sql_dict_lookup_multi_real(dict, pool, keys, values_r);
+	else T_BEGIN {
+		ret = sql_dict_lookup_multi_real(dict, pool, keys, values_r);
+	} T_END;
+	return ret;
+}
+
+static void
+sql_dict_lookup_async_callback(struct sql_result *sql_result,
+			       struct sql_dict_lookup_context *ctx)
+{
+	struct dict_lookup_result result;
+
+	memset(&result, 0, sizeof(result));
+	result.ret = sql_result_next_row(sql_result);
+	if (result.ret < 0) {
+		i_error("dict sql lookup failed: %s",
+			sql_result_get_error(sql_result));
+	} else if (result.ret > 0) {
+		result.value = sql_result_get_field_value(sql_result, 0);
+	}
+	ctx->callback(&result, ctx->context);
+	i_free(ctx);
+}
+
+static void
+sql_dict_lookup_async(struct dict *_dict, const char *key,
+		      dict_lookup_callback_t *callback, void *context)
+{
+	struct sql_dict *dict = (struct sql_dict *)_dict;
+	const struct dict_sql_map *map;
+	struct sql_dict_lookup_context *ctx;
+	ARRAY_TYPE(const_string) values;
+
+	map = sql_dict_find_map(dict, key, &values);
+	if (map == NULL) {
+		struct dict_lookup_result result;
+
+		i_error("sql dict lookup: Invalid/unmapped key: %s", key);
+		memset(&result, 0, sizeof(result));
+		callback(&result, context);
+		return;
+	}
+
+	ctx = i_new(struct sql_dict_lookup_context, 1);
+	ctx->callback = callback;
+	ctx->context = context;
+	T_BEGIN {
+		string_t *query = t_str_new(256);
+
+		str_printfa(query, "SELECT %s FROM %s",
+			    map->value_field, map->table);
+		sql_dict_where_build(dict, map, &values, key[0],
+				     SQL_DICT_RECURSE_NONE, query);
+		sql_query(dict->db, str_c(query),
+			  sql_dict_lookup_async_callback, ctx);
+	} T_END;
+}
+
 static const struct dict_sql_map *
 sql_dict_iterate_find_next_map(struct sql_dict_iterate_context *ctx,
 			       ARRAY_TYPE(const_string) *values)
@@ -340,6 +558,24 @@ sql_dict_iterate_find_next_map(struct sql_dict_iterate_context *ctx,
 	return NULL;
 }
 
+static void sql_dict_iterate_callback(struct sql_result *result,
+				      struct sql_dict_iterate_context *ctx)
+{
+	i_assert(ctx->query_pending);
+	ctx->query_pending = FALSE;
+
+	if (ctx->destroyed) {
+		pool_unref(&ctx->pool);
+		return;
+	}
+	sql_result_ref(result);
+	ctx->result = result;
+	/* call the callback only if dict_iterate() already returned that
+	   it's waiting for this result */
+	if (ctx->ctx.has_more)
+		ctx->ctx.async_callback(ctx->ctx.async_context);
+}
+
 static bool sql_dict_iterate_next_query(struct sql_dict_iterate_context *ctx)
 {
 	struct sql_dict *dict = (struct sql_dict *)ctx->ctx.dict;
@@ -353,8 +589,11 @@ static bool sql_dict_iterate_next_query(struct sql_dict_iterate_context *ctx)
 	if (map == NULL)
 		return FALSE;
 
-	if (ctx->result != NULL)
+	if (ctx->result != NULL) {
 		sql_result_unref(ctx->result);
+		ctx->result = NULL;
+	}
+	ctx->map = map;
 
 	T_BEGIN {
 		string_t *query = t_str_new(256);
@@ -393,10 +632,14 @@ static bool sql_dict_iterate_next_query(struct sql_dict_iterate_context *ctx)
 			}
 		} else if ((ctx->flags & DICT_ITERATE_FLAG_SORT_BY_VALUE) != 0)
 			str_printfa(query, " ORDER BY %s", map->value_field);
-		ctx->result = sql_query_s(dict->db, str_c(query));
+		if ((ctx->flags & DICT_ITERATE_FLAG_ASYNC) == 0)
+			ctx->result = sql_query_s(dict->db, str_c(query));
+		else {
+			ctx->query_pending = TRUE;
+			sql_query(dict->db, str_c(query),
+				  sql_dict_iterate_callback, ctx);
+		}
 	} T_END;
-
-	ctx->map = map;
 	return TRUE;
 }
 
@@ -438,6 +681,11 @@ static bool sql_dict_iterate(struct dict_iterate_context *_ctx,
 	unsigned int i, count;
 	int ret;
 
+	_ctx->has_more = FALSE;
+	if (ctx->query_pending) {
+		_ctx->has_more = TRUE;
+		return FALSE;
+	}
 	if (ctx->result == NULL) {
 		ctx->failed = TRUE;
 		return FALSE;
@@ -447,6 +695,10 @@ static bool sql_dict_iterate(struct dict_iterate_context *_ctx,
 		/* see if there are more results in the next map */
 		if (!sql_dict_iterate_next_query(ctx))
 			return FALSE;
+		if (ctx->query_pending) {
+			_ctx->has_more = TRUE;
+			return FALSE;
+		}
 	}
 	if (ret < 0) {
 		ctx->failed = TRUE;
@@ -488,7 +740,12 @@ static int sql_dict_iterate_deinit(struct dict_iterate_context *_ctx)
 
 	if (ctx->result != NULL)
 		sql_result_unref(ctx->result);
-	pool_unref(&ctx->pool);
+	if (ctx->query_pending) {
+		/* free the context once the query callback is called */
+		ctx->destroyed = TRUE;
+	} else {
+		pool_unref(&ctx->pool);
+	}
 	return ret;
 }
 
@@ -912,7 +1169,9 @@ static struct dict sql_dict = {
 		sql_dict_set,
 		sql_dict_unset,
 		sql_dict_append,
-		sql_dict_atomic_inc
+		sql_dict_atomic_inc,
+		sql_dict_lookup_async,
+		sql_dict_lookup_multi
 	}
 };
 
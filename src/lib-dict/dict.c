@@ -126,6 +126,88 @@ int dict_lookup(struct dict *dict, pool_t pool, const char *key,
 	return dict->v.lookup(dict, pool, key, value_r);
 }
 
+struct dict_lookup_multi_context {
+	pool_t pool;
+	const char **value_r;
+	int *ret;
+};
+
+static void
+dict_lookup_multi_callback(const struct dict_lookup_result *result,
+			   struct dict_lookup_multi_context *ctx)
+{
+	if (result->ret > 0)
+		*ctx->value_r = p_strdup(ctx->pool, result->value);
+	else if (result->ret < 0)
+		*ctx->ret = -1;
+}
+
+int dict_lookup_multi(struct dict *dict, pool_t pool,
+		      const char *const *keys, const char **values_r)
+{
+	struct dict_lookup_multi_context *ctx;
+	unsigned int i, count;
+	int ret = 0;
+
+	count = str_array_length(keys);
+	for (i = 0; i < count; i++) {
+		i_assert(dict_key_prefix_is_valid(keys[i]));
+		values_r[i] = NULL;
+	}
+	if (count == 0)
+		return 0;
+
+	if (dict->v.lookup_multi != NULL)
+		return dict->v.lookup_multi(dict, pool, keys, values_r);
+
+	if (dict->v.lookup_async == NULL) {
+		for (i = 0; i < count; i++) {
+			if (dict->v.lookup(dict, pool, keys[i],
+					   &values_r[i]) < 0) {
+				values_r[i] = NULL;
+				ret = -1;
+			}
+		}
+		return ret;
+	}
+
+	/* pipeline the lookups */
+	ctx = i_new(struct dict_lookup_multi_context, count);
+	for (i = 0; i < count; i++) {
+		ctx[i].pool = pool;
+		ctx[i].value_r = &values_r[i];
+		ctx[i].ret = &ret;
+		dict->v.lookup_async(dict, keys[i],
+			(dict_lookup_callback_t *)dict_lookup_multi_callback,
+			&ctx[i]);
+	}
+	if (dict_wait(dict) < 0)
+		ret = -1;
+	i_free(ctx);
+	return ret;
+}
+
+void dict_lookup_async(struct dict *dict, const char *key,
+		       dict_lookup_callback_t *callback, void *context)
+{
+	struct dict_lookup_result result;
+
+	i_assert(dict_key_prefix_is_valid(key));
+
+	if (dict->v.lookup_async != NULL) {
+		dict->v.lookup_async(dict, key, callback, context);
+		return;
+	}
+
+	/* driver doesn't support asynchronous lookups */
+	memset(&result, 0, sizeof(result));
+	T_BEGIN {
+		result.ret = dict->v.lookup(dict, pool_datastack_create(),
+					    key, &result.value);
+		callback(&result, context);
+	} T_END;
+}
+
 struct dict_iterate_context *
 dict_iterate_init(struct dict *dict, const char *path,
 		  enum dict_iterate_flags flags)
@@ -161,6 +243,20 @@ bool dict_iterate(struct dict_iterate_context *ctx,
 		ctx->dict->v.iterate(ctx, key_r, value_r);
 }
 
+#undef dict_iterate_set_async_callback
+void dict_iterate_set_async_callback(struct dict_iterate_context *ctx,
+				     dict_iterate_callback_t *callback,
+				     void *context)
+{
+	ctx->async_callback = callback;
+	ctx->async_context = context;
+}
+
+bool dict_iterate_has_more(struct dict_iterate_context *ctx)
+{
+	return ctx->has_more;
+}
+
 int dict_iterate_deinit(struct dict_iterate_context **_ctx)
 {
 	struct dict_iterate_context *ctx = *_ctx;
@@ -10,7 +10,10 @@ enum dict_iterate_flags {
 	DICT_ITERATE_FLAG_RECURSE             = 0x01,
 	DICT_ITERATE_FLAG_SORT_BY_KEY         = 0x02,
 	DICT_ITERATE_FLAG_SORT_BY_VALUE       = 0x04,
-	DICT_ITERATE_FLAG_NO_VALUE            = 0x08
+	DICT_ITERATE_FLAG_NO_VALUE            = 0x08,
+	/* Don't block waiting for more results. See
+	   dict_iterate_set_async_callback(). */
+	DICT_ITERATE_FLAG_ASYNC               = 0x10
 };
 
 enum dict_data_type {
@@ -18,7 +21,17 @@ enum dict_data_type {
 	DICT_DATA_TYPE_UINT32
 };
 
+struct dict_lookup_result {
+	/* 1 if found, 0 if not found, -1 if lookup failed */
+	int ret;
+	/* found value, valid only until the callback returns */
+	const char *value;
+};
+
 typedef void dict_transaction_commit_callback_t(int ret, void *context);
+typedef void dict_lookup_callback_t(const struct dict_lookup_result *result,
+				    void *context);
+typedef void dict_iterate_callback_t(void *context);
 
 void dict_driver_register(struct dict *driver);
 void dict_driver_unregister(struct dict *driver);
@@ -45,6 +58,19 @@ int dict_wait(struct dict *dict);
 int dict_lookup(struct dict *dict, pool_t pool,
 		const char *key, const char **value_r);
 
+/* Lookup values for all the keys with a single request, if the driver
+   supports it. values_r must have space for as many values as there are
+   keys. Keys that don't exist get NULL values. Returns 0 if ok, -1 if the
+   lookup failed. */
+int dict_lookup_multi(struct dict *dict, pool_t pool,
+		      const char *const *keys, const char **values_r);
+
+/* Lookup value for key asynchronously. The callback is called once the
+   reply arrives, which may also happen before this function returns.
+   dict_wait() can be used to wait for all pending lookups to finish. */
+void dict_lookup_async(struct dict *dict, const char *key,
+		       dict_lookup_callback_t *callback, void *context);
+
 /* Iterate through all values in a path. flag indicates how iteration
    is carried out */
 struct dict_iterate_context *
@@ -55,6 +81,20 @@ dict_iterate_init_multiple(struct dict *dict, const char *const *paths,
 			   enum dict_iterate_flags flags);
 bool dict_iterate(struct dict_iterate_context *ctx,
 		  const char **key_r, const char **value_r);
+/* With DICT_ITERATE_FLAG_ASYNC, dict_iterate() returns FALSE when it would
+   have to block waiting for more results. The callback is then called when
+   more results are available and dict_iterate() should be called again.
+   Drivers that don't support asynchronous iteration simply block. */
+void dict_iterate_set_async_callback(struct dict_iterate_context *ctx,
+				     dict_iterate_callback_t *callback,
+				     void *context);
+#define dict_iterate_set_async_callback(ctx, callback, context) \
+	dict_iterate_set_async_callback(ctx + \
+		CALLBACK_TYPECHECK(callback, void (*)(typeof(context))), \
+		(dict_iterate_callback_t *)callback, context)
+/* Returns TRUE if dict_iterate() returned FALSE only because it's waiting
+   for more results, i.e. the iteration hasn't finished yet. */
+bool dict_iterate_has_more(struct dict_iterate_context *ctx);
 /* Returns 0 = ok, -1 = iteration failed */
 int dict_iterate_deinit(struct dict_iterate_context **ctx);
 
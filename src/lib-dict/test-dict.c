@@ -37,10 +37,139 @@ static void test_dict_escape(void)
 	test_end();
 }
 
+static struct dict test_dict_instance;
+static const char *test_dict_pending_keys[8];
+static dict_lookup_callback_t *test_dict_pending_callbacks[8];
+static void *test_dict_pending_contexts[8];
+static unsigned int test_dict_pending_count;
+
+static int
+test_dict_init(struct dict *driver, const char *uri ATTR_UNUSED,
+	       enum dict_data_type value_type ATTR_UNUSED,
+	       const char *username ATTR_UNUSED,
+	       const char *base_dir ATTR_UNUSED, struct dict **dict_r,
+	       const char **error_r ATTR_UNUSED)
+{
+	test_dict_instance = *driver;
+	*dict_r = &test_dict_instance;
+	return 0;
+}
+
+static void test_dict_deinit(struct dict *dict ATTR_UNUSED)
+{
+}
+
+static int test_dict_lookup_key(const char *key, const char **value_r)
+{
+	if (strcmp(key, "shared/fail") == 0)
+		return -1;
+	if (strncmp(key, "shared/found/", 13) != 0)
+		return 0;
+	*value_r = key + 13;
+	return 1;
+}
+
+static int
+test_dict_lookup(struct dict *dict ATTR_UNUSED, pool_t pool,
+		 const char *key, const char **value_r)
+{
+	const char *value;
+	int ret;
+
+	if ((ret = test_dict_lookup_key(key, &value)) > 0)
+		*value_r = p_strdup(pool, value);
+	return ret;
+}
+
+static void
+test_dict_lookup_async(struct dict *dict ATTR_UNUSED, const char *key,
+		       dict_lookup_callback_t *callback, void *context)
+{
+	i_assert(test_dict_pending_count < N_ELEMENTS(test_dict_pending_keys));
+	test_dict_pending_keys[test_dict_pending_count] = key;
+	test_dict_pending_callbacks[test_dict_pending_count] = callback;
+	test_dict_pending_contexts[test_dict_pending_count] = context;
+	test_dict_pending_count++;
+}
+
+static int test_dict_wait(struct dict *dict ATTR_UNUSED)
+{
+	struct dict_lookup_result result;
+	unsigned int i;
+
+	for (i = 0; i < test_dict_pending_count; i++) {
+		memset(&result, 0, sizeof(result));
+		result.ret = test_dict_lookup_key(test_dict_pending_keys[i],
+						  &result.value);
+		test_dict_pending_callbacks[i](&result,
+					       test_dict_pending_contexts[i]);
+	}
+	test_dict_pending_count = 0;
+	return 0;
+}
+
+static struct dict test_dict_driver = {
+	.name = "test",
+	{
+		test_dict_init,
+		test_dict_deinit,
+		NULL,
+		test_dict_lookup,
+		NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+		NULL,
+		NULL
+	}
+};
+
+static void test_dict_lookup_multi_with(struct dict *dict)
+{
+	const char *keys[] = {
+		"shared/found/foo", "priv/missing", "shared/found/bar", NULL
+	};
+	const char *fail_keys[] = { "shared/found/x", "shared/fail", NULL };
+	const char *values[N_ELEMENTS(keys)];
+
+	test_assert(dict_lookup_multi(dict, pool_datastack_create(),
+				      keys, values) == 0);
+	test_assert(values[0] != NULL && strcmp(values[0], "foo") == 0);
+	test_assert(values[1] == NULL);
+	test_assert(values[2] != NULL && strcmp(values[2], "bar") == 0);
+
+	test_assert(dict_lookup_multi(dict, pool_datastack_create(),
+				      fail_keys, values) < 0);
+	test_assert(values[0] != NULL && strcmp(values[0], "x") == 0);
+	test_assert(values[1] == NULL);
+}
+
+static void test_dict_lookup_multi(void)
+{
+	struct dict *dict;
+	const char *error;
+
+	test_begin("dict lookup multi");
+	dict_driver_register(&test_dict_driver);
+	test_assert(dict_init("test:", DICT_DATA_TYPE_STRING, "user", "",
+			      &dict, &error) == 0);
+	/* fallback to synchronous lookups */
+	test_dict_lookup_multi_with(dict);
+	dict_deinit(&dict);
+
+	/* fallback to pipelined asynchronous lookups */
+	test_dict_driver.v.lookup_async = test_dict_lookup_async;
+	test_dict_driver.v.wait = test_dict_wait;
+	test_assert(dict_init("test:", DICT_DATA_TYPE_STRING, "user", "",
+			      &dict, &error) == 0);
+	test_dict_lookup_multi_with(dict);
+	dict_deinit(&dict);
+	dict_driver_unregister(&test_dict_driver);
+	test_end();
+}
+
 int main(void)
 {
 	static void (*test_functions[])(void) = {
 		test_dict_escape,
+		test_dict_lookup_multi,
 		NULL
 	};
 	return test_run(test_functions);
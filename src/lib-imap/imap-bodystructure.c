@@ -4,7 +4,9 @@
 #include "buffer.h"
 #include "istream.h"
 #include "str.h"
+#include "numpack.h"
 #include "message-parser.h"
+#include "message-part-serialize.h"
 #include "rfc822-parser.h"
 #include "rfc2231-parser.h"
 #include "imap-parser.h"
@@ -1007,3 +1009,170 @@ int imap_body_parse_from_bodystructure(const char *bodystructure,
 	i_stream_destroy(&input);
 	return ret;
 }
+
+/*
+   message_part_serialize() output
+   for each part in the same order as message_part_serialize() writes them:
+     content_type, content_subtype, content_type_params,
+     content_transfer_encoding, content_id, content_description,
+     content_disposition, content_disposition_params, content_md5,
+     content_language, content_location, envelope (only for message/rfc822's
+     child)
+
+   strings are written as numpack(length+1) followed by the string without
+   NUL, or numpack(0) for NULL.
+*/
+
+static void serialize_string(buffer_t *dest, const char *str)
+{
+	size_t len;
+
+	if (str == NULL)
+		numpack_encode(dest, 0);
+	else {
+		len = strlen(str);
+		numpack_encode(dest, len + 1);
+		buffer_append(dest, str, len);
+	}
+}
+
+static void
+imap_bodystructure_serialize_part(const struct message_part *part,
+				  buffer_t *dest, string_t *tmpstr)
+{
+	struct message_part_body_data *data;
+	const char *envelope_str;
+
+	for (; part != NULL; part = part->next) {
+		data = part->context;
+		i_assert(data != NULL);
+
+		serialize_string(dest, data->content_type);
+		serialize_string(dest, data->content_subtype);
+		serialize_string(dest, data->content_type_params);
+		serialize_string(dest, data->content_transfer_encoding);
+		serialize_string(dest, data->content_id);
+		serialize_string(dest, data->content_description);
+		serialize_string(dest, data->content_disposition);
+		serialize_string(dest, data->content_disposition_params);
+		serialize_string(dest, data->content_md5);
+		serialize_string(dest, data->content_language);
+		serialize_string(dest, data->content_location);
+
+		/* envelope exists only for message/rfc822's child */
+		envelope_str = NULL;
+		if (part->parent != NULL &&
+		    (part->parent->flags & MESSAGE_PART_FLAG_MESSAGE_RFC822) != 0) {
+			envelope_str = data->envelope_str;
+			if (envelope_str == NULL) {
+				str_truncate(tmpstr, 0);
+				imap_envelope_write_part_data(data->envelope,
+							      tmpstr);
+				envelope_str = str_c(tmpstr);
+			}
+		}
+		serialize_string(dest, envelope_str);
+
+		if (part->children != NULL) {
+			imap_bodystructure_serialize_part(part->children,
+							  dest, tmpstr);
+		}
+	}
+}
+
+void imap_bodystructure_serialize(struct message_part *parts, buffer_t *dest)
+{
+	message_part_serialize(parts, dest);
+	imap_bodystructure_serialize_part(parts, dest, t_str_new(256));
+}
+
+static bool
+deserialize_string(pool_t pool, const unsigned char **data,
+		   const unsigned char *end, const char **str_r)
+{
+	uint64_t len;
+
+	if (numpack_decode(data, end, &len) < 0)
+		return FALSE;
+	if (len == 0) {
+		*str_r = NULL;
+		return TRUE;
+	}
+	len--;
+	if (len > (size_t)(end - *data))
+		return FALSE;
+	*str_r = p_strndup(pool, *data, len);
+	*data += len;
+	return TRUE;
+}
+
+static bool
+imap_bodystructure_deserialize_part(pool_t pool, struct message_part *part,
+				    const unsigned char **data,
+				    const unsigned char *end)
+{
+	struct message_part_body_data *body;
+	const char *envelope_str;
+
+	for (; part != NULL; part = part->next) {
+		part->context = body =
+			p_new(pool, struct message_part_body_data, 1);
+		body->pool = pool;
+
+		if (!deserialize_string(pool, data, end, &body->content_type) ||
+		    !deserialize_string(pool, data, end, &body->content_subtype) ||
+		    !deserialize_string(pool, data, end, &body->content_type_params) ||
+		    !deserialize_string(pool, data, end, &body->content_transfer_encoding) ||
+		    !deserialize_string(pool, data, end, &body->content_id) ||
+		    !deserialize_string(pool, data, end, &body->content_description) ||
+		    !deserialize_string(pool, data, end, &body->content_disposition) ||
+		    !deserialize_string(pool, data, end, &body->content_disposition_params) ||
+		    !deserialize_string(pool, data, end, &body->content_md5) ||
+		    !deserialize_string(pool, data, end, &body->content_language) ||
+		    !deserialize_string(pool, data, end, &body->content_location) ||
+		    !deserialize_string(pool, data, end, &envelope_str))
+			return FALSE;
+
+		if (part->parent != NULL &&
+		    (part->parent->flags & MESSAGE_PART_FLAG_MESSAGE_RFC822) != 0) {
+			if (envelope_str == NULL)
+				return FALSE;
+			body->envelope_str = envelope_str;
+		} else if (envelope_str != NULL) {
+			return FALSE;
+		}
+
+		if (part->children != NULL) {
+			if (!imap_bodystructure_deserialize_part(pool,
+					part->children, data, end))
+				return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+struct message_part *
+imap_bodystructure_deserialize(pool_t pool, const void *data, size_t size,
+			       const char **error_r)
+{
+	struct message_part *parts;
+	const unsigned char *p, *end;
+	size_t used_size;
+
+	parts = message_part_deserialize_partial(pool, data, size,
+						 &used_size, error_r);
+	if (parts == NULL)
+		return NULL;
+
+	p = CONST_PTR_OFFSET(data, used_size);
+	end = CONST_PTR_OFFSET(data, size);
+	if (!imap_bodystructure_deserialize_part(pool, parts, &p, end)) {
+		*error_r = "Broken BODYSTRUCTURE data";
+		return NULL;
+	}
+	if (p != end) {
+		*error_r = "Too much data";
+		return NULL;
+	}
+	return parts;
+}
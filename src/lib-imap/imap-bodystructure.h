@@ -44,6 +44,16 @@ void imap_bodystructure_write(const struct message_part *part,
 int imap_bodystructure_parse(const char *bodystructure, pool_t pool,
 			     struct message_part *parts, const char **error_r);
 
+/* Serialize the message_parts together with their BODYSTRUCTURE data. The
+   message_part->contexts must contain struct message_part_body_data. */
+void imap_bodystructure_serialize(struct message_part *parts, buffer_t *dest);
+/* Deserialize data written by imap_bodystructure_serialize(). Returns the
+   parts with their message_part->contexts filled, or NULL and error_r if
+   the data is broken. */
+struct message_part *
+imap_bodystructure_deserialize(pool_t pool, const void *data, size_t size,
+			       const char **error_r);
+
 /* Get BODY part from BODYSTRUCTURE and write it to dest.
    Returns 0 if ok, -1 if bodystructure wasn't valid. */
 int imap_body_parse_from_bodystructure(const char *bodystructure,
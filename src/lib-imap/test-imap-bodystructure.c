@@ -1,6 +1,7 @@
 /* Copyright (c) 2013 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "buffer.h"
 #include "istream.h"
 #include "str.h"
 #include "message-parser.h"
@@ -130,11 +131,46 @@ static void test_imap_bodystructure_parse(void)
 	test_end();
 }
 
+static void test_imap_bodystructure_serialize(void)
+{
+	struct message_part *parts;
+	const char *error;
+	string_t *str = t_str_new(128);
+	buffer_t *buf = buffer_create_dynamic(pool_datastack_create(), 256);
+	pool_t pool = pool_alloconly_create("imap bodystructure serialize", 1024);
+	size_t i;
+
+	test_begin("imap bodystructure serialize");
+	parts = msg_parse(pool, TRUE);
+	imap_bodystructure_serialize(parts, buf);
+
+	parts = imap_bodystructure_deserialize(pool, buf->data, buf->used,
+					       &error);
+	test_assert(parts != NULL);
+	if (parts != NULL) {
+		imap_bodystructure_write(parts, str, TRUE);
+		test_assert(strcmp(str_c(str), testmsg_bodystructure) == 0);
+	}
+
+	/* truncated data */
+	for (i = 0; i < buf->used; i++) {
+		test_assert(imap_bodystructure_deserialize(pool, buf->data, i,
+							   &error) == NULL);
+	}
+	buffer_append_c(buf, 0);
+	test_assert(imap_bodystructure_deserialize(pool, buf->data, buf->used,
+						   &error) == NULL);
+
+	pool_unref(&pool);
+	test_end();
+}
+
 int main(void)
 {
 	static void (*test_functions[])(void) = {
 		test_imap_bodystructure_write,
 		test_imap_bodystructure_parse,
+		test_imap_bodystructure_serialize,
 		NULL
 	};
 	return test_run(test_functions);
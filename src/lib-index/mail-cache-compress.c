@@ -199,6 +199,7 @@ mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
 			ctx.field_file_map[i] = i;
 		used_fields_count = i;
 	} else {
+		mail_cache_decisions_compress(cache, trans);
 		for (i = used_fields_count = 0; i < orig_fields_count; i++) {
 			struct mail_cache_field_private *priv =
 				&cache->fields[i];
@@ -214,9 +215,12 @@ mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
 				priv->field.decision = dec;
 			}
 
-			/* drop all fields we don't want */
+			/* drop all fields we don't want. fields dropped by
+			   the access statistics are kept, so that the "no"
+			   decision is seen by other processes. */
 			if ((dec & ~MAIL_CACHE_DECISION_FORCED) ==
-			    MAIL_CACHE_DECISION_NO && !priv->adding) {
+			    MAIL_CACHE_DECISION_NO && !priv->adding &&
+			    !mail_cache_stats_field_dropped(cache, i)) {
 				priv->used = FALSE;
 				priv->field.last_used = 0;
 			}
@@ -503,3 +507,54 @@ bool mail_cache_need_compress(struct mail_cache *cache)
 		(cache->index->flags & MAIL_INDEX_OPEN_FLAG_SAVEONLY) == 0 &&
 		!cache->index->readonly;
 }
+
+int mail_cache_compress_external(struct mail_cache *cache)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	int ret;
+
+	view = mail_index_view_open(cache->index);
+	trans = mail_index_transaction_begin(view,
+					MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+	if (mail_cache_compress(cache, trans) < 0) {
+		mail_index_transaction_rollback(&trans);
+		ret = -1;
+	} else {
+		ret = mail_index_transaction_commit(&trans);
+	}
+	mail_index_view_close(&view);
+	return ret;
+}
+
+int mail_cache_compress_if_needed(struct mail_cache *cache)
+{
+	if (!mail_cache_need_compress(cache))
+		return 0;
+	return mail_cache_compress_external(cache);
+}
+
+#undef mail_cache_set_compress_callback
+void mail_cache_set_compress_callback(struct mail_cache *cache,
+				      mail_cache_compress_callback_t *callback,
+				      void *context)
+{
+	cache->compress_callback = callback;
+	cache->compress_context = context;
+}
+
+void mail_cache_unset_compress_callback(struct mail_cache *cache,
+					void *context)
+{
+	if (cache->compress_context == context) {
+		cache->compress_callback = NULL;
+		cache->compress_context = NULL;
+	}
+}
+
+bool mail_cache_compress_delay(struct mail_cache *cache)
+{
+	if (cache->compress_callback == NULL || cache->compressing)
+		return FALSE;
+	return cache->compress_callback(cache->compress_context);
+}
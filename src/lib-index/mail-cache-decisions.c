@@ -64,10 +64,27 @@
    months, it's changed. I picked two months because people go to at least
    one month vacations where they might still be reading mails, but with
    different clients.
+
+   The rules above only see how the fields are accessed, not what caching
+   them actually gains. So each field also has hit/miss counters and the
+   time spent generating the field after misses. These are kept in the
+   "cache-stats" index extension header, and when compressing they're used
+   to keep fields that are expensive to generate and looked up again
+   permanently cached, and to drop fields that are practically never found
+   from cache when looked up. The counters are halved after each
+   compression, so old access patterns are eventually forgotten.
+
+   A field dropped this way stays in the cache file with "no" decision.
+   For a month it isn't added to cache and its decision isn't raised, so
+   mail_cache_decision_add() won't start caching it again. Its counters are
+   reset when compressing, because lookups of a field that isn't cached
+   tell nothing about caching it.
 */
 
 #include "lib.h"
+#include "array.h"
 #include "ioloop.h"
+#include "time-util.h"
 #include "mail-cache-private.h"
 
 void mail_cache_decision_state_update(struct mail_cache_view *view,
@@ -134,6 +151,22 @@ void mail_cache_decision_add(struct mail_cache_view *view, uint32_t seq,
 
 	i_assert(field < cache->fields_count);
 
+	if (field < array_count(&view->field_misses)) {
+		struct mail_cache_view_miss *miss =
+			array_idx_modifiable(&view->field_misses, field);
+		struct timeval now;
+
+		if (miss->seq == seq) {
+			/* the field was just generated after a lookup
+			   didn't find it */
+			if (gettimeofday(&now, NULL) < 0)
+				i_fatal("gettimeofday() failed: %m");
+			cache->fields[field].stats_miss_usecs +=
+				timeval_diff_usecs(&now, &miss->tv);
+			miss->seq = 0;
+		}
+	}
+
 	if (MAIL_CACHE_IS_UNUSABLE(cache) || view->no_decision_updates)
 		return;
 
@@ -151,3 +184,109 @@ void mail_cache_decision_add(struct mail_cache_view *view, uint32_t seq,
 	mail_index_lookup_uid(view->view, seq, &uid);
 	cache->fields[field].uid_highwater = uid;
 }
+
+void mail_cache_decision_lookup(struct mail_cache_view *view, uint32_t seq,
+				unsigned int field, bool found)
+{
+	struct mail_cache *cache = view->cache;
+	struct mail_cache_view_miss *miss;
+
+	i_assert(field < cache->fields_count);
+
+	if (view->no_decision_updates)
+		return;
+
+	cache->stats_pending_lookups++;
+	if (found) {
+		cache->fields[field].stats_hits++;
+		return;
+	}
+	cache->fields[field].stats_misses++;
+
+	miss = array_idx_modifiable(&view->field_misses, field);
+	miss->seq = seq;
+	if (gettimeofday(&miss->tv, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+}
+
+static void
+mail_cache_decision_compress_field(struct mail_cache *cache,
+				   struct mail_cache_field_stats *stat)
+{
+	struct mail_cache_field_private *priv;
+	enum mail_cache_decision_type dec;
+	unsigned int field, lookups;
+
+	if (stat->dropped_time != 0) {
+		/* the field wasn't cached (at least for a while), so the
+		   counters say nothing about caching it. start from zero
+		   once the drop expires. */
+		if (ioloop_time - stat->dropped_time >=
+		    MAIL_CACHE_STATS_DROP_SECS)
+			stat->dropped_time = 0;
+		stat->hits = stat->misses = 0;
+		stat->miss_usecs = 0;
+		return;
+	}
+
+	lookups = stat->hits + stat->misses;
+	if (lookups < MAIL_CACHE_STATS_MIN_LOOKUPS)
+		return;
+
+	field = mail_cache_register_lookup(cache, stat->name);
+	if (field == UINT_MAX)
+		return;
+	priv = &cache->fields[field];
+	dec = priv->field.decision;
+	if ((dec & MAIL_CACHE_DECISION_FORCED) != 0 ||
+	    dec == MAIL_CACHE_DECISION_NO || priv->adding)
+		return;
+
+	if (stat->hits * 100ULL / lookups <
+	    MAIL_CACHE_STATS_DROP_HIT_PERCENTAGE) {
+		/* the cached data is hardly ever used. remember that, so
+		   mail_cache_decision_add() won't start caching it again
+		   right away. */
+		dec = MAIL_CACHE_DECISION_NO;
+		stat->dropped_time = ioloop_time;
+		stat->hits = stat->misses = 0;
+		stat->miss_usecs = 0;
+		priv->stats_dropped_time = stat->dropped_time;
+	} else if (stat->misses > 0 &&
+		   stat->miss_usecs / stat->misses >=
+		   MAIL_CACHE_STATS_EXPENSIVE_USECS) {
+		/* it's expensive to generate this field again, and it is
+		   being looked up repeatedly */
+		dec = MAIL_CACHE_DECISION_YES;
+	} else {
+		return;
+	}
+	if (priv->field.decision != dec) {
+		priv->field.decision = dec;
+		priv->decision_dirty = TRUE;
+	}
+}
+
+void mail_cache_decisions_compress(struct mail_cache *cache,
+				   struct mail_index_transaction *trans)
+{
+	ARRAY_TYPE(mail_cache_field_stats) stats;
+	struct mail_cache_field_stats *stat;
+
+	if (cache->index->readonly)
+		return;
+
+	T_BEGIN {
+		t_array_init(&stats, 32);
+		mail_cache_stats_read(cache,
+				      mail_index_transaction_get_view(trans),
+				      pool_datastack_create(), TRUE, &stats);
+		array_foreach_modifiable(&stats, stat) {
+			mail_cache_decision_compress_field(cache, stat);
+			stat->hits /= 2;
+			stat->misses /= 2;
+			stat->miss_usecs /= 2;
+		}
+		mail_cache_stats_write(cache, trans, &stats);
+	} T_END;
+}
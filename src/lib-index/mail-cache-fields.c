@@ -81,7 +81,8 @@ mail_cache_field_update(struct mail_cache *cache,
 	orig = &cache->fields[newfield->idx];
 	if ((newfield->decision & MAIL_CACHE_DECISION_FORCED) != 0 ||
 	    ((orig->field.decision & MAIL_CACHE_DECISION_FORCED) == 0 &&
-	     newfield->decision > orig->field.decision)) {
+	     newfield->decision > orig->field.decision &&
+	     !mail_cache_stats_field_dropped(cache, newfield->idx))) {
 		orig->field.decision = newfield->decision;
 		if (!initial_registering)
 			orig->decision_dirty = TRUE;
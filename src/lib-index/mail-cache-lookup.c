@@ -7,8 +7,12 @@
 #include "mail-cache-private.h"
 
 #include <stdlib.h>
+#include <fcntl.h>
 
 #define CACHE_PREFETCH IO_BLOCK_SIZE
+/* Cache file is prefetched in blocks of this size. Records closer than this
+   to each other are prefetched with a single call. */
+#define CACHE_FILE_PREFETCH_BLOCK_SIZE (1024*16)
 
 int mail_cache_get_record(struct mail_cache *cache, uint32_t offset,
 			  const struct mail_cache_record **rec_r)
@@ -304,6 +308,29 @@ int mail_cache_lookup_iter_next(struct mail_cache_lookup_iterate_ctx *ctx,
 	return 1;
 }
 
+static void
+mail_cache_view_save_field(struct mail_cache_view *view,
+			   const struct mail_cache_iterate_field *field)
+{
+	const struct mail_cache_field *field_def =
+		&view->cache->fields[field->field_idx].field;
+	struct mail_cache_view_field *vfield;
+
+	if (field_def->type == MAIL_CACHE_FIELD_BITMASK ||
+	    field_def->field_size > MAIL_CACHE_VIEW_FIELD_MAX_SIZE ||
+	    field->size != field_def->field_size)
+		return;
+
+	vfield = array_idx_modifiable(&view->cached_fields, field->field_idx);
+	if (vfield->exists_value == view->cached_exists_value) {
+		/* lookups return the first one */
+		return;
+	}
+	vfield->exists_value = view->cached_exists_value;
+	vfield->size = field->size;
+	memcpy(vfield->data, field->data, field->size);
+}
+
 static int mail_cache_seq(struct mail_cache_view *view, uint32_t seq)
 {
 	struct mail_cache_lookup_iterate_ctx iter;
@@ -311,8 +338,9 @@ static int mail_cache_seq(struct mail_cache_view *view, uint32_t seq)
 	int ret;
 
 	if (++view->cached_exists_value == 0) {
-		/* wrapped, we'll have to clear the buffer */
+		/* wrapped, we'll have to clear the buffers */
 		buffer_reset(view->cached_exists_buf);
+		array_clear(&view->cached_fields);
 		view->cached_exists_value++;
 	}
 	view->cached_exists_seq = seq;
@@ -321,6 +349,7 @@ static int mail_cache_seq(struct mail_cache_view *view, uint32_t seq)
 	while ((ret = mail_cache_lookup_iter_next(&iter, &field)) > 0) {
 		buffer_write(view->cached_exists_buf, field.field_idx,
 			     &view->cached_exists_value, 1);
+		mail_cache_view_save_field(view, &field);
 	}
 	return ret;
 }
@@ -404,14 +433,28 @@ int mail_cache_lookup_field(struct mail_cache_view *view, buffer_t *dest_buf,
 			    uint32_t seq, unsigned int field_idx)
 {
 	const struct mail_cache_field *field_def;
+	const struct mail_cache_view_field *vfield;
 	struct mail_cache_lookup_iterate_ctx iter;
 	struct mail_cache_iterate_field field;
 	int ret;
 
 	ret = mail_cache_field_exists(view, seq, field_idx);
 	mail_cache_decision_state_update(view, seq, field_idx);
-	if (ret <= 0)
-		return ret;
+	if (ret < 0)
+		return -1;
+	mail_cache_decision_lookup(view, seq, field_idx, ret > 0);
+	if (ret == 0)
+		return 0;
+
+	if (field_idx < array_count(&view->cached_fields)) {
+		/* small fixed size fields were already copied while checking
+		   which fields exist */
+		vfield = array_idx(&view->cached_fields, field_idx);
+		if (vfield->exists_value == view->cached_exists_value) {
+			buffer_append(dest_buf, vfield->data, vfield->size);
+			return 1;
+		}
+	}
 
 	/* the field should exist */
 	mail_cache_lookup_iter_init(view, seq, &iter);
@@ -597,6 +640,8 @@ int mail_cache_lookup_headers(struct mail_cache_view *view, string_t *dest,
 			      unsigned int fields_count)
 {
 	pool_t pool;
+	unsigned int i;
+	bool found;
 	int ret;
 
 	T_BEGIN {
@@ -606,5 +651,62 @@ int mail_cache_lookup_headers(struct mail_cache_view *view, string_t *dest,
 		if (pool != NULL)
 			pool_unref(&pool);
 	} T_END;
+	if (ret >= 0) {
+		for (i = 0; i < fields_count; i++) {
+			/* if some header wasn't found, the others may
+			   still have been */
+			found = ret > 0 ||
+				mail_cache_field_exists(view, seq,
+							field_idxs[i]) > 0;
+			mail_cache_decision_lookup(view, seq, field_idxs[i],
+						   found);
+		}
+	}
 	return ret;
 }
+
+void mail_cache_prefetch(struct mail_cache_view *view,
+			 const ARRAY_TYPE(seq_range) *seqs)
+{
+/* HAVE_POSIX_FADVISE alone isn't enough for CentOS 4.9 */
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	struct mail_cache *cache = view->cache;
+	ARRAY_TYPE(seq_range) blocks;
+	const struct seq_range *range;
+	uint32_t seq, offset, reset_id;
+	int ret;
+
+	if (!cache->opened)
+		(void)mail_cache_open_and_verify(cache);
+	if (MAIL_CACHE_IS_UNUSABLE(cache) || cache->fd == -1)
+		return;
+
+	/* find the blocks containing the messages' newest cache records.
+	   the older records for the same message are usually close by. */
+	t_array_init(&blocks, 16);
+	array_foreach(seqs, range) {
+		for (seq = range->seq1; seq <= range->seq2; seq++) {
+			offset = mail_cache_lookup_cur_offset(view->view, seq,
+							      &reset_id);
+			if (offset != 0 && reset_id == cache->hdr->file_seq) {
+				seq_range_array_add(&blocks,
+					offset / CACHE_FILE_PREFETCH_BLOCK_SIZE);
+			}
+		}
+	}
+
+	/* tell the OS to start reading them into memory. this is done
+	   regardless of whether the cache file is mmap()ed or read(). */
+	array_foreach(&blocks, range) {
+		ret = posix_fadvise(cache->fd,
+			(off_t)range->seq1 * CACHE_FILE_PREFETCH_BLOCK_SIZE,
+			(off_t)(range->seq2 - range->seq1 + 1) *
+			CACHE_FILE_PREFETCH_BLOCK_SIZE, POSIX_FADV_WILLNEED);
+		if (ret != 0) {
+			errno = ret;
+			mail_cache_set_syscall_error(cache, "posix_fadvise()");
+			break;
+		}
+	}
+#endif
+}
@@ -5,6 +5,8 @@
 #include "mail-index-private.h"
 #include "mail-cache.h"
 
+#include <sys/time.h>
+
 #define MAIL_CACHE_MAJOR_VERSION 1
 #define MAIL_CACHE_MINOR_VERSION 1
 
@@ -28,6 +30,18 @@
 /* If cache record becomes larger than this, don't add it. */
 #define MAIL_CACHE_RECORD_MAX_SIZE (64*1024)
 
+/* Write the field access statistics to index after this many lookups */
+#define MAIL_CACHE_STATS_FLUSH_LOOKUPS 1000
+/* Don't base caching decisions on fewer lookups than this */
+#define MAIL_CACHE_STATS_MIN_LOOKUPS 100
+/* Keep fields that are looked up again permanently cached if generating
+   them takes at least this long on average */
+#define MAIL_CACHE_STATS_EXPENSIVE_USECS 1000
+/* Drop fields when compressing if less than n% of their lookups are hits */
+#define MAIL_CACHE_STATS_DROP_HIT_PERCENTAGE 5
+/* Don't start caching a dropped field again for this many seconds */
+#define MAIL_CACHE_STATS_DROP_SECS (3600*24*30)
+
 #define MAIL_CACHE_LOCK_TIMEOUT 10
 #define MAIL_CACHE_LOCK_CHANGE_TIMEOUT 300
 
@@ -87,6 +101,17 @@ struct mail_cache_header_fields {
 #define MAIL_CACHE_FIELD_NAMES(count) \
 	(MAIL_CACHE_FIELD_DECISION(count) + sizeof(uint8_t) * (count))
 
+/* "cache-stats" index extension header is an array of these records, each
+   followed by the NUL-terminated field name padded to 32bit alignment. */
+struct mail_cache_stats_record {
+	uint32_t hits;
+	uint32_t misses;
+	uint64_t miss_usecs;
+	/* when the field was dropped because of these statistics, 0 if not */
+	uint32_t dropped_time;
+	uint32_t unused_padding;
+};
+
 struct mail_cache_record {
 	uint32_t prev_offset;
 	uint32_t size; /* full record size, including this header */
@@ -98,6 +123,12 @@ struct mail_cache_field_private {
 
 	uint32_t uid_highwater;
 
+	/* access statistics not yet written to index */
+	uint32_t stats_hits, stats_misses;
+	uint64_t stats_miss_usecs;
+	/* dropped_time from "cache-stats" header, if it's been looked up */
+	uint32_t stats_dropped_time;
+
 	/* Unused fields aren't written to cache file */
 	unsigned int used:1;
 	unsigned int adding:1;
@@ -106,7 +137,7 @@ struct mail_cache_field_private {
 
 struct mail_cache {
 	struct mail_index *index;
-	uint32_t ext_id;
+	uint32_t ext_id, stats_ext_id;
 
 	char *filepath;
 	int fd;
@@ -148,6 +179,11 @@ struct mail_cache {
 	/* 0 is no need for compression, otherwise the file sequence number
 	   which we want compressed. */
 	uint32_t need_compress_file_seq;
+	/* number of lookups with stats not yet written to index */
+	unsigned int stats_pending_lookups;
+	/* If set, called instead of compressing within the index sync */
+	mail_cache_compress_callback_t *compress_callback;
+	void *compress_context;
 
 	unsigned int *file_field_map;
 	unsigned int file_fields_count;
@@ -167,6 +203,22 @@ struct mail_cache_loop_track {
 	uoff_t size_sum;
 };
 
+/* Fixed size fields up to this size are remembered by mail_cache_view for
+   the last looked up message. */
+#define MAIL_CACHE_VIEW_FIELD_MAX_SIZE 16
+
+struct mail_cache_view_field {
+	/* valid if this matches mail_cache_view.cached_exists_value */
+	uint8_t exists_value;
+	uint8_t size;
+	unsigned char data[MAIL_CACHE_VIEW_FIELD_MAX_SIZE];
+};
+
+struct mail_cache_view_miss {
+	uint32_t seq;
+	struct timeval tv;
+};
+
 struct mail_cache_view {
 	struct mail_cache *cache;
 	struct mail_index_view *view, *trans_view;
@@ -182,6 +234,13 @@ struct mail_cache_view {
 	buffer_t *cached_exists_buf;
 	uint8_t cached_exists_value;
 	uint32_t cached_exists_seq;
+	/* the first values of small fixed size fields seen while filling
+	   cached_exists_buf, indexed by field_idx. these can be returned
+	   without going through the record list again. */
+	ARRAY(struct mail_cache_view_field) cached_fields;
+	/* when the field was last found missing from the cache, indexed by
+	   field_idx. used to measure how long it took to generate it. */
+	ARRAY(struct mail_cache_view_miss) field_misses;
 
 	unsigned int no_decision_updates:1;
 };
@@ -258,12 +317,38 @@ int mail_cache_reopen(struct mail_cache *cache);
 
 void mail_cache_delete(struct mail_cache *cache);
 
+/* Compress the cache in its own external index transaction. */
+int mail_cache_compress_external(struct mail_cache *cache);
+
 /* Notify the decision handling code that field was looked up for seq.
    This should be called even for fields that aren't currently in cache file */
 void mail_cache_decision_state_update(struct mail_cache_view *view,
 				      uint32_t seq, unsigned int field);
 void mail_cache_decision_add(struct mail_cache_view *view, uint32_t seq,
 			     unsigned int field);
+/* Update the field's access statistics after a lookup */
+void mail_cache_decision_lookup(struct mail_cache_view *view, uint32_t seq,
+				unsigned int field, bool found);
+/* Use the access statistics to update the decisions of fields before
+   compressing. The statistics are decayed in the given transaction. */
+void mail_cache_decisions_compress(struct mail_cache *cache,
+				   struct mail_index_transaction *trans);
+
+/* Read the access statistics from view's "cache-stats" header. If
+   take_pending=TRUE, the statistics not yet written are moved there as well,
+   otherwise they're just added. */
+void mail_cache_stats_read(struct mail_cache *cache,
+			   struct mail_index_view *view, pool_t pool,
+			   bool take_pending,
+			   ARRAY_TYPE(mail_cache_field_stats) *stats);
+/* Returns TRUE if the field was recently dropped because of its access
+   statistics, and it shouldn't be cached again yet. */
+bool mail_cache_stats_field_dropped(struct mail_cache *cache,
+				    unsigned int field);
+/* Replace the "cache-stats" header with the given statistics. */
+void mail_cache_stats_write(struct mail_cache *cache,
+			    struct mail_index_transaction *trans,
+			    const ARRAY_TYPE(mail_cache_field_stats) *stats);
 
 int mail_cache_expunge_handler(struct mail_index_sync_map_ctx *sync_ctx,
 			       uint32_t seq, const void *data,
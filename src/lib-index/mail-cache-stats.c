@@ -0,0 +1,197 @@
+/* Copyright (c) 2013 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "ioloop.h"
+#include "mail-cache-private.h"
+
+static struct mail_cache_field_stats *
+mail_cache_stats_find(ARRAY_TYPE(mail_cache_field_stats) *stats,
+		      const char *name)
+{
+	struct mail_cache_field_stats *stat;
+
+	array_foreach_modifiable(stats, stat) {
+		if (strcmp(stat->name, name) == 0)
+			return stat;
+	}
+	return NULL;
+}
+
+static void
+mail_cache_stats_parse(const void *hdr_data, size_t size, pool_t pool,
+		       ARRAY_TYPE(mail_cache_field_stats) *stats)
+{
+	struct mail_cache_stats_record rec;
+	struct mail_cache_field_stats *stat;
+	const unsigned char *data = hdr_data, *name_end;
+	size_t pos, name_size;
+
+	for (pos = 0; pos + sizeof(rec) < size; ) {
+		memcpy(&rec, data + pos, sizeof(rec));
+		pos += sizeof(rec);
+
+		name_end = memchr(data + pos, '\0', size - pos);
+		if (name_end == NULL)
+			break;
+		name_size = name_end - (data + pos);
+
+		stat = array_append_space(stats);
+		stat->name = p_strndup(pool, data + pos, name_size);
+		stat->hits = rec.hits;
+		stat->misses = rec.misses;
+		stat->miss_usecs = rec.miss_usecs;
+		stat->dropped_time = rec.dropped_time;
+		pos += (name_size + 1 + 3) & ~3;
+	}
+}
+
+void mail_cache_stats_read(struct mail_cache *cache,
+			   struct mail_index_view *view, pool_t pool,
+			   bool take_pending,
+			   ARRAY_TYPE(mail_cache_field_stats) *stats)
+{
+	struct mail_cache_field_private *priv;
+	struct mail_cache_field_stats *stat;
+	const void *data;
+	size_t size;
+	unsigned int i;
+
+	mail_index_get_header_ext(view, cache->stats_ext_id, &data, &size);
+	mail_cache_stats_parse(data, size, pool, stats);
+
+	for (i = 0; i < cache->fields_count; i++) {
+		priv = &cache->fields[i];
+		if (priv->stats_hits == 0 && priv->stats_misses == 0)
+			continue;
+
+		stat = mail_cache_stats_find(stats, priv->field.name);
+		if (stat == NULL) {
+			stat = array_append_space(stats);
+			stat->name = p_strdup(pool, priv->field.name);
+		}
+		stat->hits += priv->stats_hits;
+		stat->misses += priv->stats_misses;
+		stat->miss_usecs += priv->stats_miss_usecs;
+
+		if (take_pending) {
+			priv->stats_hits = 0;
+			priv->stats_misses = 0;
+			priv->stats_miss_usecs = 0;
+		}
+	}
+	if (take_pending)
+		cache->stats_pending_lookups = 0;
+}
+
+static bool mail_cache_stats_drop_is_active(time_t dropped_time)
+{
+	return dropped_time != 0 &&
+		ioloop_time - dropped_time < MAIL_CACHE_STATS_DROP_SECS;
+}
+
+bool mail_cache_stats_field_dropped(struct mail_cache *cache,
+				    unsigned int field)
+{
+	struct mail_cache_field_private *priv = &cache->fields[field];
+	struct mail_index_map *map = cache->index->map;
+	ARRAY_TYPE(mail_cache_field_stats) stats;
+	const struct mail_cache_field_stats *stat;
+	const struct mail_index_ext *ext;
+	uint32_t idx;
+
+	if (mail_cache_stats_drop_is_active(priv->stats_dropped_time))
+		return TRUE;
+
+	/* another process may have dropped it */
+	if (map == NULL ||
+	    !mail_index_map_get_ext_idx(map, cache->stats_ext_id, &idx))
+		return FALSE;
+	ext = array_idx(&map->extensions, idx);
+
+	T_BEGIN {
+		t_array_init(&stats, 32);
+		mail_cache_stats_parse(CONST_PTR_OFFSET(map->hdr_base,
+							ext->hdr_offset),
+				       ext->hdr_size, pool_datastack_create(),
+				       &stats);
+		stat = mail_cache_stats_find(&stats, priv->field.name);
+		priv->stats_dropped_time = stat == NULL ? 0 :
+			stat->dropped_time;
+	} T_END;
+	return mail_cache_stats_drop_is_active(priv->stats_dropped_time);
+}
+
+void mail_cache_stats_write(struct mail_cache *cache,
+			    struct mail_index_transaction *trans,
+			    const ARRAY_TYPE(mail_cache_field_stats) *stats)
+{
+	struct mail_index_view *view = mail_index_transaction_get_view(trans);
+	const struct mail_cache_field_stats *stat;
+	struct mail_cache_stats_record rec;
+	const void *old_data;
+	size_t old_size;
+	buffer_t *buf;
+
+	buf = buffer_create_dynamic(pool_datastack_create(), 1024);
+	array_foreach(stats, stat) {
+		if (stat->hits == 0 && stat->misses == 0 &&
+		    stat->dropped_time == 0)
+			continue;
+
+		memset(&rec, 0, sizeof(rec));
+		rec.hits = stat->hits;
+		rec.misses = stat->misses;
+		rec.miss_usecs = stat->miss_usecs;
+		rec.dropped_time = stat->dropped_time;
+		buffer_append(buf, &rec, sizeof(rec));
+		buffer_append(buf, stat->name, strlen(stat->name) + 1);
+		if ((buf->used & 3) != 0)
+			buffer_append_zero(buf, 4 - (buf->used & 3));
+	}
+
+	mail_index_get_header_ext(view, cache->stats_ext_id,
+				  &old_data, &old_size);
+	if (old_size != buf->used)
+		mail_index_ext_resize_hdr(trans, cache->stats_ext_id, buf->used);
+	if (buf->used > 0) {
+		mail_index_update_header_ext(trans, cache->stats_ext_id, 0,
+					     buf->data, buf->used);
+	}
+}
+
+bool mail_cache_stats_need_flush(struct mail_cache *cache)
+{
+	return cache->stats_pending_lookups >= MAIL_CACHE_STATS_FLUSH_LOOKUPS &&
+		!cache->index->readonly;
+}
+
+void mail_cache_stats_flush(struct mail_cache *cache,
+			    struct mail_index_transaction *trans)
+{
+	ARRAY_TYPE(mail_cache_field_stats) stats;
+
+	if (cache->stats_pending_lookups == 0 || cache->index->readonly)
+		return;
+
+	T_BEGIN {
+		t_array_init(&stats, 32);
+		mail_cache_stats_read(cache,
+				      mail_index_transaction_get_view(trans),
+				      pool_datastack_create(), TRUE, &stats);
+		mail_cache_stats_write(cache, trans, &stats);
+	} T_END;
+}
+
+const struct mail_cache_field_stats *
+mail_cache_get_field_stats(struct mail_cache *cache,
+			   struct mail_index_view *view, pool_t pool,
+			   unsigned int *count_r)
+{
+	ARRAY_TYPE(mail_cache_field_stats) stats;
+
+	p_array_init(&stats, pool, 32);
+	mail_cache_stats_read(cache, view, pool, FALSE, &stats);
+	return array_get(&stats, count_r);
+}
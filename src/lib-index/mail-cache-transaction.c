@@ -165,8 +165,6 @@ static int
 mail_cache_transaction_compress(struct mail_cache_transaction_ctx *ctx)
 {
 	struct mail_cache *cache = ctx->cache;
-	struct mail_index_view *view;
-	struct mail_index_transaction *trans;
 	int ret;
 
 	ctx->tried_compression = TRUE;
@@ -174,16 +172,7 @@ mail_cache_transaction_compress(struct mail_cache_transaction_ctx *ctx)
 	cache->need_compress_file_seq =
 		MAIL_CACHE_IS_UNUSABLE(cache) ? 0 : cache->hdr->file_seq;
 
-	view = mail_index_view_open(cache->index);
-	trans = mail_index_transaction_begin(view,
-					MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
-	if (mail_cache_compress(cache, trans) < 0) {
-		mail_index_transaction_rollback(&trans);
-		ret = -1;
-	} else {
-		ret = mail_index_transaction_commit(&trans);
-	}
-	mail_index_view_close(&view);
+	ret = mail_cache_compress_external(cache);
 	mail_cache_transaction_reset(ctx);
 	return ret;
 }
@@ -643,6 +632,13 @@ void mail_cache_add(struct mail_cache_transaction_ctx *ctx, uint32_t seq,
 	if (ctx->cache->fields[field_idx].field.decision ==
 	    (MAIL_CACHE_DECISION_NO | MAIL_CACHE_DECISION_FORCED))
 		return;
+	if (ctx->cache->fields[field_idx].field.decision ==
+	    MAIL_CACHE_DECISION_NO &&
+	    mail_cache_stats_field_dropped(ctx->cache, field_idx)) {
+		/* the access statistics showed that caching this field
+		   is useless */
+		return;
+	}
 
 	if (ctx->cache_file_seq == 0) {
 		mail_cache_transaction_open_if_needed(ctx);
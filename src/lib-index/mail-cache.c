@@ -503,6 +503,21 @@ int mail_cache_open_and_verify(struct mail_cache *cache)
 	return ret;
 }
 
+void mail_cache_park(struct mail_cache *cache)
+{
+	if (!cache->opened || cache->locked ||
+	    cache->field_header_write_pending) {
+		/* nothing to release or the cache is in use */
+		return;
+	}
+
+	mail_cache_file_close(cache);
+	if (cache->read_buf != NULL)
+		buffer_free(&cache->read_buf);
+	/* reopen the file when it's accessed the next time */
+	cache->opened = FALSE;
+}
+
 static struct mail_cache *mail_cache_alloc(struct mail_index *index)
 {
 	struct mail_cache *cache;
@@ -533,6 +548,8 @@ static struct mail_cache *mail_cache_alloc(struct mail_index *index)
 	cache->ext_id =
 		mail_index_ext_register(index, "cache", 0,
 					sizeof(uint32_t), sizeof(uint32_t));
+	cache->stats_ext_id =
+		mail_index_ext_register(index, "cache-stats", 0, 0, 0);
 	mail_index_register_expunge_handler(index, cache->ext_id, FALSE,
 					    mail_cache_expunge_handler, cache);
 	return cache;
@@ -822,6 +839,8 @@ mail_cache_view_open(struct mail_cache *cache, struct mail_index_view *iview)
 	view->cached_exists_buf =
 		buffer_create_dynamic(default_pool,
 				      cache->file_fields_count + 10);
+	i_array_init(&view->cached_fields, cache->file_fields_count + 10);
+	i_array_init(&view->field_misses, cache->fields_count + 10);
 	return view;
 }
 
@@ -837,6 +856,8 @@ void mail_cache_view_close(struct mail_cache_view **_view)
                 (void)mail_cache_header_fields_update(view->cache);
 
 	buffer_free(&view->cached_exists_buf);
+	array_free(&view->cached_fields);
+	array_free(&view->field_misses);
 	i_free(view);
 }
 
@@ -9,6 +9,8 @@ struct mail_cache;
 struct mail_cache_view;
 struct mail_cache_transaction_ctx;
 
+typedef bool mail_cache_compress_callback_t(void *context);
+
 enum mail_cache_decision_type {
 	/* Not needed currently */
 	MAIL_CACHE_DECISION_NO		= 0x00,
@@ -42,6 +44,17 @@ struct mail_cache_field {
 	time_t last_used;
 };
 
+struct mail_cache_field_stats {
+	const char *name;
+	/* number of lookups that found/didn't find the field in cache */
+	uint32_t hits, misses;
+	/* total time spent generating the field after cache misses */
+	uint64_t miss_usecs;
+	/* when caching the field was stopped because of the statistics */
+	time_t dropped_time;
+};
+ARRAY_DEFINE_TYPE(mail_cache_field_stats, struct mail_cache_field_stats);
+
 struct mail_cache *mail_cache_open_or_create(struct mail_index *index);
 struct mail_cache *mail_cache_create(struct mail_index *index);
 void mail_cache_free(struct mail_cache **cache);
@@ -63,15 +76,52 @@ const struct mail_cache_field *
 mail_cache_register_get_list(struct mail_cache *cache, pool_t pool,
 			     unsigned int *count_r);
 
+/* Returns the field access statistics stored in the index, including the
+   changes in this process that haven't been written there yet. */
+const struct mail_cache_field_stats *
+mail_cache_get_field_stats(struct mail_cache *cache,
+			   struct mail_index_view *view, pool_t pool,
+			   unsigned int *count_r);
+/* Returns TRUE if enough field access statistics have been collected that
+   they should be written to index. */
+bool mail_cache_stats_need_flush(struct mail_cache *cache);
+/* Write the collected field access statistics to index. */
+void mail_cache_stats_flush(struct mail_cache *cache,
+			    struct mail_index_transaction *trans);
+
 /* Returns TRUE if cache should be compressed. */
 bool mail_cache_need_compress(struct mail_cache *cache);
 /* Compress cache file. Offsets are updated to given transaction. */
 int mail_cache_compress(struct mail_cache *cache,
 			struct mail_index_transaction *trans);
+/* Compress the cache file in its own transaction if it's wanted. */
+int mail_cache_compress_if_needed(struct mail_cache *cache);
+/* Set a callback that is called when index syncing notices that the cache
+   should be compressed. If the callback returns TRUE, the sync skips the
+   compression and the caller is expected to call
+   mail_cache_compress_if_needed() later on, e.g. once the current command
+   has been finished. */
+void mail_cache_set_compress_callback(struct mail_cache *cache,
+				      mail_cache_compress_callback_t *callback,
+				      void *context);
+#define mail_cache_set_compress_callback(cache, callback, context) \
+	  mail_cache_set_compress_callback(cache, \
+		(mail_cache_compress_callback_t *)callback, \
+		(void *)((char *)context + CALLBACK_TYPECHECK(callback, \
+			bool (*)(typeof(context)))))
+/* Unset the compress callback, if it's still the one set with context. */
+void mail_cache_unset_compress_callback(struct mail_cache *cache,
+					void *context);
+/* Returns TRUE if compression was handed over to the compress callback. */
+bool mail_cache_compress_delay(struct mail_cache *cache);
 /* Returns TRUE if there is at least something in the cache. */
 bool mail_cache_exists(struct mail_cache *cache);
 /* Open and read cache header. Returns 0 if ok, -1 if error/corrupted. */
 int mail_cache_open_and_verify(struct mail_cache *cache);
+/* Close the cache file and free its memory. The file is opened again when
+   it's accessed the next time. This must not be called while there are
+   open cache transactions. */
+void mail_cache_park(struct mail_cache *cache);
 
 struct mail_cache_view *
 mail_cache_view_open(struct mail_cache *cache, struct mail_index_view *iview);
@@ -129,6 +179,11 @@ int mail_cache_lookup_field(struct mail_cache_view *view, buffer_t *dest_buf,
 int mail_cache_lookup_headers(struct mail_cache_view *view, string_t *dest,
 			      uint32_t seq, unsigned int field_idxs[],
 			      unsigned int fields_count);
+/* Ask the OS to start reading the cache records of the given messages into
+   memory, so the following lookups for them don't need to wait for disk
+   I/O one record at a time. */
+void mail_cache_prefetch(struct mail_cache_view *view,
+			 const ARRAY_TYPE(seq_range) *seqs);
 
 /* "Error in index cache file %s: ...". */
 void mail_cache_set_corrupted(struct mail_cache *cache, const char *fmt, ...)
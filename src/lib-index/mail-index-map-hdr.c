@@ -228,7 +228,7 @@ static void mail_index_map_clear_recent_flags(struct mail_index_map *map)
 	unsigned int i;
 
 	for (i = 0; i < map->hdr.messages_count; i++) {
-		rec = MAIL_INDEX_MAP_IDX(map, i);
+		rec = mail_index_map_modify_idx(map, i);
 		rec->flags &= ~MAIL_RECENT;
 	}
 }
@@ -33,8 +33,8 @@ static int mail_index_mmap(struct mail_index_map *map, uoff_t file_size)
 	const struct mail_index_header *hdr;
 
 	i_assert(rec_map->mmap_base == NULL);
+	i_assert(rec_map->chunks_count == 0);
 
-	buffer_free(&rec_map->buffer);
 	if (file_size > SSIZE_T_MAX) {
 		/* too large file to map into memory */
 		mail_index_set_error(index, "Index file too large: %s",
@@ -51,6 +51,13 @@ static int mail_index_mmap(struct mail_index_map *map, uoff_t file_size)
 	}
 	rec_map->mmap_size = file_size;
 
+	if ((index->flags & MAIL_INDEX_OPEN_FLAG_SAVEONLY) == 0) {
+		/* the records are usually all accessed soon after mapping, so
+		   avoid faulting them in one page at a time */
+		if (madvise(rec_map->mmap_base, file_size, MADV_WILLNEED) < 0)
+			mail_index_set_syscall_error(index, "madvise()");
+	}
+
 	hdr = rec_map->mmap_base;
 	if (rec_map->mmap_size >
 	    offsetof(struct mail_index_header, major_version) &&
@@ -91,7 +98,8 @@ static int mail_index_mmap(struct mail_index_map *map, uoff_t file_size)
 	mail_index_map_copy_hdr(map, hdr);
 
 	map->hdr_base = rec_map->mmap_base;
-	rec_map->records = PTR_OFFSET(rec_map->mmap_base, map->hdr.header_size);
+	mail_index_record_map_set_mmap_records(rec_map, map->hdr.header_size,
+					       map->hdr.record_size);
 	return 1;
 }
 
@@ -130,7 +138,8 @@ mail_index_try_read_map(struct mail_index_map *map,
 	void *data = NULL;
 	ssize_t ret;
 	size_t pos, records_size, initial_buf_pos = 0;
-	unsigned int records_count = 0, extra;
+	size_t chunk_size, offset, size, part;
+	unsigned int i, records_count = 0, extra;
 
 	i_assert(map->rec_map->mmap_base == NULL);
 
@@ -186,27 +195,35 @@ mail_index_try_read_map(struct mail_index_map *map,
 				records_count);
 		}
 
-		if (map->rec_map->buffer == NULL) {
-			map->rec_map->buffer =
-				buffer_create_dynamic(default_pool,
-						      records_size);
-		}
+		mail_index_record_map_set_records(map->rec_map,
+						  hdr->record_size, NULL,
+						  records_count);
 
-		/* @UNSAFE */
-		buffer_set_used_size(map->rec_map->buffer, 0);
+		/* @UNSAFE: read the records directly into the chunks */
 		if (initial_buf_pos <= hdr->header_size)
 			extra = 0;
-		else {
+		else
 			extra = initial_buf_pos - hdr->header_size;
-			buffer_append(map->rec_map->buffer,
-				      CONST_PTR_OFFSET(buf, hdr->header_size),
-				      extra);
-		}
-		if (records_size > extra) {
-			data = buffer_append_space_unsafe(map->rec_map->buffer,
-							  records_size - extra);
-			ret = pread_full(index->fd, data, records_size - extra,
-					 hdr->header_size + extra);
+		chunk_size = MAIL_INDEX_RECORD_CHUNK_COUNT * hdr->record_size;
+		for (i = 0, offset = 0; offset < records_size; i++) {
+			data = map->rec_map->chunks[i];
+			size = I_MIN(records_size - offset, chunk_size);
+			if (offset < extra) {
+				part = I_MIN(size, extra - offset);
+				memcpy(data, CONST_PTR_OFFSET(buf,
+					hdr->header_size + offset), part);
+			} else {
+				part = 0;
+			}
+			if (part < size) {
+				ret = pread_full(index->fd,
+						 PTR_OFFSET(data, part),
+						 size - part, hdr->header_size +
+						 offset + part);
+				if (ret <= 0)
+					break;
+			}
+			offset += size;
 		}
 	}
 
@@ -226,9 +243,7 @@ mail_index_try_read_map(struct mail_index_map *map,
 		return 0;
 	}
 
-	map->rec_map->records =
-		buffer_get_modifiable_data(map->rec_map->buffer, NULL);
-	map->rec_map->records_count = records_count;
+	i_assert(map->rec_map->records_count == records_count);
 
 	mail_index_map_copy_hdr(map, hdr);
 	map->hdr_base = map->hdr_copy_buf->data;
@@ -369,7 +384,8 @@ static int mail_index_map_latest_file(struct mail_index *index)
 		mail_index_unmap(&new_map);
 		return ret < 0 ? -1 : (unusable ? 0 : 1);
 	}
-	i_assert(new_map->rec_map->records != NULL);
+	i_assert(new_map->rec_map->records_count == 0 ||
+		 new_map->rec_map->chunks != NULL);
 
 	index->last_read_log_file_seq = new_map->hdr.log_file_seq;
 	index->last_read_log_file_head_offset =
@@ -7,6 +7,23 @@
 #include "mail-index-private.h"
 #include "mail-index-modseq.h"
 
+/* Minimum number of records allocated for a growing chunk */
+#define MAIL_INDEX_RECORD_CHUNK_MIN_ALLOC 16
+
+#define MAIL_INDEX_RECORD_CHUNKS(records_count) \
+	(((records_count) + MAIL_INDEX_RECORD_CHUNK_COUNT - 1) >> \
+	 MAIL_INDEX_RECORD_CHUNK_SHIFT)
+#define MAIL_INDEX_RECORD_CHUNK(records) \
+	((struct mail_index_record_chunk *)(records) - 1)
+
+/* Header in front of each in-memory record chunk. The records are 64bit
+   aligned after it. */
+struct mail_index_record_chunk {
+	unsigned int refcount;
+	/* number of records allocated for this chunk */
+	unsigned int records_alloc;
+};
+
 void mail_index_map_init_extbufs(struct mail_index_map *map,
 				 unsigned int initial_count)
 {
@@ -263,14 +280,219 @@ struct mail_index_map *mail_index_map_alloc(struct mail_index *index)
 	return mail_index_map_clone(&tmp_map);
 }
 
+static void *
+mail_index_record_chunk_alloc(unsigned int records_alloc,
+			      unsigned int record_size)
+{
+	struct mail_index_record_chunk *chunk;
+
+	i_assert(records_alloc <= MAIL_INDEX_RECORD_CHUNK_COUNT);
+
+	chunk = i_malloc(sizeof(*chunk) + records_alloc * record_size);
+	chunk->refcount = 1;
+	chunk->records_alloc = records_alloc;
+	return chunk + 1;
+}
+
+static void mail_index_record_chunk_unref(void *records)
+{
+	struct mail_index_record_chunk *chunk =
+		MAIL_INDEX_RECORD_CHUNK(records);
+
+	i_assert(chunk->refcount > 0);
+	if (--chunk->refcount == 0)
+		i_free(chunk);
+}
+
+static void
+mail_index_record_map_set_chunks_count(struct mail_index_record_map *rec_map,
+				       unsigned int count)
+{
+	unsigned int i, old_alloc;
+
+	if (count > rec_map->chunks_alloc) {
+		old_alloc = rec_map->chunks_alloc;
+		rec_map->chunks_alloc = nearest_power(count);
+		rec_map->chunks = i_realloc(rec_map->chunks,
+					    old_alloc * sizeof(void *),
+					    rec_map->chunks_alloc *
+					    sizeof(void *));
+	}
+	if (rec_map->mmap_base == NULL) {
+		for (i = count; i < rec_map->chunks_count; i++)
+			mail_index_record_chunk_unref(rec_map->chunks[i]);
+	}
+	rec_map->chunks_count = count;
+}
+
+static void
+mail_index_record_map_truncate(struct mail_index_record_map *rec_map,
+			       unsigned int count)
+{
+	i_assert(count <= rec_map->records_count);
+
+	mail_index_record_map_set_chunks_count(rec_map,
+		MAIL_INDEX_RECORD_CHUNKS(count));
+	rec_map->records_count = count;
+}
+
+void
+mail_index_record_map_set_mmap_records(struct mail_index_record_map *rec_map,
+				       unsigned int header_size,
+				       unsigned int record_size)
+{
+	unsigned int i, count;
+
+	i_assert(rec_map->mmap_base != NULL);
+
+	count = MAIL_INDEX_RECORD_CHUNKS(rec_map->records_count);
+
+	mail_index_record_map_set_chunks_count(rec_map, count);
+	for (i = 0; i < count; i++) {
+		rec_map->chunks[i] = PTR_OFFSET(rec_map->mmap_base, header_size +
+			((size_t)i << MAIL_INDEX_RECORD_CHUNK_SHIFT) *
+			record_size);
+	}
+}
+
+void mail_index_record_map_set_records(struct mail_index_record_map *rec_map,
+				       unsigned int record_size,
+				       const void *records, unsigned int count)
+{
+	size_t chunk_size = MAIL_INDEX_RECORD_CHUNK_COUNT * record_size;
+	unsigned int i, n, chunks_count = MAIL_INDEX_RECORD_CHUNKS(count);
+
+	mail_index_record_map_set_chunks_count(rec_map, 0);
+	mail_index_record_map_set_chunks_count(rec_map, chunks_count);
+	for (i = 0; i < chunks_count; i++) {
+		n = I_MIN(count - (i << MAIL_INDEX_RECORD_CHUNK_SHIFT),
+			  MAIL_INDEX_RECORD_CHUNK_COUNT);
+		rec_map->chunks[i] =
+			mail_index_record_chunk_alloc(n, record_size);
+		if (records != NULL) {
+			memcpy(rec_map->chunks[i],
+			       CONST_PTR_OFFSET(records, i * chunk_size),
+			       n * record_size);
+		}
+	}
+	rec_map->records_count = count;
+}
+
+static void *
+mail_index_record_map_modify_chunk(struct mail_index_record_map *rec_map,
+				   unsigned int chunk_idx,
+				   unsigned int record_size,
+				   unsigned int min_alloc)
+{
+	struct mail_index_record_chunk *chunk;
+	void *records = rec_map->chunks[chunk_idx], *new_records;
+	unsigned int used, alloc;
+
+	if (rec_map->mmap_base != NULL) {
+		/* MAP_PRIVATE mmap, which can't grow */
+		i_assert(min_alloc == 0);
+		return records;
+	}
+
+	chunk = MAIL_INDEX_RECORD_CHUNK(records);
+	if (chunk->refcount == 1 && chunk->records_alloc >= min_alloc)
+		return records;
+
+	alloc = chunk->records_alloc;
+	if (alloc < min_alloc) {
+		alloc = I_MAX(nearest_power(min_alloc),
+			      MAIL_INDEX_RECORD_CHUNK_MIN_ALLOC);
+		alloc = I_MIN(alloc, MAIL_INDEX_RECORD_CHUNK_COUNT);
+	}
+	if (chunk->refcount == 1) {
+		chunk = i_realloc(chunk, sizeof(*chunk) +
+				  chunk->records_alloc * record_size,
+				  sizeof(*chunk) + alloc * record_size);
+		chunk->records_alloc = alloc;
+		new_records = chunk + 1;
+	} else {
+		/* the chunk is shared with another record map.
+		   copy only the records that are visible to us. */
+		used = rec_map->records_count -
+			(chunk_idx << MAIL_INDEX_RECORD_CHUNK_SHIFT);
+		used = I_MIN(used, chunk->records_alloc);
+		new_records = mail_index_record_chunk_alloc(alloc, record_size);
+		memcpy(new_records, records, used * record_size);
+		mail_index_record_chunk_unref(records);
+	}
+	rec_map->chunks[chunk_idx] = new_records;
+	return new_records;
+}
+
+struct mail_index_record *
+mail_index_map_modify_idx(struct mail_index_map *map, uint32_t idx)
+{
+	void *records;
+
+	i_assert(idx < map->rec_map->records_count);
+
+	records = mail_index_record_map_modify_chunk(map->rec_map,
+		idx >> MAIL_INDEX_RECORD_CHUNK_SHIFT, map->hdr.record_size, 0);
+	return PTR_OFFSET(records, (idx & MAIL_INDEX_RECORD_CHUNK_MASK) *
+			  map->hdr.record_size);
+}
+
+void *mail_index_map_append_space(struct mail_index_map *map)
+{
+	struct mail_index_record_map *rec_map = map->rec_map;
+	uint32_t idx = rec_map->records_count;
+	unsigned int chunk_idx = idx >> MAIL_INDEX_RECORD_CHUNK_SHIFT;
+	unsigned int chunk_pos = idx & MAIL_INDEX_RECORD_CHUNK_MASK;
+	void *records;
+
+	i_assert(rec_map->mmap_base == NULL);
+	i_assert(chunk_idx <= rec_map->chunks_count);
+
+	if (chunk_idx == rec_map->chunks_count) {
+		mail_index_record_map_set_chunks_count(rec_map, chunk_idx + 1);
+		records = mail_index_record_chunk_alloc(
+			MAIL_INDEX_RECORD_CHUNK_MIN_ALLOC, map->hdr.record_size);
+		rec_map->chunks[chunk_idx] = records;
+	} else {
+		records = mail_index_record_map_modify_chunk(rec_map,
+			chunk_idx, map->hdr.record_size, chunk_pos + 1);
+	}
+	return PTR_OFFSET(records, chunk_pos * map->hdr.record_size);
+}
+
+void mail_index_map_delete_records(struct mail_index_map *map,
+				   uint32_t idx, uint32_t count)
+{
+	struct mail_index_record_map *rec_map = map->rec_map;
+	uint32_t dest_idx = idx, src_idx = idx + count, n;
+	void *dest;
+
+	i_assert(src_idx <= rec_map->records_count);
+
+	while (src_idx < rec_map->records_count) {
+		/* move as much as possible within a single chunk */
+		n = MAIL_INDEX_RECORD_CHUNK_COUNT -
+			I_MAX(dest_idx & MAIL_INDEX_RECORD_CHUNK_MASK,
+			      src_idx & MAIL_INDEX_RECORD_CHUNK_MASK);
+		n = I_MIN(n, rec_map->records_count - src_idx);
+
+		/* get dest first, because it may replace the chunk that src
+		   also points to */
+		dest = mail_index_map_modify_idx(map, dest_idx);
+		memmove(dest, MAIL_INDEX_MAP_IDX(map, src_idx),
+			n * map->hdr.record_size);
+		dest_idx += n;
+		src_idx += n;
+	}
+	mail_index_record_map_truncate(rec_map, dest_idx);
+}
+
 static void mail_index_record_map_free(struct mail_index_map *map,
 				       struct mail_index_record_map *rec_map)
 {
-	if (rec_map->buffer != NULL) {
-		i_assert(rec_map->mmap_base == NULL);
-		buffer_free(&rec_map->buffer);
-	} else if (rec_map->mmap_base != NULL) {
-		i_assert(rec_map->buffer == NULL);
+	mail_index_record_map_set_chunks_count(rec_map, 0);
+	i_free(rec_map->chunks);
+	if (rec_map->mmap_base != NULL) {
 		if (munmap(rec_map->mmap_base, rec_map->mmap_size) < 0)
 			mail_index_set_syscall_error(map->index, "munmap()");
 		rec_map->mmap_base = NULL;
@@ -324,13 +546,23 @@ static void mail_index_map_copy_records(struct mail_index_record_map *dest,
 					const struct mail_index_record_map *src,
 					unsigned int record_size)
 {
-	size_t size;
+	unsigned int i;
 
-	size = src->records_count * record_size;
-	dest->buffer = buffer_create_dynamic(default_pool, I_MIN(size, 1024));
-	buffer_append(dest->buffer, src->records, size);
+	if (src->mmap_base != NULL) {
+		/* mmaped records are contiguous */
+		mail_index_record_map_set_records(dest, record_size,
+			src->records_count == 0 ? NULL : src->chunks[0],
+			src->records_count);
+		return;
+	}
 
-	dest->records = buffer_get_modifiable_data(dest->buffer, NULL);
+	/* share the chunks. they get copied only when they're modified. */
+	i_assert(dest->chunks_count == 0);
+	mail_index_record_map_set_chunks_count(dest, src->chunks_count);
+	for (i = 0; i < src->chunks_count; i++) {
+		dest->chunks[i] = src->chunks[i];
+		MAIL_INDEX_RECORD_CHUNK(src->chunks[i])->refcount++;
+	}
 	dest->records_count = src->records_count;
 }
 
@@ -383,11 +615,9 @@ struct mail_index_map *mail_index_map_clone(const struct mail_index_map *map)
 	mem_map = i_new(struct mail_index_map, 1);
 	mem_map->index = map->index;
 	mem_map->refcount = 1;
-	if (map->rec_map == NULL) {
+	if (map->rec_map == NULL)
 		mem_map->rec_map = mail_index_record_map_alloc(mem_map);
-		mem_map->rec_map->buffer =
-			buffer_create_dynamic(default_pool, 1024);
-	} else {
+	else {
 		mem_map->rec_map = map->rec_map;
 		array_append(&mem_map->rec_map->maps, &mem_map, 1);
 	}
@@ -440,15 +670,14 @@ void mail_index_record_map_move_to_private(struct mail_index_map *map)
 	}
 
 	if (new_map->records_count != map->hdr.messages_count) {
-		new_map->records_count = map->hdr.messages_count;
+		mail_index_record_map_truncate(new_map,
+					       map->hdr.messages_count);
 		if (new_map->records_count == 0)
 			new_map->last_appended_uid = 0;
 		else {
 			rec = MAIL_INDEX_MAP_IDX(map, new_map->records_count-1);
 			new_map->last_appended_uid = rec->uid;
 		}
-		buffer_set_used_size(new_map->buffer, new_map->records_count *
-				     map->hdr.record_size);
 	}
 }
 
@@ -499,14 +728,11 @@ static uint32_t mail_index_bsearch_uid(struct mail_index_map *map,
 				       uint32_t uid, uint32_t left_idx,
 				       int nearest_side)
 {
-	const struct mail_index_record *rec_base, *rec;
-	uint32_t idx, right_idx, record_size;
+	const struct mail_index_record *rec;
+	uint32_t idx, right_idx;
 
 	i_assert(map->hdr.messages_count <= map->rec_map->records_count);
 
-	rec_base = map->rec_map->records;
-	record_size = map->hdr.record_size;
-
 	idx = left_idx;
 	right_idx = I_MIN(map->hdr.messages_count, uid);
 
@@ -514,7 +740,7 @@ static uint32_t mail_index_bsearch_uid(struct mail_index_map *map,
 	while (left_idx < right_idx) {
 		idx = (left_idx + right_idx) / 2;
 
-                rec = CONST_PTR_OFFSET(rec_base, idx * record_size);
+		rec = MAIL_INDEX_MAP_IDX(map, idx);
 		if (rec->uid < uid)
 			left_idx = idx+1;
 		else if (rec->uid > uid)
@@ -524,7 +750,7 @@ static uint32_t mail_index_bsearch_uid(struct mail_index_map *map,
 	}
 	i_assert(idx < map->hdr.messages_count);
 
-	rec = CONST_PTR_OFFSET(rec_base, idx * record_size);
+	rec = MAIL_INDEX_MAP_IDX(map, idx);
 	if (rec->uid != uid) {
 		if (nearest_side > 0) {
 			/* we want uid or larger */
@@ -210,6 +210,8 @@ int mail_index_modseq_set(struct mail_index_view *view,
 	if (*modseqp > min_modseq)
 		return 0;
 	else {
+		rec = mail_index_map_modify_idx(view->map, seq-1);
+		modseqp = PTR_OFFSET(rec, ext->record_offset);
 		*modseqp = min_modseq;
 		return 1;
 	}
@@ -306,8 +308,11 @@ mail_index_modseq_update(struct mail_index_modseq_sync *ctx,
 	for (; seq1 <= seq2; seq1++) {
 		rec = MAIL_INDEX_MAP_IDX(ctx->view->map, seq1-1);
 		modseqp = PTR_OFFSET(rec, ext->record_offset);
-		if (*modseqp == 0 || (nonzeros && *modseqp < modseq))
+		if (*modseqp == 0 || (nonzeros && *modseqp < modseq)) {
+			rec = mail_index_map_modify_idx(ctx->view->map, seq1-1);
+			modseqp = PTR_OFFSET(rec, ext->record_offset);
 			*modseqp = modseq;
+		}
 	}
 }
 
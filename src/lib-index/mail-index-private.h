@@ -34,9 +34,20 @@ struct mail_index_sync_map_ctx;
 #define MAIL_INDEX_MAP_IS_IN_MEMORY(map) \
 	((map)->rec_map->mmap_base == NULL)
 
+/* Records are stored in chunks of this many records, so that a record map
+   can share the unmodified chunks with other record maps. */
+#define MAIL_INDEX_RECORD_CHUNK_SHIFT 8
+#define MAIL_INDEX_RECORD_CHUNK_COUNT (1U << MAIL_INDEX_RECORD_CHUNK_SHIFT)
+#define MAIL_INDEX_RECORD_CHUNK_MASK (MAIL_INDEX_RECORD_CHUNK_COUNT - 1)
+
+/* Returns the record for reading. Use mail_index_map_modify_idx() for
+   records that are going to be modified. */
 #define MAIL_INDEX_MAP_IDX(map, idx) \
 	((struct mail_index_record *) \
-	 PTR_OFFSET((map)->rec_map->records, (idx) * (map)->hdr.record_size))
+	 PTR_OFFSET((map)->rec_map->chunks[(idx) >> \
+					   MAIL_INDEX_RECORD_CHUNK_SHIFT], \
+		    ((idx) & MAIL_INDEX_RECORD_CHUNK_MASK) * \
+		    (map)->hdr.record_size))
 
 #define MAIL_TRANSACTION_FLAG_UPDATE_IS_INTERNAL(u) \
 	((((u)->add_flags | (u)->remove_flags) & MAIL_INDEX_FLAGS_MASK) == 0 && \
@@ -120,9 +131,12 @@ struct mail_index_record_map {
 	void *mmap_base;
 	size_t mmap_size, mmap_used_size;
 
-	buffer_t *buffer;
-
-	void *records; /* struct mail_index_record[] */
+	/* struct mail_index_record[MAIL_INDEX_RECORD_CHUNK_COUNT] chunks.
+	   With mmap_base these point directly to the mmaped records.
+	   Otherwise they're reference counted and shared with other record
+	   maps until modified. */
+	void **chunks;
+	unsigned int chunks_count, chunks_alloc;
 	unsigned int records_count;
 
 	struct mail_index_map_modseq *modseq;
@@ -290,6 +304,28 @@ struct mail_index_map *mail_index_map_clone(const struct mail_index_map *map);
 void mail_index_record_map_move_to_private(struct mail_index_map *map);
 /* Move a mmaped map to memory. */
 void mail_index_map_move_to_memory(struct mail_index_map *map);
+/* Point the record chunks to the mmaped records after header_size. */
+void
+mail_index_record_map_set_mmap_records(struct mail_index_record_map *rec_map,
+				       unsigned int header_size,
+				       unsigned int record_size);
+/* Replace all records in an in-memory record map with copies of the given
+   records. If records is NULL, they're zero-filled instead. */
+void mail_index_record_map_set_records(struct mail_index_record_map *rec_map,
+				       unsigned int record_size,
+				       const void *records, unsigned int count);
+/* Like MAIL_INDEX_MAP_IDX(), but the returned record can be modified. If the
+   record's chunk is still shared with another record map, it's copied
+   first. */
+struct mail_index_record *
+mail_index_map_modify_idx(struct mail_index_map *map, uint32_t idx);
+/* Returns space for a new record after the last record. records_count
+   isn't updated. */
+void *mail_index_map_append_space(struct mail_index_map *map);
+/* Delete count records starting from idx and move the following records
+   backwards. */
+void mail_index_map_delete_records(struct mail_index_map *map,
+				   uint32_t idx, uint32_t count);
 void mail_index_fchown(struct mail_index *index, int fd, const char *path);
 
 bool mail_index_map_lookup_ext(struct mail_index_map *map, const char *name,
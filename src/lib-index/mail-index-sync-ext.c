@@ -218,9 +218,10 @@ static void sync_ext_reorder(struct mail_index_map *map, uint32_t ext_map_idx,
 	/* copy the records to new buffer */
 	new_buffer_size = map->rec_map->records_count * new_record_size;
 	new_buffer = buffer_create_dynamic(default_pool, new_buffer_size);
-	src = map->rec_map->records;
 	offset = 0;
 	for (rec_idx = 0; rec_idx < map->rec_map->records_count; rec_idx++) {
+		src = MAIL_INDEX_MAP_IDX(map, rec_idx);
+
 		/* write the base record */
 		buffer_write(new_buffer, offset, src,
 			     sizeof(struct mail_index_record));
@@ -231,7 +232,6 @@ static void sync_ext_reorder(struct mail_index_map *map, uint32_t ext_map_idx,
 				     CONST_PTR_OFFSET(src, old_offsets[i]),
 				     copy_sizes[i]);
 		}
-		src = CONST_PTR_OFFSET(src, map->hdr.record_size);
 		offset += new_record_size;
 	}
 
@@ -242,10 +242,10 @@ static void sync_ext_reorder(struct mail_index_map *map, uint32_t ext_map_idx,
 		buffer_append_zero(new_buffer, space);
 	}
 
-	buffer_free(&map->rec_map->buffer);
-	map->rec_map->buffer = new_buffer;
-	map->rec_map->records =
-		buffer_get_modifiable_data(map->rec_map->buffer, NULL);
+	mail_index_record_map_set_records(map->rec_map, new_record_size,
+					  new_buffer->data,
+					  map->rec_map->records_count);
+	buffer_free(&new_buffer);
 	map->hdr.record_size = new_record_size;
 
 	/* update record offsets in headers */
@@ -572,7 +572,7 @@ static void mail_index_sync_ext_clear(struct mail_index_view *view,
 	map->hdr_base = map->hdr_copy_buf->data;
 
 	for (i = 0; i < view->map->rec_map->records_count; i++) {
-		rec = MAIL_INDEX_MAP_IDX(view->map, i);
+		rec = mail_index_map_modify_idx(view->map, i);
 		memset(PTR_OFFSET(rec, ext->record_offset), 0,
 		       ext->record_size);
 	}
@@ -674,7 +674,7 @@ mail_index_sync_ext_rec_update(struct mail_index_sync_map_ctx *ctx,
 	i_assert(ext->record_offset + ext->record_size <=
 		 view->map->hdr.record_size);
 
-	rec = MAIL_INDEX_MAP_IDX(view->map, seq-1);
+	rec = mail_index_map_modify_idx(view->map, seq-1);
 	old_data = PTR_OFFSET(rec, ext->record_offset);
 
 	rext = array_idx(&view->index->extensions, ext->index_idx);
@@ -723,7 +723,7 @@ mail_index_sync_ext_atomic_inc(struct mail_index_sync_map_ctx *ctx,
 	i_assert(ext->record_offset + ext->record_size <=
 		 view->map->hdr.record_size);
 
-	rec = MAIL_INDEX_MAP_IDX(view->map, seq-1);
+	rec = mail_index_map_modify_idx(view->map, seq-1);
 	data = PTR_OFFSET(rec, ext->record_offset);
 
 	min_value = u->diff >= 0 ? 0 : (uint64_t)(-(int64_t)u->diff);
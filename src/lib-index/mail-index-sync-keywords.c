@@ -226,20 +226,29 @@ keywords_update_records(struct mail_index_sync_map_ctx *ctx,
 
 	i_assert(data_offset >= sizeof(struct mail_index_record));
 
+	/* don't copy shared record chunks for messages whose keyword
+	   doesn't actually change */
 	switch (type) {
 	case MODIFY_ADD:
 		for (seq1--; seq1 < seq2; seq1++) {
-			rec = MAIL_INDEX_MAP_IDX(view->map, seq1);
+			data = PTR_OFFSET(MAIL_INDEX_MAP_IDX(view->map, seq1),
+					  data_offset);
+			if ((*data & data_mask) != 0)
+				continue;
+			rec = mail_index_map_modify_idx(view->map, seq1);
 			data = PTR_OFFSET(rec, data_offset);
 			*data |= data_mask;
 		}
 		break;
 	case MODIFY_REMOVE:
-		data_mask = ~data_mask;
 		for (seq1--; seq1 < seq2; seq1++) {
-			rec = MAIL_INDEX_MAP_IDX(view->map, seq1);
+			data = PTR_OFFSET(MAIL_INDEX_MAP_IDX(view->map, seq1),
+					  data_offset);
+			if ((*data & data_mask) == 0)
+				continue;
+			rec = mail_index_map_modify_idx(view->map, seq1);
 			data = PTR_OFFSET(rec, data_offset);
-			*data &= data_mask;
+			*data &= ~data_mask;
 		}
 		break;
 	default:
@@ -338,7 +347,7 @@ mail_index_sync_keywords_reset(struct mail_index_sync_map_ctx *ctx,
 
 		mail_index_modseq_reset_keywords(ctx->modseq_ctx, seq1, seq2);
 		for (seq1--; seq1 < seq2; seq1++) {
-			rec = MAIL_INDEX_MAP_IDX(map, seq1);
+			rec = mail_index_map_modify_idx(map, seq1);
 			memset(PTR_OFFSET(rec, ext->record_offset),
 			       0, ext->record_size);
 		}
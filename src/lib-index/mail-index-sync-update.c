@@ -14,6 +14,15 @@
    reading the main index */
 #define MAIL_INDEX_SYNC_MIN_READ_INDEX_SIZE 2048
 
+/* Header counter and lowwater changes caused by a range of records, so they
+   can be applied to the header(s) once instead of for each record. */
+struct mail_index_sync_count_changes {
+	unsigned int seen_added, seen_removed;
+	unsigned int deleted_added, deleted_removed;
+	/* lowest UIDs that are unseen/deleted after the change, 0 if none */
+	uint32_t first_unseen_uid, first_deleted_uid;
+};
+
 static void
 mail_index_sync_update_log_offset(struct mail_index_sync_map_ctx *ctx,
 				  struct mail_index_map *map, bool eol)
@@ -141,6 +150,116 @@ mail_index_header_update_counts(struct mail_index_header *hdr,
 	return 0;
 }
 
+static void
+mail_index_sync_count_changes_add(struct mail_index_sync_count_changes *changes,
+				  uint32_t uid, uint8_t old_flags,
+				  uint8_t new_flags)
+{
+	if (((old_flags ^ new_flags) & MAIL_SEEN) != 0) {
+		if ((old_flags & MAIL_SEEN) != 0)
+			changes->seen_removed++;
+		else
+			changes->seen_added++;
+	}
+	if (((old_flags ^ new_flags) & MAIL_DELETED) != 0) {
+		if ((old_flags & MAIL_DELETED) != 0)
+			changes->deleted_removed++;
+		else
+			changes->deleted_added++;
+	}
+	if ((new_flags & MAIL_SEEN) == 0 && changes->first_unseen_uid == 0)
+		changes->first_unseen_uid = uid;
+	if ((new_flags & MAIL_DELETED) != 0 && changes->first_deleted_uid == 0)
+		changes->first_deleted_uid = uid;
+}
+
+static int
+mail_index_header_apply_count_changes(struct mail_index_header *hdr,
+			const struct mail_index_sync_count_changes *changes,
+			const char **error_r)
+{
+	/* the changes come from a single flag update or expunge, so the same
+	   flag can't have been both added and removed. this allows the
+	   lowwaters to be updated before the counters, just like when
+	   handling the records one at a time. */
+	if (changes->first_unseen_uid != 0 &&
+	    changes->first_unseen_uid < hdr->first_unseen_uid_lowwater)
+		hdr->first_unseen_uid_lowwater = changes->first_unseen_uid;
+	if (changes->first_deleted_uid != 0 &&
+	    changes->first_deleted_uid < hdr->first_deleted_uid_lowwater)
+		hdr->first_deleted_uid_lowwater = changes->first_deleted_uid;
+
+	if (changes->seen_removed > 0) {
+		if (hdr->seen_messages_count < changes->seen_removed) {
+			*error_r = "Seen counter wrong";
+			return -1;
+		}
+		hdr->seen_messages_count -= changes->seen_removed;
+	}
+	if (changes->seen_added > 0) {
+		if (hdr->seen_messages_count + changes->seen_added >
+		    hdr->messages_count) {
+			*error_r = "Seen counter wrong";
+			return -1;
+		}
+		hdr->seen_messages_count += changes->seen_added;
+		if (hdr->seen_messages_count == hdr->messages_count)
+			hdr->first_unseen_uid_lowwater = hdr->next_uid;
+	}
+
+	if (changes->deleted_added > 0) {
+		hdr->deleted_messages_count += changes->deleted_added;
+		if (hdr->deleted_messages_count > hdr->messages_count) {
+			*error_r = "Deleted counter wrong";
+			return -1;
+		}
+	}
+	if (changes->deleted_removed > 0) {
+		if (hdr->deleted_messages_count < changes->deleted_removed ||
+		    hdr->deleted_messages_count > hdr->messages_count) {
+			*error_r = "Deleted counter wrong";
+			return -1;
+		}
+		hdr->deleted_messages_count -= changes->deleted_removed;
+		if (hdr->deleted_messages_count == 0)
+			hdr->first_deleted_uid_lowwater = hdr->next_uid;
+	}
+	return 0;
+}
+
+static bool
+mail_index_sync_maps_have_uid(struct mail_index_sync_map_ctx *ctx,
+			      uint32_t uid)
+{
+	struct mail_index_map *const *mapp;
+
+	array_foreach(&ctx->view->map->rec_map->maps, mapp) {
+		if (uid >= (*mapp)->hdr.next_uid)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void
+mail_index_sync_header_apply_count_changes(struct mail_index_sync_map_ctx *ctx,
+		const struct mail_index_sync_count_changes *changes, bool all)
+{
+	struct mail_index_map *const *mapp;
+	const char *error;
+
+	if (!all) {
+		if (mail_index_header_apply_count_changes(&ctx->view->map->hdr,
+							  changes, &error) < 0)
+			mail_index_sync_set_corrupted(ctx, "%s", error);
+		return;
+	}
+	array_foreach(&ctx->view->map->rec_map->maps, mapp) {
+		if (mail_index_header_apply_count_changes(&(*mapp)->hdr,
+							  changes, &error) < 0)
+			mail_index_sync_set_corrupted(ctx, "%s", error);
+	}
+}
+
 static void
 mail_index_sync_header_update_counts_all(struct mail_index_sync_map_ctx *ctx,
 					 uint32_t uid,
@@ -238,6 +357,7 @@ sync_expunge(struct mail_index_sync_map_ctx *ctx, uint32_t uid1, uint32_t uid2)
 {
 	struct mail_index_map *map;
 	struct mail_index_record *rec;
+	struct mail_index_sync_count_changes changes;
 	uint32_t seq_count, seq, seq1, seq2;
 
 	if (!mail_index_lookup_seq_range(ctx->view, uid1, uid2, &seq1, &seq2)) {
@@ -248,36 +368,29 @@ sync_expunge(struct mail_index_sync_map_ctx *ctx, uint32_t uid1, uint32_t uid2)
 	sync_expunge_call_handlers(ctx, seq1, seq2);
 
 	map = mail_index_sync_get_atomic_map(ctx);
-	for (seq = seq1; seq <= seq2; seq++) {
-		rec = MAIL_INDEX_MAP_IDX(map, seq-1);
-		mail_index_sync_header_update_counts(ctx, rec->uid, rec->flags,
-						     0, FALSE);
+	rec = MAIL_INDEX_MAP_IDX(map, seq2-1);
+	if (rec->uid >= map->hdr.next_uid) {
+		mail_index_sync_set_corrupted(ctx, "uid %u >= next_uid %u",
+					      rec->uid, map->hdr.next_uid);
+	} else {
+		memset(&changes, 0, sizeof(changes));
+		for (seq = seq1; seq <= seq2; seq++) {
+			rec = MAIL_INDEX_MAP_IDX(map, seq-1);
+			mail_index_sync_count_changes_add(&changes, rec->uid,
+							  rec->flags, 0);
+		}
+		/* expunges don't move the lowwaters */
+		changes.first_unseen_uid = 0;
+		mail_index_sync_header_apply_count_changes(ctx, &changes,
+							   FALSE);
 	}
 
-	/* @UNSAFE */
-	memmove(MAIL_INDEX_MAP_IDX(map, seq1-1),
-		MAIL_INDEX_MAP_IDX(map, seq2),
-		(map->rec_map->records_count - seq2) * map->hdr.record_size);
-
 	seq_count = seq2 - seq1 + 1;
-	map->rec_map->records_count -= seq_count;
+	mail_index_map_delete_records(map, seq1-1, seq_count);
 	map->hdr.messages_count -= seq_count;
 	mail_index_modseq_expunge(ctx->modseq_ctx, seq1, seq2);
 }
 
-static void *sync_append_record(struct mail_index_map *map)
-{
-	size_t append_pos;
-	void *ret;
-
-	append_pos = map->rec_map->records_count * map->hdr.record_size;
-	ret = buffer_get_space_unsafe(map->rec_map->buffer, append_pos,
-				      map->hdr.record_size);
-	map->rec_map->records =
-		buffer_get_modifiable_data(map->rec_map->buffer, NULL);
-	return ret;
-}
-
 static bool sync_update_ignored_change(struct mail_index_sync_map_ctx *ctx)
 {
 	struct mail_index_transaction_commit_result *result =
@@ -372,9 +485,7 @@ static int sync_append(const struct mail_index_record *rec,
 		i_assert(old_rec->uid == rec->uid);
 		new_flags = old_rec->flags;
 	} else {
-		/* don't rely on buffer->used being at the correct position.
-		   at least expunges can move it */
-		dest = sync_append_record(map);
+		dest = mail_index_map_append_space(map);
 		memcpy(dest, rec, sizeof(*rec));
 		memset(PTR_OFFSET(dest, sizeof(*rec)), 0,
 		       map->hdr.record_size - sizeof(*rec));
@@ -403,7 +514,8 @@ static int sync_flag_update(const struct mail_transaction_flag_update *u,
 {
 	struct mail_index_view *view = ctx->view;
 	struct mail_index_record *rec;
-	uint8_t flag_mask, old_flags;
+	struct mail_index_sync_count_changes changes;
+	uint8_t flag_mask, old_flags, new_flags;
 	uint32_t idx, seq1, seq2;
 
 	if (!mail_index_lookup_seq_range(view, u->uid1, u->uid2, &seq1, &seq2))
@@ -425,11 +537,34 @@ static int sync_flag_update(const struct mail_transaction_flag_update *u,
 		/* we're not modifying any counted/lowwatered flags */
 		for (idx = seq1-1; idx < seq2; idx++) {
 			rec = MAIL_INDEX_MAP_IDX(view->map, idx);
-			rec->flags = (rec->flags & flag_mask) | u->add_flags;
+			new_flags = (rec->flags & flag_mask) | u->add_flags;
+			if (rec->flags != new_flags) {
+				/* don't copy shared chunks unnecessarily */
+				rec = mail_index_map_modify_idx(view->map, idx);
+				rec->flags = new_flags;
+			}
 		}
-	} else {
+	} else if (mail_index_sync_maps_have_uid(ctx,
+			MAIL_INDEX_MAP_IDX(view->map, seq2-1)->uid)) {
+		/* all the maps sharing the records have all of these
+		   messages, so the header changes can be summed up and
+		   applied once */
+		memset(&changes, 0, sizeof(changes));
 		for (idx = seq1-1; idx < seq2; idx++) {
 			rec = MAIL_INDEX_MAP_IDX(view->map, idx);
+			old_flags = rec->flags;
+			new_flags = (old_flags & flag_mask) | u->add_flags;
+			if (old_flags != new_flags) {
+				rec = mail_index_map_modify_idx(view->map, idx);
+				rec->flags = new_flags;
+			}
+			mail_index_sync_count_changes_add(&changes, rec->uid,
+							  old_flags, new_flags);
+		}
+		mail_index_sync_header_apply_count_changes(ctx, &changes, TRUE);
+	} else {
+		for (idx = seq1-1; idx < seq2; idx++) {
+			rec = mail_index_map_modify_idx(view->map, idx);
 
 			old_flags = rec->flags;
 			rec->flags = (rec->flags & flag_mask) | u->add_flags;
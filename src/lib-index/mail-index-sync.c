@@ -273,7 +273,8 @@ mail_index_need_sync(struct mail_index *index, enum mail_index_sync_flags flags,
 		return TRUE;
 
 	/* already synced */
-	return mail_cache_need_compress(index->cache);
+	return mail_cache_need_compress(index->cache) ||
+		mail_cache_stats_need_flush(index->cache);
 }
 
 static int
@@ -715,9 +716,10 @@ void mail_index_sync_reset(struct mail_index_sync_ctx *ctx)
 		sync_list->idx = 0;
 }
 
-static void mail_index_sync_end(struct mail_index_sync_ctx **_ctx)
+static int mail_index_sync_end(struct mail_index_sync_ctx **_ctx)
 {
         struct mail_index_sync_ctx *ctx = *_ctx;
+	int ret;
 
 	i_assert(ctx->index->syncing);
 
@@ -725,12 +727,17 @@ static void mail_index_sync_end(struct mail_index_sync_ctx **_ctx)
 
 	ctx->index->syncing = FALSE;
 	mail_transaction_log_sync_unlock(ctx->index->log);
+	/* all the transactions committed during the sync are flushed
+	   with a single fdatasync(). with a successful commit this was
+	   already done before writing dovecot.index. */
+	ret = mail_transaction_log_fsync_head(ctx->index->log);
 
 	mail_index_view_close(&ctx->view);
 	mail_index_transaction_rollback(&ctx->sync_trans);
 	if (array_is_created(&ctx->sync_list))
 		array_free(&ctx->sync_list);
 	i_free(ctx);
+	return ret;
 }
 
 static void
@@ -793,12 +800,18 @@ int mail_index_sync_commit(struct mail_index_sync_ctx **_ctx)
 	}
 
 	mail_index_sync_update_mailbox_offset(ctx);
-	if (mail_cache_need_compress(index->cache)) {
+	if (mail_cache_need_compress(index->cache) &&
+	    !mail_cache_compress_delay(index->cache)) {
 		/* if cache compression fails, we don't really care.
 		   the cache offsets are updated only if the compression was
 		   successful. */
 		(void)mail_cache_compress(index->cache, ctx->ext_trans);
 	}
+	if (mail_cache_stats_need_flush(index->cache)) {
+		/* write the statistics only once there are enough of them,
+		   so a sync doesn't rewrite the header each time */
+		mail_cache_stats_flush(index->cache, ctx->ext_trans);
+	}
 
 	if ((ctx->flags & MAIL_INDEX_SYNC_FLAG_DROP_RECENT) != 0) {
 		next_uid = mail_index_transaction_get_next_uid(ctx->ext_trans);
@@ -811,7 +824,7 @@ int mail_index_sync_commit(struct mail_index_sync_ctx **_ctx)
 	}
 
 	if (mail_index_transaction_commit(&ctx->ext_trans) < 0) {
-		mail_index_sync_end(&ctx);
+		(void)mail_index_sync_end(&ctx);
 		return -1;
 	}
 
@@ -830,6 +843,12 @@ int mail_index_sync_commit(struct mail_index_sync_ctx **_ctx)
 		ret = -1;
 	index->sync_commit_result = NULL;
 
+	/* dovecot.index must not point to log offsets that aren't on disk
+	   yet, so the transactions committed during the sync are flushed
+	   before it's written */
+	if (mail_transaction_log_fsync_head(index->log) < 0)
+		ret = -1;
+
 	want_rotate = mail_transaction_log_want_rotate(index->log);
 	if (ret == 0 &&
 	    (want_rotate || mail_index_sync_want_index_write(index))) {
@@ -837,7 +856,8 @@ int mail_index_sync_commit(struct mail_index_sync_ctx **_ctx)
 		index->index_min_write = FALSE;
 		mail_index_write(index, want_rotate);
 	}
-	mail_index_sync_end(_ctx);
+	if (mail_index_sync_end(_ctx) < 0)
+		ret = -1;
 	return ret;
 }
 
@@ -845,7 +865,7 @@ void mail_index_sync_rollback(struct mail_index_sync_ctx **ctx)
 {
 	if ((*ctx)->ext_trans != NULL)
 		mail_index_transaction_rollback(&(*ctx)->ext_trans);
-	mail_index_sync_end(ctx);
+	(void)mail_index_sync_end(ctx);
 }
 
 void mail_index_sync_flags_apply(const struct mail_index_sync_rec *sync_rec,
@@ -61,7 +61,7 @@ static int mail_index_recreate(struct mail_index *index)
 {
 	struct mail_index_map *map = index->map;
 	struct ostream *output;
-	unsigned int base_size;
+	unsigned int i, base_size;
 	const char *path;
 	int ret = 0, fd;
 
@@ -79,8 +79,13 @@ static int mail_index_recreate(struct mail_index *index)
 	o_stream_nsend(output, &map->hdr, base_size);
 	o_stream_nsend(output, CONST_PTR_OFFSET(map->hdr_base, base_size),
 		       map->hdr.header_size - base_size);
-	o_stream_nsend(output, map->rec_map->records,
-		       map->rec_map->records_count * map->hdr.record_size);
+	for (i = 0; i < map->rec_map->records_count;
+	     i += MAIL_INDEX_RECORD_CHUNK_COUNT) {
+		o_stream_nsend(output, MAIL_INDEX_MAP_IDX(map, i),
+			       I_MIN(map->rec_map->records_count - i,
+				     MAIL_INDEX_RECORD_CHUNK_COUNT) *
+			       map->hdr.record_size);
+	}
 	o_stream_nflush(output);
 	if (o_stream_nfinish(output) < 0) {
 		mail_index_file_set_syscall_error(index, path, "write()");
@@ -90,12 +90,12 @@ static int log_buffer_write(struct mail_transaction_log_append_ctx *ctx)
 	if ((ctx->want_fsync &&
 	     file->log->index->fsync_mode != FSYNC_MODE_NEVER) ||
 	    file->log->index->fsync_mode == FSYNC_MODE_ALWAYS) {
-		if (fdatasync(file->fd) < 0) {
-			mail_index_file_set_syscall_error(ctx->log->index,
-							  file->filepath,
-							  "fdatasync()");
-			return log_buffer_move_to_memory(ctx);
-		}
+		/* fdatasync() only after the log is unlocked. this way other
+		   processes can append to the log while we're waiting, and
+		   their fdatasync()s get merged with ours. if the log is
+		   sync-locked, all the transactions committed during the
+		   sync share a single fdatasync() when the sync finishes. */
+		file->fsync_pending = TRUE;
 	}
 
 	if (file->mmap_base == NULL && file->buffer != NULL) {
@@ -109,6 +109,7 @@ static int log_buffer_write(struct mail_transaction_log_append_ctx *ctx)
 			      ctx->output->used);
 	}
 	file->sync_offset += ctx->output->used;
+	mail_transaction_log_file_update_committed_size(file);
 	return 0;
 }
 
@@ -198,6 +199,40 @@ mail_transaction_log_append_locked(struct mail_transaction_log_append_ctx *ctx)
 	return 0;
 }
 
+int mail_transaction_log_file_fsync(struct mail_transaction_log_file *file)
+{
+	if (!file->fsync_pending)
+		return 0;
+	file->fsync_pending = FALSE;
+
+	if (MAIL_TRANSACTION_LOG_FILE_IN_MEMORY(file))
+		return 0;
+	if (fdatasync(file->fd) < 0) {
+		mail_index_file_set_syscall_error(file->log->index,
+						  file->filepath,
+						  "fdatasync()");
+		return -1;
+	}
+	return 0;
+}
+
+int mail_transaction_log_fsync_head(struct mail_transaction_log *log)
+{
+	struct mail_transaction_log_file *file = log->head;
+
+	if (mail_transaction_log_file_fsync(file) == 0)
+		return 0;
+
+	/* the data may not be on disk. fallback to in-memory indexes, the
+	   same as with write failures. the file was already read up to
+	   sync_offset, so the in-memory copy contains everything that was
+	   written. */
+	if (mail_index_move_to_memory(log->index) < 0)
+		return -1;
+	i_assert(MAIL_TRANSACTION_LOG_FILE_IN_MEMORY(file));
+	return 0;
+}
+
 int mail_transaction_log_append_begin(struct mail_index *index,
 				      enum mail_transaction_type flags,
 				      struct mail_transaction_log_append_ctx **ctx_r)
@@ -226,13 +261,19 @@ int mail_transaction_log_append_commit(struct mail_transaction_log_append_ctx **
 {
 	struct mail_transaction_log_append_ctx *ctx = *_ctx;
 	struct mail_index *index = ctx->log->index;
+	struct mail_transaction_log_file *file = index->log->head;
 	int ret = 0;
 
 	*_ctx = NULL;
 
 	ret = mail_transaction_log_append_locked(ctx);
-	if (!index->log_sync_locked)
-		mail_transaction_log_file_unlock(index->log->head);
+	if (!index->log_sync_locked) {
+		mail_transaction_log_file_unlock(file);
+		/* the transaction is already visible to others, so it can't
+		   be truncated away anymore if fdatasync() fails */
+		if (mail_transaction_log_fsync_head(index->log) < 0)
+			ret = -1;
+	}
 
 	buffer_free(&ctx->output);
 	i_free(ctx);
@@ -2,6 +2,7 @@
 
 #include "lib.h"
 #include "array.h"
+#include "bsearch-insert-pos.h"
 #include "ioloop.h"
 #include "file-dotlock.h"
 #include "nfs-workarounds.h"
@@ -93,6 +94,89 @@ mail_transaction_log_file_alloc(struct mail_transaction_log *log,
 	return file;
 }
 
+static bool
+log_file_use_committed_size(struct mail_transaction_log_file *file)
+{
+#ifdef __ATOMIC_RELEASE
+	/* the header is accessed via mmap, which isn't reliable with
+	   NFS or with whatever other reason mmap was disabled for */
+	return !MAIL_TRANSACTION_LOG_FILE_IN_MEMORY(file) &&
+		file->hdr.hdr_size >= sizeof(struct mail_transaction_log_header) &&
+		(file->log->index->flags &
+		 MAIL_INDEX_OPEN_FLAG_MMAP_DISABLE) == 0 &&
+		!file->log->nfs_flush;
+#else
+	return FALSE;
+#endif
+}
+
+static bool
+log_file_read_committed_size(const struct mail_transaction_log_header *hdr,
+			     uint16_t *seq_r, uoff_t *size_r)
+{
+#ifdef __ATOMIC_RELEASE
+	uint16_t seq;
+
+	*seq_r = __atomic_load_n(&hdr->committed_size_seq, __ATOMIC_ACQUIRE);
+	if ((*seq_r & 1) != 0) {
+		/* being updated */
+		return FALSE;
+	}
+	*size_r = __atomic_load_n(&hdr->committed_size, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	seq = __atomic_load_n(&hdr->committed_size_seq, __ATOMIC_RELAXED);
+	return seq == *seq_r;
+#else
+	return FALSE;
+#endif
+}
+
+void mail_transaction_log_file_update_committed_size(struct mail_transaction_log_file *file)
+{
+#ifdef __ATOMIC_RELEASE
+	struct mail_transaction_log_header *hdr;
+	uint16_t seq;
+
+	i_assert(file->locked);
+
+	if (!log_file_use_committed_size(file) || file->mmap_hdr_failed ||
+	    file->sync_offset > (uint32_t)-1)
+		return;
+
+	if (file->mmap_hdr == NULL) {
+		hdr = mmap(NULL, sizeof(*hdr), PROT_READ | PROT_WRITE,
+			   MAP_SHARED, file->fd, 0);
+		if (hdr == MAP_FAILED) {
+			log_file_set_syscall_error(file, "mmap()");
+			file->mmap_hdr_failed = TRUE;
+			return;
+		}
+		file->mmap_hdr = hdr;
+	}
+	hdr = file->mmap_hdr;
+
+	/* seqlock write. if the previous writer died while updating, the
+	   seq is still odd and we can continue from there. */
+	seq = __atomic_load_n(&hdr->committed_size_seq, __ATOMIC_RELAXED) | 1;
+	__atomic_store_n(&hdr->committed_size_seq, seq, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&hdr->committed_size, (uint32_t)file->sync_offset,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&hdr->committed_size_seq, (uint16_t)(seq + 1),
+			 __ATOMIC_RELEASE);
+#endif
+}
+
+static void log_file_munmap_hdr(struct mail_transaction_log_file *file)
+{
+	if (file->mmap_hdr == NULL)
+		return;
+
+	if (munmap(file->mmap_hdr, sizeof(*file->mmap_hdr)) < 0)
+		log_file_set_syscall_error(file, "munmap()");
+	file->mmap_hdr = NULL;
+}
+
 void mail_transaction_log_file_free(struct mail_transaction_log_file **_file)
 {
 	struct mail_transaction_log_file *file = *_file;
@@ -102,6 +186,7 @@ void mail_transaction_log_file_free(struct mail_transaction_log_file **_file)
 	*_file = NULL;
 
 	mail_transaction_log_file_unlock(file);
+	(void)mail_transaction_log_file_fsync(file);
 
 	for (p = &file->log->files; *p != NULL; p = &(*p)->next) {
 		if (*p == file) {
@@ -115,11 +200,14 @@ void mail_transaction_log_file_free(struct mail_transaction_log_file **_file)
 
 	if (file->buffer != NULL) 
 		buffer_free(&file->buffer);
+	if (array_is_created(&file->modseq_checkpoints))
+		array_free(&file->modseq_checkpoints);
 
 	if (file->mmap_base != NULL) {
 		if (munmap(file->mmap_base, file->mmap_size) < 0)
 			log_file_set_syscall_error(file, "munmap()");
 	}
+	log_file_munmap_hdr(file);
 
 	if (file->fd != -1) {
 		if (close(file->fd) < 0)
@@ -1109,6 +1197,91 @@ modseq_cache_get_modseq(struct mail_transaction_log_file *file, uint64_t modseq)
 	return &file->modseq_cache[best];
 }
 
+static int modseq_checkpoint_cmp(const uoff_t *offset,
+				 const struct modseq_cache *checkpoint)
+{
+	if (*offset < checkpoint->offset)
+		return -1;
+	return *offset > checkpoint->offset ? 1 : 0;
+}
+
+static void
+modseq_checkpoint_update(struct mail_transaction_log_file *file,
+			 uoff_t prev_offset, uoff_t offset, uint64_t modseq)
+{
+	const struct modseq_cache *checkpoints;
+	struct modseq_cache checkpoint;
+	unsigned int idx, count;
+
+	if (prev_offset / LOG_FILE_MODSEQ_CHECKPOINT_INTERVAL ==
+	    offset / LOG_FILE_MODSEQ_CHECKPOINT_INTERVAL) {
+		/* didn't cross a checkpoint boundary */
+		return;
+	}
+
+	if (!array_is_created(&file->modseq_checkpoints)) {
+		i_array_init(&file->modseq_checkpoints, 32);
+		idx = 0;
+	} else {
+		if (array_bsearch_insert_pos(&file->modseq_checkpoints,
+					     &offset, modseq_checkpoint_cmp,
+					     &idx))
+			return;
+		checkpoints = array_get(&file->modseq_checkpoints, &count);
+		if (idx > 0 && checkpoints[idx-1].offset /
+		    LOG_FILE_MODSEQ_CHECKPOINT_INTERVAL ==
+		    offset / LOG_FILE_MODSEQ_CHECKPOINT_INTERVAL) {
+			/* already have one for this interval */
+			return;
+		}
+	}
+
+	checkpoint.offset = offset;
+	checkpoint.highest_modseq = modseq;
+	array_insert(&file->modseq_checkpoints, idx, &checkpoint, 1);
+}
+
+static const struct modseq_cache *
+modseq_checkpoint_get_offset(struct mail_transaction_log_file *file,
+			     uoff_t offset)
+{
+	const struct modseq_cache *checkpoints;
+	unsigned int idx, count;
+
+	if (!array_is_created(&file->modseq_checkpoints))
+		return NULL;
+
+	/* find the last checkpoint at or before offset */
+	checkpoints = array_get(&file->modseq_checkpoints, &count);
+	if (array_bsearch_insert_pos(&file->modseq_checkpoints, &offset,
+				     modseq_checkpoint_cmp, &idx))
+		return &checkpoints[idx];
+	return idx == 0 ? NULL : &checkpoints[idx-1];
+}
+
+static const struct modseq_cache *
+modseq_checkpoint_get_modseq(struct mail_transaction_log_file *file,
+			     uint64_t modseq)
+{
+	const struct modseq_cache *checkpoints;
+	unsigned int idx, left_idx, right_idx;
+
+	if (!array_is_created(&file->modseq_checkpoints))
+		return NULL;
+
+	/* find the last checkpoint whose highest_modseq is below modseq */
+	checkpoints = array_get(&file->modseq_checkpoints, &right_idx);
+	left_idx = 0;
+	while (left_idx < right_idx) {
+		idx = (left_idx + right_idx) / 2;
+		if (checkpoints[idx].highest_modseq < modseq)
+			left_idx = idx + 1;
+		else
+			right_idx = idx;
+	}
+	return left_idx == 0 ? NULL : &checkpoints[left_idx-1];
+}
+
 static int
 log_get_synced_record(struct mail_transaction_log_file *file, uoff_t *offset,
 		      const struct mail_transaction_header **hdr_r)
@@ -1141,7 +1314,8 @@ int mail_transaction_log_file_get_highest_modseq_at(
 {
 	const struct mail_transaction_header *hdr;
 	struct modseq_cache *cache;
-	uoff_t cur_offset;
+	const struct modseq_cache *checkpoint;
+	uoff_t cur_offset, prev_offset;
 	uint64_t cur_modseq;
 	int ret;
 
@@ -1167,6 +1341,16 @@ int mail_transaction_log_file_get_highest_modseq_at(
 		cur_modseq = cache->highest_modseq;
 	}
 
+	checkpoint = modseq_checkpoint_get_offset(file, offset);
+	if (checkpoint != NULL && checkpoint->offset > cur_offset) {
+		if (checkpoint->offset == offset) {
+			*highest_modseq_r = checkpoint->highest_modseq;
+			return 0;
+		}
+		cur_offset = checkpoint->offset;
+		cur_modseq = checkpoint->highest_modseq;
+	}
+
 	ret = mail_transaction_log_file_map(file, cur_offset, offset);
 	if (ret <= 0) {
 		if (ret < 0)
@@ -1180,9 +1364,12 @@ int mail_transaction_log_file_get_highest_modseq_at(
 	i_assert(cur_offset >= file->buffer_offset);
 	i_assert(cur_offset + file->buffer->used >= offset);
 	while (cur_offset < offset) {
+		prev_offset = cur_offset;
 		if (log_get_synced_record(file, &cur_offset, &hdr) < 0)
 			return- 1;
 		mail_transaction_update_modseq(hdr, hdr + 1, &cur_modseq);
+		modseq_checkpoint_update(file, prev_offset, cur_offset,
+					 cur_modseq);
 	}
 
 	/* @UNSAFE: cache the value */
@@ -1202,7 +1389,8 @@ int mail_transaction_log_file_get_modseq_next_offset(
 {
 	const struct mail_transaction_header *hdr;
 	struct modseq_cache *cache;
-	uoff_t cur_offset;
+	const struct modseq_cache *checkpoint;
+	uoff_t cur_offset, prev_offset;
 	uint64_t cur_modseq;
 	int ret;
 
@@ -1230,6 +1418,12 @@ int mail_transaction_log_file_get_modseq_next_offset(
 		cur_modseq = cache->highest_modseq;
 	}
 
+	checkpoint = modseq_checkpoint_get_modseq(file, modseq);
+	if (checkpoint != NULL && checkpoint->offset > cur_offset) {
+		cur_offset = checkpoint->offset;
+		cur_modseq = checkpoint->highest_modseq;
+	}
+
 	ret = mail_transaction_log_file_map(file, cur_offset,
 					    file->sync_offset);
 	if (ret <= 0) {
@@ -1243,9 +1437,12 @@ int mail_transaction_log_file_get_modseq_next_offset(
 
 	i_assert(cur_offset >= file->buffer_offset);
 	while (cur_offset < file->sync_offset) {
+		prev_offset = cur_offset;
 		if (log_get_synced_record(file, &cur_offset, &hdr) < 0)
 			return -1;
 		mail_transaction_update_modseq(hdr, hdr + 1, &cur_modseq);
+		modseq_checkpoint_update(file, prev_offset, cur_offset,
+					 cur_modseq);
 		if (cur_modseq >= modseq)
 			break;
 	}
@@ -1373,9 +1570,13 @@ mail_transaction_log_file_sync(struct mail_transaction_log_file *file)
 		}
 
 		file->sync_offset += trans_size;
+		modseq_checkpoint_update(file, file->sync_offset - trans_size,
+					 file->sync_offset,
+					 file->sync_highest_modseq);
 	}
 
-	if (file->mmap_base != NULL && !file->locked) {
+	if (file->mmap_base != NULL && !file->locked &&
+	    !file->mmap_committed) {
 		/* Now that all the mmaped pages have page faulted, check if
 		   the file had changed while doing that. Only after the last
 		   page has faulted, the size returned by fstat() can be
@@ -1584,14 +1785,62 @@ log_file_map_check_offsets(struct mail_transaction_log_file *file,
 	return 1;
 }
 
+static void
+log_file_mmap_set_size(struct mail_transaction_log_file *file, size_t size,
+		       bool committed)
+{
+	i_assert(size <= file->mmap_size);
+
+	buffer_create_from_const_data(&file->mmap_buffer,
+				      file->mmap_base, size);
+	file->buffer = &file->mmap_buffer;
+	file->mmap_committed = committed;
+}
+
+static bool
+log_file_mmap_committed(struct mail_transaction_log_file *file,
+			uoff_t end_offset)
+{
+	uint16_t seq;
+	uoff_t size;
+
+	if (file->locked || end_offset == (uoff_t)-1) {
+		/* committed_size is only a lower bound for the file size,
+		   since not all writers update it. the lock owner appends to
+		   sync_offset, so it must see the real EOF. same for callers
+		   that want everything up to EOF. */
+		return FALSE;
+	}
+	if (!log_file_use_committed_size(file) ||
+	    !log_file_read_committed_size(file->mmap_base, &seq, &size))
+		return FALSE;
+
+	if (seq == file->mmap_committed_size_seq ||
+	    size <= file->buffer->used || size > file->mmap_size ||
+	    size < end_offset) {
+		/* not updated since mmaping, no new transactions, they
+		   don't fit to the mmaped area or the wanted offset isn't
+		   known to be committed */
+		return FALSE;
+	}
+	/* transactions up to committed_size are fully written, so they can be
+	   read without fstat()ing or locking the file */
+	log_file_mmap_set_size(file, size, TRUE);
+	return TRUE;
+}
+
 static int
 mail_transaction_log_file_mmap(struct mail_transaction_log_file *file)
 {
+	uoff_t size;
+
 	if (file->buffer != NULL) {
 		/* in case we just switched to mmaping */
 		buffer_free(&file->buffer);
 	}
 	file->mmap_size = file->last_size;
+	if (log_file_use_committed_size(file))
+		file->mmap_size += LOG_FILE_MMAP_EXTRA_SIZE;
 	file->mmap_base = mmap(NULL, file->mmap_size, PROT_READ, MAP_SHARED,
 			       file->fd, 0);
 	if (file->mmap_base == MAP_FAILED) {
@@ -1607,10 +1856,12 @@ mail_transaction_log_file_mmap(struct mail_transaction_log_file *file)
 			log_file_set_syscall_error(file, "madvise()");
 	}
 
-	buffer_create_from_const_data(&file->mmap_buffer,
-				      file->mmap_base, file->mmap_size);
-	file->buffer = &file->mmap_buffer;
 	file->buffer_offset = 0;
+	log_file_mmap_set_size(file, file->last_size, FALSE);
+	if (log_file_use_committed_size(file)) {
+		(void)log_file_read_committed_size(file->mmap_base,
+			&file->mmap_committed_size_seq, &size);
+	}
 	return 0;
 }
 
@@ -1629,7 +1880,7 @@ mail_transaction_log_file_munmap(struct mail_transaction_log_file *file)
 
 static int
 mail_transaction_log_file_map_mmap(struct mail_transaction_log_file *file,
-				   uoff_t start_offset)
+				   uoff_t start_offset, uoff_t end_offset)
 {
 	struct stat st;
 	int ret;
@@ -1639,6 +1890,14 @@ mail_transaction_log_file_map_mmap(struct mail_transaction_log_file *file,
 	i_assert(file->buffer_offset == 0 || file->mmap_base == NULL);
 	i_assert(file->mmap_size == 0 || file->mmap_base != NULL);
 
+	if (file->mmap_base != NULL &&
+	    log_file_mmap_committed(file, end_offset)) {
+		if ((ret = mail_transaction_log_file_sync(file)) < 0)
+			return 0;
+		if (ret > 0)
+			return 1;
+	}
+
 	if (fstat(file->fd, &st) < 0) {
 		log_file_set_syscall_error(file, "fstat()");
 		return -1;
@@ -1652,6 +1911,13 @@ mail_transaction_log_file_map_mmap(struct mail_transaction_log_file *file,
 		return 0;
 	}
 
+	if (file->mmap_base != NULL &&
+	    (uoff_t)st.st_size > file->buffer->used &&
+	    (uoff_t)st.st_size <= file->mmap_size) {
+		/* the file grew, but it still fits to the mmaped area */
+		log_file_mmap_set_size(file, st.st_size, FALSE);
+	}
+
 	if (file->buffer != NULL && file->buffer_offset <= start_offset &&
 	    (uoff_t)st.st_size == file->buffer_offset + file->buffer->used) {
 		/* we already have the whole file mapped */
@@ -1744,7 +2010,8 @@ int mail_transaction_log_file_map(struct mail_transaction_log_file *file,
 	}
 
 	if ((file->log->index->flags & MAIL_INDEX_OPEN_FLAG_MMAP_DISABLE) == 0)
-		ret = mail_transaction_log_file_map_mmap(file, start_offset);
+		ret = mail_transaction_log_file_map_mmap(file, start_offset,
+							 end_offset);
 	else {
 		mail_transaction_log_file_munmap(file);
 		ret = mail_transaction_log_file_read(file, start_offset, FALSE);
@@ -1771,8 +2038,8 @@ void mail_transaction_log_file_move_to_memory(struct mail_transaction_log_file
 		/* just copy to memory */
 		i_assert(file->buffer_offset == 0);
 
-		buf = buffer_create_dynamic(default_pool, file->mmap_size);
-		buffer_append(buf, file->mmap_base, file->mmap_size);
+		buf = buffer_create_dynamic(default_pool, file->buffer->used);
+		buffer_append_buf(buf, file->buffer, 0, (size_t)-1);
 		buffer_free(&file->buffer);
 		file->buffer = buf;
 
@@ -1785,6 +2052,7 @@ void mail_transaction_log_file_move_to_memory(struct mail_transaction_log_file
 		(void)mail_transaction_log_file_read(file, 0, FALSE);
 	}
 	file->last_size = 0;
+	log_file_munmap_hdr(file);
 
 	if (close(file->fd) < 0)
 		log_file_set_syscall_error(file, "close()");
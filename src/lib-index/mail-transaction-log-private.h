@@ -25,6 +25,12 @@ struct dotlock_settings;
 #define MAIL_TRANSACTION_LOG_FILE_IN_MEMORY(file) ((file)->fd == -1)
 
 #define LOG_FILE_MODSEQ_CACHE_SIZE 10
+/* Remember the highest_modseq at approximately every this many bytes of
+   the log file, so modseq lookups never need to scan more than this. */
+#define LOG_FILE_MODSEQ_CHECKPOINT_INTERVAL (1024*32)
+/* Map this much more than the file's size, so that transactions appended
+   afterwards can be read without re-mmaping the file. */
+#define LOG_FILE_MMAP_EXTRA_SIZE (1024*128)
 
 struct modseq_cache {
 	uoff_t offset;
@@ -51,8 +57,16 @@ struct mail_transaction_log_file {
 	buffer_t mmap_buffer;
 	buffer_t *buffer;
 	uoff_t buffer_offset;
+	/* mmap_size may be larger than the file. mmap_buffer contains only
+	   the part of it that is known to exist. */
 	void *mmap_base;
 	size_t mmap_size;
+	/* hdr.committed_size_seq when the file was mmaped. committed_size
+	   can't be trusted until it has changed, since after a crash it may
+	   point past the end of the file. */
+	uint16_t mmap_committed_size_seq;
+	/* writable mapping of the header for updating committed_size */
+	struct mail_transaction_log_header *mmap_hdr;
 
 	/* points to the next uncommitted transaction. usually same as EOF. */
 	uoff_t sync_offset;
@@ -73,6 +87,9 @@ struct mail_transaction_log_file {
 	uoff_t index_deleted_offset, index_undeleted_offset;
 
 	struct modseq_cache modseq_cache[LOG_FILE_MODSEQ_CACHE_SIZE];
+	/* sorted by offset (and so also by highest_modseq), at most one
+	   per LOG_FILE_MODSEQ_CHECKPOINT_INTERVAL */
+	ARRAY(struct modseq_cache) modseq_checkpoints;
 
 	struct file_lock *file_lock;
 	time_t lock_created;
@@ -80,6 +97,12 @@ struct mail_transaction_log_file {
 	unsigned int locked:1;
 	unsigned int locked_sync_offset_updated:1;
 	unsigned int corrupted:1;
+	/* data has been written that still needs to be fdatasync()ed */
+	unsigned int fsync_pending:1;
+	/* mmap_buffer's size came from hdr.committed_size, so it contains
+	   only fully written transactions */
+	unsigned int mmap_committed:1;
+	unsigned int mmap_hdr_failed:1;
 };
 
 struct mail_transaction_log {
@@ -121,6 +144,16 @@ int mail_transaction_log_file_open(struct mail_transaction_log_file *file);
 int mail_transaction_log_file_create(struct mail_transaction_log_file *file,
 				     bool reset);
 int mail_transaction_log_file_lock(struct mail_transaction_log_file *file);
+/* fdatasync() the file if any appends have been written since the last
+   call. One call covers all the transactions written before it, including
+   the ones written by other processes. */
+int mail_transaction_log_file_fsync(struct mail_transaction_log_file *file);
+/* fdatasync() the head file's pending appends. If it fails, the index is
+   moved to memory. Returns 0 if the transactions are either on disk or in
+   memory, -1 if moving to memory failed. */
+int mail_transaction_log_fsync_head(struct mail_transaction_log *log);
+/* Update hdr.committed_size to sync_offset after appending to the file. */
+void mail_transaction_log_file_update_committed_size(struct mail_transaction_log_file *file);
 
 int mail_transaction_log_find_file(struct mail_transaction_log *log,
 				   uint32_t file_seq, bool nfs_flush,
@@ -265,6 +265,9 @@ int mail_transaction_log_rotate(struct mail_transaction_log *log, bool reset)
 		}
 	}
 
+	/* the old head's pending appends must be durable before the
+	   new file is */
+	(void)mail_transaction_log_file_fsync(log->head);
 	if (--log->head->refcount == 0)
 		mail_transaction_logs_clean(log);
 	else
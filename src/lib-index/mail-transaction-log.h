@@ -22,8 +22,14 @@ struct mail_transaction_log_header {
 	uint64_t initial_modseq; /* v1.1+ (note: log's major/minor version) */
 
 	uint8_t compat_flags; /* enum mail_index_header_compat_flags, v1.2+ */
-	uint8_t unused[3];
-	uint32_t unused2; /* so that this struct is 64bit aligned */
+	uint8_t unused;
+	/* v2.2+: seqlock for committed_size. It's odd while committed_size
+	   is being updated. */
+	uint16_t committed_size_seq;
+	/* v2.2+: the file contains fully written transactions at least up to
+	   this offset. Older versions don't update it, so it can't be used to
+	   determine that there are no more transactions. */
+	uint32_t committed_size;
 };
 
 enum mail_transaction_type {
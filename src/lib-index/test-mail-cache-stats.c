@@ -0,0 +1,309 @@
+/* Copyright (c) 2013 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "mail-cache-private.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+enum test_field {
+	TEST_FIELD_HIT = 0,
+	TEST_FIELD_MISS,
+	TEST_FIELD_DROP,
+	TEST_FIELD_KEEP,
+	TEST_FIELD_FEW,
+	TEST_FIELD_EXPENSIVE,
+	TEST_FIELD_FORCED,
+
+	TEST_FIELD_COUNT
+};
+
+static struct mail_cache_field test_fields[TEST_FIELD_COUNT] = {
+	{ .name = "hit", .type = MAIL_CACHE_FIELD_STRING,
+	  .decision = MAIL_CACHE_DECISION_TEMP },
+	{ .name = "miss", .type = MAIL_CACHE_FIELD_STRING,
+	  .decision = MAIL_CACHE_DECISION_TEMP },
+	{ .name = "drop", .type = MAIL_CACHE_FIELD_STRING,
+	  .decision = MAIL_CACHE_DECISION_TEMP },
+	{ .name = "keep", .type = MAIL_CACHE_FIELD_STRING,
+	  .decision = MAIL_CACHE_DECISION_TEMP },
+	{ .name = "few", .type = MAIL_CACHE_FIELD_STRING,
+	  .decision = MAIL_CACHE_DECISION_TEMP },
+	{ .name = "expensive", .type = MAIL_CACHE_FIELD_STRING,
+	  .decision = MAIL_CACHE_DECISION_TEMP },
+	{ .name = "forced", .type = MAIL_CACHE_FIELD_STRING,
+	  .decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED },
+};
+
+static struct mail_index *test_index_open(const char *dir)
+{
+	struct mail_index *index;
+
+	index = mail_index_alloc(dir, "dovecot.index");
+	if (mail_index_open_or_create(index, MAIL_INDEX_OPEN_FLAG_CREATE) < 0)
+		i_fatal("mail_index_open_or_create(%s) failed", dir);
+	mail_cache_register_fields(index->cache, test_fields,
+				   TEST_FIELD_COUNT);
+	return index;
+}
+
+static void test_index_close(struct mail_index **index)
+{
+	mail_index_close(*index);
+	mail_index_free(index);
+}
+
+static void test_index_sync(struct mail_index *index)
+{
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *t;
+
+	test_assert(mail_index_sync_begin(index, &sync_ctx, &view, &t, 0) == 1);
+	test_assert(mail_index_sync_commit(&sync_ctx) == 0);
+}
+
+static const struct mail_cache_field_stats *
+test_stats_get(struct mail_index *index, enum test_field field)
+{
+	struct mail_index_view *view;
+	const struct mail_cache_field_stats *stats;
+	unsigned int i, count;
+
+	test_assert(mail_index_refresh(index) == 0);
+	view = mail_index_view_open(index);
+	stats = mail_cache_get_field_stats(index->cache, view,
+					   pool_datastack_create(), &count);
+	mail_index_view_close(&view);
+
+	for (i = 0; i < count; i++) {
+		if (strcmp(stats[i].name, test_fields[field].name) == 0)
+			return &stats[i];
+	}
+	return NULL;
+}
+
+static void
+test_stats_lookups(struct mail_index *index, enum test_field field,
+		   unsigned int hits, unsigned int misses)
+{
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	unsigned int i;
+
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(index->cache, view);
+	for (i = 0; i < hits; i++) {
+		mail_cache_decision_lookup(cache_view, 1,
+					   test_fields[field].idx, TRUE);
+	}
+	for (i = 0; i < misses; i++) {
+		mail_cache_decision_lookup(cache_view, 1,
+					   test_fields[field].idx, FALSE);
+	}
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+}
+
+static void
+test_stats_set(struct mail_index *index, enum test_field field,
+	       unsigned int hits, unsigned int misses, uint64_t miss_usecs)
+{
+	struct mail_cache_field_private *priv =
+		&index->cache->fields[test_fields[field].idx];
+
+	priv->stats_hits = hits;
+	priv->stats_misses = misses;
+	priv->stats_miss_usecs = miss_usecs;
+	index->cache->stats_pending_lookups += hits + misses;
+}
+
+static enum mail_cache_decision_type
+test_decision_get(struct mail_index *index, enum test_field field)
+{
+	return index->cache->fields[test_fields[field].idx].field.decision;
+}
+
+static void test_mail_cache_stats_flush(const char *dir)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_transaction *t;
+	const struct mail_cache_field_stats *stat;
+
+	test_begin("mail cache stats flush");
+	index = test_index_open(dir);
+
+	/* the statistics are written only after enough lookups */
+	test_stats_lookups(index, TEST_FIELD_HIT, 600, 0);
+	test_stats_lookups(index, TEST_FIELD_MISS, 0,
+			   MAIL_CACHE_STATS_FLUSH_LOOKUPS - 600 - 1);
+	index->cache->fields[test_fields[TEST_FIELD_MISS].idx].
+		stats_miss_usecs = 12345;
+	test_assert(!mail_cache_stats_need_flush(index->cache));
+	test_index_sync(index);
+	test_assert(index->cache->stats_pending_lookups ==
+		    MAIL_CACHE_STATS_FLUSH_LOOKUPS - 1);
+
+	test_stats_lookups(index, TEST_FIELD_MISS, 0, 1);
+	test_assert(mail_cache_stats_need_flush(index->cache));
+	/* not yet written, but the pending lookups are included */
+	T_BEGIN {
+		stat = test_stats_get(index, TEST_FIELD_HIT);
+		test_assert(stat != NULL && stat->hits == 600 &&
+			    stat->misses == 0);
+	} T_END;
+	test_index_sync(index);
+	test_assert(!mail_cache_stats_need_flush(index->cache));
+	test_assert(index->cache->stats_pending_lookups == 0);
+	test_index_close(&index);
+
+	/* another process sees the written statistics */
+	index = test_index_open(dir);
+	T_BEGIN {
+		stat = test_stats_get(index, TEST_FIELD_HIT);
+		test_assert(stat != NULL && stat->hits == 600 &&
+			    stat->misses == 0 && stat->miss_usecs == 0);
+		stat = test_stats_get(index, TEST_FIELD_MISS);
+		test_assert(stat != NULL && stat->hits == 0 &&
+			    stat->misses == MAIL_CACHE_STATS_FLUSH_LOOKUPS - 600 &&
+			    stat->miss_usecs == 12345);
+	} T_END;
+
+	/* the new lookups are added to the written ones */
+	test_stats_lookups(index, TEST_FIELD_HIT, 10, 5);
+	view = mail_index_view_open(index);
+	t = mail_index_transaction_begin(view, 0);
+	mail_cache_stats_flush(index->cache, t);
+	test_assert(mail_index_transaction_commit(&t) == 0);
+	mail_index_view_close(&view);
+	test_index_close(&index);
+
+	index = test_index_open(dir);
+	T_BEGIN {
+		stat = test_stats_get(index, TEST_FIELD_HIT);
+		test_assert(stat != NULL && stat->hits == 610 &&
+			    stat->misses == 5);
+		stat = test_stats_get(index, TEST_FIELD_MISS);
+		test_assert(stat != NULL &&
+			    stat->misses == MAIL_CACHE_STATS_FLUSH_LOOKUPS - 600);
+	} T_END;
+	test_index_close(&index);
+	test_end();
+}
+
+static void test_mail_cache_stats_decisions(const char *dir)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_transaction *t;
+	const struct mail_cache_field_stats *stat;
+	unsigned int drop_hits, drop_misses;
+
+	test_begin("mail cache stats decisions");
+	index = test_index_open(dir);
+
+	/* just below the hit percentage: dropped */
+	drop_hits = MAIL_CACHE_STATS_DROP_HIT_PERCENTAGE - 1;
+	drop_misses = 100 - drop_hits;
+	test_stats_set(index, TEST_FIELD_DROP, drop_hits, drop_misses, 0);
+	/* exactly at the hit percentage: kept as it was */
+	test_stats_set(index, TEST_FIELD_KEEP,
+		       MAIL_CACHE_STATS_DROP_HIT_PERCENTAGE,
+		       100 - MAIL_CACHE_STATS_DROP_HIT_PERCENTAGE,
+		       (100 - MAIL_CACHE_STATS_DROP_HIT_PERCENTAGE) *
+		       (MAIL_CACHE_STATS_EXPENSIVE_USECS - 1));
+	/* no hits, but too few lookups to decide anything */
+	test_stats_set(index, TEST_FIELD_FEW, 0,
+		       MAIL_CACHE_STATS_MIN_LOOKUPS - 1, 0);
+	/* expensive to generate: cached permanently */
+	test_stats_set(index, TEST_FIELD_EXPENSIVE, 50, 50,
+		       50 * MAIL_CACHE_STATS_EXPENSIVE_USECS);
+	/* forced decisions are never changed */
+	test_stats_set(index, TEST_FIELD_FORCED, 0, 1000, 0);
+
+	view = mail_index_view_open(index);
+	t = mail_index_transaction_begin(view, 0);
+	mail_cache_decisions_compress(index->cache, t);
+	test_assert(mail_index_transaction_commit(&t) == 0);
+	mail_index_view_close(&view);
+
+	test_assert(test_decision_get(index, TEST_FIELD_DROP) ==
+		    MAIL_CACHE_DECISION_NO);
+	test_assert(test_decision_get(index, TEST_FIELD_KEEP) ==
+		    MAIL_CACHE_DECISION_TEMP);
+	test_assert(test_decision_get(index, TEST_FIELD_FEW) ==
+		    MAIL_CACHE_DECISION_TEMP);
+	test_assert(test_decision_get(index, TEST_FIELD_EXPENSIVE) ==
+		    MAIL_CACHE_DECISION_YES);
+	test_assert(test_decision_get(index, TEST_FIELD_FORCED) ==
+		    (MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED));
+	test_assert(mail_cache_stats_field_dropped(index->cache,
+		test_fields[TEST_FIELD_DROP].idx));
+	test_assert(!mail_cache_stats_field_dropped(index->cache,
+		test_fields[TEST_FIELD_KEEP].idx));
+	test_index_close(&index);
+
+	/* the drop is remembered in the header and the other counters
+	   were halved */
+	index = test_index_open(dir);
+	test_assert(mail_cache_stats_field_dropped(index->cache,
+		test_fields[TEST_FIELD_DROP].idx));
+	test_assert(!mail_cache_stats_field_dropped(index->cache,
+		test_fields[TEST_FIELD_EXPENSIVE].idx));
+	T_BEGIN {
+		stat = test_stats_get(index, TEST_FIELD_DROP);
+		test_assert(stat != NULL && stat->hits == 0 &&
+			    stat->misses == 0 && stat->dropped_time != 0);
+		stat = test_stats_get(index, TEST_FIELD_EXPENSIVE);
+		test_assert(stat != NULL && stat->hits == 25 &&
+			    stat->misses == 25 &&
+			    stat->miss_usecs ==
+			    25 * MAIL_CACHE_STATS_EXPENSIVE_USECS);
+		stat = test_stats_get(index, TEST_FIELD_FEW);
+		test_assert(stat != NULL &&
+			    stat->misses == (MAIL_CACHE_STATS_MIN_LOOKUPS - 1) / 2);
+	} T_END;
+	test_index_close(&index);
+	test_end();
+}
+
+static void test_mail_cache_stats(void)
+{
+	char dir_template[] = "/tmp/dovecot.test.XXXXXX";
+	const char *dir, *subdir;
+	struct ioloop *ioloop;
+
+	/* indexids are created from ioloop_time */
+	ioloop = io_loop_create();
+
+	if ((dir = mkdtemp(dir_template)) == NULL)
+		i_fatal("mkdtemp(%s) failed: %m", dir_template);
+
+	subdir = t_strconcat(dir, "/flush", NULL);
+	if (mkdir(subdir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", subdir);
+	test_mail_cache_stats_flush(subdir);
+
+	subdir = t_strconcat(dir, "/decisions", NULL);
+	if (mkdir(subdir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", subdir);
+	test_mail_cache_stats_decisions(subdir);
+
+	if (unlink_directory(dir, UNLINK_DIRECTORY_FLAG_RMDIR) < 0)
+		i_fatal("unlink_directory(%s) failed: %m", dir);
+	io_loop_destroy(&ioloop);
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_mail_cache_stats,
+		NULL
+	};
+	return test_run(test_functions);
+}
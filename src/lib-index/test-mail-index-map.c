@@ -0,0 +1,216 @@
+/* Copyright (c) 2013 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "test-common.h"
+#include "mail-index-private.h"
+
+static void test_map_append(struct mail_index_map *map, unsigned int count)
+{
+	struct mail_index_record *rec;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		rec = mail_index_map_append_space(map);
+		memset(rec, 0, map->hdr.record_size);
+		rec->uid = map->hdr.next_uid++;
+		map->rec_map->records_count++;
+		map->hdr.messages_count++;
+	}
+}
+
+static struct mail_index_map *test_map_copy(struct mail_index_map *map)
+{
+	struct mail_index_map *copy;
+
+	copy = mail_index_map_clone(map);
+	mail_index_record_map_move_to_private(copy);
+	return copy;
+}
+
+static bool
+test_map_chunk_shared(struct mail_index_map *map1,
+		      struct mail_index_map *map2, unsigned int chunk_idx)
+{
+	return map1->rec_map->chunks[chunk_idx] ==
+		map2->rec_map->chunks[chunk_idx];
+}
+
+static bool
+test_map_check_uids(struct mail_index_map *map,
+		    const uint32_t *uids, unsigned int count)
+{
+	unsigned int i;
+
+	if (map->rec_map->records_count != count)
+		return FALSE;
+	for (i = 0; i < count; i++) {
+		if (MAIL_INDEX_MAP_IDX(map, i)->uid != uids[i])
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static bool test_map_check_range(struct mail_index_map *map,
+				 uint32_t first_uid, unsigned int count)
+{
+	unsigned int i;
+
+	if (map->rec_map->records_count != count)
+		return FALSE;
+	for (i = 0; i < count; i++) {
+		if (MAIL_INDEX_MAP_IDX(map, i)->uid != first_uid + i)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void test_mail_index_map_copy_on_write(void)
+{
+	struct mail_index *index;
+	struct mail_index_map *map1, *map2;
+	struct mail_index_record *rec;
+
+	test_begin("mail index map copy on write");
+	index = mail_index_alloc(NULL, "dovecot.index");
+	map1 = mail_index_map_alloc(index);
+	test_map_append(map1, 600);
+	test_assert(map1->rec_map->chunks_count == 3);
+
+	/* the copy shares all the chunks */
+	map2 = test_map_copy(map1);
+	test_assert(map1->rec_map != map2->rec_map);
+	test_assert(map2->rec_map->chunks_count == 3);
+	test_assert(test_map_chunk_shared(map1, map2, 0));
+	test_assert(test_map_chunk_shared(map1, map2, 1));
+	test_assert(test_map_chunk_shared(map1, map2, 2));
+
+	/* modifying a record copies only its chunk */
+	rec = mail_index_map_modify_idx(map2, 300);
+	rec->flags = MAIL_SEEN;
+	test_assert(MAIL_INDEX_MAP_IDX(map2, 300)->flags == MAIL_SEEN);
+	test_assert(MAIL_INDEX_MAP_IDX(map1, 300)->flags == 0);
+	test_assert(test_map_chunk_shared(map1, map2, 0));
+	test_assert(!test_map_chunk_shared(map1, map2, 1));
+	test_assert(test_map_chunk_shared(map1, map2, 2));
+
+	/* the same from the original map's side */
+	rec = mail_index_map_modify_idx(map1, 10);
+	rec->flags = MAIL_DELETED;
+	test_assert(MAIL_INDEX_MAP_IDX(map1, 10)->flags == MAIL_DELETED);
+	test_assert(MAIL_INDEX_MAP_IDX(map2, 10)->flags == 0);
+	test_assert(!test_map_chunk_shared(map1, map2, 0));
+	test_assert(test_map_chunk_shared(map1, map2, 2));
+
+	/* a chunk that is no longer shared is modified in place */
+	rec = mail_index_map_modify_idx(map2, 301);
+	test_assert(rec == MAIL_INDEX_MAP_IDX(map2, 301));
+
+	/* appending to the shared partial chunk and over the next chunk
+	   boundary doesn't change the original map */
+	test_map_append(map2, 200);
+	test_assert(map2->rec_map->chunks_count == 4);
+	test_assert(!test_map_chunk_shared(map1, map2, 2));
+	test_assert(test_map_check_range(map1, 1, 600));
+	test_assert(test_map_check_range(map2, 1, 800));
+	test_assert(MAIL_INDEX_MAP_IDX(map1, 300)->flags == 0);
+	test_assert(MAIL_INDEX_MAP_IDX(map2, 300)->flags == MAIL_SEEN);
+
+	mail_index_unmap(&map2);
+	test_assert(test_map_check_range(map1, 1, 600));
+	test_assert(MAIL_INDEX_MAP_IDX(map1, 10)->flags == MAIL_DELETED);
+	mail_index_unmap(&map1);
+	mail_index_free(&index);
+	test_end();
+}
+
+static void test_mail_index_map_append_boundary(void)
+{
+	struct mail_index *index;
+	struct mail_index_map *map;
+
+	test_begin("mail index map append over chunk boundary");
+	index = mail_index_alloc(NULL, "dovecot.index");
+	map = mail_index_map_alloc(index);
+
+	test_map_append(map, MAIL_INDEX_RECORD_CHUNK_COUNT);
+	test_assert(map->rec_map->chunks_count == 1);
+	test_map_append(map, 1);
+	test_assert(map->rec_map->chunks_count == 2);
+	test_assert(test_map_check_range(map, 1,
+					 MAIL_INDEX_RECORD_CHUNK_COUNT + 1));
+	/* the partially filled chunk grows as needed */
+	test_map_append(map, MAIL_INDEX_RECORD_CHUNK_COUNT);
+	test_assert(map->rec_map->chunks_count == 3);
+	test_assert(test_map_check_range(map, 1,
+					 MAIL_INDEX_RECORD_CHUNK_COUNT*2 + 1));
+
+	mail_index_unmap(&map);
+	mail_index_free(&index);
+	test_end();
+}
+
+static void test_mail_index_map_delete_records(void)
+{
+	static const struct {
+		uint32_t idx, count;
+	} deletes[] = {
+		/* within a chunk */
+		{ 5, 10 },
+		/* across the first chunk boundary */
+		{ 250, 20 },
+		/* from the first chunk over a whole chunk to the third */
+		{ 200, 300 },
+		/* the tail, removing the last chunk */
+		{ 300, 270 },
+		/* the head */
+		{ 0, 1 }
+	};
+	struct mail_index *index;
+	struct mail_index_map *map1, *map2;
+	ARRAY(uint32_t) uids;
+	const uint32_t *uidp;
+	unsigned int i, count;
+	uint32_t uid;
+
+	test_begin("mail index map delete records");
+	index = mail_index_alloc(NULL, "dovecot.index");
+	map1 = mail_index_map_alloc(index);
+	test_map_append(map1, 900);
+	map2 = test_map_copy(map1);
+
+	t_array_init(&uids, 900);
+	for (uid = 1; uid <= 900; uid++)
+		array_append(&uids, &uid, 1);
+
+	for (i = 0; i < N_ELEMENTS(deletes); i++) {
+		mail_index_map_delete_records(map2, deletes[i].idx,
+					      deletes[i].count);
+		map2->hdr.messages_count -= deletes[i].count;
+		array_delete(&uids, deletes[i].idx, deletes[i].count);
+
+		uidp = array_get(&uids, &count);
+		test_assert(test_map_check_uids(map2, uidp, count));
+		test_assert(map2->rec_map->chunks_count ==
+			    (count + MAIL_INDEX_RECORD_CHUNK_MASK) >>
+			    MAIL_INDEX_RECORD_CHUNK_SHIFT);
+		/* the original map is unchanged */
+		test_assert(test_map_check_range(map1, 1, 900));
+	}
+
+	mail_index_unmap(&map1);
+	mail_index_unmap(&map2);
+	mail_index_free(&index);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_mail_index_map_copy_on_write,
+		test_mail_index_map_append_boundary,
+		test_mail_index_map_delete_records,
+		NULL
+	};
+	return test_run(test_functions);
+}
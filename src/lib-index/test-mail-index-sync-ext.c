@@ -27,6 +27,12 @@ int mail_index_map_ext_hdr_check(const struct mail_index_header *hdr ATTR_UNUSED
 				 const char *name ATTR_UNUSED,
 				 const char **error_r ATTR_UNUSED) { return -1; }
 void mail_index_modseq_hdr_update(struct mail_index_modseq_sync *ctx ATTR_UNUSED) {}
+struct mail_index_record *
+mail_index_map_modify_idx(struct mail_index_map *map, uint32_t idx) { return MAIL_INDEX_MAP_IDX(map, idx); }
+void mail_index_record_map_set_records(struct mail_index_record_map *rec_map ATTR_UNUSED,
+				       unsigned int record_size ATTR_UNUSED,
+				       const void *records ATTR_UNUSED,
+				       unsigned int count ATTR_UNUSED) {}
 bool mail_index_lookup_seq(struct mail_index_view *view ATTR_UNUSED,
 			   uint32_t uid, uint32_t *seq_r) {
 	*seq_r = uid;
@@ -48,12 +54,15 @@ static void test_mail_index_sync_ext_atomic_inc(void)
 	ctx.view->map->hdr.next_uid = 2;
 	ctx.view->map->hdr.record_size = sizeof(struct mail_index_record) + 16;
 	ctx.view->map->rec_map = t_new(struct mail_index_record_map, 1);
-	ctx.view->map->rec_map->records =
+	ctx.view->map->rec_map->chunks = t_new(void *, 1);
+	ctx.view->map->rec_map->chunks[0] =
 		t_malloc(ctx.view->map->hdr.record_size);
+	ctx.view->map->rec_map->records_count = 1;
 	t_array_init(&ctx.view->map->extensions, 4);
 	ext = array_append_space(&ctx.view->map->extensions);
 	ext->record_offset = sizeof(struct mail_index_record);
-	ptr = PTR_OFFSET(ctx.view->map->rec_map->records, ext->record_offset);
+	ptr = PTR_OFFSET(ctx.view->map->rec_map->chunks[0],
+			 ext->record_offset);
 
 	memset(&u, 0, sizeof(u));
 	test_assert(mail_index_sync_ext_atomic_inc(&ctx, &u) == -1);
@@ -0,0 +1,372 @@
+/* Copyright (c) 2013 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "ioloop.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "mail-index-private.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TEST_MESSAGES_COUNT 300
+/* don't expunge below this, so there's something left to compare */
+#define TEST_MESSAGES_MIN_COUNT 100
+#define TEST_CHANGES_COUNT 400
+#define TEST_KEYWORDS_COUNT 2
+#define TEST_RAND_SEED 1
+
+/* The same changes are written to two indexes. "batch" gets each change
+   as a single record covering the whole range, while "single" gets one
+   transaction for each message. The replayed maps must end up the same. */
+struct test_index {
+	struct mail_index *index;
+	struct mail_keywords *keywords[TEST_KEYWORDS_COUNT];
+};
+
+struct test_message {
+	uint32_t uid;
+	uint8_t flags;
+	unsigned int keywords;
+};
+ARRAY_DEFINE_TYPE(test_message, struct test_message);
+
+static const char *test_keyword_names[TEST_KEYWORDS_COUNT] = { "a", "b" };
+
+static void test_index_open(struct test_index *tindex, const char *dir)
+{
+	const char *keyword[2];
+	unsigned int i;
+
+	tindex->index = mail_index_alloc(dir, "dovecot.index");
+	if (mail_index_open_or_create(tindex->index,
+				      MAIL_INDEX_OPEN_FLAG_CREATE) < 0)
+		i_fatal("mail_index_open_or_create(%s) failed", dir);
+	keyword[1] = NULL;
+	for (i = 0; i < TEST_KEYWORDS_COUNT; i++) {
+		keyword[0] = test_keyword_names[i];
+		tindex->keywords[i] =
+			mail_index_keywords_create(tindex->index, keyword);
+	}
+}
+
+static void test_index_close(struct test_index *tindex)
+{
+	unsigned int i;
+
+	for (i = 0; i < TEST_KEYWORDS_COUNT; i++)
+		mail_index_keywords_unref(&tindex->keywords[i]);
+	mail_index_close(tindex->index);
+	mail_index_free(&tindex->index);
+}
+
+static void test_index_append(struct test_index *tindex, unsigned int count)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *t;
+	uint32_t uid_validity = ioloop_time, seq;
+	unsigned int i;
+
+	view = mail_index_view_open(tindex->index);
+	t = mail_index_transaction_begin(view, 0);
+	mail_index_update_header(t,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	for (i = 0; i < count; i++)
+		mail_index_append(t, i + 1, &seq);
+	test_assert(mail_index_transaction_commit(&t) == 0);
+	mail_index_view_close(&view);
+}
+
+static void
+test_index_update(struct test_index *tindex, uint32_t seq1, uint32_t seq2,
+		  bool keyword, unsigned int idx, enum modify_type modify_type,
+		  enum mail_flags flags)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *t;
+	uint32_t seq;
+
+	view = mail_index_view_open(tindex->index);
+	t = mail_index_transaction_begin(view, 0);
+	for (seq = seq1; seq <= seq2; seq++) {
+		if (keyword) {
+			mail_index_update_keywords(t, seq, modify_type,
+						   tindex->keywords[idx]);
+		} else {
+			mail_index_update_flags(t, seq, modify_type, flags);
+		}
+	}
+	test_assert(mail_index_transaction_commit(&t) == 0);
+	mail_index_view_close(&view);
+}
+
+static void
+test_index_expunge(struct test_index *tindex, uint32_t uid1, uint32_t uid2)
+{
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *t;
+	uint32_t seq, seq1, seq2;
+
+	test_assert(mail_index_sync_begin(tindex->index, &sync_ctx,
+					  &view, &t, 0) == 1);
+	if (mail_index_lookup_seq_range(view, uid1, uid2, &seq1, &seq2)) {
+		for (seq = seq1; seq <= seq2; seq++)
+			mail_index_expunge(t, seq);
+	}
+	test_assert(mail_index_sync_commit(&sync_ctx) == 0);
+}
+
+static void
+test_index_compare(struct test_index *batch, struct test_index *single,
+		   const ARRAY_TYPE(keyword_indexes) *kw_map,
+		   const struct test_message *msgs, unsigned int count)
+{
+	struct mail_index_view *view1, *view2;
+	const struct mail_index_header *hdr1, *hdr2;
+	const struct mail_index_record *rec1, *rec2;
+	ARRAY_TYPE(keyword_indexes) kw1, kw2;
+	const unsigned int *kw_idx;
+	unsigned int i, keywords, seen_count = 0, deleted_count = 0;
+	uint32_t first_unseen_uid = 0, first_deleted_uid = 0;
+
+	test_assert(mail_index_refresh(batch->index) == 0);
+	test_assert(mail_index_refresh(single->index) == 0);
+	view1 = mail_index_view_open(batch->index);
+	view2 = mail_index_view_open(single->index);
+	hdr1 = mail_index_get_header(view1);
+	hdr2 = mail_index_get_header(view2);
+
+	test_assert(hdr1->messages_count == count);
+	test_assert(hdr2->messages_count == count);
+	t_array_init(&kw1, 4);
+	t_array_init(&kw2, 4);
+	for (i = 0; i < count && i < hdr1->messages_count &&
+		    i < hdr2->messages_count; i++) {
+		rec1 = mail_index_lookup(view1, i + 1);
+		rec2 = mail_index_lookup(view2, i + 1);
+		test_assert(rec1->uid == msgs[i].uid);
+		test_assert(rec2->uid == msgs[i].uid);
+		test_assert(rec1->flags == msgs[i].flags);
+		test_assert(rec2->flags == msgs[i].flags);
+
+		mail_index_lookup_keywords(view1, i + 1, &kw1);
+		mail_index_lookup_keywords(view2, i + 1, &kw2);
+		keywords = 0;
+		array_foreach(&kw1, kw_idx)
+			keywords |= 1 << *array_idx(kw_map, *kw_idx);
+		test_assert(keywords == msgs[i].keywords);
+		test_assert(array_cmp(&kw1, &kw2));
+
+		if ((msgs[i].flags & MAIL_SEEN) != 0)
+			seen_count++;
+		else if (first_unseen_uid == 0)
+			first_unseen_uid = msgs[i].uid;
+		if ((msgs[i].flags & MAIL_DELETED) != 0) {
+			deleted_count++;
+			if (first_deleted_uid == 0)
+				first_deleted_uid = msgs[i].uid;
+		}
+	}
+
+	test_assert(hdr1->seen_messages_count == seen_count);
+	test_assert(hdr1->deleted_messages_count == deleted_count);
+	test_assert(first_unseen_uid == 0 ||
+		    hdr1->first_unseen_uid_lowwater <= first_unseen_uid);
+	test_assert(first_deleted_uid == 0 ||
+		    hdr1->first_deleted_uid_lowwater <= first_deleted_uid);
+
+	test_assert(hdr1->next_uid == hdr2->next_uid);
+	test_assert(hdr1->seen_messages_count == hdr2->seen_messages_count);
+	test_assert(hdr1->deleted_messages_count ==
+		    hdr2->deleted_messages_count);
+	test_assert(hdr1->first_unseen_uid_lowwater ==
+		    hdr2->first_unseen_uid_lowwater);
+	test_assert(hdr1->first_deleted_uid_lowwater ==
+		    hdr2->first_deleted_uid_lowwater);
+
+	mail_index_view_close(&view1);
+	mail_index_view_close(&view2);
+}
+
+static void
+test_keywords_map(struct mail_index *index, ARRAY_TYPE(keyword_indexes) *map)
+{
+	const char *const *names;
+	unsigned int i, j, count;
+
+	/* index's keyword index -> test's keyword index */
+	names = array_get(mail_index_get_keywords(index), &count);
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < TEST_KEYWORDS_COUNT; j++) {
+			if (strcmp(names[i], test_keyword_names[j]) == 0)
+				break;
+		}
+		i_assert(j < TEST_KEYWORDS_COUNT);
+		array_idx_set(map, i, &j);
+	}
+}
+
+static void
+test_apply_change(ARRAY_TYPE(test_message) *msgs,
+		  struct test_index *batch, struct test_index *single)
+{
+	struct test_message *msg;
+	enum modify_type modify_type;
+	enum mail_flags flags = 0;
+	unsigned int i, count, idx = 0, first, last;
+	bool keyword;
+
+	msg = array_get_modifiable(msgs, &count);
+	if (count == 0)
+		return;
+	first = rand() % count;
+	last = first + rand() % I_MIN(count - first, 50);
+
+	if (rand() % 20 == 0 &&
+	    count - (last - first + 1) >= TEST_MESSAGES_MIN_COUNT) {
+		test_index_expunge(batch, msg[first].uid, msg[last].uid);
+		for (i = first; i <= last; i++)
+			test_index_expunge(single, msg[i].uid, msg[i].uid);
+		array_delete(msgs, first, last - first + 1);
+		return;
+	}
+
+	keyword = rand() % 4 == 0;
+	if (keyword) {
+		idx = rand() % TEST_KEYWORDS_COUNT;
+		modify_type = rand() % 2 == 0 ? MODIFY_ADD : MODIFY_REMOVE;
+	} else {
+		switch (rand() % 3) {
+		case 0:
+			modify_type = MODIFY_ADD;
+			break;
+		case 1:
+			modify_type = MODIFY_REMOVE;
+			break;
+		default:
+			modify_type = MODIFY_REPLACE;
+			break;
+		}
+		if (rand() % 2 == 0)
+			flags |= MAIL_SEEN;
+		if (rand() % 2 == 0)
+			flags |= MAIL_DELETED;
+		if (rand() % 2 == 0)
+			flags |= MAIL_FLAGGED;
+	}
+
+	test_index_update(batch, first + 1, last + 1, keyword, idx,
+			  modify_type, flags);
+	for (i = first; i <= last; i++) {
+		test_index_update(single, i + 1, i + 1, keyword, idx,
+				  modify_type, flags);
+		if (keyword) {
+			if (modify_type == MODIFY_ADD)
+				msg[i].keywords |= 1 << idx;
+			else
+				msg[i].keywords &= ~(1 << idx);
+			continue;
+		}
+		switch (modify_type) {
+		case MODIFY_ADD:
+			msg[i].flags |= flags;
+			break;
+		case MODIFY_REMOVE:
+			msg[i].flags &= ~flags;
+			break;
+		case MODIFY_REPLACE:
+			msg[i].flags = flags;
+			break;
+		}
+	}
+}
+
+static void test_mail_index_sync_batched_replay(const char *dir)
+{
+	struct test_index batch, single;
+	ARRAY_TYPE(test_message) msgs;
+	ARRAY_TYPE(keyword_indexes) batch_kw_map;
+	struct test_message *msg;
+	const struct test_message *msgs_arr;
+	const char *batch_dir, *single_dir;
+	unsigned int i, count;
+
+	/* the seed is in the test name, so a failure can be reproduced */
+	srand(TEST_RAND_SEED);
+	test_begin(t_strdup_printf("mail index sync batched replay (seed %u)",
+				   TEST_RAND_SEED));
+	batch_dir = t_strconcat(dir, "/batch", NULL);
+	single_dir = t_strconcat(dir, "/single", NULL);
+	if (mkdir(batch_dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", batch_dir);
+	if (mkdir(single_dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", single_dir);
+
+	test_index_open(&batch, batch_dir);
+	test_index_open(&single, single_dir);
+	test_index_append(&batch, TEST_MESSAGES_COUNT);
+	test_index_append(&single, TEST_MESSAGES_COUNT);
+
+	i_array_init(&msgs, TEST_MESSAGES_COUNT);
+	for (i = 0; i < TEST_MESSAGES_COUNT; i++) {
+		msg = array_append_space(&msgs);
+		msg->uid = i + 1;
+	}
+
+	for (i = 0; i < TEST_CHANGES_COUNT; i++)
+		test_apply_change(&msgs, &batch, &single);
+
+	/* changes are applied to the maps while they're synced */
+	i_array_init(&batch_kw_map, TEST_KEYWORDS_COUNT);
+	test_keywords_map(batch.index, &batch_kw_map);
+	msgs_arr = array_get(&msgs, &count);
+	test_index_compare(&batch, &single, &batch_kw_map, msgs_arr, count);
+
+	/* reopening replays the changes written after the last expunge's
+	   sync from the log */
+	test_index_close(&batch);
+	test_index_close(&single);
+	test_index_open(&batch, batch_dir);
+	test_index_open(&single, single_dir);
+	array_clear(&batch_kw_map);
+	test_keywords_map(batch.index, &batch_kw_map);
+	msgs_arr = array_get(&msgs, &count);
+	test_index_compare(&batch, &single, &batch_kw_map, msgs_arr, count);
+
+	array_free(&batch_kw_map);
+	array_free(&msgs);
+	test_index_close(&batch);
+	test_index_close(&single);
+	test_end();
+}
+
+static void test_mail_index_sync_update(void)
+{
+	char dir_template[] = "/tmp/dovecot.test.XXXXXX";
+	const char *dir;
+	struct ioloop *ioloop;
+
+	/* indexids are created from ioloop_time */
+	ioloop = io_loop_create();
+
+	if ((dir = mkdtemp(dir_template)) == NULL)
+		i_fatal("mkdtemp(%s) failed: %m", dir_template);
+	test_mail_index_sync_batched_replay(dir);
+
+	if (unlink_directory(dir, UNLINK_DIRECTORY_FLAG_RMDIR) < 0)
+		i_fatal("unlink_directory(%s) failed: %m", dir);
+	io_loop_destroy(&ioloop);
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_mail_index_sync_update,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -10,6 +10,9 @@
 #include <sys/stat.h>
 
 static bool log_lock_failure = FALSE;
+static bool move_to_memory_success = FALSE;
+static unsigned int committed_size_updates = 0;
+static uoff_t committed_size_last = 0;
 
 void mail_index_file_set_syscall_error(struct mail_index *index ATTR_UNUSED,
 				       const char *filepath ATTR_UNUSED,
@@ -23,6 +26,14 @@ int mail_transaction_log_lock_head(struct mail_transaction_log *log ATTR_UNUSED)
 }
 
 void mail_transaction_log_file_unlock(struct mail_transaction_log_file *file ATTR_UNUSED) {}
+void mail_transaction_log_file_update_committed_size(struct mail_transaction_log_file *file)
+{
+	/* called after each write, with sync_offset already pointing to the
+	   end of the written transaction */
+	test_assert(file->sync_offset > committed_size_last);
+	committed_size_last = file->sync_offset;
+	committed_size_updates++;
+}
 
 void mail_transaction_update_modseq(const struct mail_transaction_header *hdr,
 				    const void *data ATTR_UNUSED,
@@ -32,9 +43,12 @@ void mail_transaction_update_modseq(const struct mail_transaction_header *hdr,
 		*cur_modseq += 1;
 }
 
-int mail_index_move_to_memory(struct mail_index *index ATTR_UNUSED)
+int mail_index_move_to_memory(struct mail_index *index)
 {
-	return -1;
+	if (!move_to_memory_success)
+		return -1;
+	index->log->head->fd = -1;
+	return 0;
 }
 
 static void test_append_expunge(struct mail_transaction_log *log)
@@ -114,6 +128,72 @@ static void test_append_sync_offset(struct mail_transaction_log *log)
 	test_end();
 }
 
+static void test_append_fsync(struct mail_transaction_log *log)
+{
+	static unsigned int buf = 0x12345678;
+	struct mail_transaction_log_file *file = log->head;
+	struct mail_transaction_log_append_ctx *ctx;
+	unsigned int i;
+
+	test_begin("transaction log append: fsync");
+	log->index->fsync_mode = FSYNC_MODE_ALWAYS;
+	committed_size_updates = 0;
+	committed_size_last = file->sync_offset;
+
+	/* sync-locked commits leave the fsync pending */
+	log->index->log_sync_locked = TRUE;
+	for (i = 0; i < 2; i++) {
+		test_assert(mail_transaction_log_append_begin(log->index, 0, &ctx) == 0);
+		mail_transaction_log_append_add(ctx, MAIL_TRANSACTION_APPEND,
+						&buf, sizeof(buf));
+		test_assert(mail_transaction_log_append_commit(&ctx) == 0);
+		test_assert(file->fsync_pending);
+	}
+	test_assert(mail_transaction_log_file_fsync(file) == 0);
+	test_assert(!file->fsync_pending);
+	log->index->log_sync_locked = FALSE;
+
+	/* others are flushed by the commit itself */
+	test_assert(mail_transaction_log_append_begin(log->index, 0, &ctx) == 0);
+	mail_transaction_log_append_add(ctx, MAIL_TRANSACTION_APPEND,
+					&buf, sizeof(buf));
+	test_assert(mail_transaction_log_append_commit(&ctx) == 0);
+	test_assert(!file->fsync_pending);
+	test_assert(committed_size_updates == 3);
+
+	log->index->fsync_mode = FSYNC_MODE_OPTIMIZED;
+	test_end();
+}
+
+static void test_append_fsync_failure(struct mail_transaction_log *log)
+{
+	struct mail_transaction_log_file *file = log->head;
+	int old_fd = file->fd, fd[2];
+
+	test_begin("transaction log append: fsync failure");
+	/* fdatasync() fails for pipes */
+	if (pipe(fd) < 0)
+		i_fatal("pipe() failed: %m");
+	file->fd = fd[1];
+
+	/* the commit fails if the index can't be moved to memory */
+	file->fsync_pending = TRUE;
+	test_assert(mail_transaction_log_fsync_head(log) < 0);
+	test_assert(!file->fsync_pending);
+
+	/* otherwise the log is kept in memory */
+	file->fsync_pending = TRUE;
+	move_to_memory_success = TRUE;
+	test_assert(mail_transaction_log_fsync_head(log) == 0);
+	test_assert(MAIL_TRANSACTION_LOG_FILE_IN_MEMORY(file));
+	move_to_memory_success = FALSE;
+
+	i_close_fd(&fd[0]);
+	i_close_fd(&fd[1]);
+	file->fd = old_fd;
+	test_end();
+}
+
 static void test_mail_transaction_log_append(void)
 {
 	struct mail_transaction_log *log;
@@ -154,9 +234,13 @@ static void test_mail_transaction_log_append(void)
 	test_assert(mail_transaction_log_append_commit(&ctx) == 0);
 	if (fstat(fd, &st) < 0) i_fatal("fstat() failed: %m");
 	test_assert(st.st_size == 1);
-	file->fd = -1;
 	test_end();
 
+	file->log = log;
+	test_append_fsync(log);
+	test_append_fsync_failure(log);
+	file->fd = -1;
+
 	unlink(tmp_path);
 }
 
@@ -0,0 +1,372 @@
+/* Copyright (c) 2013 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "ioloop.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "mail-index-private.h"
+#include "mail-index-util.h"
+#include "mail-index-modseq.h"
+#include "mail-transaction-log-private.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+struct test_log_modseq {
+	uoff_t offset;
+	uint64_t modseq;
+};
+ARRAY_DEFINE_TYPE(test_log_modseq, struct test_log_modseq);
+
+static struct mail_index *
+test_index_open(const char *dir, enum mail_index_open_flags flags)
+{
+	struct mail_index *index;
+
+	index = mail_index_alloc(dir, "dovecot.index");
+	if (mail_index_open_or_create(index, flags |
+				      MAIL_INDEX_OPEN_FLAG_CREATE) < 0)
+		i_fatal("mail_index_open_or_create(%s) failed", dir);
+	return index;
+}
+
+static void test_index_close(struct mail_index **index)
+{
+	mail_index_close(*index);
+	mail_index_free(index);
+}
+
+static void test_index_sync(struct mail_index *index)
+{
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *t;
+
+	test_assert(mail_index_sync_begin(index, &sync_ctx, &view, &t, 0) == 1);
+	test_assert(mail_index_sync_commit(&sync_ctx) == 0);
+}
+
+static void
+test_index_append(struct mail_index *index, uint32_t first_uid,
+		  unsigned int count)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *t;
+	unsigned int i;
+	uint32_t seq;
+
+	view = mail_index_view_open(index);
+	t = mail_index_transaction_begin(view, 0);
+	if (first_uid == 1) {
+		uint32_t uid_validity = ioloop_time;
+
+		mail_index_update_header(t,
+			offsetof(struct mail_index_header, uid_validity),
+			&uid_validity, sizeof(uid_validity), TRUE);
+	}
+	for (i = 0; i < count; i++)
+		mail_index_append(t, first_uid + i, &seq);
+	test_assert(mail_index_transaction_commit(&t) == 0);
+	mail_index_view_close(&view);
+}
+
+static void
+test_index_check_uids(struct mail_index *index, uint32_t last_uid)
+{
+	struct mail_index_view *view;
+	uint32_t seq, uid;
+
+	test_assert(mail_index_refresh(index) == 0);
+	view = mail_index_view_open(index);
+	test_assert(mail_index_view_get_messages_count(view) == last_uid);
+	for (seq = 1; seq <= mail_index_view_get_messages_count(view); seq++) {
+		mail_index_lookup_uid(view, seq, &uid);
+		test_assert(uid == seq);
+	}
+	mail_index_view_close(&view);
+}
+
+static uoff_t test_log_get_size(const char *dir)
+{
+	struct stat st;
+
+	if (stat(t_strconcat(dir, "/dovecot.index.log", NULL), &st) < 0)
+		i_fatal("stat(%s) failed: %m", dir);
+	return st.st_size;
+}
+
+static void
+test_log_read_hdr(const char *dir, struct mail_transaction_log_header *hdr_r)
+{
+	const char *path = t_strconcat(dir, "/dovecot.index.log", NULL);
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (pread(fd, hdr_r, sizeof(*hdr_r), 0) != sizeof(*hdr_r))
+		i_fatal("pread(%s) failed: %m", path);
+	i_close_fd(&fd);
+}
+
+/* Scan the whole log file and get the highest modseq at each transaction
+   boundary */
+static void
+test_log_scan_modseqs(const char *dir, ARRAY_TYPE(test_log_modseq) *modseqs)
+{
+	const char *path = t_strconcat(dir, "/dovecot.index.log", NULL);
+	const struct mail_transaction_log_header *hdr;
+	const struct mail_transaction_header *thdr;
+	struct test_log_modseq *modseq;
+	unsigned char *data;
+	struct stat st;
+	uoff_t offset;
+	uint64_t cur_modseq;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (fstat(fd, &st) < 0)
+		i_fatal("fstat(%s) failed: %m", path);
+	data = i_malloc(st.st_size);
+	if (pread(fd, data, st.st_size, 0) != st.st_size)
+		i_fatal("pread(%s) failed: %m", path);
+	i_close_fd(&fd);
+
+	hdr = (const void *)data;
+	offset = hdr->hdr_size;
+	cur_modseq = hdr->initial_modseq;
+	modseq = array_append_space(modseqs);
+	modseq->offset = offset;
+	modseq->modseq = cur_modseq;
+	while (offset < (uoff_t)st.st_size) {
+		thdr = CONST_PTR_OFFSET(data, offset);
+		mail_transaction_update_modseq(thdr, thdr + 1, &cur_modseq);
+		offset += mail_index_offset_to_uint32(thdr->size);
+
+		modseq = array_append_space(modseqs);
+		modseq->offset = offset;
+		modseq->modseq = cur_modseq;
+	}
+	test_assert(offset == (uoff_t)st.st_size);
+	i_free(data);
+}
+
+static void
+test_log_modseq_lookups(struct mail_transaction_log_file *file,
+			const ARRAY_TYPE(test_log_modseq) *modseqs)
+{
+	const struct test_log_modseq *expected;
+	unsigned int i, idx, count;
+	uint64_t modseq, initial_modseq, highest_modseq;
+	uoff_t offset;
+
+	expected = array_get(modseqs, &count);
+	initial_modseq = expected[0].modseq;
+	highest_modseq = expected[count-1].modseq;
+
+	for (i = 0; i < 1000; i++) {
+		if (i % 2 == 0) {
+			/* make sure the lookups don't just hit the cache */
+			memset(file->modseq_cache, 0,
+			       sizeof(file->modseq_cache));
+		}
+		idx = rand() % count;
+		test_assert(mail_transaction_log_file_get_highest_modseq_at(
+			file, expected[idx].offset, &modseq) == 0);
+		test_assert(modseq == expected[idx].modseq);
+	}
+
+	for (i = 0; i < 1000; i++) {
+		if (i % 2 == 0) {
+			memset(file->modseq_cache, 0,
+			       sizeof(file->modseq_cache));
+		}
+		modseq = initial_modseq +
+			rand() % (highest_modseq - initial_modseq + 1);
+		/* the first transaction boundary where the modseq is
+		   reached */
+		for (idx = 0; expected[idx].modseq < modseq; idx++) ;
+		test_assert(mail_transaction_log_file_get_modseq_next_offset(
+			file, modseq, &offset) == 0);
+		test_assert(offset == expected[idx].offset);
+	}
+}
+
+static void test_log_modseq_checkpoints(const char *dir)
+{
+	ARRAY_TYPE(test_log_modseq) modseqs;
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_transaction *t;
+	struct mail_transaction_log_file *file;
+	const struct test_log_modseq *last;
+	unsigned int i;
+	uint32_t seq;
+
+	test_begin("transaction log modseq checkpoints");
+	index = test_index_open(dir, 0);
+	test_index_append(index, 1, 100);
+	mail_index_modseq_enable(index);
+
+	/* write enough transactions that several checkpoints are
+	   created */
+	view = mail_index_view_open(index);
+	for (i = 0; i < 8000; i++) {
+		t = mail_index_transaction_begin(view, 0);
+		if (i % 37 == 0)
+			mail_index_append(t, 101 + i / 37, &seq);
+		mail_index_update_flags(t, 1 + i % 100,
+			(i / 100) % 2 == 0 ? MODIFY_ADD : MODIFY_REMOVE,
+			i % 3 == 0 ? MAIL_SEEN : MAIL_FLAGGED);
+		test_assert(mail_index_transaction_commit(&t) == 0);
+	}
+	mail_index_view_close(&view);
+
+	i_array_init(&modseqs, 8192);
+	test_log_scan_modseqs(dir, &modseqs);
+	last = array_idx(&modseqs, array_count(&modseqs)-1);
+	test_assert(last->modseq >= 8000);
+
+	file = index->log->head;
+	test_assert(file->sync_offset == last->offset);
+	test_assert(array_is_created(&file->modseq_checkpoints) &&
+		    array_count(&file->modseq_checkpoints) >=
+		    last->offset / LOG_FILE_MODSEQ_CHECKPOINT_INTERVAL - 1);
+	/* checkpoints created while syncing the log */
+	test_log_modseq_lookups(file, &modseqs);
+
+	/* checkpoints created by the lookups, in random order */
+	array_clear(&file->modseq_checkpoints);
+	test_log_modseq_lookups(file, &modseqs);
+	test_assert(array_count(&file->modseq_checkpoints) > 0);
+
+	array_free(&modseqs);
+	test_index_close(&index);
+	test_end();
+}
+
+static void test_log_committed_size_seqlock(const char *dir)
+{
+	struct mail_transaction_log_header hdr;
+	struct mail_index *index;
+	uint16_t seq;
+
+	test_begin("transaction log committed_size seqlock");
+	index = test_index_open(dir, 0);
+	test_index_append(index, 1, 10);
+	test_log_read_hdr(dir, &hdr);
+#ifdef __ATOMIC_RELEASE
+	test_assert((hdr.committed_size_seq & 1) == 0);
+	test_assert(hdr.committed_size == test_log_get_size(dir));
+	seq = hdr.committed_size_seq;
+
+	/* each append bumps the seq by two and leaves it even */
+	test_index_append(index, 11, 10);
+	test_log_read_hdr(dir, &hdr);
+	test_assert(hdr.committed_size_seq == (uint16_t)(seq + 2));
+	test_assert(hdr.committed_size == test_log_get_size(dir));
+#else
+	(void)seq;
+#endif
+	test_index_close(&index);
+	test_end();
+}
+
+static void test_log_mixed_writers(const char *dir)
+{
+	struct mail_transaction_log_header hdr;
+	struct mail_index *writer, *writer2, *old_writer, *reader;
+	uint32_t next_uid = 1;
+
+	test_begin("transaction log mixed writers");
+	writer = test_index_open(dir, 0);
+	/* create the log and dovecot.index, so the others open them instead
+	   of creating new ones */
+	test_index_append(writer, next_uid, 1); next_uid++;
+	test_index_sync(writer);
+
+	/* old_writer never updates committed_size, like older versions or
+	   processes using mmap_disable=yes */
+	writer2 = test_index_open(dir, 0);
+	old_writer = test_index_open(dir, MAIL_INDEX_OPEN_FLAG_MMAP_DISABLE);
+	reader = test_index_open(dir, 0);
+
+	/* enough data that the log gets mmaped */
+	test_index_append(old_writer, next_uid, 2000); next_uid += 2000;
+	test_index_append(writer, next_uid, 1); next_uid++;
+	test_index_check_uids(reader, next_uid - 1);
+
+	/* committed_size is now ahead of what writer has mapped, but behind
+	   the EOF */
+	test_index_append(writer2, next_uid, 1); next_uid++;
+	test_index_append(old_writer, next_uid, 1); next_uid++;
+	test_log_read_hdr(dir, &hdr);
+	test_assert(hdr.committed_size < test_log_get_size(dir));
+
+	/* the writer must append after the old writer's transaction */
+	test_index_append(writer, next_uid, 1); next_uid++;
+	test_assert(writer->log->head->sync_offset ==
+		    test_log_get_size(dir));
+	test_index_append(writer2, next_uid, 1); next_uid++;
+	test_index_append(old_writer, next_uid, 1); next_uid++;
+	test_index_append(writer, next_uid, 1); next_uid++;
+	test_assert(writer->log->head->sync_offset ==
+		    test_log_get_size(dir));
+
+	test_index_check_uids(reader, next_uid - 1);
+	test_index_check_uids(writer, next_uid - 1);
+	test_index_check_uids(writer2, next_uid - 1);
+	test_index_check_uids(old_writer, next_uid - 1);
+
+	test_index_close(&reader);
+	test_index_close(&old_writer);
+	test_index_close(&writer2);
+	test_index_close(&writer);
+	test_end();
+}
+
+static void test_mail_transaction_log_file(void)
+{
+	char dir_template[] = "/tmp/dovecot.test.XXXXXX";
+	const char *dir, *subdir;
+	struct ioloop *ioloop;
+
+	/* indexids are created from ioloop_time */
+	ioloop = io_loop_create();
+
+	if ((dir = mkdtemp(dir_template)) == NULL)
+		i_fatal("mkdtemp(%s) failed: %m", dir_template);
+
+	subdir = t_strconcat(dir, "/seqlock", NULL);
+	if (mkdir(subdir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", subdir);
+	test_log_committed_size_seqlock(subdir);
+
+	subdir = t_strconcat(dir, "/mixed", NULL);
+	if (mkdir(subdir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", subdir);
+	test_log_mixed_writers(subdir);
+
+	subdir = t_strconcat(dir, "/modseq", NULL);
+	if (mkdir(subdir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", subdir);
+	test_log_modseq_checkpoints(subdir);
+
+	if (unlink_directory(dir, UNLINK_DIRECTORY_FLAG_RMDIR) < 0)
+		i_fatal("unlink_directory(%s) failed: %m", dir);
+	io_loop_destroy(&ioloop);
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_mail_transaction_log_file,
+		NULL
+	};
+	return test_run(test_functions);
+}
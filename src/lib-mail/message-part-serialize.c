@@ -242,8 +242,8 @@ message_part_deserialize_part(struct deserialize_context *ctx,
 }
 
 struct message_part *
-message_part_deserialize(pool_t pool, const void *data, size_t size,
-			 const char **error_r)
+message_part_deserialize_partial(pool_t pool, const void *data, size_t size,
+				 size_t *used_size_r, const char **error_r)
 {
 	struct deserialize_context ctx;
         struct message_part *part;
@@ -257,11 +257,25 @@ message_part_deserialize(pool_t pool, const void *data, size_t size,
 		*error_r = ctx.error;
 		return NULL;
 	}
+	*used_size_r = ctx.data - (const unsigned char *)data;
+	return part;
+}
 
-	if (ctx.data != ctx.end) {
+struct message_part *
+message_part_deserialize(pool_t pool, const void *data, size_t size,
+			 const char **error_r)
+{
+        struct message_part *part;
+	size_t used_size;
+
+	part = message_part_deserialize_partial(pool, data, size,
+						&used_size, error_r);
+	if (part == NULL)
+		return NULL;
+
+	if (used_size != size) {
 		*error_r = "Too much data";
 		return NULL;
 	}
-
 	return part;
 }
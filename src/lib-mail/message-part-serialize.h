@@ -12,5 +12,11 @@ void message_part_serialize(struct message_part *part, buffer_t *dest);
 struct message_part *
 message_part_deserialize(pool_t pool, const void *data, size_t size,
 			 const char **error_r);
+/* Like message_part_deserialize(), but allow the serialized parts to be
+   followed by other data. The number of bytes used by the parts is returned
+   in used_size_r. */
+struct message_part *
+message_part_deserialize_partial(pool_t pool, const void *data, size_t size,
+				 size_t *used_size_r, const char **error_r);
 
 #endif
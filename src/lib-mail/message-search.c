@@ -1,6 +1,7 @@
 /* Copyright (c) 2002-2013 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "array.h"
 #include "buffer.h"
 #include "istream.h"
 #include "str.h"
@@ -14,7 +15,15 @@ struct message_search_context {
 	enum message_search_flags flags;
 	normalizer_func_t *normalizer;
 
-	struct str_find_context *str_find_ctx;
+	/* keys matched against both headers and bodies */
+	struct str_find_multi_context *text_find_ctx;
+	/* keys matched only against bodies */
+	struct str_find_multi_context *body_find_ctx;
+	/* key index -> index in text_find_ctx or body_find_ctx */
+	ARRAY(unsigned int) key_idx_map;
+	/* key index -> TRUE if it's in body_find_ctx */
+	ARRAY(bool) key_body_only;
+
 	struct message_part *prev_part;
 
 	struct message_decoder_context *decoder;
@@ -25,15 +34,73 @@ struct message_search_context *
 message_search_init(const char *normalized_key_utf8,
 		    normalizer_func_t *normalizer,
 		    enum message_search_flags flags)
+{
+	struct message_search_key key;
+
+	key.normalized_key_utf8 = normalized_key_utf8;
+	key.flags = flags;
+	return message_search_init_multi(&key, 1, normalizer);
+}
+
+static void
+message_search_init_keys(struct message_search_context *ctx,
+			 const struct message_search_key *keys,
+			 unsigned int keys_count)
+{
+	ARRAY_TYPE(const_string) text_keys, body_keys;
+	unsigned int i, idx;
+	bool body_only;
+
+	t_array_init(&text_keys, keys_count);
+	t_array_init(&body_keys, keys_count);
+	for (i = 0; i < keys_count; i++) {
+		i_assert(*keys[i].normalized_key_utf8 != '\0');
+
+		body_only = (keys[i].flags &
+			     MESSAGE_SEARCH_FLAG_SKIP_HEADERS) != 0;
+		if (body_only) {
+			idx = array_count(&body_keys);
+			array_append(&body_keys, &keys[i].normalized_key_utf8, 1);
+		} else {
+			/* headers need to be searched for at least this key */
+			ctx->flags &= ~MESSAGE_SEARCH_FLAG_SKIP_HEADERS;
+			idx = array_count(&text_keys);
+			array_append(&text_keys, &keys[i].normalized_key_utf8, 1);
+		}
+		array_append(&ctx->key_idx_map, &idx, 1);
+		array_append(&ctx->key_body_only, &body_only, 1);
+	}
+	if (array_count(&text_keys) > 0) {
+		ctx->text_find_ctx =
+			str_find_multi_init(default_pool,
+					    array_idx(&text_keys, 0),
+					    array_count(&text_keys));
+	}
+	if (array_count(&body_keys) > 0) {
+		ctx->body_find_ctx =
+			str_find_multi_init(default_pool,
+					    array_idx(&body_keys, 0),
+					    array_count(&body_keys));
+	}
+}
+
+struct message_search_context *
+message_search_init_multi(const struct message_search_key *keys,
+			  unsigned int keys_count,
+			  normalizer_func_t *normalizer)
 {
 	struct message_search_context *ctx;
 
-	i_assert(*normalized_key_utf8 != '\0');
+	i_assert(keys_count > 0);
 
 	ctx = i_new(struct message_search_context, 1);
-	ctx->flags = flags;
+	ctx->flags = MESSAGE_SEARCH_FLAG_SKIP_HEADERS;
 	ctx->decoder = message_decoder_init(normalizer, 0);
-	ctx->str_find_ctx = str_find_init(default_pool, normalized_key_utf8);
+	i_array_init(&ctx->key_idx_map, keys_count);
+	i_array_init(&ctx->key_body_only, keys_count);
+	T_BEGIN {
+		message_search_init_keys(ctx, keys, keys_count);
+	} T_END;
 	return ctx;
 }
 
@@ -42,7 +109,12 @@ void message_search_deinit(struct message_search_context **_ctx)
 	struct message_search_context *ctx = *_ctx;
 
 	*_ctx = NULL;
-	str_find_deinit(&ctx->str_find_ctx);
+	if (ctx->text_find_ctx != NULL)
+		str_find_multi_deinit(&ctx->text_find_ctx);
+	if (ctx->body_find_ctx != NULL)
+		str_find_multi_deinit(&ctx->body_find_ctx);
+	array_free(&ctx->key_idx_map);
+	array_free(&ctx->key_body_only);
 	message_decoder_deinit(&ctx->decoder);
 	i_free(ctx);
 }
@@ -79,32 +151,54 @@ static void handle_header(struct message_search_context *ctx,
 	}
 }
 
+static bool search_more(struct message_search_context *ctx,
+			const unsigned char *data, size_t size, bool body)
+{
+	bool text_found = TRUE, body_found = TRUE;
+
+	if (ctx->text_find_ctx != NULL)
+		text_found = str_find_multi_more(ctx->text_find_ctx, data, size);
+	if (ctx->body_find_ctx != NULL) {
+		/* headers are never matched against the body-only keys, but
+		   they may all have been found already */
+		body_found = str_find_multi_more(ctx->body_find_ctx, data,
+						 body ? size : 0);
+	}
+	return text_found && body_found;
+}
+
 static bool search_header(struct message_search_context *ctx,
 			  const struct message_header_line *hdr)
 {
 	static const unsigned char crlf[2] = { '\r', '\n' };
 
-	return str_find_more(ctx->str_find_ctx,
-			     (const unsigned char *)hdr->name, hdr->name_len) ||
-		str_find_more(ctx->str_find_ctx,
-			      hdr->middle, hdr->middle_len) ||
-		str_find_more(ctx->str_find_ctx, hdr->full_value,
-			      hdr->full_value_len) ||
-		(!hdr->no_newline &&
-		 str_find_more(ctx->str_find_ctx, crlf, 2));
+	return search_more(ctx, (const unsigned char *)hdr->name,
+			   hdr->name_len, FALSE) ||
+		search_more(ctx, hdr->middle, hdr->middle_len, FALSE) ||
+		search_more(ctx, hdr->full_value, hdr->full_value_len, FALSE) ||
+		(!hdr->no_newline && search_more(ctx, crlf, 2, FALSE));
 }
 
 static bool message_search_more_decoded2(struct message_search_context *ctx,
 					 struct message_block *block)
 {
-	if (block->hdr != NULL) {
-		if (search_header(ctx, block->hdr))
-			return TRUE;
-	} else {
-		if (str_find_more(ctx->str_find_ctx, block->data, block->size))
-			return TRUE;
-	}
-	return FALSE;
+	if (block->hdr != NULL)
+		return search_header(ctx, block->hdr);
+	else
+		return search_more(ctx, block->data, block->size, TRUE);
+}
+
+static void message_search_part_reset(struct message_search_context *ctx)
+{
+	/* Content-Type defaults to text/plain */
+	ctx->content_type_text = TRUE;
+
+	ctx->prev_part = NULL;
+	if (ctx->text_find_ctx != NULL)
+		str_find_multi_reset_input(ctx->text_find_ctx);
+	if (ctx->body_find_ctx != NULL)
+		str_find_multi_reset_input(ctx->body_find_ctx);
+	message_decoder_decode_reset(ctx->decoder);
 }
 
 bool message_search_more(struct message_search_context *ctx,
@@ -116,7 +210,7 @@ bool message_search_more(struct message_search_context *ctx,
 	if (raw_block->part != ctx->prev_part) {
 		/* part changes. we must change this before looking at
 		   content type */
-		message_search_reset(ctx);
+		message_search_part_reset(ctx);
 		ctx->prev_part = raw_block->part;
 
 		if (hdr == NULL) {
@@ -160,21 +254,31 @@ bool message_search_more_decoded(struct message_search_context *ctx,
 {
 	if (block->part != ctx->prev_part) {
 		/* part changes */
-		message_search_reset(ctx);
+		message_search_part_reset(ctx);
 		ctx->prev_part = block->part;
 	}
 
 	return message_search_more_decoded2(ctx, block);
 }
 
-void message_search_reset(struct message_search_context *ctx)
+bool message_search_key_found(struct message_search_context *ctx,
+			      unsigned int idx)
 {
-	/* Content-Type defaults to text/plain */
-	ctx->content_type_text = TRUE;
+	unsigned int find_idx = *array_idx(&ctx->key_idx_map, idx);
 
-	ctx->prev_part = NULL;
-	str_find_reset(ctx->str_find_ctx);
-	message_decoder_decode_reset(ctx->decoder);
+	if (*array_idx(&ctx->key_body_only, idx))
+		return str_find_multi_is_matched(ctx->body_find_ctx, find_idx);
+	else
+		return str_find_multi_is_matched(ctx->text_find_ctx, find_idx);
+}
+
+void message_search_reset(struct message_search_context *ctx)
+{
+	message_search_part_reset(ctx);
+	if (ctx->text_find_ctx != NULL)
+		str_find_multi_reset(ctx->text_find_ctx);
+	if (ctx->body_find_ctx != NULL)
+		str_find_multi_reset(ctx->body_find_ctx);
 }
 
 static int
@@ -10,22 +10,40 @@ enum message_search_flags {
 	MESSAGE_SEARCH_FLAG_SKIP_HEADERS	= 0x01
 };
 
+struct message_search_key {
+	const char *normalized_key_utf8;
+	enum message_search_flags flags;
+};
+
 /* The key must be given in UTF-8 charset */
 struct message_search_context *
 message_search_init(const char *normalized_key_utf8,
 		    normalizer_func_t *normalizer,
 		    enum message_search_flags flags);
+/* Search multiple keys with a single pass over the message. */
+struct message_search_context *
+message_search_init_multi(const struct message_search_key *keys,
+			  unsigned int keys_count,
+			  normalizer_func_t *normalizer);
 void message_search_deinit(struct message_search_context **ctx);
 
-/* Returns TRUE if key is found from input buffer, FALSE if not. */
+/* Returns TRUE if all the keys have been found since the last reset,
+   FALSE if not. */
 bool message_search_more(struct message_search_context *ctx,
 			 struct message_block *raw_block);
 /* The data has already passed through decoder. */
 bool message_search_more_decoded(struct message_search_context *ctx,
 				 struct message_block *block);
+/* Returns TRUE if the key with the given index has been found since the
+   last reset. */
+bool message_search_key_found(struct message_search_context *ctx,
+			      unsigned int idx);
+/* Forget the found keys and any partially processed input. */
 void message_search_reset(struct message_search_context *ctx);
-/* Search a full message. Returns 1 if match was found, 0 if not,
-   -1 if error (if stream_error == 0, the parts contained broken data) */
+/* Search a full message. Returns 1 if all keys were found, 0 if not,
+   -1 if error (if stream_error == 0, the parts contained broken data).
+   message_search_key_found() can be used afterwards to check which of the
+   keys were found. */
 int message_search_msg(struct message_search_context *ctx,
 		       struct istream *input, struct message_part *parts)
 	ATTR_NULL(3);
@@ -5,9 +5,42 @@
 #include "hex-binary.h"
 #include "quoted-printable.h"
 
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
 #define QP_IS_TRAILING_SPACE(c) \
 	((c) == ' ' || (c) == '\t')
 
+/* Returns the position of the first chr1 or chr2 in src starting from pos,
+   or size if neither is found. Most of the QP encoded data is usually
+   plain text, so this is where most of the decoding time goes. */
+static inline size_t
+qp_find_chr2(const unsigned char *src, size_t pos, size_t size,
+	     unsigned char chr1, unsigned char chr2)
+{
+#ifdef __SSE2__
+	const __m128i mask1 = _mm_set1_epi8(chr1);
+	const __m128i mask2 = _mm_set1_epi8(chr2);
+	__m128i data;
+	unsigned int found;
+
+	for (; pos + 16 <= size; pos += 16) {
+		data = _mm_loadu_si128((const void *)(src + pos));
+		found = _mm_movemask_epi8(
+			_mm_or_si128(_mm_cmpeq_epi8(data, mask1),
+				     _mm_cmpeq_epi8(data, mask2)));
+		if (found != 0)
+			return pos + __builtin_ctz(found);
+	}
+#endif
+	for (; pos < size; pos++) {
+		if (src[pos] == chr1 || src[pos] == chr2)
+			break;
+	}
+	return pos;
+}
+
 static int
 qp_is_end_of_line(const unsigned char *src, size_t *src_pos, size_t size)
 {
@@ -40,8 +73,9 @@ quoted_printable_decode_full(const unsigned char *src, size_t src_size,
 
 	next = 0;
 	for (src_pos = 0; src_pos < src_size; src_pos++) {
-		if (src[src_pos] != '=' && src[src_pos] != '\n')
-			continue;
+		src_pos = qp_find_chr2(src, src_pos, src_size, '=', '\n');
+		if (src_pos == src_size)
+			break;
 
 		if (src[src_pos] == '\n') {
 			/* drop trailing whitespace */
@@ -126,8 +160,9 @@ int quoted_printable_q_decode(const unsigned char *src, size_t src_size,
 
 	next = 0;
 	for (src_pos = 0; src_pos < src_size; src_pos++) {
-		if (src[src_pos] != '_' && src[src_pos] != '=')
-			continue;
+		src_pos = qp_find_chr2(src, src_pos, src_size, '_', '=');
+		if (src_pos == src_size)
+			break;
 
 		buffer_append(dest, src + next, src_pos - next);
 		next = src_pos;
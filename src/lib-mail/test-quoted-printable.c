@@ -28,7 +28,11 @@ static void test_quoted_printable_decode(void)
 		{ "foo=  ", "foo", 3, 0 },
 		{ "foo=A", "foo", 2, 0 },
 		{ "foo=Ax", "foo=Ax", 0, -1 },
-		{ "foo=Ax=xy", "foo=Ax=xy", 0, -1 }
+		{ "foo=Ax=xy", "foo=Ax=xy", 0, -1 },
+		{ "0123456789abcdefghij=3D0123456789abcdefghij  \r\n"
+		  "xyz0123456789abcdef=\r\n0123456789abcdefghijklmnopq",
+		  "0123456789abcdefghij=0123456789abcdefghij\r\n"
+		  "xyz0123456789abcdef0123456789abcdefghijklmnopq", 0, 0 }
 	};
 	buffer_t *buf;
 	unsigned int i, start, end, len;
@@ -100,7 +104,9 @@ static void test_quoted_printable_q_decode(void)
 		"foo=", "foo=",
 		"foo=A", "foo=A",
 		"foo=Ax", "foo=Ax",
-		"foo=Ax=xy", "foo=Ax=xy"
+		"foo=Ax=xy", "foo=Ax=xy",
+		"0123456789abcdefghij_0123456789=3Dabcdefghijklmnop_",
+		"0123456789abcdefghij 0123456789=abcdefghijklmnop "
 	};
 	buffer_t *buf;
 	unsigned int i;
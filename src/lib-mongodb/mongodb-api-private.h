@@ -1,30 +1,86 @@
 #ifndef MONGODB_API_PRIVATE_H
 #define MONGODB_API_PRIVATE_H
 
+#include "array.h"
 #include "mongodb-api.h"
+#include "mongodb-pool.h"
 #include <mongo.h>
 #include <hash.h>
 
 #define MONGODB_DEBUG
 
+#define MONGODB_DEFAULT_PORT 27017
+#define MONGODB_DEFAULT_DATABASE "mail"
+#define MONGODB_DEFAULT_TIMEOUT_MSECS (1000*30)
+
 struct mongodb_conn {
 	pool_t pool;
 	struct mongodb_uri uri;
-	mongo *conn;
+	unsigned int timeout_msecs;
+
+	struct mongodb_pool *pool_conns;
+	char *error;
+};
+
+struct mongodb_fields {
+	/* field name in the document -> name in the result. nested
+	   documents' parent names map to "" */
+	HASH_TABLE(const char *, const char *) fieldmap;
+	HASH_TABLE(const char *, string_t *) defaults;
+};
+
+/* A string value containing %variables in a compiled query */
+struct mongodb_template_slot {
+	/* offset to the value's int32 length in the template */
+	size_t offset;
+	/* bitmask of the documents (indexes to docs) containing the value */
+	uint32_t parents;
+	const char *value;
+};
+
+struct mongodb_template {
+	pool_t pool;
+	mongodb_conn_t conn;
+
+	/* BSON query with the variable strings still unexpanded */
+	buffer_t *query;
+	ARRAY(struct mongodb_template_slot) slots;
+	/* offsets to the start of each (sub)document in the query */
+	ARRAY(size_t) docs;
+
+	bson fields_bson;
+	struct mongodb_fields fields;
 };
 
 struct mongodb_query {
 	pool_t pool;
 	mongodb_conn_t conn;
-	mongo_cursor *cursor;
 
-	char *error;
+	const char *error;
+	/* connection the query was sent to */
+	struct mongodb_wire *wire;
 
 	bson *query;
 	bson *other;
 
-	HASH_TABLE(const char *, const char *) fieldmap;
-	HASH_TABLE(const char *, string_t *) defaults;
+	/* points to own_fields, or to the template's fields */
+	const struct mongodb_fields *fields;
+	struct mongodb_fields own_fields;
+
+	/* namespace of find() cursor or pending request */
+	const char *ns;
+	/* collection of pending update */
+	const char *collection;
+	int64_t cursor_id;
+	buffer_t *documents;
+	size_t documents_pos;
+
+	/* pending async request */
+	mongodb_query_callback_t *callback;
+	void *context;
+	unsigned int multi:1;
+	/* query and other point to memory not owned by bson */
+	unsigned int bson_borrowed:1;
 };
 
 struct mongodb_result {
@@ -37,7 +93,8 @@ struct mongodb_driver_vfuncs {
 	/* connection api */
 	mongodb_conn_t (*conn_init)(const char *connection_string);
 	void (*conn_deinit)(mongodb_conn_t *_conn);
-	char *(*get_error)(mongodb_conn_t conn);
+	const char *(*get_error)(mongodb_conn_t conn);
+	void (*conn_wait)(mongodb_conn_t conn);
 
 	/* query api */
 	mongodb_query_t (*query_init)(mongodb_conn_t conn);
@@ -53,6 +110,21 @@ struct mongodb_driver_vfuncs {
 	int (*query_find)(mongodb_query_t query, const char *collection);
 	int (*query_find_next)(mongodb_query_t query, mongodb_result_t *result);
 	int (*query_update)(mongodb_query_t query, const char *collection, bool multi);
+	void (*query_find_one_async)(mongodb_query_t query, const char *collection,
+				     mongodb_query_callback_t *callback, void *context);
+	void (*query_update_async)(mongodb_query_t query, const char *collection,
+				   bool multi, mongodb_query_callback_t *callback,
+				   void *context);
+
+	/* template api */
+	mongodb_template_t (*template_init)(mongodb_conn_t conn,
+					    const char *query_json,
+					    const char *fields,
+					    const char *defaults,
+					    const char **error_r);
+	void (*template_deinit)(mongodb_template_t *_tmpl);
+	mongodb_query_t (*query_init_template)(mongodb_template_t tmpl,
+					       const struct var_expand_table *table);
 
 	/* result api */
 	int (*result_var_expand)(mongodb_result_t result, struct var_expand_table *_table);
@@ -52,11 +52,16 @@ void mongodb_conn_deinit(mongodb_conn_t *_conn)
 	mongodb_vfuncs->conn_deinit(_conn);
 }
 
-char *mongodb_get_error(mongodb_conn_t conn)
+const char *mongodb_get_error(mongodb_conn_t conn)
 {
 	return mongodb_vfuncs->get_error(conn);
 }
 
+void mongodb_conn_wait(mongodb_conn_t conn)
+{
+	mongodb_vfuncs->conn_wait(conn);
+}
+
 /* query api */
 mongodb_query_t mongodb_query_init(mongodb_conn_t conn)
 {
@@ -114,6 +119,43 @@ int mongodb_query_update(mongodb_query_t query, const char *collection, bool mul
 	return mongodb_vfuncs->query_update(query, collection, multi);
 }
 
+void mongodb_query_find_one_async(mongodb_query_t query, const char *collection,
+				  mongodb_query_callback_t *callback, void *context)
+{
+	mongodb_vfuncs->query_find_one_async(query, collection,
+					     callback, context);
+}
+
+void mongodb_query_update_async(mongodb_query_t query, const char *collection,
+				bool multi, mongodb_query_callback_t *callback,
+				void *context)
+{
+	mongodb_vfuncs->query_update_async(query, collection, multi,
+					   callback, context);
+}
+
+/* template api */
+mongodb_template_t mongodb_template_init(mongodb_conn_t conn,
+					 const char *query_json,
+					 const char *fields,
+					 const char *defaults,
+					 const char **error_r)
+{
+	return mongodb_vfuncs->template_init(conn, query_json, fields,
+					     defaults, error_r);
+}
+
+void mongodb_template_deinit(mongodb_template_t *_tmpl)
+{
+	mongodb_vfuncs->template_deinit(_tmpl);
+}
+
+mongodb_query_t mongodb_query_init_template(mongodb_template_t tmpl,
+					    const struct var_expand_table *table)
+{
+	return mongodb_vfuncs->query_init_template(tmpl, table);
+}
+
 int mongodb_result_var_expand(mongodb_result_t result, struct var_expand_table *_table)
 {
 	return mongodb_vfuncs->result_var_expand(result, _table);
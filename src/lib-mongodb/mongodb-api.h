@@ -23,9 +23,17 @@ typedef struct mongodb_conn *mongodb_conn_t;
 struct mongodb_query;
 typedef struct mongodb_query *mongodb_query_t;
 
+struct mongodb_template;
+typedef struct mongodb_template *mongodb_template_t;
+
 struct mongodb_result;
 typedef struct mongodb_result *mongodb_result_t;
 
+/* ret is one of MONGODB_QUERY_*. result is non-NULL only with
+   MONGODB_QUERY_OK and it's freed with the query. */
+typedef void mongodb_query_callback_t(int ret, mongodb_result_t result,
+				      void *context);
+
 struct mongodb_result_iterate_context {
 	mongodb_result_t             result;
     struct hash_iterate_context *iter;
@@ -35,7 +43,9 @@ struct mongodb_result_iterate_context {
 /* connection api */
 mongodb_conn_t mongodb_conn_init(const char *connection_string);
 void mongodb_conn_deinit(mongodb_conn_t *_conn);
-char *mongodb_get_error(mongodb_conn_t conn);
+const char *mongodb_get_error(mongodb_conn_t conn);
+/* Wait until all pending asynchronous queries have finished. */
+void mongodb_conn_wait(mongodb_conn_t conn);
 
 /* query api */
 mongodb_query_t mongodb_query_init(mongodb_conn_t conn);
@@ -51,6 +61,34 @@ int mongodb_query_find_one(mongodb_query_t query, const char *collection, mongod
 int mongodb_query_find(mongodb_query_t query, const char *collection);
 int mongodb_query_find_next(mongodb_query_t query, mongodb_result_t *result_r);
 int mongodb_query_update(mongodb_query_t query, const char *collection, bool multi);
+/* Asynchronous versions of the above. The query is sent to the server
+   immediately (pipelined with any other pending queries) and the callback
+   is called from the ioloop once the reply arrives. The callback may also
+   be called before the function returns if sending fails. The query must
+   not be freed before the callback is called. */
+void mongodb_query_find_one_async(mongodb_query_t query, const char *collection,
+				  mongodb_query_callback_t *callback, void *context);
+void mongodb_query_update_async(mongodb_query_t query, const char *collection,
+				bool multi, mongodb_query_callback_t *callback,
+				void *context);
+
+/* template api */
+/* Compile a query JSON and its fields and defaults once, so that they
+   don't need to be parsed again for each query. String values in the query
+   may contain %variables, which are expanded by
+   mongodb_query_init_template(). %variables anywhere else, such as in keys
+   or as unquoted values, are rejected. defaults may be NULL. Returns NULL
+   and sets error_r if the query can't be parsed. */
+mongodb_template_t mongodb_template_init(mongodb_conn_t conn,
+					 const char *query_json,
+					 const char *fields,
+					 const char *defaults,
+					 const char **error_r);
+void mongodb_template_deinit(mongodb_template_t *_tmpl);
+/* Create a query from the template. The template must not be freed before
+   the query. */
+mongodb_query_t mongodb_query_init_template(mongodb_template_t tmpl,
+					    const struct var_expand_table *table);
 
 void mongodb_result_field(mongodb_result_t result, const char *key, const char **value_r);
 void mongodb_result_debug(mongodb_result_t result);
@@ -1,17 +1,16 @@
 /* Copyright (c) 2004-2013 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "array.h"
+#include "buffer.h"
 #include "str.h"
 #include "hash.h"
 #include "istream.h"
 #include "json-parser.h"
 
+#include <stdlib.h>
 #include <mongo.h>
 
-#include "istream.h"
-#include "str.h"
-#include "json-parser.h"
-
 #include "mongodb-api-private.h"
 
 #define MAX_KEY_LENGTH 128
@@ -19,6 +18,23 @@
 
 static void mongodb_driver_result_debug(mongodb_result_t result);
 
+/* BSON integers are little endian */
+static int32_t mongodb_get_int32(const unsigned char *data)
+{
+	return (int32_t)((uint32_t)data[0] | ((uint32_t)data[1] << 8) |
+			 ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24));
+}
+
+static void mongodb_set_int32(unsigned char *data, int32_t num)
+{
+	uint32_t unum = num;
+
+	data[0] = unum & 0xff;
+	data[1] = (unum >> 8) & 0xff;
+	data[2] = (unum >> 16) & 0xff;
+	data[3] = (unum >> 24) & 0xff;
+}
+
 /* JSON parser */
 struct mongodb_json_iter {
 	struct json_parser *parser;
@@ -91,31 +107,123 @@ static int mongodb_json_iter_deinit(struct mongodb_json_iter **_iter,
 } /* end of JSON parser */
 
 /* connection api */
+static int
+mongodb_driver_parse_option(struct mongodb_conn *conn,
+			    struct mongodb_pool_settings *set,
+			    const char *key, const char *value)
+{
+	if (strcmp(key, "maxPoolSize") == 0) {
+		if (str_to_uint(value, &set->connection_limit) < 0 ||
+		    set->connection_limit == 0) {
+			conn->error = i_strdup_printf(
+				"Invalid maxPoolSize: %s", value);
+			return -1;
+		}
+	} else if (strcmp(key, "socketTimeoutMS") == 0) {
+		if (str_to_uint(value, &set->timeout_msecs) < 0) {
+			conn->error = i_strdup_printf(
+				"Invalid socketTimeoutMS: %s", value);
+			return -1;
+		}
+	} else if (strcmp(key, "readPreference") == 0) {
+		if (strcmp(value, "primary") == 0)
+			set->read_preference = MONGODB_READ_PRIMARY;
+		else if (strcmp(value, "primaryPreferred") == 0)
+			set->read_preference = MONGODB_READ_PRIMARY_PREFERRED;
+		else if (strcmp(value, "secondary") == 0)
+			set->read_preference = MONGODB_READ_SECONDARY;
+		else if (strcmp(value, "secondaryPreferred") == 0)
+			set->read_preference = MONGODB_READ_SECONDARY_PREFERRED;
+		else if (strcmp(value, "nearest") == 0)
+			set->read_preference = MONGODB_READ_NEAREST;
+		else {
+			conn->error = i_strdup_printf(
+				"Invalid readPreference: %s", value);
+			return -1;
+		}
+	}
+	/* ignore unknown options, like the official drivers do */
+	return 0;
+}
+
+static int mongodb_driver_parse_uri(struct mongodb_conn *conn, const char *uri,
+				    struct mongodb_pool_settings *set_r)
+{
+	const char *p, *hosts, *options = NULL, *const *args;
+	const char *value;
+
+	if (strncmp(uri, "mongodb://", 10) != 0) {
+		conn->error = i_strdup_printf("Invalid URI: %s", uri);
+		return -1;
+	}
+	uri += 10;
+
+	/* mongodb://host1[:port1][,host2[:port2],...][/[database][?options]] */
+	p = strchr(uri, '/');
+	if (p == NULL) {
+		hosts = uri;
+		conn->uri.database = MONGODB_DEFAULT_DATABASE;
+	} else {
+		hosts = t_strdup_until(uri, p++);
+		options = strchr(p, '?');
+		if (options != NULL)
+			p = t_strdup_until(p, options++);
+		conn->uri.database = *p == '\0' ? MONGODB_DEFAULT_DATABASE :
+			p_strdup(conn->pool, p);
+	}
+	if (*hosts == '\0')
+		hosts = "localhost";
+
+	memset(set_r, 0, sizeof(*set_r));
+	set_r->hosts = t_strsplit(hosts, ",");
+	set_r->connection_limit = MONGODB_POOL_DEFAULT_CONNECTION_LIMIT;
+	set_r->timeout_msecs = MONGODB_DEFAULT_TIMEOUT_MSECS;
+	set_r->read_preference = MONGODB_READ_PRIMARY;
+
+	if (options != NULL) {
+		for (args = t_strsplit(options, "&;"); *args != NULL; args++) {
+			value = strchr(*args, '=');
+			if (value == NULL)
+				continue;
+			if (mongodb_driver_parse_option(conn, set_r,
+					t_strdup_until(*args, value),
+					value + 1) < 0)
+				return -1;
+		}
+	}
+
+	/* the first host is kept only for informational purposes */
+	p = strchr(set_r->hosts[0], ':');
+	conn->uri.host.host = p == NULL ? p_strdup(conn->pool, set_r->hosts[0]) :
+		p_strdup_until(conn->pool, set_r->hosts[0], p);
+	conn->uri.host.port = p == NULL ? MONGODB_DEFAULT_PORT : atoi(p + 1);
+	return 0;
+}
+
 static mongodb_conn_t mongodb_driver_conn_init(const char *connection_string)
 {
 	struct mongodb_conn *conn;
+	struct mongodb_pool_settings set;
+	const char *error;
 	pool_t pool;
 
-	/* TODO: add error reporting */
-	if (strncmp(connection_string, "mongodb://", 10) != 0)
-		return NULL;
-
-	/* TODO: add proper mongo uri parsing, maybe add to the right place (mongoc)? */
-	connection_string += 10;
-
 	pool = pool_alloconly_create("mongodb_connection", 1024);
 	conn = p_new(pool, struct mongodb_conn, 1);
 	conn->pool = pool;
-	conn->conn = p_new(pool, mongo, 1);
 
-	/* FIXME: replace with proper uri parsing */
-	conn->uri.host.host = "localhost";
-	conn->uri.host.port = 27017;
-	conn->uri.database = "mail";
-
-	mongo_client(conn->conn, "localhost", 27017);
-
-	return (struct mongodb_conn *)conn;
+	if (mongodb_driver_parse_uri(conn, connection_string, &set) < 0) {
+		i_error("mongodb: %s", conn->error);
+		i_free(conn->error);
+		pool_unref(&pool);
+		return NULL;
+	}
+	conn->timeout_msecs = set.timeout_msecs;
+	if (mongodb_pool_init(&set, &conn->pool_conns, &error) < 0) {
+		i_error("mongodb: %s", error);
+		pool_unref(&pool);
+		return NULL;
+	}
+	return conn;
 }
 
 static void mongodb_driver_conn_deinit(mongodb_conn_t *_conn) {
@@ -124,82 +232,91 @@ static void mongodb_driver_conn_deinit(mongodb_conn_t *_conn) {
 
 	*_conn = NULL;
 
-	mongo_destroy(conn->conn);
-
-	p_free(pool, conn);
+	mongodb_pool_deinit(&conn->pool_conns);
+	i_free(conn->error);
 	pool_unref(&pool);
 }
 
-static char *mongodb_driver_get_error(mongodb_conn_t conn)
-{
-	switch (conn->conn->err) {
-		case MONGO_CONN_SUCCESS:
-			return "connection successful";
-		case MONGO_IO_ERROR:
-			return "io error";
-		case MONGO_SOCKET_ERROR:
-			return "socket error";
-		case MONGO_READ_SIZE_ERROR:
-			return "unexpected response length";
-		case MONGO_COMMAND_FAILED:
-			return "command failed";
-		case MONGO_WRITE_ERROR:
-			return "write failed";
-		case MONGO_NS_INVALID:
-			return "invalid namespace";
-		case MONGO_BSON_INVALID:
-			return "bson is invalid";
-		case MONGO_BSON_NOT_FINISHED:
-			return "bson not finished";
-		case MONGO_BSON_TOO_LARGE:
-			return "bson object exceeds max bson size";
-		case MONGO_WRITE_CONCERN_INVALID:
-			return "invalid write concern supplied";
-		default:
-			return "unknown error";
-	}
+static const char *mongodb_driver_get_error(mongodb_conn_t conn)
+{
+	return conn->error != NULL ? conn->error : "unknown error";
+}
+
+static void mongodb_driver_set_error(mongodb_conn_t conn, const char *error)
+{
+	i_free(conn->error);
+	conn->error = i_strdup(error);
+}
+
+static void mongodb_driver_conn_wait(mongodb_conn_t conn)
+{
+	mongodb_pool_wait(conn->pool_conns);
 }
 /* end of connection api */
 
 /* start of query api */
-static mongodb_query_t mongodb_driver_query_init(mongodb_conn_t conn)
+static void
+mongodb_fields_init(struct mongodb_fields *fields, pool_t pool)
+{
+	hash_table_create(&fields->fieldmap, pool, 0, str_hash, strcmp);
+	hash_table_create(&fields->defaults, pool, 0, str_hash, strcmp);
+}
+
+static void mongodb_fields_deinit(struct mongodb_fields *fields)
+{
+	if (hash_table_is_created(fields->defaults))
+		hash_table_destroy(&fields->defaults);
+	if (hash_table_is_created(fields->fieldmap))
+		hash_table_destroy(&fields->fieldmap);
+}
+
+static mongodb_query_t mongodb_driver_query_alloc(mongodb_conn_t conn)
 {
 	mongodb_query_t query;
-	pool_t pool = conn->pool;
+	pool_t pool;
 
+	pool = pool_alloconly_create("mongodb query", 1024);
 	query = p_new(pool, struct mongodb_query, 1);
 	query->pool = pool;
 	query->conn = conn;
-	query->cursor = NULL;
-	query->other = NULL;
+	return query;
+}
+
+static mongodb_query_t mongodb_driver_query_init(mongodb_conn_t conn)
+{
+	mongodb_query_t query;
 
-	hash_table_create(&query->fieldmap, conn->pool, 0, str_hash, strcmp);
-	hash_table_create(&query->defaults, conn->pool, 0, str_hash, strcmp);
+	query = mongodb_driver_query_alloc(conn);
+	mongodb_fields_init(&query->own_fields, query->pool);
+	query->fields = &query->own_fields;
 	return query;
 }
 
 static void mongodb_driver_query_deinit(mongodb_query_t *_query) {
 	struct mongodb_query *query = *_query;
+	pool_t pool = query->pool;
 
 	*_query = NULL;
 
-	bson_destroy(query->query);
-	if (query->cursor != NULL) {
-		mongo_cursor_destroy(query->cursor);
+	i_assert(query->callback == NULL);
+
+	if (query->cursor_id != 0)
+		mongodb_wire_kill_cursor(query->wire, query->cursor_id);
+	if (query->documents != NULL)
+		buffer_free(&query->documents);
+	if (!query->bson_borrowed) {
+		if (query->query != NULL)
+			bson_destroy(query->query);
+		if (query->other != NULL)
+			bson_destroy(query->other);
 	}
 
-	p_free(query->pool, query->query);
-
-	bson_destroy(query->other);
-	p_free(query->pool, query->other);
-
-	hash_table_destroy(&query->defaults);
-	hash_table_destroy(&query->fieldmap);
-
-	p_free(query->pool, query);
+	mongodb_fields_deinit(&query->own_fields);
+	pool_unref(&pool);
 }
 
-static int mongodb_driver_query_parse_defaults(struct mongodb_query *query, const char *json)
+static int mongodb_fields_parse_defaults(struct mongodb_fields *fields,
+					 pool_t pool, const char *json)
 {
 	struct mongodb_json_iter *iter;
 	const char *key, *value, *error;
@@ -208,10 +325,10 @@ static int mongodb_driver_query_parse_defaults(struct mongodb_query *query, cons
 	iter = mongodb_json_iter_init(json);
 	while (mongodb_json_iter_next(iter, &key, &value)) {
 		if (value != NULL) {
-			value_dup = str_new(query->pool, MAX_FIELD_LENGTH);
+			value_dup = str_new(pool, MAX_FIELD_LENGTH);
 			str_append(value_dup, value);
-			hash_table_insert(query->defaults,
-					  (const char *)p_strdup(query->pool, key),
+			hash_table_insert(fields->defaults,
+					  (const char *)p_strdup(pool, key),
 					  value_dup);
 		}
 	}
@@ -223,32 +340,88 @@ static int mongodb_driver_query_parse_defaults(struct mongodb_query *query, cons
 	return 0;
 }
 
+static int mongodb_driver_query_parse_defaults(struct mongodb_query *query, const char *json)
+{
+	i_assert(query->fields == &query->own_fields);
+
+	return mongodb_fields_parse_defaults(&query->own_fields,
+					     query->pool, json);
+}
+
+static int mongodb_json_append_number(bson *b, const char *key,
+				      const char *value)
+{
+	long long num;
+
+	if (strpbrk(value, ".eE") != NULL)
+		return bson_append_double(b, key, strtod(value, NULL));
+	if (str_to_llong(value, &num) < 0)
+		return -1;
+	if (num >= INT_MIN && num <= INT_MAX)
+		return bson_append_int(b, key, (int)num);
+	return bson_append_long(b, key, num);
+}
+
 static int mongodb_json_to_bson(bson *b, const char *json)
 {
-	struct mongodb_json_iter *iter;
-	const char *key, *value, *error;
+	struct json_parser *parser;
+	struct istream *input;
+	enum json_type type;
+	const char *key = NULL, *value, *error;
+	unsigned int depth = 0;
 	int ret = 0;
 
 	bson_init(b);
 
-	iter = mongodb_json_iter_init(json);
-	while (mongodb_json_iter_next(iter, &key, &value)) {
-		mongodb_debug("type=%d, key=%s, value=%s", iter->type, key, value);
-		switch (iter->type) {
-			case JSON_TYPE_STRING:
-				ret = bson_append_string(b, key, value);
-				break;
-			default:
-				break;
+	input = i_stream_create_from_data(json, strlen(json));
+	parser = json_parser_init(input);
+	while (ret == 0 && json_parse_next(parser, &type, &value) > 0) {
+		mongodb_debug("type=%d, key=%s, value=%s", type, key, value);
+		if (type != JSON_TYPE_OBJECT_KEY &&
+		    type != JSON_TYPE_OBJECT_END && key == NULL) {
+			ret = -1;
+			break;
 		}
-
-		if (ret < 0)
+		switch (type) {
+		case JSON_TYPE_OBJECT_KEY:
+			key = t_strdup(value);
+			continue;
+		case JSON_TYPE_OBJECT:
+			ret = bson_append_start_object(b, key);
+			depth++;
+			break;
+		case JSON_TYPE_OBJECT_END:
+			if (depth == 0) {
+				ret = -1;
+				break;
+			}
+			ret = bson_append_finish_object(b);
+			depth--;
+			break;
+		case JSON_TYPE_STRING:
+			ret = bson_append_string(b, key, value);
+			break;
+		case JSON_TYPE_NUMBER:
+			ret = mongodb_json_append_number(b, key, value);
+			break;
+		case JSON_TYPE_TRUE:
+		case JSON_TYPE_FALSE:
+			ret = bson_append_bool(b, key, type == JSON_TYPE_TRUE);
 			break;
+		case JSON_TYPE_NULL:
+			ret = bson_append_null(b, key);
+			break;
+		case JSON_TYPE_ARRAY:
+		case JSON_TYPE_ARRAY_END:
+			/* not supported */
+			ret = -1;
+			break;
+		}
+		key = NULL;
 	}
-
-	if (mongodb_json_iter_deinit(&iter, &error) < 0) {
+	if (json_parser_deinit(&parser, &error) < 0 || depth != 0)
 		ret = -1;
-	}
+	i_stream_unref(&input);
 
 	if (ret == 0 && bson_finish(b) != BSON_OK) {
 		ret = -2;
@@ -265,8 +438,8 @@ static int mongodb_driver_query_parse_query(struct mongodb_query *query, const c
 
 	ret = mongodb_json_to_bson(query->query, json);
 	if (ret < 0) {
-		ret = -1;
 		query->error = (ret == -1) ? "failed to parse query" : "failed create query bson";
+		ret = -1;
 	}
 
 	return ret;
@@ -280,8 +453,8 @@ static int mongodb_driver_query_parse_update(struct mongodb_query *query, const
 
 	ret = mongodb_json_to_bson(query->other, json);
 	if (ret < 0) {
-		ret = -1;
 		query->error = (ret == -1) ? "failed to parse update" : "failed create update bson";
+		ret = -1;
 	}
 
 	return ret;
@@ -303,31 +476,33 @@ static void str_trim_whitespace(char *string)
 	*last_nwsc = 0;
 }
 
-static int mongodb_driver_query_parse_fields(struct mongodb_query *query, const char *_fields)
+static int mongodb_fields_parse(struct mongodb_fields *dest, bson *b,
+				pool_t pool, const char *_fields)
 {
 	char *key, *value;
-	char *field, *s1, *map, *s2, *dot, *s3, *fields = p_strdup(query->pool, _fields);
+	char *field, *s1, *map, *s2, *dot, *s3, *fields = p_strdup(pool, _fields);
 
 	string_t *key_parts;
 	int ret = 0;
 
 	/* initialize the fields bson */
-	query->other = p_new(query->pool, bson, 1);
-	bson_init(query->other);
+	bson_init(b);
 
 	mongodb_debug("parsing fields '%s'", fields);
-	key_parts = str_new(query->pool, 128);
+	key_parts = str_new(pool, 128);
 	field = strtok_r(fields, ",", &s1);
 	while (field != NULL) {
 		str_truncate(key_parts, 0);
 		map = strtok_r(field, ":", &s2);
-		key = p_strdup(query->pool, map);
+		key = p_strdup(pool, map);
 		str_trim_whitespace(key);
 
 		/* handle dotted fields */
 		dot = strtok_r(map, ".", &s3);
 		str_append(key_parts, dot);
-		hash_table_insert(query->fieldmap, (const char *)str_c(key_parts), (const char *)"\0");
+		hash_table_insert(dest->fieldmap,
+				  (const char *)p_strdup(pool, str_c(key_parts)),
+				  (const char *)"");
 		dot = strtok_r(NULL, ".", &s3);
 		while (dot != NULL) {
 			str_printfa(key_parts, ".%s", dot);
@@ -336,28 +511,37 @@ static int mongodb_driver_query_parse_fields(struct mongodb_query *query, const
 
 		map = strtok_r(NULL, ":", &s2);
 		if (map != NULL) {
-			value = p_strdup(query->pool, map);
+			value = p_strdup(pool, map);
 			str_trim_whitespace(value);
 		} else {
 			value = NULL;
 		}
 
 		mongodb_debug("fieldmap: '%s' = '%s'", key, (value == NULL) ? key : value);
-		bson_append_int(query->other, key, 1);
-		hash_table_insert(query->fieldmap, (const char *)key,
+		bson_append_int(b, key, 1);
+		hash_table_insert(dest->fieldmap, (const char *)key,
 				  (const char *)((value == NULL) ? key : value));
 		field = strtok_r(NULL, ",", &s1);
 	}
 
 	if (ret == 0) {
-		ret = bson_finish(query->other);
+		ret = bson_finish(b);
 	} else {
-		bson_init_zero(query->other);
+		bson_init_zero(b);
 	}
 
 	return ret;
 }
 
+static int mongodb_driver_query_parse_fields(struct mongodb_query *query, const char *_fields)
+{
+	i_assert(query->fields == &query->own_fields);
+
+	query->other = p_new(query->pool, bson, 1);
+	return mongodb_fields_parse(&query->own_fields, query->other,
+				    query->pool, _fields);
+}
+
 static inline const char *bson_to_string(bson_iterator *iter)
 {
 	bson_type type = bson_iterator_type(iter);
@@ -392,7 +576,7 @@ mongodb_driver_query_result_nested(mongodb_query_t query, bson_iterator *iter,
 		} else {
 			doc_key = t_strdup_printf("%s.%s", parent_key, bson_iterator_key(iter));
 		}
-		key = (const char *)hash_table_lookup(query->fieldmap, doc_key);
+		key = (const char *)hash_table_lookup(query->fields->fieldmap, doc_key);
 		mongodb_debug("result doc key=%s; map key=%s", doc_key, key);
 		if (key == NULL)
 			continue; /* most likely the _id field, but still ignore any unknown fields */
@@ -415,7 +599,8 @@ mongodb_driver_query_result_nested(mongodb_query_t query, bson_iterator *iter,
 	return ret;
 }
 
-static int mongodb_driver_query_result(mongodb_query_t query, bson *_result, mongodb_result_t *result_r)
+static int mongodb_driver_query_result(mongodb_query_t query, const char *doc,
+				       mongodb_result_t *result_r)
 {
 	mongodb_result_t result;
 	bson_iterator iter[1];
@@ -425,117 +610,336 @@ static int mongodb_driver_query_result(mongodb_query_t query, bson *_result, mon
 	result = p_new(query->pool, struct mongodb_result, 1);
 	result->query = query;
 	hash_table_create(&(result->fields), query->pool, 0, str_hash, strcmp);
-	hash_table_copy(result->fields, query->defaults);
+	hash_table_copy(result->fields, query->fields->defaults);
 	*result_r = result;
 
 	/* grab the parts of the BSON result we are interested in */
-	bson_iterator_init(iter, _result);
+	bson_iterator_from_buffer(iter, doc);
 	ret = mongodb_driver_query_result_nested(query, iter, NULL, result);
 	mongodb_driver_result_debug(result);
 
 	return ret;
 }
 
-static int mongodb_driver_query_find_one(mongodb_query_t query, const char *collection, mongodb_result_t *result_r)
+static void mongodb_driver_query_callback(mongodb_query_t query, int ret,
+					  mongodb_result_t result)
 {
-	struct mongodb_conn *conn = query->conn;
+	mongodb_query_callback_t *callback = query->callback;
+
+	query->callback = NULL;
+	callback(ret, result, query->context);
+}
+
+static void
+mongodb_driver_query_set_error(mongodb_query_t query, const char *error)
+{
+	query->error = p_strdup(query->pool, error);
+	mongodb_driver_set_error(query->conn, error);
+	if (query->wire != NULL) {
+		mongodb_pool_reply_error(query->conn->pool_conns,
+					 query->wire, error);
+	}
+}
+
+/* Remember the connection picked for the query. Returns FALSE and calls
+   the callback with failure if there are no usable servers. */
+static bool
+mongodb_driver_query_set_wire(mongodb_query_t query, struct mongodb_wire *wire)
+{
+	query->wire = wire;
+	if (wire != NULL)
+		return TRUE;
+
+	mongodb_driver_query_set_error(query, "No available MongoDB servers");
+	mongodb_driver_query_callback(query, MONGODB_QUERY_ERROR, NULL);
+	return FALSE;
+}
+
+/* Pick the connection for the query. send_callback is called once it's
+   known, which may be only after the replica set roles are looked up. */
+static void
+mongodb_driver_query_get_wire(mongodb_query_t query, bool write,
+			      mongodb_pool_wire_callback_t *send_callback)
+{
+	query->wire = NULL;
+	mongodb_pool_get_wire(query->conn->pool_conns, write,
+			      send_callback, query);
+}
 
+static const char *
+mongodb_driver_query_ns(mongodb_query_t query, const char *collection)
+{
 	const char *ns;
-	bson *_result;
-	int ret = -1;
 
-	/* execute the query on the mongo database */
-	ns = t_strdup_printf("%s.%s", conn->uri.database,
-			     collection);
+	ns = p_strdup_printf(query->pool, "%s.%s",
+			     query->conn->uri.database, collection);
 	mongodb_debug("ns=%s", ns);
+	bson_debug(query->conn, query->query, 0);
+	if (query->other != NULL)
+		bson_debug(query->conn, query->other, 0);
+	return ns;
+}
 
-	_result = p_new(conn->pool, bson, 1);
-
-	bson_debug(conn, query->query, 0);
-	bson_debug(conn, query->other, 0);
-	ret = mongo_find_one(conn->conn, ns, query->query, query->other, _result);
+static void
+mongodb_driver_find_one_reply(const struct mongodb_wire_reply *reply,
+			      void *context)
+{
+	mongodb_query_t query = context;
+	mongodb_result_t result = NULL;
+	int ret;
 
-	/* if we have a matching document, convert the fields as-per the field map */
-	if (ret != MONGO_OK) {
-		mongodb_debug("converting result");
-		if (conn->conn->err == MONGO_CONN_SUCCESS) {
-			ret = MONGODB_QUERY_ERROR;
-		} else {
-			ret = MONGODB_QUERY_NO_RESULT;
-		}
+	if (reply->error != NULL) {
+		mongodb_driver_query_set_error(query, reply->error);
+		ret = MONGODB_QUERY_ERROR;
+	} else if (reply->number_returned < 1) {
+		ret = MONGODB_QUERY_NO_RESULT;
 	} else {
-		ret = mongodb_driver_query_result(query, _result, result_r);
+		/* if we have a matching document, convert the fields as-per
+		   the field map */
+		mongodb_debug("converting result");
+		(void)mongodb_driver_query_result(query,
+			(const char *)reply->documents, &result);
+		ret = MONGODB_QUERY_OK;
 	}
+	mongodb_driver_query_callback(query, ret, result);
+}
 
-	return ret;
+static void
+mongodb_driver_find_one_send(struct mongodb_wire *wire, int32_t flags,
+			     void *context)
+{
+	mongodb_query_t query = context;
+
+	if (!mongodb_driver_query_set_wire(query, wire))
+		return;
+	/* numberToReturn=-1 returns a single document and closes the cursor */
+	mongodb_wire_query(wire, query->ns, flags, 0, -1,
+			   query->query, query->other,
+			   mongodb_driver_find_one_reply, query);
 }
 
-static int mongodb_driver_query_find(mongodb_query_t query, const char *collection)
+static void
+mongodb_driver_query_find_one_async(mongodb_query_t query,
+				    const char *collection,
+				    mongodb_query_callback_t *callback,
+				    void *context)
 {
-	struct mongodb_conn *conn = query->conn;
-	const char *ns;
+	i_assert(query->callback == NULL);
+	i_assert(query->query != NULL);
+
+	query->callback = callback;
+	query->context = context;
+	query->ns = mongodb_driver_query_ns(query, collection);
+	mongodb_driver_query_get_wire(query, FALSE,
+				      mongodb_driver_find_one_send);
+}
 
-	ns = t_strdup_printf("%s.%s", conn->uri.database,
-			     collection);
-	mongodb_debug("ns=%s", ns);
-	bson_debug(conn, query->query, 0);
-	bson_debug(conn, query->other, 0);
+struct mongodb_driver_sync_context {
+	int ret;
+	mongodb_result_t result;
+	bool finished;
+};
 
-	/* execute the query on the mongo database */
-	query->cursor = mongo_find(conn->conn, ns, query->query, query->other, 0, 0, 0);
+static void mongodb_driver_sync_callback(int ret, mongodb_result_t result,
+					 void *context)
+{
+	struct mongodb_driver_sync_context *ctx = context;
 
-	if (query->cursor == NULL) {
-		return MONGODB_QUERY_ERROR;
+	ctx->ret = ret;
+	ctx->result = result;
+	ctx->finished = TRUE;
+}
+
+static void mongodb_driver_sync_wait(mongodb_query_t query,
+				     struct mongodb_driver_sync_context *ctx)
+{
+	if (!ctx->finished && query->wire == NULL) {
+		/* the connection hasn't been picked yet */
+		mongodb_pool_wait(query->conn->pool_conns);
 	}
+	if (!ctx->finished)
+		mongodb_wire_wait(query->wire);
+	i_assert(ctx->finished);
+}
 
-	return MONGO_OK;
+static int mongodb_driver_query_find_one(mongodb_query_t query, const char *collection, mongodb_result_t *result_r)
+{
+	struct mongodb_driver_sync_context ctx;
+
+	memset(&ctx, 0, sizeof(ctx));
+	mongodb_driver_query_find_one_async(query, collection,
+					    mongodb_driver_sync_callback, &ctx);
+	mongodb_driver_sync_wait(query, &ctx);
+	*result_r = ctx.result;
+	return ctx.ret;
 }
 
-static int mongodb_driver_query_find_next(mongodb_query_t query, mongodb_result_t *result_r)
+static void
+mongodb_driver_find_reply(const struct mongodb_wire_reply *reply,
+			  void *context)
 {
+	mongodb_query_t query = context;
 
-	int ret;
-	bson *_result;
-
-	_result = p_new(query->pool, bson, 1);
-	ret = mongo_cursor_next(query->cursor);
-	if (ret == MONGO_OK) {
-		ret = bson_copy(_result, &query->cursor->current);
-		if (ret == MONGO_OK) {
-			ret = mongodb_driver_query_result(query, _result, result_r);
-		}
-	} else if (ret == MONGO_ERROR && query->cursor->err == MONGO_CURSOR_EXHAUSTED) {
-		ret = MONGODB_QUERY_NO_RESULT;
-	} else {
-		ret = MONGODB_QUERY_ERROR;
+	if (reply->error != NULL) {
+		mongodb_driver_query_set_error(query, reply->error);
+		query->cursor_id = 0;
+		mongodb_driver_query_callback(query, MONGODB_QUERY_ERROR, NULL);
+		return;
 	}
 
-	return ret;
+	/* the reply data is gone after this call, so keep a copy of the
+	   documents until they're iterated through */
+	if (query->documents == NULL) {
+		query->documents = buffer_create_dynamic(default_pool,
+							 reply->documents_size);
+	}
+	buffer_set_used_size(query->documents, 0);
+	buffer_append(query->documents, reply->documents,
+		      reply->documents_size);
+	query->documents_pos = 0;
+	query->cursor_id = reply->cursor_id;
+	mongodb_driver_query_callback(query, MONGODB_QUERY_OK, NULL);
 }
 
-static int mongodb_driver_query_update(mongodb_query_t query, const char *collection, bool multi)
+static void
+mongodb_driver_find_send(struct mongodb_wire *wire, int32_t flags,
+			 void *context)
 {
-	struct mongodb_conn *conn = query->conn;
-	const char *ns;
-	int flags = 0, ret;
+	mongodb_query_t query = context;
 
-	ns = t_strdup_printf("%s.%s", conn->uri.database,
-			     collection);
-	mongodb_debug("ns=%s", ns);
-	bson_debug(conn, query->query, 0);
-	bson_debug(conn, query->other, 0);
+	if (!mongodb_driver_query_set_wire(query, wire))
+		return;
+	mongodb_wire_query(wire, query->ns, flags, 0, 0,
+			   query->query, query->other,
+			   mongodb_driver_find_reply, query);
+}
 
-	/* execute the query on the mongo database */
-	if (mongo_update(conn->conn, ns, query->query, query->other, flags, 0) != MONGO_OK)
-		ret = MONGODB_QUERY_ERROR;
-	else
-		ret = MONGODB_QUERY_OK;
+static int mongodb_driver_query_find(mongodb_query_t query, const char *collection)
+{
+	struct mongodb_driver_sync_context ctx;
+
+	i_assert(query->callback == NULL);
+	i_assert(query->query != NULL);
+
+	memset(&ctx, 0, sizeof(ctx));
+	query->callback = mongodb_driver_sync_callback;
+	query->context = &ctx;
+	query->ns = mongodb_driver_query_ns(query, collection);
+	mongodb_driver_query_get_wire(query, FALSE, mongodb_driver_find_send);
+	mongodb_driver_sync_wait(query, &ctx);
+	return ctx.ret;
+}
+
+static int mongodb_driver_query_find_next(mongodb_query_t query, mongodb_result_t *result_r)
+{
+	struct mongodb_driver_sync_context ctx;
+	const unsigned char *doc;
+	int32_t doc_size;
 
-	if (query->cursor == NULL) {
+	if (query->documents == NULL)
 		return MONGODB_QUERY_ERROR;
+
+	if (query->documents_pos == query->documents->used) {
+		if (query->cursor_id == 0)
+			return MONGODB_QUERY_NO_RESULT;
+
+		/* fetch the next batch */
+		memset(&ctx, 0, sizeof(ctx));
+		query->callback = mongodb_driver_sync_callback;
+		query->context = &ctx;
+		mongodb_wire_get_more(query->wire, query->ns, 0,
+				      query->cursor_id,
+				      mongodb_driver_find_reply, query);
+		mongodb_driver_sync_wait(query, &ctx);
+		if (ctx.ret != MONGODB_QUERY_OK)
+			return ctx.ret;
+		if (query->documents->used == 0)
+			return MONGODB_QUERY_NO_RESULT;
 	}
 
-	return MONGO_OK;
+	doc = CONST_PTR_OFFSET(query->documents->data, query->documents_pos);
+	doc_size = mongodb_get_int32(doc);
+	if (doc_size < 5 ||
+	    (size_t)doc_size > query->documents->used - query->documents_pos) {
+		query->error = "Invalid document in reply";
+		mongodb_driver_set_error(query->conn, query->error);
+		return MONGODB_QUERY_ERROR;
+	}
+	query->documents_pos += doc_size;
+	(void)mongodb_driver_query_result(query, (const char *)doc, result_r);
+	return MONGODB_QUERY_OK;
+}
+
+static void
+mongodb_driver_update_reply(const struct mongodb_wire_reply *reply,
+			    void *context)
+{
+	mongodb_query_t query = context;
+	bson_iterator iter;
+	const char *error = reply->error;
+
+	if (error == NULL && reply->number_returned > 0) {
+		/* getLastError reply: { err: null | "error", ... } */
+		bson_iterator_from_buffer(&iter,
+					  (const char *)reply->documents);
+		while (bson_iterator_next(&iter) != BSON_EOO) {
+			if (strcmp(bson_iterator_key(&iter), "err") == 0 &&
+			    bson_iterator_type(&iter) == BSON_STRING) {
+				error = t_strdup(bson_iterator_string(&iter));
+				break;
+			}
+		}
+	}
+
+	if (error != NULL) {
+		mongodb_driver_query_set_error(query, error);
+		mongodb_driver_query_callback(query, MONGODB_QUERY_ERROR, NULL);
+	} else {
+		mongodb_driver_query_callback(query, MONGODB_QUERY_OK, NULL);
+	}
+}
+
+static void
+mongodb_driver_update_send(struct mongodb_wire *wire,
+			   int32_t flags ATTR_UNUSED, void *context)
+{
+	mongodb_query_t query = context;
+
+	if (!mongodb_driver_query_set_wire(query, wire))
+		return;
+	mongodb_wire_update(wire, query->conn->uri.database,
+			    query->collection,
+			    query->multi ? MONGODB_WIRE_UPDATE_FLAG_MULTI : 0,
+			    query->query, query->other,
+			    mongodb_driver_update_reply, query);
+}
+
+static void
+mongodb_driver_query_update_async(mongodb_query_t query,
+				  const char *collection, bool multi,
+				  mongodb_query_callback_t *callback,
+				  void *context)
+{
+	i_assert(query->callback == NULL);
+	i_assert(query->query != NULL && query->other != NULL);
+
+	query->callback = callback;
+	query->context = context;
+	query->collection = p_strdup(query->pool, collection);
+	query->multi = multi;
+	(void)mongodb_driver_query_ns(query, collection);
+	mongodb_driver_query_get_wire(query, TRUE, mongodb_driver_update_send);
+}
+
+static int mongodb_driver_query_update(mongodb_query_t query, const char *collection, bool multi)
+{
+	struct mongodb_driver_sync_context ctx;
+
+	memset(&ctx, 0, sizeof(ctx));
+	mongodb_driver_query_update_async(query, collection, multi,
+					  mongodb_driver_sync_callback, &ctx);
+	mongodb_driver_sync_wait(query, &ctx);
+	return ctx.ret;
 }
 
 static void mongodb_driver_query_debug(mongodb_query_t query)
@@ -556,6 +960,206 @@ static void mongodb_driver_query_debug(mongodb_query_t query)
 }
 /* end of query api */
 
+/* template api */
+static int
+mongodb_template_scan(struct mongodb_template *tmpl, const char *doc,
+		      uint32_t parents, const char **error_r)
+{
+	struct mongodb_template_slot *slot;
+	bson_iterator iter;
+	const char *value;
+	size_t offset = doc - (const char *)tmpl->query->data;
+	unsigned int doc_idx = array_count(&tmpl->docs);
+
+	if (doc_idx >= sizeof(parents)*8) {
+		*error_r = "Too many nested documents";
+		return -1;
+	}
+	array_append(&tmpl->docs, &offset, 1);
+	parents |= 1U << doc_idx;
+
+	bson_iterator_from_buffer(&iter, doc);
+	while (bson_iterator_next(&iter) != BSON_EOO) {
+		if (strchr(bson_iterator_key(&iter), '%') != NULL) {
+			/* the keys were expanded when the whole query was
+			   expanded before parsing, but not anymore */
+			*error_r = t_strdup_printf(
+				"%%variables are expanded only inside string "
+				"values, not in keys: %s",
+				bson_iterator_key(&iter));
+			return -1;
+		}
+		switch (bson_iterator_type(&iter)) {
+		case BSON_OBJECT:
+			if (mongodb_template_scan(tmpl, bson_iterator_value(&iter),
+						  parents, error_r) < 0)
+				return -1;
+			break;
+		case BSON_STRING:
+			value = bson_iterator_string(&iter);
+			if (strchr(value, '%') == NULL)
+				break;
+			/* the value is expanded for each query */
+			slot = array_append_space(&tmpl->slots);
+			slot->offset = bson_iterator_value(&iter) -
+				(const char *)tmpl->query->data;
+			slot->parents = parents;
+			slot->value = p_strdup(tmpl->pool, value);
+			break;
+		default:
+			break;
+		}
+	}
+	return 0;
+}
+
+static void mongodb_driver_template_deinit(mongodb_template_t *_tmpl)
+{
+	struct mongodb_template *tmpl = *_tmpl;
+	pool_t pool = tmpl->pool;
+
+	*_tmpl = NULL;
+
+	if (tmpl->fields_bson.data != NULL)
+		bson_destroy(&tmpl->fields_bson);
+	mongodb_fields_deinit(&tmpl->fields);
+	pool_unref(&pool);
+}
+
+static mongodb_template_t
+mongodb_driver_template_init(mongodb_conn_t conn, const char *query_json,
+			     const char *fields, const char *defaults,
+			     const char **error_r)
+{
+	struct mongodb_template *tmpl;
+	bson b;
+	pool_t pool;
+	int ret;
+
+	pool = pool_alloconly_create("mongodb template", 1024);
+	tmpl = p_new(pool, struct mongodb_template, 1);
+	tmpl->pool = pool;
+	tmpl->conn = conn;
+	p_array_init(&tmpl->slots, pool, 4);
+	p_array_init(&tmpl->docs, pool, 2);
+	mongodb_fields_init(&tmpl->fields, pool);
+
+	ret = mongodb_json_to_bson(&b, query_json);
+	if (ret == 0) {
+		tmpl->query = buffer_create_dynamic(pool, bson_size(&b));
+		buffer_append(tmpl->query, bson_data(&b), bson_size(&b));
+	}
+	bson_destroy(&b);
+
+	if (ret < 0) {
+		*error_r = strchr(query_json, '%') == NULL ?
+			"Failed to parse query" :
+			"Failed to parse query (%variables are expanded only "
+			"inside string values, e.g. \"%u\", not %u)";
+		ret = -1;
+	} else if (mongodb_template_scan(tmpl, tmpl->query->data,
+					 0, error_r) < 0) {
+		ret = -1;
+	} else if (mongodb_fields_parse(&tmpl->fields, &tmpl->fields_bson,
+					pool, fields) != BSON_OK) {
+		*error_r = "Failed to parse fields";
+		ret = -1;
+	} else if (defaults != NULL &&
+		   mongodb_fields_parse_defaults(&tmpl->fields, pool,
+						 defaults) < 0) {
+		*error_r = "Failed to parse defaults";
+		ret = -1;
+	}
+	if (ret < 0) {
+		mongodb_driver_template_deinit(&tmpl);
+		return NULL;
+	}
+	return tmpl;
+}
+
+static void
+mongodb_template_copy(const struct mongodb_template *tmpl, buffer_t *dest,
+		      size_t start, size_t end, unsigned int *doc_idx,
+		      size_t *doc_dest_offsets)
+{
+	const size_t *docs;
+	unsigned int count;
+
+	/* remember where the documents starting in this range end up */
+	docs = array_get(&tmpl->docs, &count);
+	for (; *doc_idx < count && docs[*doc_idx] < end; (*doc_idx)++) {
+		doc_dest_offsets[*doc_idx] =
+			dest->used + (docs[*doc_idx] - start);
+	}
+	buffer_append(dest, CONST_PTR_OFFSET(tmpl->query->data, start),
+		      end - start);
+}
+
+static mongodb_query_t
+mongodb_driver_query_init_template(mongodb_template_t tmpl,
+				   const struct var_expand_table *table)
+{
+	const struct mongodb_template_slot *slot;
+	size_t doc_dest_offsets[32];
+	int32_t doc_growth[32];
+	mongodb_query_t query;
+	buffer_t *dest;
+	string_t *value;
+	unsigned char *data;
+	unsigned int i, doc_idx = 0, docs_count;
+	size_t pos = 0;
+	int32_t old_len, new_len;
+
+	query = mongodb_driver_query_alloc(tmpl->conn);
+	query->fields = &tmpl->fields;
+	query->other = &tmpl->fields_bson;
+	query->bson_borrowed = TRUE;
+
+	/* copy the template, replacing the variable strings with their
+	   expanded values. the lengths of the documents containing them
+	   are fixed afterwards. */
+	docs_count = array_count(&tmpl->docs);
+	memset(doc_growth, 0, sizeof(doc_growth));
+	dest = buffer_create_dynamic(query->pool, tmpl->query->used + 128);
+	value = t_str_new(128);
+	array_foreach(&tmpl->slots, slot) {
+		mongodb_template_copy(tmpl, dest, pos, slot->offset,
+				      &doc_idx, doc_dest_offsets);
+
+		str_truncate(value, 0);
+		var_expand(value, slot->value, table);
+		old_len = mongodb_get_int32(CONST_PTR_OFFSET(tmpl->query->data,
+							     slot->offset));
+		new_len = str_len(value) + 1;
+
+		data = buffer_append_space_unsafe(dest, 4);
+		mongodb_set_int32(data, new_len);
+		buffer_append(dest, str_c(value), new_len);
+
+		for (i = 0; i < docs_count; i++) {
+			if ((slot->parents & (1U << i)) != 0)
+				doc_growth[i] += new_len - old_len;
+		}
+		pos = slot->offset + 4 + old_len;
+	}
+	mongodb_template_copy(tmpl, dest, pos, tmpl->query->used,
+			      &doc_idx, doc_dest_offsets);
+
+	data = buffer_get_modifiable_data(dest, NULL);
+	for (i = 0; i < docs_count; i++) {
+		if (doc_growth[i] != 0) {
+			mongodb_set_int32(data + doc_dest_offsets[i],
+				mongodb_get_int32(data + doc_dest_offsets[i]) +
+				doc_growth[i]);
+		}
+	}
+
+	query->query = p_new(query->pool, bson, 1);
+	bson_init_data(query->query, (char *)data);
+	return query;
+}
+/* end of template api */
+
 /* result api */
 static int mongodb_driver_result_var_expand(mongodb_result_t result, struct var_expand_table *_table)
 {
@@ -657,6 +1261,7 @@ const struct mongodb_driver_vfuncs mongodb_vfuncs = {
 	mongodb_driver_conn_init,
 	mongodb_driver_conn_deinit,
 	mongodb_driver_get_error,
+	mongodb_driver_conn_wait,
 
 	/* query api */
 	mongodb_driver_query_init,
@@ -670,6 +1275,13 @@ const struct mongodb_driver_vfuncs mongodb_vfuncs = {
 	mongodb_driver_query_find,
 	mongodb_driver_query_find_next,
 	mongodb_driver_query_update,
+	mongodb_driver_query_find_one_async,
+	mongodb_driver_query_update_async,
+
+	/* template api */
+	mongodb_driver_template_init,
+	mongodb_driver_template_deinit,
+	mongodb_driver_query_init_template,
 
 	/* result api */
 	mongodb_driver_result_var_expand,
@@ -0,0 +1,554 @@
+/* Copyright (c) 2013 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "ioloop.h"
+#include "mongodb-pool.h"
+
+/* Reconnection delays, the same as lib-sql uses. */
+#define MONGODB_CONNECT_MIN_DELAY 1
+#define MONGODB_CONNECT_MAX_DELAY (60*30)
+#define MONGODB_CONNECT_RESET_DELAY 15
+
+enum mongodb_host_role {
+	MONGODB_HOST_ROLE_UNKNOWN = 0,
+	MONGODB_HOST_ROLE_PRIMARY,
+	MONGODB_HOST_ROLE_SECONDARY,
+	/* arbiter, recovering, etc. - not usable for queries */
+	MONGODB_HOST_ROLE_OTHER
+};
+
+struct mongodb_pool_host {
+	char *name;
+	struct ip_addr ip;
+	unsigned int port;
+
+	enum mongodb_host_role role;
+	unsigned int connection_count;
+
+	/* don't try to connect before this time */
+	time_t connect_next;
+	unsigned int connect_delay;
+	unsigned int connect_failure_count;
+
+	unsigned int discovering:1;
+};
+
+struct mongodb_pool_connection {
+	struct mongodb_pool *pool;
+	struct mongodb_wire *wire;
+	unsigned int host_idx;
+};
+
+struct mongodb_pool_wire_request {
+	bool write;
+	mongodb_pool_wire_callback_t *callback;
+	void *context;
+};
+
+struct mongodb_pool {
+	unsigned int connection_limit;
+	unsigned int timeout_msecs;
+	enum mongodb_read_preference read_preference;
+
+	ARRAY(struct mongodb_pool_host) hosts;
+	/* all connections to all hosts */
+	ARRAY(struct mongodb_pool_connection *) all_connections;
+
+	/* number of isMaster commands we're still waiting for */
+	unsigned int discovery_pending;
+	/* requests waiting for the pending isMaster replies */
+	ARRAY(struct mongodb_pool_wire_request) wire_requests;
+	/* roles have been successfully looked up at least once */
+	unsigned int discovered:1;
+};
+
+static void mongodb_pool_discover(struct mongodb_pool *pool);
+static void mongodb_pool_wire_requests_flush(struct mongodb_pool *pool);
+
+static void
+mongodb_pool_wire_state_changed(struct mongodb_wire *wire ATTR_UNUSED,
+				enum mongodb_wire_state state, void *context)
+{
+	struct mongodb_pool_connection *conn = context;
+	struct mongodb_pool *pool = conn->pool;
+	struct mongodb_pool_host *host =
+		array_idx_modifiable(&pool->hosts, conn->host_idx);
+
+	switch (state) {
+	case MONGODB_WIRE_STATE_CONNECTED:
+		host->connect_failure_count = 0;
+		host->connect_delay = MONGODB_CONNECT_MIN_DELAY;
+		host->connect_next = 0;
+		break;
+	case MONGODB_WIRE_STATE_CONNECT_FAILED:
+		if (host->connect_failure_count > 0) {
+			/* increase delay between reconnections to this
+			   server */
+			host->connect_delay *= 5;
+			if (host->connect_delay > MONGODB_CONNECT_MAX_DELAY)
+				host->connect_delay = MONGODB_CONNECT_MAX_DELAY;
+		}
+		host->connect_failure_count++;
+		host->connect_next = ioloop_time + host->connect_delay;
+		if (host->role == MONGODB_HOST_ROLE_PRIMARY) {
+			/* the primary may have failed over elsewhere */
+			host->role = MONGODB_HOST_ROLE_UNKNOWN;
+			mongodb_pool_discover(pool);
+		}
+		break;
+	case MONGODB_WIRE_STATE_DISCONNECTED:
+		if (host->role == MONGODB_HOST_ROLE_PRIMARY) {
+			host->role = MONGODB_HOST_ROLE_UNKNOWN;
+			mongodb_pool_discover(pool);
+		}
+		break;
+	}
+}
+
+static struct mongodb_pool_connection *
+mongodb_pool_add_connection(struct mongodb_pool *pool, unsigned int host_idx)
+{
+	struct mongodb_pool_host *host =
+		array_idx_modifiable(&pool->hosts, host_idx);
+	struct mongodb_pool_connection *conn;
+
+	host->connection_count++;
+
+	conn = i_new(struct mongodb_pool_connection, 1);
+	conn->pool = pool;
+	conn->host_idx = host_idx;
+	conn->wire = mongodb_wire_init(&host->ip, host->port,
+				       pool->timeout_msecs);
+	mongodb_wire_set_state_callback(conn->wire,
+					mongodb_pool_wire_state_changed, conn);
+	array_append(&pool->all_connections, &conn, 1);
+	return conn;
+}
+
+static struct mongodb_pool_connection *
+mongodb_pool_host_get_connection(struct mongodb_pool *pool,
+				 unsigned int host_idx)
+{
+	struct mongodb_pool_connection *const *connp;
+
+	array_foreach(&pool->all_connections, connp) {
+		if ((*connp)->host_idx == host_idx)
+			return *connp;
+	}
+	return mongodb_pool_add_connection(pool, host_idx);
+}
+
+struct mongodb_pool_discover_context {
+	struct mongodb_pool *pool;
+	unsigned int host_idx;
+};
+
+static void mongodb_pool_discover_reply(const struct mongodb_wire_reply *reply,
+					void *context)
+{
+	struct mongodb_pool_discover_context *ctx = context;
+	struct mongodb_pool *pool = ctx->pool;
+	struct mongodb_pool_host *host =
+		array_idx_modifiable(&pool->hosts, ctx->host_idx);
+	bson_iterator iter;
+	bool ismaster = FALSE, secondary = FALSE;
+
+	i_free(ctx);
+	host->discovering = FALSE;
+	i_assert(pool->discovery_pending > 0);
+	pool->discovery_pending--;
+
+	if (reply->error != NULL || reply->number_returned < 1) {
+		host->role = MONGODB_HOST_ROLE_UNKNOWN;
+		if (pool->discovery_pending == 0)
+			mongodb_pool_wire_requests_flush(pool);
+		return;
+	}
+
+	bson_iterator_from_buffer(&iter, (const char *)reply->documents);
+	while (bson_iterator_next(&iter) != BSON_EOO) {
+		if (bson_iterator_type(&iter) != BSON_BOOL)
+			continue;
+		if (strcmp(bson_iterator_key(&iter), "ismaster") == 0)
+			ismaster = bson_iterator_bool(&iter);
+		else if (strcmp(bson_iterator_key(&iter), "secondary") == 0)
+			secondary = bson_iterator_bool(&iter);
+	}
+
+	host->role = ismaster ? MONGODB_HOST_ROLE_PRIMARY :
+		secondary ? MONGODB_HOST_ROLE_SECONDARY :
+		MONGODB_HOST_ROLE_OTHER;
+	pool->discovered = TRUE;
+	if (pool->discovery_pending == 0)
+		mongodb_pool_wire_requests_flush(pool);
+}
+
+static void mongodb_pool_discover(struct mongodb_pool *pool)
+{
+	struct mongodb_pool_discover_context *ctx;
+	struct mongodb_pool_connection *conn;
+	struct mongodb_pool_host *hosts;
+	unsigned int i, count;
+	bson cmd;
+
+	hosts = array_get_modifiable(&pool->hosts, &count);
+	if (count == 1) {
+		/* nothing to choose from. let the server tell us if it's
+		   not the primary. */
+		hosts[0].role = MONGODB_HOST_ROLE_PRIMARY;
+		pool->discovered = TRUE;
+		return;
+	}
+
+	bson_init(&cmd);
+	bson_append_int(&cmd, "ismaster", 1);
+	bson_finish(&cmd);
+
+	for (i = 0; i < count; i++) {
+		if (hosts[i].discovering || hosts[i].connect_next > ioloop_time)
+			continue;
+
+		hosts[i].discovering = TRUE;
+		pool->discovery_pending++;
+
+		ctx = i_new(struct mongodb_pool_discover_context, 1);
+		ctx->pool = pool;
+		ctx->host_idx = i;
+		conn = mongodb_pool_host_get_connection(pool, i);
+		mongodb_wire_query(conn->wire, "admin.$cmd", 0, 0, -1,
+				   &cmd, NULL, mongodb_pool_discover_reply, ctx);
+	}
+	bson_destroy(&cmd);
+}
+
+static int
+mongodb_pool_parse_host(struct mongodb_pool_host *host, const char *str,
+			const char **error_r)
+{
+	struct ip_addr *ips;
+	unsigned int ips_count, port = 27017;
+	const char *p, *hostname = str;
+	int ret;
+
+	p = strrchr(str, ':');
+	if (p != NULL && strchr(str, ']') < p) {
+		hostname = t_strdup_until(str, p);
+		if (str_to_uint(p + 1, &port) < 0 || port == 0 || port > 65535) {
+			*error_r = t_strdup_printf("Invalid port: %s", str);
+			return -1;
+		}
+	}
+	if (*hostname == '[') {
+		/* [ipv6]:port */
+		hostname = t_strcut(hostname + 1, ']');
+	}
+	if (*hostname == '\0')
+		hostname = "localhost";
+
+	if (net_addr2ip(hostname, &host->ip) < 0) {
+		ret = net_gethostbyname(hostname, &ips, &ips_count);
+		if (ret != 0) {
+			*error_r = t_strdup_printf(
+				"gethostbyname(%s) failed: %s",
+				hostname, net_gethosterror(ret));
+			return -1;
+		}
+		host->ip = ips[0];
+	}
+	host->name = i_strdup(str);
+	host->port = port;
+	host->connect_delay = MONGODB_CONNECT_MIN_DELAY;
+	return 0;
+}
+
+int mongodb_pool_init(const struct mongodb_pool_settings *set,
+		      struct mongodb_pool **pool_r, const char **error_r)
+{
+	struct mongodb_pool *pool;
+	struct mongodb_pool_host *host;
+	const char *const *hostp;
+
+	i_assert(set->hosts[0] != NULL);
+
+	pool = i_new(struct mongodb_pool, 1);
+	pool->connection_limit = set->connection_limit != 0 ?
+		set->connection_limit : MONGODB_POOL_DEFAULT_CONNECTION_LIMIT;
+	pool->timeout_msecs = set->timeout_msecs;
+	pool->read_preference = set->read_preference;
+	i_array_init(&pool->hosts, 4);
+	i_array_init(&pool->all_connections, 16);
+	i_array_init(&pool->wire_requests, 8);
+
+	for (hostp = set->hosts; *hostp != NULL; hostp++) {
+		host = array_append_space(&pool->hosts);
+		if (mongodb_pool_parse_host(host, *hostp, error_r) < 0) {
+			mongodb_pool_deinit(&pool);
+			return -1;
+		}
+	}
+
+	/* start looking up the replica set members' roles immediately */
+	mongodb_pool_discover(pool);
+	*pool_r = pool;
+	return 0;
+}
+
+void mongodb_pool_deinit(struct mongodb_pool **_pool)
+{
+	struct mongodb_pool *pool = *_pool;
+	struct mongodb_pool_connection **connp;
+	struct mongodb_pool_host *host;
+	const struct mongodb_pool_wire_request *req;
+
+	*_pool = NULL;
+
+	/* fail the requests still waiting for a connection before the
+	   aborted isMaster replies would try to send them */
+	array_foreach(&pool->wire_requests, req)
+		req->callback(NULL, 0, req->context);
+	array_clear(&pool->wire_requests);
+
+	array_foreach_modifiable(&pool->all_connections, connp) {
+		mongodb_wire_deinit(&(*connp)->wire);
+		i_free(*connp);
+	}
+	array_foreach_modifiable(&pool->hosts, host)
+		i_free(host->name);
+	array_free(&pool->all_connections);
+	array_free(&pool->wire_requests);
+	array_free(&pool->hosts);
+	i_free(pool);
+}
+
+static bool
+mongodb_pool_have_role(struct mongodb_pool *pool, enum mongodb_host_role role)
+{
+	const struct mongodb_pool_host *host;
+
+	array_foreach(&pool->hosts, host) {
+		if (host->role == role && host->connect_next <= ioloop_time)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static bool
+mongodb_pool_want_role(struct mongodb_pool *pool, bool write,
+		       enum mongodb_host_role role)
+{
+	if (write)
+		return role == MONGODB_HOST_ROLE_PRIMARY;
+
+	switch (pool->read_preference) {
+	case MONGODB_READ_PRIMARY:
+		return role == MONGODB_HOST_ROLE_PRIMARY;
+	case MONGODB_READ_PRIMARY_PREFERRED:
+		if (mongodb_pool_have_role(pool, MONGODB_HOST_ROLE_PRIMARY))
+			return role == MONGODB_HOST_ROLE_PRIMARY;
+		return role == MONGODB_HOST_ROLE_SECONDARY;
+	case MONGODB_READ_SECONDARY:
+		return role == MONGODB_HOST_ROLE_SECONDARY;
+	case MONGODB_READ_SECONDARY_PREFERRED:
+		if (mongodb_pool_have_role(pool, MONGODB_HOST_ROLE_SECONDARY))
+			return role == MONGODB_HOST_ROLE_SECONDARY;
+		return role == MONGODB_HOST_ROLE_PRIMARY;
+	case MONGODB_READ_NEAREST:
+		return role == MONGODB_HOST_ROLE_PRIMARY ||
+			role == MONGODB_HOST_ROLE_SECONDARY;
+	}
+	i_unreached();
+}
+
+static void mongodb_pool_reset_connect_delays(struct mongodb_pool *pool)
+{
+	struct mongodb_pool_host *host;
+
+	/* no usable hosts. connect delays may have gotten too high, reset
+	   all of them to see if some are still alive. */
+	array_foreach_modifiable(&pool->hosts, host) {
+		if (host->connect_delay > MONGODB_CONNECT_RESET_DELAY)
+			host->connect_delay = MONGODB_CONNECT_RESET_DELAY;
+		if (host->connect_next > ioloop_time + host->connect_delay)
+			host->connect_next = ioloop_time + host->connect_delay;
+	}
+}
+
+static struct mongodb_wire *
+mongodb_pool_find_wire(struct mongodb_pool *pool, bool write,
+		       bool any_role)
+{
+	struct mongodb_pool_connection *const *conns, *best = NULL;
+	struct mongodb_pool_host *hosts;
+	unsigned int i, count, hosts_count, pending, best_pending = UINT_MAX;
+	unsigned int new_host_idx = UINT_MAX;
+
+	hosts = array_get_modifiable(&pool->hosts, &hosts_count);
+
+	/* find the least loaded connection to a wanted host */
+	conns = array_get(&pool->all_connections, &count);
+	for (i = 0; i < count; i++) {
+		const struct mongodb_pool_host *host =
+			&hosts[conns[i]->host_idx];
+
+		if (host->connect_next > ioloop_time)
+			continue;
+		if (!any_role && !mongodb_pool_want_role(pool, write, host->role))
+			continue;
+
+		pending = mongodb_wire_get_pending_count(conns[i]->wire);
+		if (pending < best_pending) {
+			best = conns[i];
+			best_pending = pending;
+		}
+	}
+	if (best != NULL && best_pending == 0)
+		return best->wire;
+
+	/* all connections are busy. open a new one to the wanted host that
+	   has the least connections, if it's still below the limit. */
+	for (i = 0; i < hosts_count; i++) {
+		if (hosts[i].connect_next > ioloop_time ||
+		    hosts[i].connection_count >= pool->connection_limit)
+			continue;
+		if (!any_role &&
+		    !mongodb_pool_want_role(pool, write, hosts[i].role))
+			continue;
+		if (new_host_idx == UINT_MAX ||
+		    hosts[i].connection_count <
+		    hosts[new_host_idx].connection_count)
+			new_host_idx = i;
+	}
+	if (new_host_idx != UINT_MAX)
+		return mongodb_pool_add_connection(pool, new_host_idx)->wire;
+	return best == NULL ? NULL : best->wire;
+}
+
+static void
+mongodb_pool_queue_wire_request(struct mongodb_pool *pool, bool write,
+				mongodb_pool_wire_callback_t *callback,
+				void *context)
+{
+	struct mongodb_pool_wire_request *req;
+
+	req = array_append_space(&pool->wire_requests);
+	req->write = write;
+	req->callback = callback;
+	req->context = context;
+}
+
+static void
+mongodb_pool_get_wire_now(struct mongodb_pool *pool, bool write,
+			  bool can_wait,
+			  mongodb_pool_wire_callback_t *callback,
+			  void *context)
+{
+	struct mongodb_wire *wire;
+	int32_t flags = 0;
+
+	wire = mongodb_pool_find_wire(pool, write, FALSE);
+	if (wire == NULL && !pool->discovered) {
+		/* none of the servers replied to isMaster. just try any of
+		   them and let it fail if it's not the right one. */
+		wire = mongodb_pool_find_wire(pool, write, TRUE);
+	}
+	if (wire == NULL) {
+		mongodb_pool_reset_connect_delays(pool);
+		if (pool->discovery_pending == 0)
+			mongodb_pool_discover(pool);
+		if (can_wait && pool->discovery_pending > 0) {
+			/* the primary was lost. wait for the rediscovery
+			   instead of failing the request. */
+			mongodb_pool_queue_wire_request(pool, write,
+							callback, context);
+			return;
+		}
+	} else if (!write && pool->read_preference != MONGODB_READ_PRIMARY) {
+		flags |= MONGODB_WIRE_QUERY_FLAG_SLAVE_OK;
+	}
+	callback(wire, flags, context);
+}
+
+static void mongodb_pool_wire_requests_flush(struct mongodb_pool *pool)
+{
+	ARRAY(struct mongodb_pool_wire_request) requests;
+	const struct mongodb_pool_wire_request *req;
+
+	if (array_count(&pool->wire_requests) == 0)
+		return;
+
+	/* the callbacks may add new requests */
+	i_array_init(&requests, array_count(&pool->wire_requests));
+	array_append_array(&requests, &pool->wire_requests);
+	array_clear(&pool->wire_requests);
+
+	/* the requests already waited for one discovery. don't keep
+	   them waiting if it didn't find a usable server. */
+	array_foreach(&requests, req) {
+		mongodb_pool_get_wire_now(pool, req->write, FALSE,
+					  req->callback, req->context);
+	}
+	array_free(&requests);
+}
+
+void mongodb_pool_get_wire(struct mongodb_pool *pool, bool write,
+			   mongodb_pool_wire_callback_t *callback,
+			   void *context)
+{
+	if (!pool->discovered && pool->discovery_pending == 0)
+		mongodb_pool_discover(pool);
+	if (pool->discovery_pending > 0) {
+		/* we don't know yet which server is the primary. this
+		   happens until the initial lookups have finished and
+		   while the servers are rediscovered after a failover. */
+		mongodb_pool_queue_wire_request(pool, write,
+						callback, context);
+		return;
+	}
+	mongodb_pool_get_wire_now(pool, write, TRUE, callback, context);
+}
+
+void mongodb_pool_reply_error(struct mongodb_pool *pool,
+			      struct mongodb_wire *wire, const char *error)
+{
+	struct mongodb_pool_connection *const *connp;
+	struct mongodb_pool_host *host;
+
+	if (strstr(error, "not master") == NULL)
+		return;
+
+	/* the primary has changed */
+	array_foreach(&pool->all_connections, connp) {
+		if ((*connp)->wire == wire) {
+			host = array_idx_modifiable(&pool->hosts,
+						    (*connp)->host_idx);
+			if (host->role == MONGODB_HOST_ROLE_PRIMARY)
+				host->role = MONGODB_HOST_ROLE_UNKNOWN;
+			break;
+		}
+	}
+	if (pool->discovery_pending == 0)
+		mongodb_pool_discover(pool);
+}
+
+void mongodb_pool_wait(struct mongodb_pool *pool)
+{
+	struct mongodb_pool_connection *conn;
+	unsigned int i;
+	bool pending;
+
+	do {
+		pending = FALSE;
+		/* the reply callbacks may add new connections, which can
+		   reallocate the array */
+		for (i = 0; i < array_count(&pool->all_connections); i++) {
+			conn = *array_idx(&pool->all_connections, i);
+			if (mongodb_wire_get_pending_count(conn->wire) > 0) {
+				mongodb_wire_wait(conn->wire);
+				pending = TRUE;
+			}
+		}
+	} while (pending);
+}
+
+// vim: noexpandtab shiftwidth=8 tabstop=8
@@ -0,0 +1,62 @@
+#ifndef MONGODB_POOL_H
+#define MONGODB_POOL_H
+
+#include "mongodb-wire.h"
+
+#define MONGODB_POOL_DEFAULT_CONNECTION_LIMIT 5
+
+struct mongodb_pool;
+
+enum mongodb_read_preference {
+	/* all reads go to the primary */
+	MONGODB_READ_PRIMARY = 0,
+	/* primary if it's available, otherwise secondaries */
+	MONGODB_READ_PRIMARY_PREFERRED,
+	/* only secondaries */
+	MONGODB_READ_SECONDARY,
+	/* secondaries if they're available, otherwise the primary */
+	MONGODB_READ_SECONDARY_PREFERRED,
+	/* any member, the least loaded one wins */
+	MONGODB_READ_NEAREST
+};
+
+struct mongodb_pool_settings {
+	/* host:port strings */
+	const char *const *hosts;
+	/* maximum number of connections per host */
+	unsigned int connection_limit;
+	unsigned int timeout_msecs;
+	enum mongodb_read_preference read_preference;
+};
+
+/* Returns 0 if ok, -1 if some of the hosts couldn't be resolved. */
+int mongodb_pool_init(const struct mongodb_pool_settings *set,
+		      struct mongodb_pool **pool_r, const char **error_r);
+void mongodb_pool_deinit(struct mongodb_pool **pool);
+
+typedef void mongodb_pool_wire_callback_t(struct mongodb_wire *wire,
+					  int32_t flags, void *context);
+
+/* Find the least loaded connection that the request can be sent to,
+   creating a new connection if all the existing ones are busy. Writes
+   always go to the primary, reads follow the read preference. flags is set
+   to the OP_QUERY flags that the request needs, and wire is NULL if no
+   suitable server is currently available. The callback is called
+   immediately, except while the replica set members' roles are still being
+   looked up for the first time. Then the request is queued until the
+   lookups have finished. */
+void mongodb_pool_get_wire(struct mongodb_pool *pool, bool write,
+			   mongodb_pool_wire_callback_t *callback,
+			   void *context);
+/* Notify the pool about an error reply received from the wire. If the
+   server is no longer the primary, the replica set roles are looked up
+   again. */
+void mongodb_pool_reply_error(struct mongodb_pool *pool,
+			      struct mongodb_wire *wire, const char *error);
+/* Wait until all pending requests in all connections have finished,
+   including the requests queued by mongodb_pool_get_wire(). */
+void mongodb_pool_wait(struct mongodb_pool *pool);
+
+#endif
+
+// vim: noexpandtab shiftwidth=8 tabstop=8
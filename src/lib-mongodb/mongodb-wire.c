@@ -0,0 +1,595 @@
+/* Copyright (c) 2013 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "ioloop.h"
+#include "istream.h"
+#include "ostream.h"
+#include "connection.h"
+#include "mongodb-wire.h"
+
+#define MONGODB_WIRE_HEADER_SIZE 16
+/* header + responseFlags + cursorID + startingFrom + numberReturned */
+#define MONGODB_WIRE_REPLY_MIN_SIZE (MONGODB_WIRE_HEADER_SIZE + 20)
+#define MONGODB_WIRE_MAX_MESSAGE_SIZE (48*1024*1024)
+
+#define MONGODB_WIRE_REPLY_FLAG_CURSOR_NOT_FOUND 0x01
+#define MONGODB_WIRE_REPLY_FLAG_QUERY_FAILURE    0x02
+
+enum mongodb_wire_opcode {
+	MONGODB_WIRE_OP_REPLY = 1,
+	MONGODB_WIRE_OP_UPDATE = 2001,
+	MONGODB_WIRE_OP_QUERY = 2004,
+	MONGODB_WIRE_OP_GET_MORE = 2005,
+	MONGODB_WIRE_OP_KILL_CURSORS = 2007
+};
+
+struct mongodb_wire_request {
+	int32_t id;
+	mongodb_wire_callback_t *callback;
+	void *context;
+};
+
+struct mongodb_wire {
+	struct connection conn;
+
+	unsigned int timeout_msecs;
+	int32_t next_request_id;
+
+	/* requests sent before the connection was established */
+	buffer_t *pending_output;
+	ARRAY(struct mongodb_wire_request) requests;
+
+	struct ioloop *ioloop;
+	struct timeout *to_request;
+
+	mongodb_wire_state_callback_t *state_callback;
+	void *state_context;
+
+	unsigned int connecting:1;
+	unsigned int connected:1;
+};
+
+static struct connection_list *mongodb_wire_connections;
+
+static void mongodb_wire_append_int32(buffer_t *buf, int32_t num)
+{
+	uint32_t unum = num;
+	unsigned char data[4];
+
+	data[0] = unum & 0xff;
+	data[1] = (unum >> 8) & 0xff;
+	data[2] = (unum >> 16) & 0xff;
+	data[3] = (unum >> 24) & 0xff;
+	buffer_append(buf, data, sizeof(data));
+}
+
+static void mongodb_wire_append_int64(buffer_t *buf, int64_t num)
+{
+	uint64_t unum = num;
+
+	mongodb_wire_append_int32(buf, unum & 0xffffffff);
+	mongodb_wire_append_int32(buf, unum >> 32);
+}
+
+static int32_t mongodb_wire_get_int32(const unsigned char *data)
+{
+	return (int32_t)((uint32_t)data[0] | ((uint32_t)data[1] << 8) |
+			 ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24));
+}
+
+static int64_t mongodb_wire_get_int64(const unsigned char *data)
+{
+	return (int64_t)((uint64_t)(uint32_t)mongodb_wire_get_int32(data) |
+			 ((uint64_t)(uint32_t)mongodb_wire_get_int32(data + 4) << 32));
+}
+
+static void
+mongodb_wire_fail_requests(struct mongodb_wire *wire, const char *error)
+{
+	struct mongodb_wire_reply reply;
+	struct mongodb_wire_request request;
+
+	memset(&reply, 0, sizeof(reply));
+	reply.error = error;
+
+	while (array_count(&wire->requests) > 0) {
+		request = *array_idx(&wire->requests, 0);
+		array_delete(&wire->requests, 0, 1);
+		request.callback(&reply, request.context);
+	}
+}
+
+static void mongodb_wire_state_changed(struct mongodb_wire *wire,
+				       enum mongodb_wire_state state)
+{
+	if (wire->state_callback != NULL)
+		wire->state_callback(wire, state, wire->state_context);
+}
+
+static void mongodb_wire_disconnect(struct mongodb_wire *wire,
+				    const char *error)
+{
+	if (wire->connected)
+		mongodb_wire_state_changed(wire, MONGODB_WIRE_STATE_DISCONNECTED);
+	wire->connecting = FALSE;
+	wire->connected = FALSE;
+	if (wire->to_request != NULL)
+		timeout_remove(&wire->to_request);
+	buffer_set_used_size(wire->pending_output, 0);
+	connection_disconnect(&wire->conn);
+
+	mongodb_wire_fail_requests(wire, error);
+	if (wire->ioloop != NULL)
+		io_loop_stop(wire->ioloop);
+}
+
+static void mongodb_wire_destroy(struct connection *_conn)
+{
+	struct mongodb_wire *wire = (struct mongodb_wire *)_conn;
+	const char *error;
+
+	switch (_conn->disconnect_reason) {
+	case CONNECTION_DISCONNECT_CONNECT_TIMEOUT:
+		error = "connect() timed out";
+		break;
+	case CONNECTION_DISCONNECT_BUFFER_FULL:
+		error = "Reply too large";
+		break;
+	default:
+		error = connection_disconnect_reason(_conn);
+		break;
+	}
+	if (array_count(&wire->requests) > 0)
+		i_error("mongodb: %s: %s", _conn->name, error);
+	mongodb_wire_disconnect(wire, t_strdup_printf("%s: %s",
+						      _conn->name, error));
+}
+
+static void mongodb_wire_request_timeout(struct mongodb_wire *wire)
+{
+	const char *error;
+
+	error = t_strdup_printf("%s: Request timed out in %u.%03u secs",
+				wire->conn.name, wire->timeout_msecs/1000,
+				wire->timeout_msecs%1000);
+	i_error("mongodb: %s", error);
+	mongodb_wire_disconnect(wire, error);
+}
+
+static void mongodb_wire_timeout_update(struct mongodb_wire *wire)
+{
+	if (array_count(&wire->requests) == 0) {
+		if (wire->to_request != NULL)
+			timeout_remove(&wire->to_request);
+	} else if (wire->to_request == NULL) {
+		wire->to_request = timeout_add(wire->timeout_msecs,
+					       mongodb_wire_request_timeout,
+					       wire);
+	} else {
+		timeout_reset(wire->to_request);
+	}
+}
+
+static const char *
+mongodb_wire_reply_get_error(const struct mongodb_wire_reply *reply)
+{
+	bson_iterator iter;
+
+	if (reply->number_returned < 1 || reply->documents_size < 5)
+		return "Query failed";
+
+	bson_iterator_from_buffer(&iter, (const char *)reply->documents);
+	while (bson_iterator_next(&iter) != BSON_EOO) {
+		if (strcmp(bson_iterator_key(&iter), "$err") == 0 &&
+		    bson_iterator_type(&iter) == BSON_STRING)
+			return t_strdup(bson_iterator_string(&iter));
+	}
+	return "Query failed";
+}
+
+static int mongodb_wire_input_reply(struct mongodb_wire *wire)
+{
+	struct istream *input = wire->conn.input;
+	const struct mongodb_wire_request *requests;
+	struct mongodb_wire_request request;
+	struct mongodb_wire_reply reply;
+	const unsigned char *data;
+	unsigned int i, count;
+	int32_t msg_size, response_to, response_flags;
+	size_t size;
+
+	data = i_stream_get_data(input, &size);
+	if (size < MONGODB_WIRE_HEADER_SIZE)
+		return 0;
+
+	msg_size = mongodb_wire_get_int32(data);
+	if (msg_size < MONGODB_WIRE_REPLY_MIN_SIZE ||
+	    msg_size > MONGODB_WIRE_MAX_MESSAGE_SIZE) {
+		i_error("mongodb: %s: Invalid reply size %d",
+			wire->conn.name, msg_size);
+		return -1;
+	}
+	if (size < (size_t)msg_size)
+		return 0;
+
+	response_to = mongodb_wire_get_int32(data + 8);
+	if (mongodb_wire_get_int32(data + 12) != MONGODB_WIRE_OP_REPLY) {
+		i_error("mongodb: %s: Unexpected opcode %d", wire->conn.name,
+			mongodb_wire_get_int32(data + 12));
+		return -1;
+	}
+
+	/* replies normally come in the order the requests were sent, but
+	   match them by ID anyway */
+	requests = array_get(&wire->requests, &count);
+	for (i = 0; i < count; i++) {
+		if (requests[i].id == response_to)
+			break;
+	}
+	if (i == count) {
+		i_error("mongodb: %s: Reply to unknown request %d",
+			wire->conn.name, response_to);
+		return -1;
+	}
+	request = requests[i];
+	array_delete(&wire->requests, i, 1);
+
+	memset(&reply, 0, sizeof(reply));
+	data += MONGODB_WIRE_HEADER_SIZE;
+	response_flags = mongodb_wire_get_int32(data);
+	reply.cursor_id = mongodb_wire_get_int64(data + 4);
+	reply.starting_from = mongodb_wire_get_int32(data + 12);
+	reply.number_returned = mongodb_wire_get_int32(data + 16);
+	reply.documents = data + 20;
+	reply.documents_size = msg_size - MONGODB_WIRE_REPLY_MIN_SIZE;
+
+	if ((response_flags & MONGODB_WIRE_REPLY_FLAG_CURSOR_NOT_FOUND) != 0)
+		reply.error = "Cursor not found";
+	else if ((response_flags & MONGODB_WIRE_REPLY_FLAG_QUERY_FAILURE) != 0)
+		reply.error = mongodb_wire_reply_get_error(&reply);
+
+	mongodb_wire_timeout_update(wire);
+
+	/* the reply points to the input stream buffer, so skip it only after
+	   the callback is finished with it. the callback may also have
+	   disconnected us. */
+	i_stream_ref(input);
+	request.callback(&reply, request.context);
+	i_stream_skip(input, msg_size);
+	i_stream_unref(&input);
+
+	if (wire->conn.input == NULL)
+		return -1;
+	if (array_count(&wire->requests) == 0 && wire->ioloop != NULL)
+		io_loop_stop(wire->ioloop);
+	return 1;
+}
+
+static void mongodb_wire_input(struct connection *_conn)
+{
+	struct mongodb_wire *wire = (struct mongodb_wire *)_conn;
+	int ret;
+
+	if (connection_input_read(_conn) < 0)
+		return;
+
+	while ((ret = mongodb_wire_input_reply(wire)) > 0) ;
+	if (ret < 0 && wire->conn.input != NULL) {
+		mongodb_wire_disconnect(wire, t_strdup_printf(
+			"%s: Invalid reply from server", wire->conn.name));
+	}
+}
+
+static void mongodb_wire_connected(struct connection *_conn, bool success)
+{
+	struct mongodb_wire *wire = (struct mongodb_wire *)_conn;
+
+	wire->connecting = FALSE;
+	if (!success) {
+		const char *error = t_strdup_printf(
+			"connect(%s) failed: %m", _conn->name);
+
+		i_error("mongodb: %s", error);
+		mongodb_wire_state_changed(wire,
+					   MONGODB_WIRE_STATE_CONNECT_FAILED);
+		mongodb_wire_disconnect(wire, error);
+		return;
+	}
+	wire->connected = TRUE;
+	mongodb_wire_state_changed(wire, MONGODB_WIRE_STATE_CONNECTED);
+
+	o_stream_cork(_conn->output);
+	o_stream_nsend(_conn->output, wire->pending_output->data,
+		       wire->pending_output->used);
+	o_stream_uncork(_conn->output);
+	buffer_set_used_size(wire->pending_output, 0);
+}
+
+static const struct connection_settings mongodb_wire_conn_set = {
+	.input_max_size = (size_t)-1,
+	.output_max_size = (size_t)-1,
+	.client = TRUE
+};
+
+static const struct connection_vfuncs mongodb_wire_conn_vfuncs = {
+	.destroy = mongodb_wire_destroy,
+	.input = mongodb_wire_input,
+	.client_connected = mongodb_wire_connected
+};
+
+struct mongodb_wire *
+mongodb_wire_init(const struct ip_addr *ip, unsigned int port,
+		  unsigned int timeout_msecs)
+{
+	struct mongodb_wire *wire;
+
+	if (mongodb_wire_connections == NULL) {
+		mongodb_wire_connections =
+			connection_list_init(&mongodb_wire_conn_set,
+					     &mongodb_wire_conn_vfuncs);
+	}
+
+	wire = i_new(struct mongodb_wire, 1);
+	wire->timeout_msecs = timeout_msecs;
+	wire->next_request_id = 1;
+	wire->pending_output = buffer_create_dynamic(default_pool, 256);
+	i_array_init(&wire->requests, 16);
+	connection_init_client_ip(mongodb_wire_connections, &wire->conn,
+				  ip, port);
+	return wire;
+}
+
+void mongodb_wire_deinit(struct mongodb_wire **_wire)
+{
+	struct mongodb_wire *wire = *_wire;
+
+	*_wire = NULL;
+
+	i_assert(wire->ioloop == NULL);
+
+	wire->state_callback = NULL;
+	mongodb_wire_disconnect(wire, "Connection deinitialized");
+	connection_deinit(&wire->conn);
+	buffer_free(&wire->pending_output);
+	array_free(&wire->requests);
+	i_free(wire);
+
+	if (mongodb_wire_connections->connections == NULL)
+		connection_list_deinit(&mongodb_wire_connections);
+}
+
+void mongodb_wire_set_state_callback(struct mongodb_wire *wire,
+				     mongodb_wire_state_callback_t *callback,
+				     void *context)
+{
+	wire->state_callback = callback;
+	wire->state_context = context;
+}
+
+bool mongodb_wire_is_connected(struct mongodb_wire *wire)
+{
+	return wire->connected;
+}
+
+static void
+mongodb_wire_msg_begin(struct mongodb_wire *wire, buffer_t *msg,
+		       enum mongodb_wire_opcode opcode, int32_t *id_r)
+{
+	*id_r = wire->next_request_id++;
+	if (wire->next_request_id <= 0)
+		wire->next_request_id = 1;
+
+	mongodb_wire_append_int32(msg, 0); /* messageLength, filled later */
+	mongodb_wire_append_int32(msg, *id_r);
+	mongodb_wire_append_int32(msg, 0); /* responseTo */
+	mongodb_wire_append_int32(msg, opcode);
+}
+
+static void mongodb_wire_append_bson(buffer_t *msg, const bson *b)
+{
+	buffer_append(msg, bson_data(b), bson_size(b));
+}
+
+static void mongodb_wire_msg_finish(buffer_t *msg, size_t start_pos)
+{
+	buffer_t *size_buf;
+
+	size_buf = buffer_create_dynamic(pool_datastack_create(), 4);
+	mongodb_wire_append_int32(size_buf, msg->used - start_pos);
+	buffer_write(msg, start_pos, size_buf->data, size_buf->used);
+}
+
+static void mongodb_wire_send(struct mongodb_wire *wire, const buffer_t *msg)
+{
+	if (wire->connected) {
+		o_stream_nsend(wire->conn.output, msg->data, msg->used);
+		return;
+	}
+
+	buffer_append_buf(wire->pending_output, msg, 0, (size_t)-1);
+	if (!wire->connecting) {
+		wire->connecting = TRUE;
+		if (connection_client_connect(&wire->conn) < 0) {
+			i_error("mongodb: connect(%s) failed: %m",
+				wire->conn.name);
+			/* the request gets failed by the caller */
+			wire->connecting = FALSE;
+			buffer_set_used_size(wire->pending_output, 0);
+			mongodb_wire_state_changed(wire,
+				MONGODB_WIRE_STATE_CONNECT_FAILED);
+		}
+	}
+}
+
+static void
+mongodb_wire_request_add(struct mongodb_wire *wire, int32_t id,
+			 mongodb_wire_callback_t *callback, void *context)
+{
+	struct mongodb_wire_request *request;
+
+	request = array_append_space(&wire->requests);
+	request->id = id;
+	request->callback = callback;
+	request->context = context;
+
+	if (!wire->connected && !wire->connecting) {
+		/* connect() failed immediately */
+		mongodb_wire_fail_requests(wire, t_strdup_printf(
+			"%s: Couldn't connect", wire->conn.name));
+		return;
+	}
+	mongodb_wire_timeout_update(wire);
+}
+
+static int32_t
+mongodb_wire_append_query(struct mongodb_wire *wire, buffer_t *msg,
+			  const char *ns, int32_t flags, int32_t skip,
+			  int32_t nreturn, const bson *query,
+			  const bson *fields)
+{
+	size_t start_pos = msg->used;
+	int32_t id;
+
+	mongodb_wire_msg_begin(wire, msg, MONGODB_WIRE_OP_QUERY, &id);
+	mongodb_wire_append_int32(msg, flags);
+	buffer_append(msg, ns, strlen(ns) + 1);
+	mongodb_wire_append_int32(msg, skip);
+	mongodb_wire_append_int32(msg, nreturn);
+	mongodb_wire_append_bson(msg, query);
+	if (fields != NULL)
+		mongodb_wire_append_bson(msg, fields);
+	mongodb_wire_msg_finish(msg, start_pos);
+	return id;
+}
+
+void mongodb_wire_query(struct mongodb_wire *wire, const char *ns,
+			int32_t flags, int32_t skip, int32_t nreturn,
+			const bson *query, const bson *fields,
+			mongodb_wire_callback_t *callback, void *context)
+{
+	int32_t id;
+
+	T_BEGIN {
+		buffer_t *msg = buffer_create_dynamic(pool_datastack_create(), 256);
+
+		id = mongodb_wire_append_query(wire, msg, ns, flags, skip,
+					       nreturn, query, fields);
+		mongodb_wire_send(wire, msg);
+	} T_END;
+	mongodb_wire_request_add(wire, id, callback, context);
+}
+
+void mongodb_wire_get_more(struct mongodb_wire *wire, const char *ns,
+			   int32_t nreturn, int64_t cursor_id,
+			   mongodb_wire_callback_t *callback, void *context)
+{
+	int32_t id;
+
+	T_BEGIN {
+		buffer_t *msg = buffer_create_dynamic(pool_datastack_create(), 128);
+
+		mongodb_wire_msg_begin(wire, msg, MONGODB_WIRE_OP_GET_MORE,
+				       &id);
+		mongodb_wire_append_int32(msg, 0);
+		buffer_append(msg, ns, strlen(ns) + 1);
+		mongodb_wire_append_int32(msg, nreturn);
+		mongodb_wire_append_int64(msg, cursor_id);
+		mongodb_wire_msg_finish(msg, 0);
+		mongodb_wire_send(wire, msg);
+	} T_END;
+	mongodb_wire_request_add(wire, id, callback, context);
+}
+
+void mongodb_wire_kill_cursor(struct mongodb_wire *wire, int64_t cursor_id)
+{
+	int32_t id;
+
+	if (!wire->connected) {
+		/* cursor died with the connection */
+		return;
+	}
+
+	T_BEGIN {
+		buffer_t *msg = buffer_create_dynamic(pool_datastack_create(), 64);
+
+		mongodb_wire_msg_begin(wire, msg, MONGODB_WIRE_OP_KILL_CURSORS,
+				       &id);
+		mongodb_wire_append_int32(msg, 0);
+		mongodb_wire_append_int32(msg, 1);
+		mongodb_wire_append_int64(msg, cursor_id);
+		mongodb_wire_msg_finish(msg, 0);
+		mongodb_wire_send(wire, msg);
+	} T_END;
+}
+
+void mongodb_wire_update(struct mongodb_wire *wire, const char *database,
+			 const char *collection, int32_t flags,
+			 const bson *selector, const bson *update,
+			 mongodb_wire_callback_t *callback, void *context)
+{
+	bson cmd;
+	int32_t id;
+
+	/* OP_UPDATE has no reply, so pipeline a getLastError after it. both
+	   are sent in the same write so that the getLastError can't end up
+	   on a different connection than the update. */
+	bson_init(&cmd);
+	bson_append_int(&cmd, "getlasterror", 1);
+	bson_finish(&cmd);
+
+	T_BEGIN {
+		buffer_t *msg = buffer_create_dynamic(pool_datastack_create(), 256);
+
+		mongodb_wire_msg_begin(wire, msg, MONGODB_WIRE_OP_UPDATE, &id);
+		mongodb_wire_append_int32(msg, 0);
+		buffer_append(msg, database, strlen(database));
+		buffer_append_c(msg, '.');
+		buffer_append(msg, collection, strlen(collection) + 1);
+		mongodb_wire_append_int32(msg, flags);
+		mongodb_wire_append_bson(msg, selector);
+		mongodb_wire_append_bson(msg, update);
+		mongodb_wire_msg_finish(msg, 0);
+
+		id = mongodb_wire_append_query(wire, msg,
+			t_strconcat(database, ".$cmd", NULL),
+			0, 0, -1, &cmd, NULL);
+		mongodb_wire_send(wire, msg);
+	} T_END;
+	bson_destroy(&cmd);
+	mongodb_wire_request_add(wire, id, callback, context);
+}
+
+unsigned int mongodb_wire_get_pending_count(struct mongodb_wire *wire)
+{
+	return array_count(&wire->requests);
+}
+
+void mongodb_wire_wait(struct mongodb_wire *wire)
+{
+	struct ioloop *prev_ioloop = current_ioloop;
+
+	i_assert(wire->ioloop == NULL);
+
+	if (array_count(&wire->requests) == 0)
+		return;
+
+	wire->ioloop = io_loop_create();
+	connection_switch_ioloop(&wire->conn);
+	if (wire->to_request != NULL)
+		wire->to_request = io_loop_move_timeout(&wire->to_request);
+
+	do {
+		io_loop_run(wire->ioloop);
+	} while (array_count(&wire->requests) > 0);
+
+	io_loop_set_current(prev_ioloop);
+	connection_switch_ioloop(&wire->conn);
+	if (wire->to_request != NULL)
+		wire->to_request = io_loop_move_timeout(&wire->to_request);
+	io_loop_set_current(wire->ioloop);
+	io_loop_destroy(&wire->ioloop);
+}
+
+// vim: noexpandtab shiftwidth=8 tabstop=8
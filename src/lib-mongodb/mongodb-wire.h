@@ -0,0 +1,85 @@
+#ifndef MONGODB_WIRE_H
+#define MONGODB_WIRE_H
+
+#include "net.h"
+
+#include <mongo.h>
+
+struct mongodb_wire;
+
+/* OP_QUERY flags */
+#define MONGODB_WIRE_QUERY_FLAG_SLAVE_OK	0x04
+/* OP_UPDATE flags */
+#define MONGODB_WIRE_UPDATE_FLAG_UPSERT		0x01
+#define MONGODB_WIRE_UPDATE_FLAG_MULTI		0x02
+
+struct mongodb_wire_reply {
+	/* NULL if the request succeeded, otherwise the reason why it
+	   failed (connection failure, timeout, $err from the server) */
+	const char *error;
+
+	int64_t cursor_id;
+	int32_t starting_from;
+	int32_t number_returned;
+
+	/* number_returned BSON documents concatenated together */
+	const unsigned char *documents;
+	size_t documents_size;
+};
+
+enum mongodb_wire_state {
+	MONGODB_WIRE_STATE_CONNECTED,
+	MONGODB_WIRE_STATE_CONNECT_FAILED,
+	/* a connected connection was disconnected */
+	MONGODB_WIRE_STATE_DISCONNECTED
+};
+
+typedef void mongodb_wire_callback_t(const struct mongodb_wire_reply *reply,
+				     void *context);
+typedef void mongodb_wire_state_callback_t(struct mongodb_wire *wire,
+					   enum mongodb_wire_state state,
+					   void *context);
+
+/* Create a new pipelined connection to the given MongoDB server. The
+   connection is created lazily when the first request is sent. */
+struct mongodb_wire *
+mongodb_wire_init(const struct ip_addr *ip, unsigned int port,
+		  unsigned int timeout_msecs);
+/* Abort all pending requests (callbacks are called with error set) and
+   close the connection. */
+void mongodb_wire_deinit(struct mongodb_wire **wire);
+
+/* Call the callback whenever the connection state changes. */
+void mongodb_wire_set_state_callback(struct mongodb_wire *wire,
+				     mongodb_wire_state_callback_t *callback,
+				     void *context);
+/* Returns TRUE if the connection is currently established. */
+bool mongodb_wire_is_connected(struct mongodb_wire *wire);
+
+/* Send an OP_QUERY. fields may be NULL. */
+void mongodb_wire_query(struct mongodb_wire *wire, const char *ns,
+			int32_t flags, int32_t skip, int32_t nreturn,
+			const bson *query, const bson *fields,
+			mongodb_wire_callback_t *callback, void *context);
+/* Send an OP_GET_MORE for an open cursor. */
+void mongodb_wire_get_more(struct mongodb_wire *wire, const char *ns,
+			   int32_t nreturn, int64_t cursor_id,
+			   mongodb_wire_callback_t *callback, void *context);
+/* Send an OP_KILL_CURSORS. There's no reply to this. */
+void mongodb_wire_kill_cursor(struct mongodb_wire *wire, int64_t cursor_id);
+/* Send an OP_UPDATE followed by a getLastError command on the database,
+   so that the callback is called only after the server has acknowledged
+   the update. The reply contains the getLastError document. */
+void mongodb_wire_update(struct mongodb_wire *wire, const char *database,
+			 const char *collection, int32_t flags,
+			 const bson *selector, const bson *update,
+			 mongodb_wire_callback_t *callback, void *context);
+
+/* Returns number of requests still waiting for a reply. */
+unsigned int mongodb_wire_get_pending_count(struct mongodb_wire *wire);
+/* Run a private ioloop until all pending requests have been replied to. */
+void mongodb_wire_wait(struct mongodb_wire *wire);
+
+#endif
+
+// vim: noexpandtab shiftwidth=8 tabstop=8
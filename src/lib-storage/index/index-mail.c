@@ -54,6 +54,8 @@ struct mail_cache_field global_cache_fields[MAIL_INDEX_CACHE_FIELD_COUNT] = {
 	{ .name = "mime.parts",
 	  .type = MAIL_CACHE_FIELD_VARIABLE_SIZE },
 	{ .name = "binary.parts",
+	  .type = MAIL_CACHE_FIELD_VARIABLE_SIZE },
+	{ .name = "imap.bodystructure.parts",
 	  .type = MAIL_CACHE_FIELD_VARIABLE_SIZE }
 };
 
@@ -72,7 +74,42 @@ int index_mail_cache_lookup_field(struct index_mail *mail, buffer_t *buf,
 	return ret;
 }
 
-static struct message_part *get_unserialized_parts(struct index_mail *mail)
+static bool index_mail_bodystructure_parts_cached(struct index_mail *mail)
+{
+	struct mail *_mail = &mail->mail.mail;
+	const unsigned int field_idx =
+		mail->ibox->cache_fields[MAIL_CACHE_BODYSTRUCTURE_PARTS].idx;
+
+	return mail_cache_field_exists(_mail->transaction->cache_view,
+				       _mail->seq, field_idx) > 0;
+}
+
+static struct message_part *
+get_unserialized_bodystructure_parts(struct index_mail *mail)
+{
+	const unsigned int field_idx =
+		mail->ibox->cache_fields[MAIL_CACHE_BODYSTRUCTURE_PARTS].idx;
+	struct message_part *parts;
+	buffer_t *part_buf;
+	const char *error;
+
+	part_buf = buffer_create_dynamic(pool_datastack_create(), 256);
+	if (index_mail_cache_lookup_field(mail, part_buf, field_idx) <= 0)
+		return NULL;
+
+	parts = imap_bodystructure_deserialize(mail->mail.data_pool,
+					       part_buf->data, part_buf->used,
+					       &error);
+	if (parts == NULL) {
+		mail_cache_set_corrupted(mail->mail.mail.box->cache,
+			"Corrupted cached imap.bodystructure.parts data (%s)",
+			error);
+	}
+	return parts;
+}
+
+static struct message_part *
+get_unserialized_parts(struct index_mail *mail, bool *bodystructure_r)
 {
 	const unsigned int field_idx =
 		mail->ibox->cache_fields[MAIL_CACHE_MESSAGE_PARTS].idx;
@@ -81,6 +118,13 @@ static struct message_part *get_unserialized_parts(struct index_mail *mail)
 	const char *error;
 	int ret;
 
+	if (index_mail_bodystructure_parts_cached(mail)) {
+		/* this has the parts with their BODYSTRUCTURE data, so
+		   it's preferred over plain mime.parts */
+		*bodystructure_r = TRUE;
+		return get_unserialized_bodystructure_parts(mail);
+	}
+
 	part_buf = buffer_create_dynamic(pool_datastack_create(), 128);
 	ret = index_mail_cache_lookup_field(mail, part_buf, field_idx);
 	if (ret <= 0)
@@ -98,9 +142,10 @@ static struct message_part *get_unserialized_parts(struct index_mail *mail)
 static bool get_cached_parts(struct index_mail *mail)
 {
 	struct message_part *part;
+	bool bodystructure = FALSE;
 
 	T_BEGIN {
-		part = get_unserialized_parts(mail);
+		part = get_unserialized_parts(mail, &bodystructure);
 	} T_END;
 	if (part == NULL)
 		return FALSE;
@@ -115,6 +160,11 @@ static bool get_cached_parts(struct index_mail *mail)
 	}
 
 	mail->data.parts = part;
+	if (bodystructure) {
+		/* the parts' contexts have the BODYSTRUCTURE data, it just
+		   isn't written to a string */
+		mail->data.parsed_bodystructure = TRUE;
+	}
 	return TRUE;
 }
 
@@ -641,7 +691,10 @@ index_mail_body_parsed_cache_bodystructure(struct index_mail *mail,
 		mail->ibox->cache_fields[MAIL_CACHE_IMAP_BODY].idx;
 	const unsigned int cache_field_bodystructure =
 		mail->ibox->cache_fields[MAIL_CACHE_IMAP_BODYSTRUCTURE].idx;
+	const unsigned int cache_field_bodystructure_parts =
+		mail->ibox->cache_fields[MAIL_CACHE_BODYSTRUCTURE_PARTS].idx;
 	enum mail_cache_decision_type dec;
+	buffer_t *buf;
 	string_t *str;
 	bool bodystructure_cached = FALSE;
 	bool plain_bodystructure = FALSE;
@@ -668,24 +721,31 @@ index_mail_body_parsed_cache_bodystructure(struct index_mail *mail,
 		 (data->wanted_fields & MAIL_FETCH_IMAP_BODYSTRUCTURE) != 0) {
 		cache_bodystructure =
 			mail_cache_field_can_add(_mail->transaction->cache_trans,
-				_mail->seq, cache_field_bodystructure);
+				_mail->seq, cache_field_bodystructure_parts);
 	} else {
 		cache_bodystructure =
 			mail_cache_field_want_add(_mail->transaction->cache_trans,
-				_mail->seq, cache_field_bodystructure);
+				_mail->seq, cache_field_bodystructure_parts);
 	}
 	if (cache_bodystructure) {
-		str = str_new(mail->mail.data_pool, 128);
-		imap_bodystructure_write(data->parts, str, TRUE);
-		data->bodystructure = str_c(str);
-
-		index_mail_cache_add(mail, MAIL_CACHE_IMAP_BODYSTRUCTURE,
-				     str_c(str), str_len(str)+1);
+		/* cache the BODYSTRUCTURE in a binary form together with the
+		   MIME parts. the IMAP string is generated from it when
+		   needed, and fetching individual MIME parts doesn't need to
+		   parse the BODYSTRUCTURE string. */
+		T_BEGIN {
+			buf = buffer_create_dynamic(pool_datastack_create(),
+						    1024);
+			imap_bodystructure_serialize(data->parts, buf);
+			index_mail_cache_add_idx(mail,
+				cache_field_bodystructure_parts,
+				buf->data, buf->used);
+		} T_END;
 		bodystructure_cached = TRUE;
 	} else {
 		bodystructure_cached =
 			mail_cache_field_exists(_mail->transaction->cache_view,
-				_mail->seq, cache_field_bodystructure) > 0;
+				_mail->seq, cache_field_bodystructure) > 0 ||
+			index_mail_bodystructure_parts_cached(mail);
 	}
 
 	/* normally don't cache both BODY and BODYSTRUCTURE, but do it
@@ -1071,6 +1131,20 @@ static int index_mail_parse_bodystructure(struct index_mail *mail,
 	return 0;
 }
 
+static bool get_cached_bodystructure_parts(struct index_mail *mail)
+{
+	struct index_mail_data *data = &mail->data;
+
+	if (data->parsed_bodystructure) {
+		/* if the parts came from the cache, there's nothing more to
+		   do. otherwise we may still want to cache it. */
+		return index_mail_bodystructure_parts_cached(mail);
+	}
+	if (data->parts != NULL || !get_cached_parts(mail))
+		return FALSE;
+	return data->parsed_bodystructure;
+}
+
 static void
 index_mail_get_plain_bodystructure(struct index_mail *mail, string_t *str,
 				   bool extended)
@@ -1105,8 +1179,9 @@ int index_mail_get_special(struct mail *_mail,
 
 		/* 1) use plain-7bit-ascii flag if it exists
 		   2) get BODY if it exists
-		   3) get it using BODYSTRUCTURE if it exists
-		   4) parse body structure, and save BODY/BODYSTRUCTURE
+		   3) get it using cached BODYSTRUCTURE parts if they exist
+		   4) get it using BODYSTRUCTURE if it exists
+		   5) parse body structure, and save BODY/BODYSTRUCTURE
 		      depending on what we want cached */
 
 		str = str_new(mail->mail.data_pool, 128);
@@ -1118,7 +1193,10 @@ int index_mail_get_special(struct mail *_mail,
 		} else if (index_mail_cache_lookup_field(mail, str,
 							 body_cache_field) > 0)
 			data->body = str_c(str);
-		else if (index_mail_cache_lookup_field(mail, str,
+		else if (get_cached_bodystructure_parts(mail)) {
+			imap_bodystructure_write(data->parts, str, FALSE);
+			data->body = str_c(str);
+		} else if (index_mail_cache_lookup_field(mail, str,
 					bodystructure_cache_field) > 0) {
 			data->bodystructure =
 				p_strdup(mail->mail.data_pool, str_c(str));
@@ -1162,6 +1240,9 @@ int index_mail_get_special(struct mail *_mail,
 		    get_cached_parts(mail)) {
 			index_mail_get_plain_bodystructure(mail, str, TRUE);
 			data->bodystructure = str_c(str);
+		} else if (get_cached_bodystructure_parts(mail)) {
+			imap_bodystructure_write(data->parts, str, TRUE);
+			data->bodystructure = str_c(str);
 		} else if (index_mail_cache_lookup_field(mail, str,
 					bodystructure_cache_field) > 0) {
 			data->bodystructure = str_c(str);
@@ -1402,7 +1483,8 @@ static void index_mail_update_access_parts(struct index_mail *mail)
 			cache_fields[MAIL_CACHE_MESSAGE_PARTS].idx;
 
 		if (mail_cache_field_exists(cache_view, _mail->seq,
-					    cache_field) <= 0) {
+					    cache_field) <= 0 &&
+		    !index_mail_bodystructure_parts_cached(mail)) {
 			data->access_part |= PARSE_HDR | PARSE_BODY;
 			data->save_message_parts = TRUE;
 		}
@@ -1424,7 +1506,8 @@ static void index_mail_update_access_parts(struct index_mail *mail)
 		if (mail_cache_field_exists(cache_view, _mail->seq,
 					    cache_field1) <= 0 &&
 		    mail_cache_field_exists(cache_view, _mail->seq,
-					    cache_field2) <= 0) {
+					    cache_field2) <= 0 &&
+		    !index_mail_bodystructure_parts_cached(mail)) {
 			data->access_part |= PARSE_HDR | PARSE_BODY;
 			data->save_bodystructure_header = TRUE;
 			data->save_bodystructure_body = TRUE;
@@ -1438,7 +1521,8 @@ static void index_mail_update_access_parts(struct index_mail *mail)
 			cache_fields[MAIL_CACHE_IMAP_BODYSTRUCTURE].idx;
 
                 if (mail_cache_field_exists(cache_view, _mail->seq,
-                                            cache_field) <= 0) {
+                                            cache_field) <= 0 &&
+		    !index_mail_bodystructure_parts_cached(mail)) {
 			data->access_part |= PARSE_HDR | PARSE_BODY;
 			data->save_bodystructure_header = TRUE;
 			data->save_bodystructure_body = TRUE;
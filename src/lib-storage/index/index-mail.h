@@ -23,6 +23,7 @@ enum index_cache_field {
 	MAIL_CACHE_GUID,
 	MAIL_CACHE_MESSAGE_PARTS,
 	MAIL_CACHE_BINARY_PARTS,
+	MAIL_CACHE_BODYSTRUCTURE_PARTS,
 
 	MAIL_INDEX_CACHE_FIELD_COUNT
 };
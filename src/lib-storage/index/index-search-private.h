@@ -24,6 +24,12 @@ struct index_search_context {
 	unsigned int unused_mail_idx;
 	unsigned int max_mails;
 
+	/* all the BODY and TEXT args are searched with a single pass over
+	   the message. body_search_args are in the same order as the keys
+	   in body_search_ctx. */
+	struct message_search_context *body_search_ctx;
+	ARRAY(struct mail_search_arg *) body_search_args;
+
 	struct timeval search_start_time, last_notify;
 	struct timeval last_nonblock_timeval;
 	unsigned long long cost, next_time_check_cost;
@@ -33,6 +39,7 @@ struct index_search_context {
 	unsigned int have_seqsets:1;
 	unsigned int have_index_args:1;
 	unsigned int have_mailbox_args:1;
+	unsigned int have_body_args:1;
 };
 
 struct mail *index_search_get_mail(struct index_search_context *ctx);
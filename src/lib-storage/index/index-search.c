@@ -37,6 +37,10 @@
 #define SEARCH_INITIAL_MAX_COST 30000
 #define SEARCH_RECALC_MIN_USECS 50000
 
+/* Number of mails to prefetch while searching message bodies or when
+   the message streams are wanted, with mail_prefetch_count=auto. */
+#define SEARCH_PREFETCH_COUNT 16
+
 struct search_header_context {
         struct index_search_context *index_ctx;
         struct index_mail *imail;
@@ -49,10 +53,13 @@ struct search_header_context {
 	unsigned int threading:1;
 };
 
+ARRAY_DEFINE_TYPE(message_search_key, struct message_search_key);
+
 struct search_body_context {
         struct index_search_context *index_ctx;
 	struct istream *input;
 	struct message_part *part;
+	int ret;
 };
 
 static void search_parse_msgset_args(unsigned int messages_count,
@@ -101,6 +108,10 @@ static void search_init_arg(struct mail_search_arg *arg,
 	case SEARCH_MAILBOX_GLOB:
 		ctx->have_mailbox_args = TRUE;
 		break;
+	case SEARCH_BODY:
+	case SEARCH_TEXT:
+		ctx->have_body_args = TRUE;
+		break;
 	case SEARCH_ALL:
 		if (!arg->match_not)
 			arg->match_always = TRUE;
@@ -507,6 +518,8 @@ static void search_header_arg(struct mail_search_arg *arg,
 	msg_search_ctx = msg_search_arg_context(ctx->index_ctx, arg);
 	if (msg_search_ctx == NULL)
 		return;
+	/* the key must be found within this header */
+	message_search_reset(msg_search_ctx);
 
 	T_BEGIN {
 		struct message_address *addr;
@@ -595,43 +608,129 @@ static void search_header(struct message_header_line *hdr,
 	}
 }
 
-static void search_body(struct mail_search_arg *arg,
-			struct search_body_context *ctx)
+static void
+search_body_args_find(struct index_search_context *ctx,
+		      struct mail_search_arg *args,
+		      ARRAY_TYPE(message_search_key) *search_keys)
 {
-	struct message_search_context *msg_search_ctx;
-	int ret;
+	struct message_search_key key;
+	string_t *dtc;
 
-	switch (arg->type) {
-	case SEARCH_BODY:
-	case SEARCH_TEXT:
-		break;
-	default:
-		return;
+	for (; args != NULL; args = args->next) {
+		switch (args->type) {
+		case SEARCH_SUB:
+		case SEARCH_OR:
+			search_body_args_find(ctx, args->value.subargs,
+					      search_keys);
+			continue;
+		case SEARCH_BODY:
+		case SEARCH_TEXT:
+			break;
+		default:
+			continue;
+		}
+
+		dtc = t_str_new(128);
+		if (ctx->mail_ctx.normalizer(args->value.str,
+					     strlen(args->value.str), dtc) < 0)
+			i_panic("search key not utf8: %s", args->value.str);
+		/* we don't get here if arg is "", but dtc can be "" if it
+		   only contains characters that we need to ignore. handle
+		   those searches by returning them as non-matched. */
+		if (str_len(dtc) == 0)
+			continue;
+
+		memset(&key, 0, sizeof(key));
+		key.normalized_key_utf8 = str_c(dtc);
+		if (args->type == SEARCH_BODY)
+			key.flags |= MESSAGE_SEARCH_FLAG_SKIP_HEADERS;
+		array_append(search_keys, &key, 1);
+		array_append(&ctx->body_search_args, &args, 1);
 	}
+}
 
-	msg_search_ctx = msg_search_arg_context(ctx->index_ctx, arg);
-	if (msg_search_ctx == NULL) {
-		ARG_SET_RESULT(arg, 0);
-		return;
+static void search_body_init(struct index_search_context *ctx)
+{
+	ARRAY_TYPE(message_search_key) search_keys;
+
+	i_array_init(&ctx->body_search_args, 8);
+	T_BEGIN {
+		t_array_init(&search_keys, 8);
+		search_body_args_find(ctx, ctx->mail_ctx.args->args,
+				      &search_keys);
+		if (array_count(&search_keys) > 0) {
+			ctx->body_search_ctx =
+				message_search_init_multi(
+					array_idx(&search_keys, 0),
+					array_count(&search_keys),
+					ctx->mail_ctx.normalizer);
+		}
+	} T_END;
+}
+
+static int search_body_msg(struct search_body_context *ctx)
+{
+	struct index_search_context *index_ctx = ctx->index_ctx;
+	int ret;
+
+	if (!array_is_created(&index_ctx->body_search_args))
+		search_body_init(index_ctx);
+	if (index_ctx->body_search_ctx == NULL) {
+		/* all the keys were empty */
+		return 0;
 	}
 
 	i_stream_seek(ctx->input, 0);
-	ret = message_search_msg(msg_search_ctx, ctx->input, ctx->part);
+	ret = message_search_msg(index_ctx->body_search_ctx,
+				 ctx->input, ctx->part);
 	if (ret < 0 && ctx->input->stream_errno == 0) {
 		/* try again without cached parts */
-		mail_set_cache_corrupted(ctx->index_ctx->cur_mail,
+		mail_set_cache_corrupted(index_ctx->cur_mail,
 					 MAIL_FETCH_MESSAGE_PARTS);
 
 		i_stream_seek(ctx->input, 0);
-		ret = message_search_msg(msg_search_ctx, ctx->input, NULL);
+		ret = message_search_msg(index_ctx->body_search_ctx,
+					 ctx->input, NULL);
 		i_assert(ret >= 0 || ctx->input->stream_errno != 0);
 	}
 	if (ctx->input->stream_errno != 0) {
-		mail_storage_set_critical(ctx->index_ctx->box->storage,
+		mail_storage_set_critical(index_ctx->box->storage,
 			"read(%s) failed: %m", i_stream_get_name(ctx->input));
 	}
+	return ret;
+}
+
+static void search_body(struct mail_search_arg *arg,
+			struct search_body_context *ctx)
+{
+	struct mail_search_arg *const *body_args;
+	unsigned int i, count;
+
+	switch (arg->type) {
+	case SEARCH_BODY:
+	case SEARCH_TEXT:
+		break;
+	default:
+		return;
+	}
+
+	if (ctx->ret < 0) {
+		ARG_SET_RESULT(arg, -1);
+		return;
+	}
 
-	ARG_SET_RESULT(arg, ret);
+	body_args = array_get(&ctx->index_ctx->body_search_args, &count);
+	for (i = 0; i < count; i++) {
+		if (body_args[i] == arg)
+			break;
+	}
+	if (i == count) {
+		/* empty key */
+		ARG_SET_RESULT(arg, 0);
+	} else {
+		ARG_SET_RESULT(arg, message_search_key_found(
+				ctx->index_ctx->body_search_ctx, i) ? 1 : 0);
+	}
 }
 
 static int search_arg_match_text(struct mail_search_arg *args,
@@ -738,6 +837,7 @@ static int search_arg_match_text(struct mail_search_arg *args,
 	body_ctx.input = input;
 	(void)mail_get_parts(ctx->cur_mail, &body_ctx.part);
 
+	body_ctx.ret = search_body_msg(&body_ctx);
 	return mail_search_args_foreach(args, search_body, &body_ctx);
 }
 
@@ -1017,6 +1117,37 @@ static void search_get_seqset(struct index_search_context *ctx,
 	}
 }
 
+static void search_prefetch_cache(struct index_search_context *ctx,
+				  const struct mail_search_arg *args)
+{
+	struct mailbox_transaction_context *t = ctx->mail_ctx.transaction;
+	ARRAY_TYPE(seq_range) seqs;
+
+	if ((ctx->mail_ctx.wanted_fields & ~MAIL_FETCH_FLAGS) == 0 &&
+	    ctx->mail_ctx.wanted_headers == NULL) {
+		/* everything wanted is in the index */
+		return;
+	}
+	if (ctx->seq1 > ctx->seq2)
+		return;
+
+	t_array_init(&seqs, 8);
+	if (args != NULL && args->next == NULL &&
+	    args->type == SEARCH_SEQSET && !args->match_not) {
+		/* e.g. FETCH: prefetch only the wanted messages */
+		seq_range_array_merge(&seqs, &args->value.seqset);
+		if (ctx->seq1 > 1)
+			seq_range_array_remove_range(&seqs, 1, ctx->seq1 - 1);
+		if (ctx->seq2 < (uint32_t)-1) {
+			seq_range_array_remove_range(&seqs, ctx->seq2 + 1,
+						     (uint32_t)-1);
+		}
+	} else {
+		seq_range_array_add_range(&seqs, ctx->seq1, ctx->seq2);
+	}
+	mail_cache_prefetch(t->cache_view, &seqs);
+}
+
 static int search_build_subthread(struct mail_thread_iterate_context *iter,
 				  ARRAY_TYPE(seq_range) *uids)
 {
@@ -1185,7 +1316,7 @@ index_storage_search_init(struct mailbox_transaction_context *t,
 	ctx->mail_ctx.args = args;
 	ctx->mail_ctx.sort_program = index_sort_program_init(t, sort_program);
 
-	ctx->max_mails = t->box->storage->set->mail_prefetch_count + 1;
+	ctx->max_mails = t->box->storage->set->parsed_prefetch_count + 1;
 	if (ctx->max_mails == 0)
 		ctx->max_mails = UINT_MAX;
 	ctx->next_time_check_cost = SEARCH_INITIAL_MAX_COST;
@@ -1219,8 +1350,27 @@ index_storage_search_init(struct mailbox_transaction_context *t,
 	ctx->mail_ctx.wanted_fields |= wanted_fields;
 
 	search_get_seqset(ctx, status.messages, args->args);
+	T_BEGIN {
+		search_prefetch_cache(ctx, args->args);
+	} T_END;
 	(void)mail_search_args_foreach(args->args, search_init_arg, ctx);
 
+	if (ctx->have_body_args && t->box->storage->set->parsed_prefetch_auto &&
+	    sort_program == NULL) {
+		/* reading and parsing the message bodies is slow. have the
+		   OS read the next mails while we're matching the current
+		   ones. the results are still returned in sequence order. */
+		ctx->max_mails = SEARCH_PREFETCH_COUNT;
+	}
+	if ((ctx->mail_ctx.wanted_fields & (MAIL_FETCH_STREAM_HEADER |
+					    MAIL_FETCH_STREAM_BODY)) != 0 &&
+	    t->box->storage->set->parsed_prefetch_auto &&
+	    sort_program == NULL) {
+		/* e.g. FETCH BODY[]: have the OS read the next mails while
+		   the caller is still handling the current one. */
+		ctx->max_mails = SEARCH_PREFETCH_COUNT;
+	}
+
 	/* Need to reset results for match_always cases */
 	mail_search_args_reset(ctx->mail_ctx.args->args, FALSE);
 	return &ctx->mail_ctx;
@@ -1266,6 +1416,10 @@ int index_storage_search_deinit(struct mail_search_context *_ctx)
 		mail_free(mailp);
 	}
 	array_free(&ctx->mails);
+	if (ctx->body_search_ctx != NULL)
+		message_search_deinit(&ctx->body_search_ctx);
+	if (array_is_created(&ctx->body_search_args))
+		array_free(&ctx->body_search_args);
 	i_free(ctx);
 	return ret;
 }
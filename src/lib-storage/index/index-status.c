@@ -186,10 +186,11 @@ get_metadata_cache_fields(struct mailbox *box,
 			  struct mailbox_metadata *metadata_r)
 {
 	const struct mail_cache_field *fields;
+	const struct mail_cache_field_stats *stats;
 	enum mail_cache_decision_type dec;
 	ARRAY_TYPE(mailbox_cache_field) *cache_fields;
 	struct mailbox_cache_field *cf;
-	unsigned int i, count;
+	unsigned int i, j, count, stats_count;
 
 	if (box->metadata_pool == NULL) {
 		box->metadata_pool =
@@ -198,6 +199,9 @@ get_metadata_cache_fields(struct mailbox *box,
 
 	fields = mail_cache_register_get_list(box->cache,
 					      box->metadata_pool, &count);
+	stats = mail_cache_get_field_stats(box->cache, box->view,
+					   pool_datastack_create(),
+					   &stats_count);
 
 	cache_fields = p_new(box->metadata_pool,
 			     ARRAY_TYPE(mailbox_cache_field), 1);
@@ -209,6 +213,15 @@ get_metadata_cache_fields(struct mailbox *box,
 			cf->name = fields[i].name;
 			cf->decision = fields[i].decision;
 			cf->last_used = fields[i].last_used;
+			for (j = 0; j < stats_count; j++) {
+				if (strcmp(stats[j].name, fields[i].name) == 0)
+					break;
+			}
+			if (j < stats_count) {
+				cf->hits = stats[j].hits;
+				cf->misses = stats[j].misses;
+				cf->miss_usecs = stats[j].miss_usecs;
+			}
 		}
 	}
 	metadata_r->cache_fields = cache_fields;
@@ -232,7 +245,8 @@ static void get_metadata_precache_fields(struct mailbox *box,
 			cache |= MAIL_FETCH_STREAM_HEADER;
 		else if (strcmp(name, "mime.parts") == 0 ||
 			 strcmp(name, "imap.body") == 0 ||
-			 strcmp(name, "imap.bodystructure") == 0)
+			 strcmp(name, "imap.bodystructure") == 0 ||
+			 strcmp(name, "imap.bodystructure.parts") == 0)
 			cache |= MAIL_FETCH_STREAM_BODY;
 		else if (strcmp(name, "date.received") == 0)
 			cache |= MAIL_FETCH_RECEIVED_DATE;
@@ -57,6 +57,16 @@ static void set_cache_decisions(struct mail_cache *cache,
 
 		field.decision = dec;
 		mail_cache_register_fields(cache, &field, 1);
+
+		if (strcmp(name, "imap.bodystructure") == 0) {
+			/* BODYSTRUCTURE is nowadays cached in binary form */
+			idx = mail_cache_register_lookup(cache,
+						"imap.bodystructure.parts");
+			i_assert(idx != UINT_MAX);
+			field = *mail_cache_register_get_field(cache, idx);
+			field.decision = dec;
+			mail_cache_register_fields(cache, &field, 1);
+		}
 	}
 }
 
@@ -227,6 +237,33 @@ int index_storage_mailbox_alloc_index(struct mailbox *box)
 	return 0;
 }
 
+static void index_cache_compress_timeout(struct mailbox *box)
+{
+	struct index_mailbox_context *ibox = INDEX_STORAGE_CONTEXT(box);
+
+	timeout_remove(&ibox->to_cache_compress);
+	(void)mail_cache_compress_if_needed(box->cache);
+}
+
+static bool index_cache_compress_callback(struct mailbox *box)
+{
+	struct index_mailbox_context *ibox = INDEX_STORAGE_CONTEXT(box);
+	struct ioloop *old_ioloop = current_ioloop;
+
+	if (ibox->root_ioloop == NULL)
+		return FALSE;
+
+	/* compress only after the current command has been finished, so the
+	   client doesn't have to wait for it. */
+	if (ibox->to_cache_compress == NULL) {
+		io_loop_set_current(ibox->root_ioloop);
+		ibox->to_cache_compress =
+			timeout_add(0, index_cache_compress_timeout, box);
+		io_loop_set_current(old_ioloop);
+	}
+	return TRUE;
+}
+
 int index_storage_mailbox_open(struct mailbox *box, bool move_to_memory)
 {
 	struct index_mailbox_context *ibox = INDEX_STORAGE_CONTEXT(box);
@@ -279,6 +316,9 @@ int index_storage_mailbox_open(struct mailbox *box, bool move_to_memory)
 	}
 
 	box->cache = mail_index_get_cache(box->index);
+	ibox->root_ioloop = current_ioloop;
+	mail_cache_set_compress_callback(box->cache,
+					 index_cache_compress_callback, box);
 	index_cache_register_defaults(box);
 	box->view = mail_index_view_open(box->index);
 	ibox->keyword_names = mail_index_get_keywords(box->index);
@@ -351,6 +391,14 @@ void index_storage_mailbox_close(struct mailbox *box)
 	if (box->input != NULL)
 		i_stream_unref(&box->input);
 
+	mail_cache_unset_compress_callback(box->cache, box);
+	if (ibox->to_cache_compress != NULL) {
+		/* compression is still pending, do it before the index
+		   gets closed */
+		timeout_remove(&ibox->to_cache_compress);
+		(void)mail_cache_compress_if_needed(box->cache);
+	}
+
 	if (box->view_pvt != NULL)
 		mail_index_view_close(&box->view_pvt);
 	if (box->index_pvt != NULL)
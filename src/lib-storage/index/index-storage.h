@@ -27,6 +27,10 @@ struct index_mailbox_context {
 	enum mail_index_open_flags index_flags;
 
 	struct timeout *notify_to, *notify_delay_to;
+	struct timeout *to_cache_compress;
+	/* ioloop where the mailbox was opened. to_cache_compress is added
+	   there, because the sync may run in a temporary ioloop. */
+	struct ioloop *root_ioloop;
 	struct index_notify_file *notify_files;
         struct index_notify_io *notify_ios;
 
@@ -3,6 +3,7 @@
 #include "lib.h"
 #include "array.h"
 #include "hash-format.h"
+#include "strnum.h"
 #include "var-expand.h"
 #include "unichar.h"
 #include "settings-parser.h"
@@ -31,7 +32,7 @@ static const struct setting_define mail_storage_setting_defines[] = {
 	DEF(SET_STR, mail_attachment_hash),
 	DEF(SET_SIZE, mail_attachment_min_size),
 	DEF(SET_STR_VARS, mail_attribute_dict),
-	DEF(SET_UINT, mail_prefetch_count),
+	DEF(SET_STR, mail_prefetch_count),
 	DEF(SET_STR, mail_cache_fields),
 	DEF(SET_STR, mail_always_cache_fields),
 	DEF(SET_STR, mail_never_cache_fields),
@@ -68,7 +69,7 @@ const struct mail_storage_settings mail_storage_default_settings = {
 	.mail_attachment_hash = "%{sha1}",
 	.mail_attachment_min_size = 1024*128,
 	.mail_attribute_dict = "",
-	.mail_prefetch_count = 0,
+	.mail_prefetch_count = "auto",
 	.mail_cache_fields = "flags",
 	.mail_always_cache_fields = "",
 	.mail_never_cache_fields = "imap.envelope",
@@ -369,6 +370,18 @@ static bool mail_storage_settings_check(void *_set, pool_t pool ATTR_UNUSED,
 		return FALSE;
 	}
 
+	if (strcmp(set->mail_prefetch_count, "auto") == 0) {
+		set->parsed_prefetch_auto = TRUE;
+		set->parsed_prefetch_count = 0;
+	} else if (str_to_uint(set->mail_prefetch_count,
+			       &set->parsed_prefetch_count) < 0) {
+		*error_r = t_strdup_printf("Invalid mail_prefetch_count: %s",
+					   set->mail_prefetch_count);
+		return FALSE;
+	} else {
+		set->parsed_prefetch_auto = FALSE;
+	}
+
 	if (set->mail_nfs_index && !set->mmap_disable) {
 		*error_r = "mail_nfs_index=yes requires mmap_disable=yes";
 		return FALSE;
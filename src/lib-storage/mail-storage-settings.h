@@ -16,7 +16,7 @@ struct mail_storage_settings {
 	const char *mail_attachment_hash;
 	uoff_t mail_attachment_min_size;
 	const char *mail_attribute_dict;
-	unsigned int mail_prefetch_count;
+	const char *mail_prefetch_count;
 	const char *mail_cache_fields;
 	const char *mail_always_cache_fields;
 	const char *mail_never_cache_fields;
@@ -45,6 +45,9 @@ struct mail_storage_settings {
 
 	enum file_lock_method parsed_lock_method;
 	enum fsync_mode parsed_fsync_mode;
+	unsigned int parsed_prefetch_count;
+	/* mail_prefetch_count=auto */
+	bool parsed_prefetch_auto;
 };
 
 struct mail_namespace_settings {
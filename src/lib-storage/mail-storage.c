@@ -13,6 +13,7 @@
 #include "var-expand.h"
 #include "mail-index-private.h"
 #include "mail-index-alloc-cache.h"
+#include "mail-cache.h"
 #include "mailbox-tree.h"
 #include "mailbox-list-private.h"
 #include "mail-storage-private.h"
@@ -1737,6 +1738,17 @@ void mailbox_notify_changes_stop(struct mailbox *box)
 	box->v.notify_changes(box);
 }
 
+void mailbox_park(struct mailbox *box)
+{
+	if (!box->opened || box->transaction_count > 0)
+		return;
+
+	/* the index may be shared with other mailbox instances, which may
+	   have transactions open */
+	if (box->cache != NULL && box->index->open_count == 1)
+		mail_cache_park(box->cache);
+}
+
 struct mail_search_context *
 mailbox_search_init(struct mailbox_transaction_context *t,
 		    struct mail_search_args *args,
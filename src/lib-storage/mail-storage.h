@@ -289,6 +289,10 @@ struct mailbox_cache_field {
 	int decision; /* enum mail_cache_decision_type */
 	/* last_used is unchanged, if it's (time_t)-1 */
 	time_t last_used;
+	/* Access statistics. These are ignored when updating mailbox. */
+	uint32_t hits, misses;
+	/* total time spent generating the field after cache misses */
+	uint64_t miss_usecs;
 };
 ARRAY_DEFINE_TYPE(mailbox_cache_field, struct mailbox_cache_field);
 
@@ -621,6 +625,9 @@ void mailbox_notify_changes(struct mailbox *box,
 		(void *)((char *)context + CALLBACK_TYPECHECK(callback, \
 			void (*)(struct mailbox *, typeof(context)))))
 void mailbox_notify_changes_stop(struct mailbox *box);
+/* Release memory and file descriptors that aren't needed while the mailbox
+   is only waiting for changes. They're allocated again when needed. */
+void mailbox_park(struct mailbox *box);
 
 struct mailbox_transaction_context *
 mailbox_transaction_begin(struct mailbox *box,
@@ -4,6 +4,20 @@
 #include "base64.h"
 #include "buffer.h"
 
+/* Decode long runs of base64 characters with SSSE3/AVX2 when the CPU
+   supports them. The CPU features are checked at runtime, so the binaries
+   still work with older CPUs. */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+	(defined(__clang__) || __GNUC__ > 4 || \
+	 (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#  define HAVE_BASE64_SIMD
+#  include <immintrin.h>
+#endif
+
+/* how many bytes of input to decode at most to a temporary output buffer
+   before appending it to dest */
+#define BASE64_SIMD_MAX_INPUT_SIZE 768
+
 static const char b64enc[] =
 	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
@@ -81,6 +95,178 @@ void base64_encode(const void *src, size_t src_size, buffer_t *dest)
 #define IS_EMPTY(c) \
 	((c) == '\n' || (c) == '\r' || (c) == ' ' || (c) == '\t')
 
+#ifdef HAVE_BASE64_SIMD
+/* Translate 16 base64 characters to their 6bit values and pack them into 12
+   bytes at the beginning of *out_r. Returns FALSE if the input contains
+   anything else than base64 characters (whitespace, '=', invalid data). The
+   algorithm is from Wojciech Mula's "Base64 decoding with SIMD
+   instructions". */
+static inline bool __attribute__((target("ssse3")))
+base64_decode_sse_block(__m128i in, __m128i *out_r)
+{
+	const __m128i lut_lo = _mm_setr_epi8(
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m128i lut_hi = _mm_setr_epi8(
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8(
+		0, 16, 19, 4, -65, -65, -71, -71,
+		0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i mask_2f = _mm_set1_epi8(0x2f);
+	__m128i hi_nibbles, lo_nibbles, hi, lo, roll, merged;
+
+	hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), mask_2f);
+	lo_nibbles = _mm_and_si128(in, mask_2f);
+	hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+	lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi),
+					     _mm_setzero_si128())) != 0xffff)
+		return FALSE;
+
+	roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(
+		_mm_cmpeq_epi8(in, mask_2f), hi_nibbles));
+	in = _mm_add_epi8(in, roll);
+
+	/* 00aaaaaa 00bbbbbb 00cccccc 00dddddd ->
+	   aaaaaabb bbbbcccc ccdddddd */
+	merged = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+	merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+	*out_r = _mm_shuffle_epi8(merged, _mm_setr_epi8(
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+	return TRUE;
+}
+
+static inline size_t __attribute__((target("ssse3")))
+base64_decode_sse_blocks(const unsigned char *src, size_t src_size,
+			 unsigned char *dest, size_t *dest_size_r)
+{
+	size_t src_pos = 0, dest_pos = 0;
+	__m128i out;
+
+	for (; src_pos + 16 <= src_size; src_pos += 16) {
+		if (!base64_decode_sse_block(
+			_mm_loadu_si128((const void *)(src + src_pos)), &out))
+			break;
+		_mm_storeu_si128((void *)(dest + dest_pos), out);
+		dest_pos += 12;
+	}
+	*dest_size_r = dest_pos;
+	return src_pos;
+}
+
+static size_t __attribute__((target("ssse3")))
+base64_decode_ssse3(const unsigned char *src, size_t src_size,
+		    unsigned char *dest, size_t *dest_size_r)
+{
+	return base64_decode_sse_blocks(src, src_size, dest, dest_size_r);
+}
+
+static size_t __attribute__((target("avx2")))
+base64_decode_avx2(const unsigned char *src, size_t src_size,
+		   unsigned char *dest, size_t *dest_size_r)
+{
+	const __m256i lut_lo = _mm256_setr_epi8(
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m256i lut_hi = _mm256_setr_epi8(
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(
+		0, 16, 19, 4, -65, -65, -71, -71,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 16, 19, 4, -65, -65, -71, -71,
+		0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+	size_t src_pos = 0, dest_pos = 0, size;
+	__m256i in, hi_nibbles, lo_nibbles, hi, lo, roll, merged;
+
+	for (; src_pos + 32 <= src_size; src_pos += 32) {
+		in = _mm256_loadu_si256((const void *)(src + src_pos));
+		hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4),
+					      mask_2f);
+		lo_nibbles = _mm256_and_si256(in, mask_2f);
+		hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+		lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+		if (!_mm256_testz_si256(lo, hi))
+			break;
+
+		roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(
+			_mm256_cmpeq_epi8(in, mask_2f), hi_nibbles));
+		in = _mm256_add_epi8(in, roll);
+
+		merged = _mm256_maddubs_epi16(in,
+			_mm256_set1_epi32(0x01400140));
+		merged = _mm256_madd_epi16(merged,
+			_mm256_set1_epi32(0x00011000));
+		merged = _mm256_shuffle_epi8(merged, _mm256_setr_epi8(
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+		/* move the 12 bytes of the upper lane next to the lower
+		   lane's 12 bytes */
+		merged = _mm256_permutevar8x32_epi32(merged,
+			_mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+		_mm256_storeu_si256((void *)(dest + dest_pos), merged);
+		dest_pos += 24;
+	}
+	/* the rest may still have a full 16 byte block. this gets inlined,
+	   so it's compiled with AVX instruction encoding, which avoids the
+	   AVX-SSE transition penalty. */
+	src_pos += base64_decode_sse_blocks(src + src_pos, src_size - src_pos,
+					    dest + dest_pos, &size);
+	*dest_size_r = dest_pos + size;
+	return src_pos;
+}
+
+typedef size_t base64_decode_simd_t(const unsigned char *src, size_t src_size,
+				    unsigned char *dest, size_t *dest_size_r);
+static base64_decode_simd_t *base64_decode_simd;
+static bool base64_decode_simd_initialized = FALSE;
+
+static void base64_decode_simd_init(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		base64_decode_simd = base64_decode_avx2;
+	else if (__builtin_cpu_supports("ssse3"))
+		base64_decode_simd = base64_decode_ssse3;
+	base64_decode_simd_initialized = TRUE;
+}
+
+/* Decode as many full blocks of base64 characters from the beginning of src
+   as possible and append them to dest. Returns the number of bytes
+   decoded from src, which is always a multiple of 4. */
+static size_t
+base64_decode_blocks(const unsigned char *src, size_t src_size,
+		     buffer_t *dest)
+{
+	/* the kernels store up to 32 bytes at a time, even though only 24
+	   of them are valid */
+	unsigned char output[BASE64_SIMD_MAX_INPUT_SIZE/4*3 + 8];
+	size_t src_pos = 0, pos, size;
+
+	if (unlikely(!base64_decode_simd_initialized))
+		base64_decode_simd_init();
+	if (base64_decode_simd == NULL)
+		return 0;
+
+	do {
+		/* decode to a temporary buffer first: dest may point to the
+		   same memory as src */
+		pos = base64_decode_simd(src + src_pos,
+			I_MIN(src_size - src_pos, BASE64_SIMD_MAX_INPUT_SIZE),
+			output, &size);
+		buffer_append(dest, output, size);
+		src_pos += pos;
+	} while (pos == BASE64_SIMD_MAX_INPUT_SIZE);
+	return src_pos;
+}
+#endif
+
 int base64_decode(const void *src, size_t src_size,
 		  size_t *src_pos_r, buffer_t *dest)
 {
@@ -88,8 +274,23 @@ int base64_decode(const void *src, size_t src_size,
 	size_t src_pos;
 	unsigned char input[4], output[3];
 	int ret = 1;
+#ifdef HAVE_BASE64_SIMD
+	size_t simd_next_pos = 0;
+#endif
 
 	for (src_pos = 0; src_pos+3 < src_size; ) {
+#ifdef HAVE_BASE64_SIMD
+		if (src_pos >= simd_next_pos && src_size - src_pos >= 16) {
+			src_pos += base64_decode_blocks(src_c + src_pos,
+							src_size - src_pos,
+							dest);
+			/* the next block has something that needs to be
+			   handled here. don't try again until it's done. */
+			simd_next_pos = src_pos + 16;
+			if (src_pos+3 >= src_size)
+				break;
+		}
+#endif
 		input[0] = b64dec[src_c[src_pos]];
 		if (input[0] == 0xff) {
 			if (unlikely(!IS_EMPTY(src_c[src_pos]))) {
@@ -492,6 +492,21 @@ void data_stack_set_clean_after_pop(bool enable ATTR_UNUSED)
 #endif
 }
 
+void data_stack_free_unused(void)
+{
+#ifndef USE_GC
+	while (unused_frame_blocks != NULL) {
+		struct stack_frame_block *frame_block = unused_frame_blocks;
+		unused_frame_blocks = unused_frame_blocks->prev;
+
+		free(frame_block);
+	}
+	free(unused_block);
+#endif
+	unused_frame_blocks = NULL;
+	unused_block = NULL;
+}
+
 void data_stack_init(void)
 {
 	if (data_stack_frame > 0) {
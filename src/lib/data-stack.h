@@ -103,6 +103,11 @@ void t_buffer_alloc_last_full(void);
 /* If enabled, all the used memory is cleared after t_pop(). */
 void data_stack_set_clean_after_pop(bool enable);
 
+/* Free the memory blocks that were kept for reuse after the stack had grown.
+   Processes serving many mostly idle clients can call this to avoid keeping
+   the peak memory usage of a single client around. */
+void data_stack_free_unused(void);
+
 void data_stack_init(void);
 void data_stack_deinit(void);
 
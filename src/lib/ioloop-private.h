@@ -25,6 +25,10 @@ struct ioloop {
 	time_t next_max_time;
 
 	unsigned int running:1;
+#ifdef IOLOOP_URING
+	/* handler_context is io_uring's, otherwise it's epoll's */
+	unsigned int handler_uring:1;
+#endif
 };
 
 struct io {
@@ -85,6 +89,16 @@ void io_loop_handle_remove(struct io_file *io, bool closed);
 void io_loop_handler_init(struct ioloop *ioloop, unsigned int initial_fd_count);
 void io_loop_handler_deinit(struct ioloop *ioloop);
 
+#ifdef IOLOOP_URING
+/* epoll implementation, which io_uring falls back to */
+void io_loop_epoll_handle_add(struct io_file *io);
+void io_loop_epoll_handle_remove(struct io_file *io, bool closed);
+void io_loop_epoll_handler_init(struct ioloop *ioloop,
+				unsigned int initial_fd_count);
+void io_loop_epoll_handler_deinit(struct ioloop *ioloop);
+void io_loop_epoll_handler_run(struct ioloop *ioloop);
+#endif
+
 void io_loop_notify_remove(struct io *io);
 void io_loop_notify_handler_deinit(struct ioloop *ioloop);
 
@@ -0,0 +1,467 @@
+/* Copyright (c) 2013 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "fd-close-on-exec.h"
+#include "ioloop-private.h"
+#include "ioloop-iolist.h"
+
+#ifdef IOLOOP_URING
+
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* The ring is used only for poll requests, which are queued by io_add() and
+   io_remove() and submitted all at once by the same io_uring_enter() call
+   that waits for the events. Each file descriptor has at most one poll
+   request active at a time. Poll requests are one-shot, so they're re-armed
+   after the io callbacks have been called.
+
+   The backend is chosen separately for each ioloop. If the kernel doesn't
+   support io_uring (or it's disabled by seccomp), epoll is used for all the
+   ioloops. If only creating the ring fails (e.g. a nested ioloop runs out of
+   locked memory), epoll is used for that ioloop. Setting DOVECOT_IOLOOP=epoll
+   environment makes the ioloops created after it use epoll. */
+
+#define IOLOOP_URING_MIN_ENTRIES 64
+#define IOLOOP_URING_MAX_ENTRIES 4096
+
+/* user_data for requests whose completions are ignored */
+#define IOLOOP_URING_USER_DATA_IGNORE ((uint64_t)-1)
+
+#define IO_URING_ERROR (POLLERR | POLLHUP)
+#define IO_URING_INPUT (POLLIN | POLLPRI | IO_URING_ERROR)
+#define IO_URING_OUTPUT (POLLOUT | IO_URING_ERROR)
+
+struct uring_fd {
+	struct io_list *list;
+	/* incremented whenever the poll request is removed, so that
+	   completions of already removed requests can be ignored */
+	uint32_t seq;
+	/* events that the currently active poll request waits for,
+	   0 if there is no active request */
+	unsigned int armed_events;
+};
+
+struct ioloop_handler_context {
+	int ring_fd;
+	void *ring_ptr;
+	size_t ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned int sq_entries;
+	/* SQEs filled so far / submitted to kernel so far */
+	unsigned int sqe_tail, sqe_submitted;
+
+	struct __kernel_timespec timeout;
+	ARRAY(struct uring_fd) fd_index;
+};
+
+/* -1 = not known yet, 0 = kernel doesn't support io_uring, 1 = supported */
+static int ioloop_uring_supported = -1;
+static bool ioloop_uring_warned = FALSE;
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+			      unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int
+io_loop_uring_ring_init(struct ioloop_handler_context *ctx,
+			unsigned int entries)
+{
+	struct io_uring_params params;
+	unsigned char *ptr;
+	size_t sq_size, cq_size;
+
+	memset(&params, 0, sizeof(params));
+	ctx->ring_fd = sys_io_uring_setup(entries, &params);
+	if (ctx->ring_fd < 0)
+		return -1;
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0 ||
+	    (params.features & IORING_FEAT_NODROP) == 0) {
+		/* kernel is too old: the CQ ring could overflow and drop
+		   events */
+		i_close_fd(&ctx->ring_fd);
+		errno = ENOSYS;
+		return -1;
+	}
+	fd_close_on_exec(ctx->ring_fd, TRUE);
+
+	sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	cq_size = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	ctx->ring_size = I_MAX(sq_size, cq_size);
+	ctx->ring_ptr = mmap(NULL, ctx->ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ctx->ring_fd,
+			     IORING_OFF_SQ_RING);
+	if (ctx->ring_ptr == MAP_FAILED) {
+		i_close_fd(&ctx->ring_fd);
+		return -1;
+	}
+	ctx->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ctx->sqes = mmap(NULL, ctx->sqes_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ctx->ring_fd,
+			 IORING_OFF_SQES);
+	if (ctx->sqes == MAP_FAILED) {
+		(void)munmap(ctx->ring_ptr, ctx->ring_size);
+		i_close_fd(&ctx->ring_fd);
+		return -1;
+	}
+
+	ptr = ctx->ring_ptr;
+	ctx->sq_head = (void *)(ptr + params.sq_off.head);
+	ctx->sq_tail = (void *)(ptr + params.sq_off.tail);
+	ctx->sq_mask = (void *)(ptr + params.sq_off.ring_mask);
+	ctx->sq_array = (void *)(ptr + params.sq_off.array);
+	ctx->cq_head = (void *)(ptr + params.cq_off.head);
+	ctx->cq_tail = (void *)(ptr + params.cq_off.tail);
+	ctx->cq_mask = (void *)(ptr + params.cq_off.ring_mask);
+	ctx->cqes = (void *)(ptr + params.cq_off.cqes);
+	ctx->sq_entries = params.sq_entries;
+	ctx->sqe_tail = ctx->sqe_submitted = *ctx->sq_tail;
+	return 0;
+}
+
+static void io_loop_uring_ring_deinit(struct ioloop_handler_context *ctx)
+{
+	if (munmap(ctx->sqes, ctx->sqes_size) < 0)
+		i_error("munmap(io_uring sqes) failed: %m");
+	if (munmap(ctx->ring_ptr, ctx->ring_size) < 0)
+		i_error("munmap(io_uring) failed: %m");
+	if (close(ctx->ring_fd) < 0)
+		i_error("close(io_uring) failed: %m");
+}
+
+static int
+io_loop_uring_submit(struct ioloop_handler_context *ctx, bool wait)
+{
+	unsigned int to_submit = ctx->sqe_tail - ctx->sqe_submitted;
+	int ret;
+
+	if (to_submit == 0 && !wait)
+		return 0;
+
+	__atomic_store_n(ctx->sq_tail, ctx->sqe_tail, __ATOMIC_RELEASE);
+	ret = sys_io_uring_enter(ctx->ring_fd, to_submit, wait ? 1 : 0,
+				 wait ? IORING_ENTER_GETEVENTS : 0);
+	if (ret < 0) {
+		if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+			/* EAGAIN/EBUSY: there are too many completions
+			   waiting, we'll reap them and try again */
+			return 0;
+		}
+		i_fatal("io_uring_enter() failed: %m");
+	}
+	ctx->sqe_submitted += ret;
+	return 0;
+}
+
+static struct io_uring_sqe *
+io_loop_uring_get_sqe(struct ioloop_handler_context *ctx)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head, idx;
+
+	head = __atomic_load_n(ctx->sq_head, __ATOMIC_ACQUIRE);
+	if (ctx->sqe_tail - head >= ctx->sq_entries) {
+		/* submission queue is full, flush it */
+		(void)io_loop_uring_submit(ctx, FALSE);
+		head = __atomic_load_n(ctx->sq_head, __ATOMIC_ACQUIRE);
+		if (ctx->sqe_tail - head >= ctx->sq_entries)
+			i_panic("io_uring submission queue is stuck");
+	}
+
+	idx = ctx->sqe_tail & *ctx->sq_mask;
+	sqe = &ctx->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ctx->sq_array[idx] = idx;
+	ctx->sqe_tail++;
+	return sqe;
+}
+
+static uint64_t io_loop_uring_user_data(int fd, uint32_t seq)
+{
+	return ((uint64_t)seq << 32) | (unsigned int)fd;
+}
+
+static unsigned int uring_event_mask(struct io_list *list)
+{
+	unsigned int events = 0;
+	struct io_file *io;
+	int i;
+
+	for (i = 0; i < IOLOOP_IOLIST_IOS_PER_FD; i++) {
+		io = list->ios[i];
+
+		if (io == NULL)
+			continue;
+
+		if (io->io.condition & IO_READ)
+			events |= IO_URING_INPUT;
+		if (io->io.condition & IO_WRITE)
+			events |= IO_URING_OUTPUT;
+		if (io->io.condition & IO_ERROR)
+			events |= IO_URING_ERROR;
+	}
+	return events;
+}
+
+/* Make the poll request for the fd match its ios. The requests are only
+   queued here, they're submitted when the ioloop waits for events next
+   time. */
+static void io_loop_uring_update(struct ioloop_handler_context *ctx, int fd)
+{
+	struct uring_fd *ufd;
+	struct io_uring_sqe *sqe;
+	unsigned int events;
+
+	ufd = array_idx_modifiable(&ctx->fd_index, fd);
+	events = ufd->list == NULL ? 0 : uring_event_mask(ufd->list);
+	if (events == ufd->armed_events)
+		return;
+
+	if (ufd->armed_events != 0) {
+		sqe = io_loop_uring_get_sqe(ctx);
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = io_loop_uring_user_data(fd, ufd->seq);
+		sqe->user_data = IOLOOP_URING_USER_DATA_IGNORE;
+		ufd->armed_events = 0;
+		ufd->seq++;
+	}
+	if (events != 0) {
+		sqe = io_loop_uring_get_sqe(ctx);
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+		sqe->poll_events = events;
+		sqe->user_data = io_loop_uring_user_data(fd, ufd->seq);
+		ufd->armed_events = events;
+	}
+}
+
+static void
+io_loop_uring_handle_event(struct ioloop_handler_context *ctx,
+			   uint64_t user_data, int res)
+{
+	struct uring_fd *ufd;
+	struct io_list *list;
+	struct io_file *io;
+	int fd = (int)(user_data & 0xffffffff);
+	unsigned int revents;
+	bool call;
+	int i;
+
+	if (user_data == IOLOOP_URING_USER_DATA_IGNORE)
+		return;
+	ufd = array_idx_modifiable(&ctx->fd_index, fd);
+	if ((uint32_t)(user_data >> 32) != ufd->seq) {
+		/* the request was already removed */
+		return;
+	}
+	/* the poll request is one-shot, it's finished now */
+	ufd->armed_events = 0;
+	ufd->seq++;
+	if (res < 0) {
+		if (res != -ECANCELED)
+			i_error("io_uring poll(%d) failed: %s", fd,
+				strerror(-res));
+		revents = IO_URING_ERROR;
+	} else {
+		revents = res;
+	}
+
+	list = ufd->list;
+	for (i = 0; i < IOLOOP_IOLIST_IOS_PER_FD; i++) {
+		io = list->ios[i];
+		if (io == NULL)
+			continue;
+
+		call = FALSE;
+		if ((revents & (POLLHUP | POLLERR)) != 0)
+			call = TRUE;
+		else if ((io->io.condition & IO_READ) != 0)
+			call = (revents & (POLLIN | POLLPRI)) != 0;
+		else if ((io->io.condition & IO_WRITE) != 0)
+			call = (revents & POLLOUT) != 0;
+		else if ((io->io.condition & IO_ERROR) != 0)
+			call = (revents & IO_URING_ERROR) != 0;
+
+		if (call)
+			io_loop_call_io(&io->io);
+	}
+	/* callbacks may have added/removed ios for the fd, or even
+	   re-armed it already */
+	io_loop_uring_update(ctx, fd);
+}
+
+static bool io_loop_uring_is_enabled(void)
+{
+	const char *env = getenv("DOVECOT_IOLOOP");
+
+	if (env != NULL && strcmp(env, "epoll") == 0)
+		return FALSE;
+	return ioloop_uring_supported != 0;
+}
+
+void io_loop_handler_init(struct ioloop *ioloop, unsigned int initial_fd_count)
+{
+	struct ioloop_handler_context *ctx;
+	unsigned int entries;
+
+	if (!io_loop_uring_is_enabled()) {
+		io_loop_epoll_handler_init(ioloop, initial_fd_count);
+		return;
+	}
+
+	ctx = i_new(struct ioloop_handler_context, 1);
+	entries = I_MIN(I_MAX(initial_fd_count, IOLOOP_URING_MIN_ENTRIES),
+			IOLOOP_URING_MAX_ENTRIES);
+	if (io_loop_uring_ring_init(ctx, entries) < 0) {
+		if (errno == ENOSYS || errno == EPERM) {
+			/* not supported by the kernel or blocked by seccomp */
+			ioloop_uring_supported = 0;
+		} else if (!ioloop_uring_warned) {
+			/* use epoll only for this ioloop */
+			i_warning("io_uring_setup() failed: %m - "
+				  "falling back to epoll%s", errno != ENOMEM ? "" :
+				  " (you may need to increase the locked "
+				  "memory limit)");
+			ioloop_uring_warned = TRUE;
+		}
+		i_free(ctx);
+		io_loop_epoll_handler_init(ioloop, initial_fd_count);
+		return;
+	}
+	ioloop_uring_supported = 1;
+
+	i_array_init(&ctx->fd_index, initial_fd_count);
+	ioloop->handler_context = ctx;
+	ioloop->handler_uring = TRUE;
+}
+
+void io_loop_handler_deinit(struct ioloop *ioloop)
+{
+	struct ioloop_handler_context *ctx = ioloop->handler_context;
+	struct uring_fd *ufd;
+
+	if (!ioloop->handler_uring) {
+		io_loop_epoll_handler_deinit(ioloop);
+		return;
+	}
+
+	array_foreach_modifiable(&ctx->fd_index, ufd)
+		i_free(ufd->list);
+	io_loop_uring_ring_deinit(ctx);
+	array_free(&ctx->fd_index);
+	i_free(ioloop->handler_context);
+}
+
+void io_loop_handle_add(struct io_file *io)
+{
+	struct ioloop_handler_context *ctx = io->io.ioloop->handler_context;
+	struct uring_fd *ufd;
+
+	if (!io->io.ioloop->handler_uring) {
+		io_loop_epoll_handle_add(io);
+		return;
+	}
+
+	ufd = array_idx_modifiable(&ctx->fd_index, io->fd);
+	if (ufd->list == NULL)
+		ufd->list = i_new(struct io_list, 1);
+	(void)ioloop_iolist_add(ufd->list, io);
+	io_loop_uring_update(ctx, io->fd);
+}
+
+void io_loop_handle_remove(struct io_file *io, bool closed ATTR_UNUSED)
+{
+	struct ioloop_handler_context *ctx = io->io.ioloop->handler_context;
+	struct uring_fd *ufd;
+
+	if (!io->io.ioloop->handler_uring) {
+		io_loop_epoll_handle_remove(io, closed);
+		return;
+	}
+
+	/* the poll request is removed by its user_data, so this works even
+	   if the fd was already closed */
+	ufd = array_idx_modifiable(&ctx->fd_index, io->fd);
+	(void)ioloop_iolist_del(ufd->list, io);
+	io_loop_uring_update(ctx, io->fd);
+	i_free(io);
+}
+
+void io_loop_handler_run(struct ioloop *ioloop)
+{
+	struct ioloop_handler_context *ctx = ioloop->handler_context;
+	const struct io_uring_cqe *cqe;
+	struct io_uring_sqe *sqe;
+	struct timeval tv;
+	unsigned int head, tail;
+	uint64_t user_data;
+	int msecs, res;
+
+	if (!ioloop->handler_uring) {
+		io_loop_epoll_handler_run(ioloop);
+		return;
+	}
+
+        /* get the time left for next timeout task */
+	msecs = io_loop_get_wait_time(ioloop, &tv);
+	if (msecs >= 0) {
+		/* finishes when the timeout expires or when any other
+		   request completes */
+		ctx->timeout.tv_sec = msecs / 1000;
+		ctx->timeout.tv_nsec = (long long)(msecs % 1000) * 1000000;
+		sqe = io_loop_uring_get_sqe(ctx);
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->fd = -1;
+		sqe->addr = (uintptr_t)&ctx->timeout;
+		sqe->len = 1;
+		sqe->off = 1;
+		sqe->user_data = IOLOOP_URING_USER_DATA_IGNORE;
+	}
+
+	/* submit all the queued poll changes and wait, unless there are
+	   already completions waiting */
+	head = *ctx->cq_head;
+	tail = __atomic_load_n(ctx->cq_tail, __ATOMIC_ACQUIRE);
+	(void)io_loop_uring_submit(ctx, head == tail);
+
+	/* execute timeout handlers */
+        io_loop_handle_timeouts(ioloop);
+
+	if (!ioloop->running)
+		return;
+
+	tail = __atomic_load_n(ctx->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		cqe = &ctx->cqes[head & *ctx->cq_mask];
+		user_data = cqe->user_data;
+		res = cqe->res;
+		/* release the CQE before calling the callbacks, they may
+		   run a nested ioloop */
+		head++;
+		__atomic_store_n(ctx->cq_head, head, __ATOMIC_RELEASE);
+
+		io_loop_uring_handle_event(ctx, user_data, res);
+	}
+}
+
+#endif	/* IOLOOP_URING */
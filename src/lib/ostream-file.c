@@ -530,6 +530,38 @@ static size_t o_stream_add(struct file_ostream *fstream,
 	return sent;
 }
 
+static ssize_t
+o_stream_writev_with_buffer(struct file_ostream *fstream,
+			    const struct const_iovec *iov,
+			    unsigned int iov_count)
+{
+	struct const_iovec *full_iov;
+	size_t used;
+	ssize_t ret;
+	int buf_iov_count;
+
+	/* returns how much of the new data was sent. if the buffered data
+	   couldn't be fully sent, returns 0. */
+	used = file_buffer_get_used_size(fstream);
+	T_BEGIN {
+		full_iov = t_new(struct const_iovec, iov_count + 2);
+		buf_iov_count = o_stream_fill_iovec(fstream, full_iov);
+		memcpy(full_iov + buf_iov_count, iov,
+		       sizeof(*iov) * iov_count);
+		ret = o_stream_writev(fstream, full_iov,
+				      buf_iov_count + iov_count);
+	} T_END;
+	if (ret < 0)
+		return -1;
+
+	if ((size_t)ret < used) {
+		update_buffer(fstream, ret);
+		return 0;
+	}
+	update_buffer(fstream, used);
+	return ret - used;
+}
+
 static ssize_t o_stream_file_sendv(struct ostream_private *stream,
 				   const struct const_iovec *iov,
 				   unsigned int iov_count)
@@ -538,25 +570,38 @@ static ssize_t o_stream_file_sendv(struct ostream_private *stream,
 	size_t size, total_size, added, optimal_size;
 	unsigned int i;
 	ssize_t ret = 0;
+	bool send_now = FALSE;
 
 	for (i = 0, size = 0; i < iov_count; i++)
 		size += iov[i].iov_len;
 	total_size = size;
 
-	if (size > get_unused_space(fstream) && !IS_STREAM_EMPTY(fstream)) {
-		if (o_stream_file_flush(stream) < 0)
-			return -1;
-	}
-
 	optimal_size = I_MIN(fstream->optimal_block_size,
 			     fstream->ostream.max_buffer_size);
-	if (IS_STREAM_EMPTY(fstream) &&
-	    (!stream->corked || size >= optimal_size)) {
+	if (size > get_unused_space(fstream) && !IS_STREAM_EMPTY(fstream)) {
+		if (!stream->corked || size >= optimal_size) {
+			/* the new data would be sent immediately after
+			   flushing the buffer. send them both with a single
+			   writev() call. */
+			ret = o_stream_writev_with_buffer(fstream, iov,
+							  iov_count);
+			if (ret < 0)
+				return -1;
+			send_now = IS_STREAM_EMPTY(fstream);
+		} else {
+			if (o_stream_file_flush(stream) < 0)
+				return -1;
+		}
+	} else if (IS_STREAM_EMPTY(fstream) &&
+		   (!stream->corked || size >= optimal_size)) {
 		/* send immediately */
 		ret = o_stream_writev(fstream, iov, iov_count);
 		if (ret < 0)
 			return -1;
+		send_now = TRUE;
+	}
 
+	if (send_now) {
 		size = ret;
 		while (size > 0 && iov_count > 0 && size >= iov[0].iov_len) {
 			size -= iov[0].iov_len;
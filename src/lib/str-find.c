@@ -180,3 +180,243 @@ void str_find_reset(struct str_find_context *ctx)
 {
 	ctx->match_count = 0;
 }
+
+#define STR_FIND_MULTI_NO_KEY UINT_MAX
+/* Maximum size of the DFA transition table in bytes. Larger key sets are
+   searched with a separate str_find_context for each key. */
+#define STR_FIND_MULTI_MAX_DFA_SIZE (256*1024)
+
+struct str_find_multi_context {
+	pool_t pool;
+	unsigned int keys_count, matched_count;
+	bool *matched;
+
+	/* Aho-Corasick automaton converted to a DFA. bytes that don't exist
+	   in any key map to class 0, the rest to their own classes to keep
+	   the transition table small. */
+	unsigned int byte_class[UCHAR_MAX+1];
+	unsigned int class_count, states_count;
+	/* next state = next[state * class_count + byte_class[c]] */
+	uint32_t *next;
+	/* key ending at the state, or STR_FIND_MULTI_NO_KEY. further keys
+	   with the same contents are linked via key_next. */
+	unsigned int *state_key, *key_next;
+	/* the next state in the failure chain that has a key, 0 if none */
+	uint32_t *out_link;
+
+	uint32_t state;
+
+	/* non-NULL if the DFA would have been too large */
+	struct str_find_context **key_ctx;
+};
+
+static void str_find_multi_build(struct str_find_multi_context *ctx,
+				 const char *const *keys)
+{
+	const unsigned char *key;
+	uint32_t *fail, *queue, state, next, failnext;
+	unsigned int i, j, c, queue_head, queue_tail;
+
+	/* build the trie. (uint32_t)-1 means there is no edge yet. */
+	memset(ctx->next, 0xff, sizeof(*ctx->next) *
+	       ctx->states_count * ctx->class_count);
+	ctx->states_count = 1;
+	for (i = 0; i < ctx->keys_count; i++) {
+		key = (const unsigned char *)keys[i];
+		state = 0;
+		for (j = 0; key[j] != '\0'; j++) {
+			c = ctx->byte_class[key[j]];
+			next = ctx->next[state * ctx->class_count + c];
+			if (next == (uint32_t)-1) {
+				next = ctx->states_count++;
+				ctx->next[state * ctx->class_count + c] = next;
+			}
+			state = next;
+		}
+		ctx->key_next[i] = ctx->state_key[state];
+		ctx->state_key[state] = i;
+	}
+
+	/* add the failure transitions in breadth-first order, so that the
+	   failure state's transitions are always already complete */
+	fail = t_new(uint32_t, ctx->states_count);
+	queue = t_new(uint32_t, ctx->states_count);
+	queue_head = queue_tail = 0;
+	queue[queue_tail++] = 0;
+	while (queue_head < queue_tail) {
+		state = queue[queue_head++];
+		for (c = 0; c < ctx->class_count; c++) {
+			next = ctx->next[state * ctx->class_count + c];
+			failnext = state == 0 ? 0 :
+				ctx->next[fail[state] * ctx->class_count + c];
+			if (next == (uint32_t)-1 || c == 0) {
+				/* class 0 never continues a match */
+				ctx->next[state * ctx->class_count + c] =
+					c == 0 ? 0 : failnext;
+				continue;
+			}
+			fail[next] = failnext;
+			ctx->out_link[next] =
+				ctx->state_key[failnext] != STR_FIND_MULTI_NO_KEY ?
+				failnext : ctx->out_link[failnext];
+			queue[queue_tail++] = next;
+		}
+	}
+}
+
+struct str_find_multi_context *
+str_find_multi_init(pool_t pool, const char *const *keys, unsigned int count)
+{
+	struct str_find_multi_context *ctx;
+	const unsigned char *key;
+	unsigned int i, j, max_states = 1;
+
+	i_assert(count > 0);
+
+	ctx = p_new(pool, struct str_find_multi_context, 1);
+	ctx->pool = pool;
+	ctx->keys_count = count;
+	ctx->matched = p_new(pool, bool, count);
+	ctx->key_next = p_new(pool, unsigned int, count);
+
+	ctx->class_count = 1;
+	for (i = 0; i < count; i++) {
+		key = (const unsigned char *)keys[i];
+		i_assert(*key != '\0');
+		for (j = 0; key[j] != '\0'; j++) {
+			if (ctx->byte_class[key[j]] == 0)
+				ctx->byte_class[key[j]] = ctx->class_count++;
+		}
+		max_states += j;
+	}
+
+	if (max_states > STR_FIND_MULTI_MAX_DFA_SIZE /
+	    (sizeof(uint32_t) * ctx->class_count)) {
+		ctx->key_ctx = p_new(pool, struct str_find_context *, count);
+		for (i = 0; i < count; i++)
+			ctx->key_ctx[i] = str_find_init(pool, keys[i]);
+		return ctx;
+	}
+
+	ctx->states_count = max_states;
+	ctx->next = p_new(pool, uint32_t, max_states * ctx->class_count);
+	ctx->out_link = p_new(pool, uint32_t, max_states);
+	ctx->state_key = p_new(pool, unsigned int, max_states);
+	for (i = 0; i < max_states; i++)
+		ctx->state_key[i] = STR_FIND_MULTI_NO_KEY;
+	T_BEGIN {
+		str_find_multi_build(ctx, keys);
+	} T_END;
+	return ctx;
+}
+
+void str_find_multi_deinit(struct str_find_multi_context **_ctx)
+{
+	struct str_find_multi_context *ctx = *_ctx;
+	unsigned int i;
+
+	*_ctx = NULL;
+	if (ctx->key_ctx != NULL) {
+		for (i = 0; i < ctx->keys_count; i++)
+			str_find_deinit(&ctx->key_ctx[i]);
+		p_free(ctx->pool, ctx->key_ctx);
+	}
+	p_free(ctx->pool, ctx->matched);
+	p_free(ctx->pool, ctx->key_next);
+	p_free(ctx->pool, ctx->next);
+	p_free(ctx->pool, ctx->out_link);
+	p_free(ctx->pool, ctx->state_key);
+	p_free(ctx->pool, ctx);
+}
+
+static bool
+str_find_multi_add_matches(struct str_find_multi_context *ctx, uint32_t state)
+{
+	unsigned int key_idx;
+
+	if (ctx->state_key[state] == STR_FIND_MULTI_NO_KEY)
+		state = ctx->out_link[state];
+	for (; state != 0; state = ctx->out_link[state]) {
+		key_idx = ctx->state_key[state];
+		for (; key_idx != STR_FIND_MULTI_NO_KEY;
+		     key_idx = ctx->key_next[key_idx]) {
+			if (!ctx->matched[key_idx]) {
+				ctx->matched[key_idx] = TRUE;
+				ctx->matched_count++;
+			}
+		}
+	}
+	return ctx->matched_count == ctx->keys_count;
+}
+
+static bool
+str_find_multi_more_keys(struct str_find_multi_context *ctx,
+			 const unsigned char *data, size_t size)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->keys_count; i++) {
+		if (!ctx->matched[i] &&
+		    str_find_more(ctx->key_ctx[i], data, size)) {
+			ctx->matched[i] = TRUE;
+			ctx->matched_count++;
+		}
+	}
+	return ctx->matched_count == ctx->keys_count;
+}
+
+bool str_find_multi_more(struct str_find_multi_context *ctx,
+			 const unsigned char *data, size_t size)
+{
+	const uint32_t *next = ctx->next;
+	const unsigned int *byte_class = ctx->byte_class;
+	const unsigned int *state_key = ctx->state_key;
+	const uint32_t *out_link = ctx->out_link;
+	unsigned int class_count = ctx->class_count;
+	uint32_t state = ctx->state;
+	size_t i;
+
+	if (ctx->matched_count == ctx->keys_count)
+		return TRUE;
+	if (ctx->key_ctx != NULL)
+		return str_find_multi_more_keys(ctx, data, size);
+
+	for (i = 0; i < size; i++) {
+		state = next[state * class_count + byte_class[data[i]]];
+		if (unlikely(state_key[state] != STR_FIND_MULTI_NO_KEY ||
+			     out_link[state] != 0)) {
+			if (str_find_multi_add_matches(ctx, state)) {
+				ctx->state = state;
+				return TRUE;
+			}
+		}
+	}
+	ctx->state = state;
+	return FALSE;
+}
+
+bool str_find_multi_is_matched(struct str_find_multi_context *ctx,
+			       unsigned int idx)
+{
+	i_assert(idx < ctx->keys_count);
+
+	return ctx->matched[idx];
+}
+
+void str_find_multi_reset_input(struct str_find_multi_context *ctx)
+{
+	unsigned int i;
+
+	ctx->state = 0;
+	if (ctx->key_ctx != NULL) {
+		for (i = 0; i < ctx->keys_count; i++)
+			str_find_reset(ctx->key_ctx[i]);
+	}
+}
+
+void str_find_multi_reset(struct str_find_multi_context *ctx)
+{
+	str_find_multi_reset_input(ctx);
+	ctx->matched_count = 0;
+	memset(ctx->matched, 0, sizeof(*ctx->matched) * ctx->keys_count);
+}
@@ -2,6 +2,7 @@
 #define STR_FIND_H
 
 struct str_find_context;
+struct str_find_multi_context;
 
 struct str_find_context *str_find_init(pool_t pool, const char *key);
 void str_find_deinit(struct str_find_context **ctx);
@@ -17,4 +18,26 @@ size_t str_find_get_match_end_pos(struct str_find_context *ctx);
    to earlier data. */
 void str_find_reset(struct str_find_context *ctx);
 
+/* Search multiple keys at once. The input is scanned only once regardless of
+   the number of keys, unless the keys are too large for the automaton, in
+   which case each key is searched separately. */
+struct str_find_multi_context *
+str_find_multi_init(pool_t pool, const char *const *keys, unsigned int count);
+void str_find_multi_deinit(struct str_find_multi_context **ctx);
+
+/* Returns TRUE if all keys have been found since the last reset. It's
+   possible to send the data in arbitrary blocks and have the keys still
+   match. */
+bool str_find_multi_more(struct str_find_multi_context *ctx,
+			 const unsigned char *data, size_t size);
+/* Returns TRUE if key with the given index has been found since the last
+   reset. */
+bool str_find_multi_is_matched(struct str_find_multi_context *ctx,
+			       unsigned int idx);
+/* Reset input data, but remember the keys found so far. The next
+   str_find_multi_more() call won't try to match the keys to earlier data. */
+void str_find_multi_reset_input(struct str_find_multi_context *ctx);
+/* Reset input data and forget all the found keys. */
+void str_find_multi_reset(struct str_find_multi_context *ctx);
+
 #endif
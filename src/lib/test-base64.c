@@ -1,6 +1,7 @@
 /* Copyright (c) 2007-2013 Dovecot authors, see the included COPYING file */
 
 #include "test-lib.h"
+#include "buffer.h"
 #include "str.h"
 #include "base64.h"
 
@@ -102,9 +103,69 @@ static void test_base64_random(void)
 	test_end();
 }
 
+static void test_base64_random_large(void)
+{
+	string_t *str, *wrapped, *dest;
+	unsigned char buf[2000];
+	unsigned char *data;
+	unsigned int i, j, max, pos;
+	size_t src_pos, len;
+
+	str = t_str_new(4096);
+	wrapped = t_str_new(4096);
+	dest = t_str_new(4096);
+
+	test_begin("base64 decode with large random input");
+	for (i = 0; i < 200; i++) {
+		max = rand() % sizeof(buf);
+		for (j = 0; j < max; j++)
+			buf[j] = rand();
+
+		str_truncate(str, 0);
+		base64_encode(buf, max, str);
+
+		/* wrap lines the same way as in mails */
+		str_truncate(wrapped, 0);
+		for (j = 0; j < str_len(str); j += 76) {
+			str_append_n(wrapped, str_c(str) + j, 76);
+			str_append(wrapped, "\r\n");
+		}
+		str_truncate(dest, 0);
+		test_assert(base64_decode(str_data(wrapped), str_len(wrapped),
+					  &src_pos, dest) >= 0);
+		test_assert(src_pos == str_len(wrapped));
+		test_assert(str_len(dest) == max &&
+			    memcmp(buf, str_data(dest), max) == 0);
+
+		/* decoding in place */
+		len = str_len(str);
+		str_truncate(str, 0);
+		test_assert(base64_decode(str_data(str), len, NULL, str) >= 0);
+		test_assert(str_len(str) == max &&
+			    memcmp(buf, str_data(str), max) == 0);
+
+		/* invalid character */
+		if (max < 3)
+			continue;
+		str_truncate(str, 0);
+		base64_encode(buf, max / 3 * 3, str);
+		pos = rand() % str_len(str);
+		data = buffer_get_modifiable_data(str, NULL);
+		data[pos] = '!';
+		str_truncate(dest, 0);
+		test_assert(base64_decode(str_data(str), str_len(str),
+					  &src_pos, dest) < 0);
+		test_assert(src_pos == pos / 4 * 4);
+		test_assert(str_len(dest) == pos / 4 * 3 &&
+			    memcmp(buf, str_data(dest), str_len(dest)) == 0);
+	}
+	test_end();
+}
+
 void test_base64(void)
 {
 	test_base64_encode();
 	test_base64_decode();
 	test_base64_random();
+	test_base64_random_large();
 }
@@ -0,0 +1,131 @@
+/* Copyright (c) 2013 Dovecot authors, see the included COPYING file */
+
+#include "test-lib.h"
+#include "env-util.h"
+#include "ioloop.h"
+
+#include <unistd.h>
+
+struct test_ioloop_pipe {
+	int fd[2];
+	struct io *io;
+	unsigned int input_count;
+};
+
+static void test_ioloop_pipe_input(struct test_ioloop_pipe *p)
+{
+	char c;
+
+	if (read(p->fd[0], &c, 1) != 1)
+		i_fatal("read() failed: %m");
+	p->input_count++;
+	io_loop_stop(current_ioloop);
+}
+
+static void test_ioloop_pipe_init(struct test_ioloop_pipe *p)
+{
+	memset(p, 0, sizeof(*p));
+	if (pipe(p->fd) < 0)
+		i_fatal("pipe() failed: %m");
+	p->io = io_add(p->fd[0], IO_READ, test_ioloop_pipe_input, p);
+}
+
+static void test_ioloop_pipe_deinit(struct test_ioloop_pipe *p)
+{
+	if (p->io != NULL)
+		io_remove(&p->io);
+	i_close_fd(&p->fd[0]);
+	i_close_fd(&p->fd[1]);
+}
+
+static void test_ioloop_pipe_write(struct test_ioloop_pipe *p)
+{
+	if (write(p->fd[1], "x", 1) != 1)
+		i_fatal("write() failed: %m");
+}
+
+static void test_ioloop_timeout(struct ioloop *ioloop)
+{
+	test_assert(FALSE);
+	io_loop_stop(ioloop);
+}
+
+static void test_ioloop_run(struct ioloop *ioloop)
+{
+	struct timeout *to;
+
+	to = timeout_add(5000, test_ioloop_timeout, ioloop);
+	io_loop_run(ioloop);
+	timeout_remove(&to);
+}
+
+static void test_ioloop_set_backend(const char *backend)
+{
+	if (backend == NULL)
+		env_remove("DOVECOT_IOLOOP");
+	else
+		env_put(t_strconcat("DOVECOT_IOLOOP=", backend, NULL));
+}
+
+static void
+test_ioloop_nested(const char *outer_backend, const char *nested_backend)
+{
+	struct ioloop *ioloop, *nested;
+	struct test_ioloop_pipe outer_pipe, nested_pipe;
+	struct timeout *to;
+
+	test_begin(t_strdup_printf("ioloop nested %s/%s",
+		outer_backend == NULL ? "default" : outer_backend,
+		nested_backend == NULL ? "default" : nested_backend));
+
+	/* the backend is chosen when the first io is added */
+	test_ioloop_set_backend(outer_backend);
+	ioloop = io_loop_create();
+	test_ioloop_pipe_init(&outer_pipe);
+	test_ioloop_pipe_write(&outer_pipe);
+	test_ioloop_run(ioloop);
+	test_assert(outer_pipe.input_count == 1);
+
+	test_ioloop_set_backend(nested_backend);
+	nested = io_loop_create();
+	test_ioloop_pipe_init(&nested_pipe);
+	/* the nested ioloop must not call the outer ioloop's ios */
+	test_ioloop_pipe_write(&outer_pipe);
+	test_ioloop_pipe_write(&nested_pipe);
+	test_ioloop_run(nested);
+	test_assert(nested_pipe.input_count == 1);
+	test_assert(outer_pipe.input_count == 1);
+
+	/* ios can be moved between the ioloops */
+	outer_pipe.io = io_loop_move_io(&outer_pipe.io);
+	test_ioloop_run(nested);
+	test_assert(outer_pipe.input_count == 2);
+
+	to = timeout_add_short(10, io_loop_stop, nested);
+	test_ioloop_run(nested);
+	timeout_remove(&to);
+
+	test_ioloop_pipe_deinit(&nested_pipe);
+	io_loop_set_current(ioloop);
+	outer_pipe.io = io_loop_move_io(&outer_pipe.io);
+	io_loop_set_current(nested);
+	io_loop_destroy(&nested);
+
+	test_ioloop_pipe_write(&outer_pipe);
+	test_ioloop_run(ioloop);
+	test_assert(outer_pipe.input_count == 3);
+
+	test_ioloop_pipe_deinit(&outer_pipe);
+	io_loop_destroy(&ioloop);
+	test_ioloop_set_backend(NULL);
+	test_end();
+}
+
+void test_ioloop(void)
+{
+	test_ioloop_nested(NULL, NULL);
+#ifdef IOLOOP_URING
+	test_ioloop_nested(NULL, "epoll");
+	test_ioloop_nested("epoll", NULL);
+#endif
+}
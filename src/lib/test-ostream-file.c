@@ -5,6 +5,7 @@
 #include "safe-mkstemp.h"
 #include "randgen.h"
 #include "ostream.h"
+#include "fd-set-nonblock.h"
 
 #include <stdlib.h>
 #include <unistd.h>
@@ -57,6 +58,65 @@ static void test_ostream_file_random(void)
 	i_close_fd(&fd);
 }
 
+static void test_ostream_file_send_buffered(void)
+{
+	struct ostream *output;
+	struct const_iovec iov[3];
+	unsigned char data[1024*128], buf[1024*128];
+	size_t pos;
+	ssize_t ret, sent;
+	unsigned int i;
+	int fd[2];
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = i % 253;
+
+	if (pipe(fd) < 0)
+		i_fatal("pipe() failed: %m");
+	fd_set_nonblock(fd[0], TRUE);
+	fd_set_nonblock(fd[1], TRUE);
+	output = o_stream_create_fd(fd[1], 64, FALSE);
+
+	/* small write gets buffered while corked */
+	o_stream_cork(output);
+	test_assert(o_stream_send(output, data, 10) == 10);
+	test_assert(o_stream_get_buffer_used_size(output) == 10);
+
+	/* larger write gets sent together with the buffered data */
+	iov[0].iov_base = data + 10; iov[0].iov_len = 5;
+	iov[1].iov_base = data + 15; iov[1].iov_len = 500;
+	iov[2].iov_base = data + 515; iov[2].iov_len = 485;
+	test_assert(o_stream_sendv(output, iov, 3) == 990);
+	test_assert(o_stream_get_buffer_used_size(output) == 0);
+	ret = read(fd[0], buf, sizeof(buf));
+	test_assert(ret == 1000 && memcmp(buf, data, 1000) == 0);
+
+	/* more than the pipe can hold: the rest of the data that fits gets
+	   buffered */
+	test_assert(o_stream_send(output, data, 10) == 10);
+	iov[0].iov_base = data + 10; iov[0].iov_len = sizeof(data) - 10;
+	sent = o_stream_sendv(output, iov, 1);
+	test_assert(sent > 0 && (size_t)sent < sizeof(data) - 10);
+
+	pos = 0;
+	while (pos < (size_t)sent + 10) {
+		ret = read(fd[0], buf + pos, sizeof(buf) - pos);
+		if (ret > 0)
+			pos += ret;
+		else if (ret < 0 && errno != EAGAIN)
+			i_fatal("read() failed: %m");
+		if (o_stream_flush(output) < 0)
+			break;
+	}
+	test_assert(pos == (size_t)sent + 10);
+	test_assert(memcmp(buf, data, pos) == 0);
+	o_stream_uncork(output);
+
+	o_stream_unref(&output);
+	i_close_fd(&fd[0]);
+	i_close_fd(&fd[1]);
+}
+
 void test_ostream_file(void)
 {
 	unsigned int i;
@@ -66,4 +126,8 @@ void test_ostream_file(void)
 		test_ostream_file_random();
 	} T_END;
 	test_end();
+
+	test_begin("ostream send buffered");
+	test_ostream_file_send_buffered();
+	test_end();
 }
@@ -1,6 +1,7 @@
 /* Copyright (c) 2007-2013 Dovecot authors, see the included COPYING file */
 
 #include "test-lib.h"
+#include "str.h"
 #include "str-find.h"
 
 static const char *str_find_text = "xababcd";
@@ -56,6 +57,81 @@ struct str_find_input {
 	int pos;
 };
 
+static bool test_str_find_multi_keys(const char *extra_key)
+{
+	const char *keys[] = {
+		"abab", "bab", "b", "cdx", "abab", "xabx", "abcd", NULL
+	};
+	static const bool expected[N_ELEMENTS(keys)-1] = {
+		TRUE, TRUE, TRUE, FALSE, TRUE, FALSE, TRUE
+	};
+	const unsigned char *text = (const unsigned char *)str_find_text;
+	const unsigned int text_len = strlen(str_find_text);
+	struct str_find_multi_context *ctx;
+	unsigned int i, j, pos, keys_count = N_ELEMENTS(keys)-1;
+	bool success = TRUE;
+
+	keys[keys_count] = extra_key;
+	if (extra_key != NULL)
+		keys_count++;
+	ctx = str_find_multi_init(default_pool, keys, keys_count);
+	/* divide text into every possible block combination */
+	for (i = 0; i < (1U << (text_len-1)) && success; i++) {
+		str_find_multi_reset(ctx);
+		pos = 0;
+		for (j = 0; j < text_len; j++) {
+			if ((i & (1 << j)) != 0 || j == text_len-1) {
+				if (str_find_multi_more(ctx, text+pos, j-pos+1))
+					success = FALSE;
+				pos = j + 1;
+			}
+		}
+		for (j = 0; j < N_ELEMENTS(expected); j++) {
+			if (str_find_multi_is_matched(ctx, j) != expected[j])
+				success = FALSE;
+		}
+	}
+
+	/* matches are remembered over input resets, but partial matches
+	   aren't */
+	str_find_multi_reset(ctx);
+	if (str_find_multi_more(ctx, (const void *)"xab", 3))
+		success = FALSE;
+	str_find_multi_reset_input(ctx);
+	if (str_find_multi_more(ctx, (const void *)"abcdx", 5))
+		success = FALSE;
+	if (str_find_multi_is_matched(ctx, 0) ||
+	    !str_find_multi_is_matched(ctx, 2) ||
+	    !str_find_multi_is_matched(ctx, 3) ||
+	    !str_find_multi_is_matched(ctx, 6))
+		success = FALSE;
+	/* extra_key never matches */
+	if (str_find_multi_more(ctx, (const void *)"xababxabx", 9) !=
+	    (extra_key == NULL))
+		success = FALSE;
+	for (j = 0; j < N_ELEMENTS(expected); j++) {
+		if (!str_find_multi_is_matched(ctx, j))
+			success = FALSE;
+	}
+	str_find_multi_deinit(&ctx);
+	return success;
+}
+
+static void test_str_find_multi(void)
+{
+	string_t *large_key;
+	unsigned int i;
+
+	test_out("str_find_multi()", test_str_find_multi_keys(NULL));
+
+	/* too large for the DFA, so each key is searched separately */
+	large_key = t_str_new(4096);
+	for (i = 0; i < 4096; i++)
+		str_append_c(large_key, 'A' + i % 50);
+	test_out("str_find_multi() large keys",
+		 test_str_find_multi_keys(str_c(large_key)));
+}
+
 void test_str_find(void)
 {
 	static const char *fail_input[] = {
@@ -83,4 +159,6 @@ void test_str_find(void)
 	for (i = 0; i < N_ELEMENTS(fail_input) && success; i++)
 		success = test_str_find_substring(fail_input[i], -1);
 	test_out("str_find()", success);
+
+	test_str_find_multi();
 }
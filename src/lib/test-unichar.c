@@ -5,6 +5,40 @@
 #include "buffer.h"
 #include "unichar.h"
 
+static void test_unichar_long(void)
+{
+	static const char input[] =
+		"Hello, world! Some ASCII text: abcdefghijklmnopqrstuvwxyz "
+		"\xc3\xbc\xc3\xa4 and more text \xff with invalid "
+		"data and ASCII afterwards 0123456789";
+	static const char titlecase[] =
+		"HELLO, WORLD! SOME ASCII TEXT: ABCDEFGHIJKLMNOPQRSTUVWXYZ "
+		"U\xcc\x88" "A\xcc\x88 AND MORE TEXT \xef\xbf\xbd WITH INVALID "
+		"DATA AND ASCII AFTERWARDS 0123456789";
+	static const char valid[] =
+		"Hello, world! Some ASCII text: abcdefghijklmnopqrstuvwxyz "
+		"\xc3\xbc\xc3\xa4 and more text \xef\xbf\xbd with invalid "
+		"data and ASCII afterwards 0123456789";
+	buffer_t *buf = buffer_create_dynamic(pool_datastack_create(), 256);
+
+	test_begin("unichars with long input");
+	test_assert(uni_utf8_to_decomposed_titlecase(input, strlen(input),
+						     buf) < 0);
+	test_assert(buf->used == strlen(titlecase) &&
+		    memcmp(buf->data, titlecase, buf->used) == 0);
+
+	test_assert(!uni_utf8_data_is_valid((const void *)input,
+					    strlen(input)));
+	test_assert(uni_utf8_data_is_valid((const void *)input, 70));
+
+	buffer_set_used_size(buf, 0);
+	test_assert(!uni_utf8_get_valid_data((const void *)input,
+					     strlen(input), buf));
+	test_assert(buf->used == strlen(valid) &&
+		    memcmp(buf->data, valid, buf->used) == 0);
+	test_end();
+}
+
 void test_unichar(void)
 {
 	static const char overlong_utf8[] = "\xf8\x80\x95\x81\xa1";
@@ -32,4 +66,6 @@ void test_unichar(void)
 	test_assert(!uni_utf8_str_is_valid(overlong_utf8));
 	test_assert(uni_utf8_get_char(overlong_utf8, &chr2) < 0);
 	test_end();
+
+	test_unichar_long();
 }
@@ -7,6 +7,10 @@
 
 #include "unicodemap.c"
 
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
 #define HANGUL_FIRST 0xac00
 #define HANGUL_LAST 0xd7a3
 
@@ -20,6 +24,24 @@ static const uint8_t utf8_non1_bytes[256 - 192 - 2] = {
 
 const uint8_t *const uni_utf8_non1_bytes = utf8_non1_bytes;
 
+/* Returns the number of ASCII characters at the beginning of input. */
+static inline size_t uni_ascii_len(const unsigned char *input, size_t size)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	unsigned int mask;
+
+	for (; i + 16 <= size; i += 16) {
+		mask = _mm_movemask_epi8(
+			_mm_loadu_si128((const void *)(input + i)));
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	for (; i < size && input[i] < 0x80; i++) ;
+	return i;
+}
+
 unsigned int uni_strlen(const unichar_t *str)
 {
 	unsigned int len = 0;
@@ -315,15 +337,49 @@ static void output_add_replacement_char(buffer_t *output)
 	buffer_append(output, utf8_replacement_char, UTF8_REPLACEMENT_CHAR_LEN);
 }
 
+/* ASCII characters don't have decompositions and their titlecase is the
+   same as uppercase. */
+static void
+uni_ascii_to_titlecase(const unsigned char *input, size_t size,
+		       buffer_t *output)
+{
+	unsigned char *dest = buffer_append_space_unsafe(output, size);
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i before_a = _mm_set1_epi8('a' - 1);
+	const __m128i after_z = _mm_set1_epi8('z' + 1);
+	const __m128i case_diff = _mm_set1_epi8('a' - 'A');
+	__m128i data, is_lower;
+
+	for (; i + 16 <= size; i += 16) {
+		data = _mm_loadu_si128((const void *)(input + i));
+		is_lower = _mm_and_si128(_mm_cmpgt_epi8(data, before_a),
+					 _mm_cmplt_epi8(data, after_z));
+		_mm_storeu_si128((void *)(dest + i), _mm_sub_epi8(data,
+			_mm_and_si128(is_lower, case_diff)));
+	}
+#endif
+	for (; i < size; i++)
+		dest[i] = titlecase8_map[input[i]];
+}
+
 int uni_utf8_to_decomposed_titlecase(const void *_input, size_t size,
 				     buffer_t *output)
 {
 	const unsigned char *input = _input;
 	unsigned int bytes;
+	size_t len;
 	unichar_t chr;
 	int ret = 0;
 
 	while (size > 0) {
+		if (*input < 0x80) {
+			len = uni_ascii_len(input, size);
+			uni_ascii_to_titlecase(input, len, output);
+			input += len;
+			size -= len;
+			continue;
+		}
 		if (uni_utf8_get_char_n(input, size, &chr) <= 0) {
 			/* invalid input. try the next byte. */
 			ret = -1;
@@ -363,7 +419,7 @@ static int uni_utf8_find_invalid_pos(const unsigned char *input, size_t size,
 	/* find the first invalid utf8 sequence */
 	for (i = 0; i < size;) {
 		if (input[i] < 0x80)
-			i++;
+			i += uni_ascii_len(input + i, size - i);
 		else {
 			len = is_valid_utf8_seq(input + i, size-i);
 			if (unlikely(len == 0)) {
@@ -390,7 +446,9 @@ bool uni_utf8_get_valid_data(const unsigned char *input, size_t size,
 	output_add_replacement_char(buf);
 	while (i < size) {
 		if (input[i] < 0x80) {
-			buffer_append_c(buf, input[i++]);
+			len = uni_ascii_len(input + i, size - i);
+			buffer_append(buf, input + i, len);
+			i += len;
 			continue;
 		}
 
@@ -1,5 +1,6 @@
 /* Copyright (c) 2004-2013 Dovecot authors, see the included COPYING file */
 
+#define _GNU_SOURCE /* splice() */
 #include "login-common.h"
 #include "ioloop.h"
 #include "istream.h"
@@ -8,6 +9,7 @@
 #include "str.h"
 #include "str-sanitize.h"
 #include "time-util.h"
+#include "fd-close-on-exec.h"
 #include "master-service.h"
 #include "ipc-server.h"
 #include "mail-user-hash.h"
@@ -16,6 +18,11 @@
 #include "login-proxy-state.h"
 #include "login-proxy.h"
 
+#ifdef HAVE_SPLICE
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
+
 #define MAX_PROXY_INPUT_SIZE 4096
 #define OUTBUF_THRESHOLD 1024
 #define LOGIN_PROXY_DIE_IDLE_SECS 2
@@ -24,6 +31,39 @@
 #define KILLED_BY_ADMIN_REASON "Killed by admin"
 #define PROXY_IMMEDIATE_FAILURE_SECS 30
 
+#ifdef HAVE_SPLICE
+/* maximum number of bytes to splice() at once */
+#  define LOGIN_PROXY_SPLICE_SIZE (64*1024)
+/* maximum number of empty pipes to keep open for reuse */
+#  define LOGIN_PROXY_MAX_FREE_PIPES 32
+
+/* Forwarding data in one direction with splice() through a pipe, so it
+   never gets copied to userspace. The pipe is taken from a process-wide
+   pool only for as long as there's data in it. */
+struct login_proxy_splice {
+	int pipe_fd[2];
+	/* number of bytes in the pipe */
+	size_t pipe_size;
+	/* waiting for the output fd to become writable */
+	struct io *io;
+	/* splice() isn't supported with these fds, copy the data instead */
+	unsigned int unsupported:1;
+};
+
+enum login_proxy_splice_result {
+	/* all the data was forwarded */
+	LOGIN_PROXY_SPLICE_RESULT_OK,
+	/* output is full, some data was left in the pipe */
+	LOGIN_PROXY_SPLICE_RESULT_OUTPUT_FULL,
+	/* splice() can't be used for the fds, copy the data instead */
+	LOGIN_PROXY_SPLICE_RESULT_UNSUPPORTED,
+	/* reading input failed, errno is set (0 = disconnected) */
+	LOGIN_PROXY_SPLICE_RESULT_INPUT_ERROR,
+	/* writing output failed, errno is set */
+	LOGIN_PROXY_SPLICE_RESULT_OUTPUT_ERROR
+};
+#endif
+
 struct login_proxy {
 	struct login_proxy *prev, *next;
 
@@ -34,6 +74,10 @@ struct login_proxy {
 	struct ostream *client_output, *server_output;
 	struct ssl_proxy *ssl_server_proxy;
 	time_t last_io;
+#ifdef HAVE_SPLICE
+	/* client -> server and server -> client */
+	struct login_proxy_splice client_splice, server_splice;
+#endif
 
 	struct timeval created;
 	struct timeout *to, *to_notify;
@@ -57,6 +101,10 @@ static struct login_proxy_state *proxy_state;
 static struct login_proxy *login_proxies = NULL;
 static struct login_proxy *login_proxies_pending = NULL;
 static struct ipc_server *login_proxy_ipc_server;
+#ifdef HAVE_SPLICE
+static int login_proxy_free_pipes[LOGIN_PROXY_MAX_FREE_PIPES][2];
+static unsigned int login_proxy_free_pipes_count = 0;
+#endif
 
 static void login_proxy_ipc_cmd(struct ipc_cmd *cmd, const char *line);
 
@@ -75,6 +123,224 @@ static void login_proxy_free_errno(struct login_proxy **proxy,
 	login_proxy_free_reason(proxy, reason);
 }
 
+#ifdef HAVE_SPLICE
+static int login_proxy_pipe_get(int pipe_fd[2])
+{
+	if (login_proxy_free_pipes_count > 0) {
+		login_proxy_free_pipes_count--;
+		memcpy(pipe_fd,
+		       login_proxy_free_pipes[login_proxy_free_pipes_count],
+		       sizeof(login_proxy_free_pipes[0]));
+		return 0;
+	}
+	if (pipe(pipe_fd) < 0) {
+		i_error("pipe() failed: %m");
+		return -1;
+	}
+	fd_close_on_exec(pipe_fd[0], TRUE);
+	fd_close_on_exec(pipe_fd[1], TRUE);
+	return 0;
+}
+
+static void login_proxy_pipe_put(int pipe_fd[2], bool empty)
+{
+	if (empty && login_proxy_free_pipes_count < LOGIN_PROXY_MAX_FREE_PIPES) {
+		memcpy(login_proxy_free_pipes[login_proxy_free_pipes_count],
+		       pipe_fd, sizeof(login_proxy_free_pipes[0]));
+		login_proxy_free_pipes_count++;
+	} else {
+		if (close(pipe_fd[0]) < 0)
+			i_error("close(pipe) failed: %m");
+		if (close(pipe_fd[1]) < 0)
+			i_error("close(pipe) failed: %m");
+	}
+	pipe_fd[0] = pipe_fd[1] = -1;
+}
+
+static void login_proxy_splice_init(struct login_proxy_splice *sp)
+{
+	sp->pipe_fd[0] = sp->pipe_fd[1] = -1;
+}
+
+static void login_proxy_splice_deinit(struct login_proxy_splice *sp)
+{
+	if (sp->io != NULL)
+		io_remove(&sp->io);
+	if (sp->pipe_fd[0] != -1)
+		login_proxy_pipe_put(sp->pipe_fd, sp->pipe_size == 0);
+}
+
+static enum login_proxy_splice_result
+login_proxy_splice_flush(struct login_proxy_splice *sp, int fd_out)
+{
+	ssize_t ret;
+
+	while (sp->pipe_size > 0) {
+		ret = splice(sp->pipe_fd[0], NULL, fd_out, NULL, sp->pipe_size,
+			     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (ret <= 0) {
+			if (ret == 0 || errno == EAGAIN)
+				return LOGIN_PROXY_SPLICE_RESULT_OUTPUT_FULL;
+			return LOGIN_PROXY_SPLICE_RESULT_OUTPUT_ERROR;
+		}
+		sp->pipe_size -= ret;
+	}
+	/* pipe is empty, let others use it */
+	login_proxy_pipe_put(sp->pipe_fd, TRUE);
+	return LOGIN_PROXY_SPLICE_RESULT_OK;
+}
+
+static enum login_proxy_splice_result
+login_proxy_splice(struct login_proxy_splice *sp, int fd_in, int fd_out)
+{
+	ssize_t ret;
+
+	i_assert(sp->pipe_size == 0);
+
+	if (sp->unsupported)
+		return LOGIN_PROXY_SPLICE_RESULT_UNSUPPORTED;
+	if (sp->pipe_fd[0] == -1 && login_proxy_pipe_get(sp->pipe_fd) < 0)
+		return LOGIN_PROXY_SPLICE_RESULT_UNSUPPORTED;
+
+	ret = splice(fd_in, NULL, sp->pipe_fd[1], NULL,
+		     LOGIN_PROXY_SPLICE_SIZE,
+		     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (ret < 0) {
+		switch (errno) {
+		case EAGAIN:
+		case EINTR:
+			login_proxy_pipe_put(sp->pipe_fd, TRUE);
+			return LOGIN_PROXY_SPLICE_RESULT_OK;
+		case EINVAL:
+		case ENOSYS:
+			/* splicing isn't supported for this fd type */
+			sp->unsupported = TRUE;
+			login_proxy_pipe_put(sp->pipe_fd, TRUE);
+			return LOGIN_PROXY_SPLICE_RESULT_UNSUPPORTED;
+		case ECONNRESET:
+		case ETIMEDOUT:
+			/* treat as disconnection */
+			errno = 0;
+			break;
+		}
+		return LOGIN_PROXY_SPLICE_RESULT_INPUT_ERROR;
+	}
+	if (ret == 0) {
+		/* disconnected */
+		errno = 0;
+		return LOGIN_PROXY_SPLICE_RESULT_INPUT_ERROR;
+	}
+	sp->pipe_size = ret;
+	return login_proxy_splice_flush(sp, fd_out);
+}
+
+static void server_splice_output(struct login_proxy *proxy);
+static void proxy_client_splice_output(struct login_proxy *proxy);
+
+/* Returns TRUE if the input was handled by splicing, FALSE if it needs to
+   be copied. */
+static bool
+login_proxy_splice_input(struct login_proxy *proxy, bool from_server)
+{
+	struct login_proxy_splice *sp;
+	struct ostream *output;
+	struct io **input_io;
+	int fd_in, fd_out;
+
+	if (from_server) {
+		sp = &proxy->server_splice;
+		output = proxy->client_output;
+		input_io = &proxy->server_io;
+		fd_in = proxy->server_fd;
+		fd_out = proxy->client_fd;
+	} else {
+		sp = &proxy->client_splice;
+		output = proxy->server_output;
+		input_io = &proxy->client_io;
+		fd_in = proxy->client_fd;
+		fd_out = proxy->server_fd;
+	}
+
+	if (o_stream_get_buffer_used_size(output) > 0) {
+		/* the data must be sent in order, so continue copying until
+		   the output buffer is empty */
+		return FALSE;
+	}
+
+	switch (login_proxy_splice(sp, fd_in, fd_out)) {
+	case LOGIN_PROXY_SPLICE_RESULT_OK:
+		break;
+	case LOGIN_PROXY_SPLICE_RESULT_OUTPUT_FULL:
+		/* stop reading input until the pipe has been written */
+		io_remove(input_io);
+		if (from_server) {
+			sp->io = io_add(fd_out, IO_WRITE,
+					proxy_client_splice_output, proxy);
+		} else {
+			sp->io = io_add(fd_out, IO_WRITE,
+					server_splice_output, proxy);
+		}
+		break;
+	case LOGIN_PROXY_SPLICE_RESULT_UNSUPPORTED:
+		return FALSE;
+	case LOGIN_PROXY_SPLICE_RESULT_INPUT_ERROR:
+		login_proxy_free_errno(&proxy, errno,
+				       from_server ? "server" : "client");
+		break;
+	case LOGIN_PROXY_SPLICE_RESULT_OUTPUT_ERROR:
+		login_proxy_free_errno(&proxy, errno,
+				       from_server ? "client" : "server");
+		break;
+	}
+	return TRUE;
+}
+
+static void server_input(struct login_proxy *proxy);
+static void proxy_client_input(struct login_proxy *proxy);
+
+static void
+login_proxy_splice_output(struct login_proxy *proxy, bool from_server)
+{
+	struct login_proxy_splice *sp;
+
+	proxy->last_io = ioloop_time;
+	sp = from_server ? &proxy->server_splice : &proxy->client_splice;
+	switch (login_proxy_splice_flush(sp, from_server ? proxy->client_fd :
+					 proxy->server_fd)) {
+	case LOGIN_PROXY_SPLICE_RESULT_OK:
+		/* everything sent, continue reading input */
+		io_remove(&sp->io);
+		if (from_server) {
+			proxy->server_io = io_add(proxy->server_fd, IO_READ,
+						  server_input, proxy);
+		} else {
+			proxy->client_io = io_add(proxy->client_fd, IO_READ,
+						  proxy_client_input, proxy);
+		}
+		break;
+	case LOGIN_PROXY_SPLICE_RESULT_OUTPUT_FULL:
+		break;
+	case LOGIN_PROXY_SPLICE_RESULT_OUTPUT_ERROR:
+		login_proxy_free_errno(&proxy, errno,
+				       from_server ? "client" : "server");
+		break;
+	case LOGIN_PROXY_SPLICE_RESULT_UNSUPPORTED:
+	case LOGIN_PROXY_SPLICE_RESULT_INPUT_ERROR:
+		i_unreached();
+	}
+}
+
+static void server_splice_output(struct login_proxy *proxy)
+{
+	login_proxy_splice_output(proxy, FALSE);
+}
+
+static void proxy_client_splice_output(struct login_proxy *proxy)
+{
+	login_proxy_splice_output(proxy, TRUE);
+}
+#endif
+
 static void server_input(struct login_proxy *proxy)
 {
 	unsigned char buf[OUTBUF_THRESHOLD];
@@ -88,6 +354,10 @@ static void server_input(struct login_proxy *proxy)
 		io_remove(&proxy->server_io);
 		return;
 	}
+#ifdef HAVE_SPLICE
+	if (login_proxy_splice_input(proxy, TRUE))
+		return;
+#endif
 
 	ret = net_receive(proxy->server_fd, buf, sizeof(buf));
 	if (ret < 0)
@@ -112,6 +382,10 @@ static void proxy_client_input(struct login_proxy *proxy)
 		io_remove(&proxy->client_io);
 		return;
 	}
+#ifdef HAVE_SPLICE
+	if (login_proxy_splice_input(proxy, FALSE))
+		return;
+#endif
 
 	ret = net_receive(proxy->client_fd, buf, sizeof(buf));
 	if (ret < 0)
@@ -316,6 +590,10 @@ int login_proxy_new(struct client *client,
 	proxy->client = client;
 	proxy->client_fd = -1;
 	proxy->server_fd = -1;
+#ifdef HAVE_SPLICE
+	login_proxy_splice_init(&proxy->client_splice);
+	login_proxy_splice_init(&proxy->server_splice);
+#endif
 	proxy->created = ioloop_timeval;
 	proxy->ip = set->ip;
 	proxy->host = i_strdup(set->host);
@@ -367,6 +645,10 @@ login_proxy_free_reason(struct login_proxy **_proxy, const char *reason)
 
 	if (proxy->server_io != NULL)
 		io_remove(&proxy->server_io);
+#ifdef HAVE_SPLICE
+	login_proxy_splice_deinit(&proxy->client_splice);
+	login_proxy_splice_deinit(&proxy->server_splice);
+#endif
 	if (proxy->server_input != NULL)
 		i_stream_destroy(&proxy->server_input);
 	if (proxy->server_output != NULL)
@@ -725,5 +1007,14 @@ void login_proxy_deinit(void)
 	}
 	if (login_proxy_ipc_server != NULL)
 		ipc_server_deinit(&login_proxy_ipc_server);
+#ifdef HAVE_SPLICE
+	while (login_proxy_free_pipes_count > 0) {
+		int *pipe_fd =
+			login_proxy_free_pipes[--login_proxy_free_pipes_count];
+
+		i_close_fd(&pipe_fd[0]);
+		i_close_fd(&pipe_fd[1]);
+	}
+#endif
 	login_proxy_state_deinit(&proxy_state);
 }